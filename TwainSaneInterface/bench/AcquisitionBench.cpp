@@ -0,0 +1,543 @@
+// End-to-end acquisition benchmark: SaneDevice::Scan followed by a memory or native transfer,
+// normally against the SANE "test" backend. Every case runs in a process of its own, so the
+// peak RSS and CPU time reported are those of the case alone.
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "DataSource.h"
+#include "SaneDevice.h"
+#include "Image.h"
+#include "SaneProfile.h"
+
+
+struct BenchMode {
+    const char * name;
+    const char * mode;
+    int depth;
+    bool threepass;
+};
+
+static const BenchMode benchModes [] = {
+    { "lineart",       "Gray",  1,  false },
+    { "gray8",         "Gray",  8,  false },
+    { "gray16",        "Gray",  16, false },
+    { "color8",        "Color", 8,  false },
+    { "color16",       "Color", 16, false },
+    { "color8-3pass",  "Color", 8,  true  },
+    { "color16-3pass", "Color", 16, true  }
+};
+
+struct BenchCase {
+    const BenchMode * mode;
+    int resolution;
+    double width;
+    double height;
+    bool native;
+    std::string name;
+};
+
+// What a case process reports back to the driver
+struct BenchResult {
+    int status;
+    int pages;
+    double seconds;
+    double firststrip;
+    double bytes;
+    double resizes;
+    double peak;
+};
+
+// What ends up in the JSON output, one per case
+struct BenchRecord {
+    int pages;
+    double pagesPerMin;
+    double mbPerSec;
+    double firstStripMs;
+    double peakRssKb;
+    double cpuSeconds;
+    double resizesPerPage;
+    double peakTrackedKb;
+};
+
+static std::string device = "test";
+static std::string picture = "Color pattern";
+static int pages = 3;
+static TW_UINT32 bufferSize = 0;
+static bool keep = false;
+
+
+// DataSource links against the data source manager, but Scan never calls back without a user interface
+TW_UINT16 DSM_Entry (pTW_IDENTITY pOrigin, pTW_IDENTITY pDest, TW_UINT32 DG, TW_UINT16 DAT,
+                     TW_UINT16 MSG, TW_MEMREF pData) {
+
+    return TWRC_FAILURE;
+}
+
+
+static double Now () {
+
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static std::vector <std::string> Split (const char * list) {
+
+    std::vector <std::string> items;
+    std::string s = list;
+    for (size_t pos = 0; pos <= s.size (); ) {
+        size_t comma = s.find (',', pos);
+        if (comma == std::string::npos) comma = s.size ();
+        if (comma > pos) items.push_back (s.substr (pos, comma - pos));
+        pos = comma + 1;
+    }
+    return items;
+}
+
+
+static bool SetOption (SANE_Handle handle, const char * name, double value) {
+
+    for (int option = 1; const SANE_Option_Descriptor * optdesc =
+         sane_get_option_descriptor (handle, option); option++) {
+
+        if (!optdesc->name || strcmp (optdesc->name, name) != 0) continue;
+        if (!SANE_OPTION_IS_ACTIVE (optdesc->cap) || !SANE_OPTION_IS_SETTABLE (optdesc->cap))
+            return false;
+
+        SANE_Word optval;
+        if (optdesc->type == SANE_TYPE_FIXED)
+            optval = SANE_FIX (value);
+        else if (optdesc->type == SANE_TYPE_INT || optdesc->type == SANE_TYPE_BOOL)
+            optval = lround (value);
+        else
+            return false;
+        return sane_control_option (handle, option, SANE_ACTION_SET_VALUE, &optval, NULL) ==
+            SANE_STATUS_GOOD;
+    }
+    return false;
+}
+
+
+static bool SetOption (SANE_Handle handle, const char * name, const char * value) {
+
+    for (int option = 1; const SANE_Option_Descriptor * optdesc =
+         sane_get_option_descriptor (handle, option); option++) {
+
+        if (!optdesc->name || strcmp (optdesc->name, name) != 0) continue;
+        if (optdesc->type != SANE_TYPE_STRING ||
+            !SANE_OPTION_IS_ACTIVE (optdesc->cap) || !SANE_OPTION_IS_SETTABLE (optdesc->cap))
+            return false;
+
+        std::vector <char> optval (optdesc->size, '\0');
+        strncpy (&optval [0], value, optdesc->size - 1);
+        return sane_control_option (handle, option, SANE_ACTION_SET_VALUE, &optval [0], NULL) ==
+            SANE_STATUS_GOOD;
+    }
+    return false;
+}
+
+
+static bool SelectDevice (SaneDevice * sanedevice) {
+
+    // CreateName ends with the SANE device name in parentheses, e.g. "(test:0)"
+    std::string key = "(" + device;
+    for (int index = 0; ; index++) {
+        std::string name = sanedevice->CreateName (index);
+        if (name.empty ()) return false;
+        if (name.find (key) != std::string::npos) return sanedevice->ChangeDevice (index) == index;
+    }
+}
+
+
+static BenchResult RunCase (const BenchCase & benchcase) {
+
+    BenchResult result = { 1, 0, 0, 0, 0, 0, 0 };
+
+    DataSource datasource;
+    SaneDevice * sanedevice = new SaneDevice (&datasource);
+
+    if (!sanedevice->GetSaneHandle () || !SelectDevice (sanedevice)) {
+        fprintf (stderr, "%s: device %s not found\n", benchcase.name.c_str (), device.c_str ());
+        delete sanedevice;
+        return result;
+    }
+
+    SANE_Handle handle = sanedevice->GetSaneHandle ();
+
+    result.status = 2;
+    if (!SetOption (handle, "mode", benchcase.mode->mode) ||
+        !SetOption (handle, "depth", benchcase.mode->depth) ||
+        (benchcase.mode->threepass && !SetOption (handle, "three-pass", 1)) ||
+        !SetOption (handle, "resolution", benchcase.resolution) ||
+        !SetOption (handle, "tl-x", 0.0) || !SetOption (handle, "tl-y", 0.0) ||
+        !SetOption (handle, "br-x", benchcase.width) || !SetOption (handle, "br-y", benchcase.height)) {
+        delete sanedevice;
+        return result;
+    }
+    if (!picture.empty ()) SetOption (handle, "test-picture", picture.c_str ());
+
+    result.status = 3;
+    long long resizes = MemoryResizes (MEMORY_TAGS);
+    MemoryResetPeak (MEMORY_TAGS);
+    double start = Now ();
+
+    for (int page = 0; page < pages; page++) {
+
+        double pagestart = Now ();
+
+        Image * image = sanedevice->Scan (true, false);
+        if (!image) {
+            delete sanedevice;
+            return result;
+        }
+
+        // Throughput is counted in uncompressed image bytes, the same for both transfer modes
+        TW_IMAGEINFO imageinfo;
+        image->TwainImageInfo (&imageinfo);
+        result.bytes += (double) imageinfo.ImageWidth * imageinfo.ImageLength * imageinfo.BitsPerPixel / 8;
+
+        if (benchcase.native) {
+            PicHandle pict = image->MakePict ();
+            result.firststrip += Now () - pagestart;
+            MemoryReleased (MEMORY_PICT, GetHandleSize ((Handle) pict));
+            DisposeHandle ((Handle) pict);
+        }
+        else {
+            TW_SETUPMEMXFER setupmemxfer;
+            image->TwainSetupMemXfer (&setupmemxfer);
+            TW_UINT32 size = (bufferSize ? bufferSize : setupmemxfer.Preferred);
+            if (size < setupmemxfer.MinBufSize) size = setupmemxfer.MinBufSize;
+
+            std::vector <char> memory (size);
+            TW_IMAGEMEMXFER imagememxfer;
+            memset (&imagememxfer, 0, sizeof (imagememxfer));
+            imagememxfer.Memory.Flags = TWMF_APPOWNS | TWMF_POINTER;
+            imagememxfer.Memory.Length = size;
+            imagememxfer.Memory.TheMem = &memory [0];
+
+            // As from the data source, and with --keep the strips are kept as an application would
+            image->ReleaseTransferredRows ();
+            std::vector <char> kept;
+            if (keep) kept.reserve ((Size) imageinfo.ImageLength * setupmemxfer.MinBufSize);
+
+            TW_UINT32 yoffset = 0;
+            TW_UINT16 rc;
+            bool first = true;
+            do {
+                rc = image->TwainImageMemXfer (&imagememxfer, &yoffset);
+                if (first) result.firststrip += Now () - pagestart;
+                first = false;
+                if (keep && (rc == TWRC_SUCCESS || rc == TWRC_XFERDONE))
+                    kept.insert (kept.end (), &memory [0], &memory [0] + imagememxfer.BytesWritten);
+            }
+            while (rc == TWRC_SUCCESS);
+        }
+
+        sanedevice->DequeueImage ();
+        result.pages++;
+    }
+
+    result.seconds = Now () - start;
+    result.resizes = MemoryResizes (MEMORY_TAGS) - resizes;
+    result.peak = MemoryPeak (MEMORY_TAGS);
+    result.status = 0;
+
+    delete sanedevice;
+    return result;
+}
+
+
+static bool RunChild (const BenchCase & benchcase, BenchRecord * record) {
+
+    int fds [2];
+    if (pipe (fds) != 0) return false;
+
+    pid_t pid = fork ();
+    if (pid < 0) return false;
+
+    if (pid == 0) {
+        close (fds [0]);
+        BenchResult result = RunCase (benchcase);
+        if (write (fds [1], &result, sizeof (result)) != sizeof (result)) _exit (1);
+        _exit (0);
+    }
+
+    close (fds [1]);
+    BenchResult result;
+    bool ok = (read (fds [0], &result, sizeof (result)) == sizeof (result));
+    close (fds [0]);
+
+    int status;
+    struct rusage usage;
+    wait4 (pid, &status, 0, &usage);
+
+    if (!ok || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+        fprintf (stderr, "%s: case process failed\n", benchcase.name.c_str ());
+        return false;
+    }
+    if (result.status == 2) {
+        fprintf (stderr, "%s: not supported by the device, skipped\n", benchcase.name.c_str ());
+        return false;
+    }
+    if (result.status != 0) {
+        fprintf (stderr, "%s: scan failed\n", benchcase.name.c_str ());
+        return false;
+    }
+
+    record->pages = result.pages;
+    record->pagesPerMin = result.pages * 60 / result.seconds;
+    record->mbPerSec = result.bytes / result.seconds / (1024 * 1024);
+    record->firstStripMs = result.firststrip / result.pages * 1000;
+#ifdef __APPLE__
+    record->peakRssKb = usage.ru_maxrss / 1024.0;
+#else
+    record->peakRssKb = usage.ru_maxrss;
+#endif
+    record->cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+    // The buffers the data source accounts for, and how often they are resized
+    record->resizesPerPage = result.resizes / result.pages;
+    record->peakTrackedKb = result.peak / 1024;
+    return true;
+}
+
+
+// The metrics in the output, and whether a larger value is an improvement
+struct BenchMetric {
+    const char * key;
+    bool higherIsBetter;
+};
+
+static const BenchMetric benchMetrics [] = {
+    { "pages_per_min",  true  },
+    { "mb_per_s",       true  },
+    { "first_strip_ms", false },
+    { "peak_rss_kb",    false },
+    { "cpu_s",          false },
+    { "resizes_per_page", false },
+    { "peak_tracked_kb", false }
+};
+
+#define BENCH_METRICS (sizeof (benchMetrics) / sizeof (benchMetrics [0]))
+
+
+static double Metric (const BenchRecord & record, int metric) {
+
+    switch (metric) {
+        case 0: return record.pagesPerMin;
+        case 1: return record.mbPerSec;
+        case 2: return record.firstStripMs;
+        case 3: return record.peakRssKb;
+        case 4: return record.cpuSeconds;
+        case 5: return record.resizesPerPage;
+        default: return record.peakTrackedKb;
+    }
+}
+
+
+static void WriteJson (FILE * file, const std::vector <std::pair <std::string, BenchRecord> > & records) {
+
+    fprintf (file, "{\"benchmark\": \"acquisition\", \"cases\": [\n");
+    for (size_t i = 0; i < records.size (); i++) {
+        fprintf (file, "{\"case\": \"%s\", \"pages\": %d", records [i].first.c_str (), records [i].second.pages);
+        for (size_t metric = 0; metric < BENCH_METRICS; metric++)
+            fprintf (file, ", \"%s\": %.6g", benchMetrics [metric].key, Metric (records [i].second, metric));
+        fprintf (file, "}%s\n", i + 1 < records.size () ? "," : "");
+    }
+    fprintf (file, "]}\n");
+}
+
+
+// Reads back what WriteJson wrote: one case per line, keys in any order
+static std::map <std::string, std::map <std::string, double> > ReadJson (const char * path) {
+
+    std::map <std::string, std::map <std::string, double> > baseline;
+
+    FILE * file = fopen (path, "r");
+    if (!file) return baseline;
+
+    char line [4096];
+    while (fgets (line, sizeof (line), file)) {
+        char * name = strstr (line, "\"case\": \"");
+        if (!name) continue;
+        name += 9;
+        char * end = strchr (name, '"');
+        if (!end) continue;
+        std::map <std::string, double> & values = baseline [std::string (name, end - name)];
+        for (size_t metric = 0; metric < BENCH_METRICS; metric++) {
+            std::string key = std::string ("\"") + benchMetrics [metric].key + "\": ";
+            char * value = strstr (end, key.c_str ());
+            if (value) values [benchMetrics [metric].key] = strtod (value + key.size (), NULL);
+        }
+    }
+    fclose (file);
+
+    return baseline;
+}
+
+
+static void Usage (const char * program) {
+
+    fprintf (stderr,
+             "Usage: %s [options]\n"
+             "  --device NAME         SANE device to use (default test)\n"
+             "  --modes LIST          lineart,gray8,gray16,color8,color16,color8-3pass,color16-3pass\n"
+             "  --resolutions LIST    resolutions in dpi (default 75,150,300)\n"
+             "  --sizes LIST          page sizes in mm, WxH (default 50x50,105x148,200x200)\n"
+             "  --xfer LIST           memory,native (default both)\n"
+             "  --pages N             pages per case (default 3)\n"
+             "  --buffer BYTES        memory transfer buffer size (default: preferred size)\n"
+             "  --keep                keep the memory transfers, as an application would\n"
+             "  --picture NAME        test-picture option of the test backend (default \"Color pattern\")\n"
+             "  --json FILE           write the results as JSON\n"
+             "  --compare FILE        compare with a JSON baseline written by --json\n"
+             "  --threshold PERCENT   regression threshold for --compare (default 10)\n",
+             program);
+}
+
+
+int main (int argc, char ** argv) {
+
+    std::vector <std::string> modes = Split ("lineart,gray8,gray16,color8,color16,color8-3pass,color16-3pass");
+    std::vector <std::string> resolutions = Split ("75,150,300");
+    std::vector <std::string> sizes = Split ("50x50,105x148,200x200");
+    std::vector <std::string> xfers = Split ("memory,native");
+    const char * jsonPath = NULL;
+    const char * comparePath = NULL;
+    double threshold = 10;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv [i];
+        if (arg == "--keep") {
+            keep = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            Usage (argv [0]);
+            return 2;
+        }
+        const char * value = argv [++i];
+        if (arg == "--device") device = value;
+        else if (arg == "--modes") modes = Split (value);
+        else if (arg == "--resolutions") resolutions = Split (value);
+        else if (arg == "--sizes") sizes = Split (value);
+        else if (arg == "--xfer") xfers = Split (value);
+        else if (arg == "--pages") pages = atoi (value);
+        else if (arg == "--buffer") bufferSize = strtoul (value, NULL, 10);
+        else if (arg == "--picture") picture = value;
+        else if (arg == "--json") jsonPath = value;
+        else if (arg == "--compare") comparePath = value;
+        else if (arg == "--threshold") threshold = atof (value);
+        else {
+            Usage (argv [0]);
+            return 2;
+        }
+    }
+    if (pages < 1) pages = 1;
+
+    std::vector <BenchCase> cases;
+    for (size_t m = 0; m < modes.size (); m++) {
+        const BenchMode * mode = NULL;
+        for (size_t i = 0; i < sizeof (benchModes) / sizeof (benchModes [0]); i++)
+            if (modes [m] == benchModes [i].name) mode = &benchModes [i];
+        if (!mode) {
+            fprintf (stderr, "Unknown mode %s\n", modes [m].c_str ());
+            return 2;
+        }
+        for (size_t r = 0; r < resolutions.size (); r++)
+            for (size_t s = 0; s < sizes.size (); s++)
+                for (size_t x = 0; x < xfers.size (); x++) {
+                    BenchCase benchcase;
+                    benchcase.mode = mode;
+                    benchcase.resolution = atoi (resolutions [r].c_str ());
+                    if (sscanf (sizes [s].c_str (), "%lfx%lf", &benchcase.width, &benchcase.height) != 2) {
+                        fprintf (stderr, "Bad page size %s\n", sizes [s].c_str ());
+                        return 2;
+                    }
+                    benchcase.native = (xfers [x] == "native");
+                    benchcase.name = modes [m] + "/" + resolutions [r] + "dpi/" + sizes [s] + "mm/" + xfers [x];
+                    cases.push_back (benchcase);
+                }
+    }
+
+    // Keep the user's preferences out of it, the device destructor writes them back
+    char configdir [] = "/tmp/sane-ds-bench.XXXXXX";
+    if (!mkdtemp (configdir)) {
+        perror ("mkdtemp");
+        return 1;
+    }
+    setenv ("XDG_CONFIG_HOME", configdir, 1);
+
+    printf ("%-40s %6s %10s %10s %12s %12s %8s %8s %12s\n",
+            "case", "pages", "pages/min", "MB/s", "first ms", "peak RSS kB", "CPU s", "resizes", "tracked kB");
+
+    std::vector <std::pair <std::string, BenchRecord> > records;
+    for (size_t i = 0; i < cases.size (); i++) {
+        BenchRecord record;
+        if (!RunChild (cases [i], &record)) continue;
+        printf ("%-40s %6d %10.1f %10.2f %12.2f %12.0f %8.3f %8.2f %12.0f\n", cases [i].name.c_str (),
+                record.pages, record.pagesPerMin, record.mbPerSec, record.firstStripMs, record.peakRssKb,
+                record.cpuSeconds, record.resizesPerPage, record.peakTrackedKb);
+        fflush (stdout);
+        records.push_back (std::make_pair (cases [i].name, record));
+    }
+
+    unlink ((std::string (configdir) + "/twain-sane/preferences").c_str ());
+    rmdir ((std::string (configdir) + "/twain-sane").c_str ());
+    rmdir (configdir);
+
+    if (jsonPath) {
+        FILE * file = fopen (jsonPath, "w");
+        if (!file) {
+            perror (jsonPath);
+            return 1;
+        }
+        WriteJson (file, records);
+        fclose (file);
+    }
+
+    if (!comparePath) return 0;
+
+    std::map <std::string, std::map <std::string, double> > baseline = ReadJson (comparePath);
+    if (baseline.empty ()) {
+        fprintf (stderr, "No baseline cases in %s\n", comparePath);
+        return 1;
+    }
+
+    int regressions = 0;
+    printf ("\n%-40s %-16s %12s %12s %9s\n", "case", "metric", "baseline", "current", "change");
+    for (size_t i = 0; i < records.size (); i++) {
+        std::map <std::string, std::map <std::string, double> >::iterator base =
+            baseline.find (records [i].first);
+        if (base == baseline.end ()) continue;
+        for (size_t metric = 0; metric < BENCH_METRICS; metric++) {
+            std::map <std::string, double>::iterator value = base->second.find (benchMetrics [metric].key);
+            if (value == base->second.end () || value->second == 0) continue;
+            double current = Metric (records [i].second, metric);
+            double change = (current - value->second) / value->second * 100;
+            bool worse = (benchMetrics [metric].higherIsBetter ? -change : change) > threshold;
+            if (worse) regressions++;
+            printf ("%-40s %-16s %12.6g %12.6g %+8.1f%%%s\n", records [i].first.c_str (),
+                    benchMetrics [metric].key, value->second, current, change, worse ? "  REGRESSION" : "");
+        }
+    }
+    printf ("\n%d regression%s over %g%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+
+    return (regressions ? 1 : 0);
+}
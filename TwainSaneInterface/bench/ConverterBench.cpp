@@ -0,0 +1,948 @@
+// Micro-benchmarks for the Image converters: TwainImageMemXfer, MakePict and MakeTiff on synthetic
+// image data, for every SANE frame format and depth, a range of page widths and the buffer
+// sizes advertised by TwainSetupMemXfer. With --layout native the memory transfers are set up
+// the way the data comes from the backend, as an application would negotiate it, and with
+// --compression packbits, group4 or jpeg they are compressed, which also reports the size, and
+// PackBits and Group 4 transfers are decoded and checked against the uncompressed rows.
+// JPEG streams are encoded while scanning, so that encoder is timed on its own. The output follows Google Benchmark's console and JSON formats, so the usual comparison tools
+// work on it. The PackBits of the platform and PackBitsRow are compared on the rows of a text
+// page (gray1) and a photo (gray8).
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "BlankPage.h"
+#include "ContentArea.h"
+#include "Decoders.h"
+#include "Histogram.h"
+#include "Image.h"
+#include "Interleave.h"
+#include "JpegEncoder.h"
+#include "PackBits.h"
+#include "ToneMap.h"
+
+
+struct BenchFormat {
+    const char * name;
+    SANE_Frame format;
+    int depth;
+};
+
+static const BenchFormat benchFormats [] = {
+    { "gray1",   SANE_FRAME_GRAY, 1  },
+    { "gray8",   SANE_FRAME_GRAY, 8  },
+    { "gray16",  SANE_FRAME_GRAY, 16 },
+    { "rgb1",    SANE_FRAME_RGB,  1  },
+    { "rgb8",    SANE_FRAME_RGB,  8  },
+    { "rgb16",   SANE_FRAME_RGB,  16 },
+    { "3pass1",  SANE_FRAME_RED,  1  },
+    { "3pass8",  SANE_FRAME_RED,  8  },
+    { "3pass16", SANE_FRAME_RED,  16 }
+};
+
+struct BenchRun {
+    std::string name;
+    long iterations;
+    double seconds;
+    double bytes;
+    double pixels;
+    double cycles;
+    double written;
+    double resizes;
+    double peak;
+};
+
+static int lines = 256;
+static double minTime = 0.5;
+static bool nativeLayout = false;
+static int jpegQuality = TWJQ_MEDIUM;
+static TW_UINT16 compression = TWCP_NONE;
+
+
+static double Now () {
+
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Reference cycles from the time stamp counter where there is one, 0 elsewhere
+static unsigned long long Cycles () {
+
+#if defined (__i386__) || defined (__x86_64__)
+    return __builtin_ia32_rdtsc ();
+#else
+    return 0;
+#endif
+}
+
+
+static std::vector <std::string> Split (const char * list) {
+
+    std::vector <std::string> items;
+    std::string s = list;
+    for (size_t pos = 0; pos <= s.size (); ) {
+        size_t comma = s.find (',', pos);
+        if (comma == std::string::npos) comma = s.size ();
+        if (comma > pos) items.push_back (s.substr (pos, comma - pos));
+        pos = comma + 1;
+    }
+    return items;
+}
+
+
+// Scanner-like content: smooth gradients with noise, and blank margins that compress well.
+// Lineart looks like a text page: lines of glyph-like strokes on white paper.
+static Handle MakeData (const BenchFormat & format, int width, SANE_Parameters & param) {
+
+    param.format = format.format;
+    param.last_frame = SANE_TRUE;
+    param.pixels_per_line = width;
+    param.lines = lines;
+    param.depth = format.depth;
+
+    int samples = (format.format == SANE_FRAME_RGB ? 3 : 1);
+    // Colour lineart comes as a byte of eight pixels for each channel in turn
+    param.bytes_per_line = (format.depth == 1 ? samples * ((width + 7) / 8) : width * samples * format.depth / 8);
+
+    int frames = (format.format == SANE_FRAME_GRAY || format.format == SANE_FRAME_RGB ? 1 : 3);
+    Size size = (Size) param.bytes_per_line * lines * frames;
+
+    Handle data = NewHandle (size);
+    if (!data) return NULL;
+
+    unsigned int seed = 12345;
+    for (Size i = 0; i < size; i++) {
+        Size column = i % param.bytes_per_line;
+        seed = seed * 1103515245 + 12345;
+        if (column < param.bytes_per_line / 8)
+            (*data) [i] = 0;
+        else if (format.depth == 1) {
+            static const char strokes [] = { 0x00, 0x18, 0x3C, 0x7E, (char) 0xFF, (char) 0xC3, 0x66, 0x00 };
+            Size row = i / param.bytes_per_line;
+            unsigned int glyph = (column * 2654435761U) ^ ((row / 6) * 40503U);
+            (*data) [i] = (row % 40 < 24 && column % 7 != 0 ? strokes [(glyph >> 13) & 7] : 0);
+        }
+        else
+            (*data) [i] = (char) ((column * 255 / param.bytes_per_line) + ((seed >> 16) & 0x07));
+    }
+
+    return data;
+}
+
+
+static Image * MakeImage (const BenchFormat & format, int width, TW_UINT16 xfercompression,
+                          bool otherflavor = false) {
+
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!data) return NULL;
+
+    int frames = (format.format == SANE_FRAME_GRAY || format.format == SANE_FRAME_RGB ? 1 : 3);
+
+    SANE_Resolution res = { 300, 300, SANE_TYPE_INT };
+    SANE_Rect bounds = { 0, 0, SANE_FIX (lines * 25.4 / 300), SANE_FIX (width * 25.4 / 300),
+                         SANE_TYPE_FIXED, SANE_UNIT_MM };
+
+    TW_UINT16 pixelflavor = (nativeLayout && format.format == SANE_FRAME_GRAY && format.depth == 1 ?
+                             TWPF_VANILLA : TWPF_CHOCOLATE);
+    if (otherflavor) pixelflavor = (pixelflavor == TWPF_VANILLA ? TWPF_CHOCOLATE : TWPF_VANILLA);
+
+    Image * image = new Image (param, bounds, res, data);
+    if (nativeLayout)
+        image->SetTransferLayout (pixelflavor, (frames == 3 ? TWPC_PLANAR : TWPC_CHUNKY), true, xfercompression,
+                                  jpegQuality);
+    else
+        image->SetTransferLayout (pixelflavor, TWPC_CHUNKY, false, xfercompression, jpegQuality);
+    return image;
+}
+
+
+// The encoder as SaneDevice::Scan runs it, one row at a time
+static BenchRun RunJpegEncode (const BenchFormat & format, int width) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!data) return run;
+    SANE_Resolution res = { 300, 300, SANE_TYPE_INT };
+
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        JpegEncoder jpeg (param.pixels_per_line, param.lines, (param.format == SANE_FRAME_GRAY ? 1 : 3),
+                          JpegEncoder::Quality (jpegQuality), res);
+        for (int row = 0; row < param.lines; row++)
+            jpeg.WriteRow ((const unsigned char *) &(*data) [(Size) row * param.bytes_per_line], param.depth);
+        Handle stream = jpeg.Finish ();
+        run.written = (stream ? GetHandleSize (stream) : 0);
+        if (stream) {
+            MemoryReleased (MEMORY_COMPRESSED, GetHandleSize (stream));
+            DisposeHandle (stream);
+        }
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    DisposeHandle (data);
+    return run;
+}
+
+
+static BenchRun RunMemXfer (Image * image, TW_UINT32 size) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    std::vector <char> memory (size);
+    TW_IMAGEMEMXFER imagememxfer;
+    memset (&imagememxfer, 0, sizeof (imagememxfer));
+    imagememxfer.Memory.Flags = TWMF_APPOWNS | TWMF_POINTER;
+    imagememxfer.Memory.Length = size;
+    imagememxfer.Memory.TheMem = &memory [0];
+
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        TW_UINT32 yoffset = 0;
+        TW_UINT16 rc;
+        run.written = 0;
+        do {
+            rc = image->TwainImageMemXfer (&imagememxfer, &yoffset);
+            run.written += imagememxfer.BytesWritten;
+        }
+        while (rc == TWRC_SUCCESS);
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    return run;
+}
+
+
+// Decodes the compressed memory transfers into the rows of the uncompressed ones, or for
+// Group 4 into the lineart rows as they came from the backend, and compares them
+static bool CheckCompressed (const BenchFormat & format, int width, TW_UINT32 size) {
+
+    Image * image = MakeImage (format, width, compression);
+    Image * plain = MakeImage (format, width, TWCP_NONE);
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!image || !plain || !data) {
+        delete image;
+        delete plain;
+        if (data) DisposeHandle (data);
+        return true;
+    }
+
+    std::vector <char> memory (size);
+    TW_IMAGEMEMXFER imagememxfer;
+    memset (&imagememxfer, 0, sizeof (imagememxfer));
+    imagememxfer.Memory.Flags = TWMF_APPOWNS | TWMF_POINTER;
+    imagememxfer.Memory.Length = size;
+    imagememxfer.Memory.TheMem = &memory [0];
+
+    std::vector <unsigned char> decoded;
+    TW_UINT16 xfercompression = TWCP_NONE;
+    TW_UINT32 yoffset = 0;
+    TW_UINT16 rc;
+    bool ok = true;
+    do {
+        rc = image->TwainImageMemXfer (&imagememxfer, &yoffset);
+        if (rc != TWRC_SUCCESS && rc != TWRC_XFERDONE) break;
+        xfercompression = imagememxfer.Compression;
+        if (xfercompression == TWCP_NONE) break;
+
+        const unsigned char * src = (const unsigned char *) &memory [0];
+        const unsigned char * end = src + imagememxfer.BytesWritten;
+        Size rowbytes = (xfercompression == TWCP_GROUP4 ? param.bytes_per_line : imagememxfer.BytesPerRow);
+        Size first = decoded.size ();
+        decoded.resize (first + imagememxfer.Rows * rowbytes);
+        Group4Decoder group4 (src, imagememxfer.BytesWritten, imagememxfer.Columns);
+        for (TW_UINT32 row = 0; ok && row < imagememxfer.Rows; row++) {
+            unsigned char * dst = &decoded [first + row * rowbytes];
+            if (xfercompression == TWCP_GROUP4)
+                ok = group4.DecodeRow (dst);
+            else
+                ok = ((src = UnpackBitsRow (src, end, dst, rowbytes)) != NULL);
+        }
+        if (ok) ok = (xfercompression == TWCP_GROUP4 ? group4.AtEnd () : src == end);
+    }
+    while (ok && rc == TWRC_SUCCESS);
+
+    if (xfercompression != TWCP_NONE) {
+        std::vector <unsigned char> expected;
+        if (xfercompression == TWCP_GROUP4) {
+            // without the bits past the end of the row
+            expected.assign ((unsigned char *) *data, (unsigned char *) *data + GetHandleSize (data));
+            if (width % 8)
+                for (int row = 0; row < param.lines; row++)
+                    expected [(Size) (row + 1) * param.bytes_per_line - 1] &= ~(0xFF >> (width % 8));
+        }
+        else {
+            // The uncompressed rows, in a buffer that takes them all at once
+            TW_SETUPMEMXFER setupmemxfer;
+            plain->TwainSetupMemXfer (&setupmemxfer);
+            std::vector <char> all (setupmemxfer.Preferred);
+            imagememxfer.Memory.Length = setupmemxfer.Preferred;
+            imagememxfer.Memory.TheMem = &all [0];
+            yoffset = 0;
+            do {
+                rc = plain->TwainImageMemXfer (&imagememxfer, &yoffset);
+                expected.insert (expected.end (), all.begin (), all.begin () + imagememxfer.BytesWritten);
+            }
+            while (rc == TWRC_SUCCESS);
+        }
+        if (!ok || decoded != expected) {
+            fprintf (stderr, "%s memory transfers of %s/%d in %lu byte buffers do not decode to the image\n",
+                     (xfercompression == TWCP_GROUP4 ? "Group 4" : "PackBits"), format.name, width,
+                     (unsigned long) size);
+            ok = false;
+        }
+    }
+
+    delete image;
+    delete plain;
+    DisposeHandle (data);
+    return ok;
+}
+
+
+// All memory transfers of an image, in buffers of size bytes, without the padding of the rows
+static std::vector <unsigned char> TransferRows (Image * image, TW_UINT32 size) {
+
+    TW_IMAGEINFO imageinfo;
+    image->TwainImageInfo (&imageinfo);
+    Size bits = imageinfo.ImageWidth * (imageinfo.Planar ? imageinfo.BitsPerSample [0] : imageinfo.BitsPerPixel);
+    Size rowbytes = (bits + 7) / 8;
+
+    std::vector <char> memory (size);
+    TW_IMAGEMEMXFER imagememxfer;
+    memset (&imagememxfer, 0, sizeof (imagememxfer));
+    imagememxfer.Memory.Flags = TWMF_APPOWNS | TWMF_POINTER;
+    imagememxfer.Memory.Length = size;
+    imagememxfer.Memory.TheMem = &memory [0];
+
+    std::vector <unsigned char> rows;
+    TW_UINT32 yoffset = 0;
+    TW_UINT16 rc;
+    do {
+        TW_UINT32 first = yoffset;
+        rc = image->TwainImageMemXfer (&imagememxfer, &yoffset);
+        if (rc != TWRC_SUCCESS && rc != TWRC_XFERDONE) break;
+        for (TW_UINT32 row = 0; row < yoffset - first; row++)
+            rows.insert (rows.end (), &memory [row * imagememxfer.BytesPerRow],
+                         &memory [row * imagememxfer.BytesPerRow + rowbytes]);
+    }
+    while (rc == TWRC_SUCCESS);
+    return rows;
+}
+
+
+// Memory transfers with the other pixel flavor have every sample inverted, colour lineart
+// counts its palette from the other end
+static bool CheckFlavor (const BenchFormat & format, int width, TW_UINT32 size) {
+
+    Image * image = MakeImage (format, width, TWCP_NONE);
+    Image * other = MakeImage (format, width, TWCP_NONE, true);
+    bool ok = true;
+    if (image && other) {
+        std::vector <unsigned char> rows = TransferRows (image, size);
+        std::vector <unsigned char> otherrows = TransferRows (other, size);
+        bool palette = (format.format != SANE_FRAME_GRAY && format.depth == 1);
+        for (size_t i = 0; i < rows.size (); i++)
+            rows [i] = (palette ? 7 - rows [i] : ~rows [i]);
+        if (rows.empty () || rows != otherrows) {
+            fprintf (stderr, "Memory transfers of %s/%d in %lu byte buffers are not inverted by the other pixel flavor\n",
+                     format.name, width, (unsigned long) size);
+            ok = false;
+        }
+    }
+    delete image;
+    delete other;
+    return ok;
+}
+
+
+// A native transfer, as a PICT or as a TIFF
+static BenchRun RunNative (Image * image, bool tiff) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    // How often the picture is resized while it is made, and the most memory it takes
+    long long resizes = MemoryResizes (MEMORY_PICT);
+    MemoryResetPeak (MEMORY_PICT);
+
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        Handle native = (tiff ? image->MakeTiff () : (Handle) image->MakePict ());
+        // Too large for the format
+        if (!native) break;
+        run.written = GetHandleSize (native);
+        MemoryReleased (MEMORY_PICT, GetHandleSize (native));
+        DisposeHandle (native);
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    if (!run.iterations) return run;
+    run.resizes = (double) (MemoryResizes (MEMORY_PICT) - resizes) / run.iterations;
+    run.peak = MemoryPeak (MEMORY_PICT);
+
+    return run;
+}
+
+
+// Packs every row, the way MakePict does, with the PackBits of the platform or with PackBitsRow
+static Size PackRows (Handle data, const SANE_Parameters & param, bool vector, unsigned char * packed) {
+
+    unsigned char * dst = packed;
+    for (int row = 0; row < param.lines; row++) {
+        const unsigned char * src = (const unsigned char *) &(*data) [(Size) row * param.bytes_per_line];
+        if (vector)
+            dst += PackBitsRow (src, param.bytes_per_line, dst);
+        else {
+            // PackBits takes a short count
+            Ptr s = (Ptr) src;
+            Ptr d = (Ptr) dst;
+            for (int done = 0; done < param.bytes_per_line; done += 0x4000)
+                PackBits (&s, &d, std::min (param.bytes_per_line - done, 0x4000));
+            dst = (unsigned char *) d;
+        }
+    }
+    return dst - packed;
+}
+
+
+static BenchRun RunPackBits (const BenchFormat & format, int width, bool vector) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!data) return run;
+    std::vector <unsigned char> packed ((Size) param.lines * PackBitsBound (param.bytes_per_line));
+
+    // Both encoders have to make the same bytes
+    std::vector <unsigned char> reference (packed.size ());
+    Size length = PackRows (data, param, !vector, &reference [0]);
+    if (PackRows (data, param, vector, &packed [0]) != length || memcmp (&packed [0], &reference [0], length)) {
+        fprintf (stderr, "PackBitsRow differs from PackBits for %s/%d\n", format.name, width);
+        DisposeHandle (data);
+        return run;
+    }
+
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        run.written = PackRows (data, param, vector, &packed [0]);
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    DisposeHandle (data);
+    return run;
+}
+
+
+// The three frames of a three-pass scan into chunky rows, the way SaneDevice::Scan stores them
+static BenchRun RunInterleave (const BenchFormat & format, int width) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!data) return run;
+    Size plane = (Size) param.bytes_per_line * param.lines;
+    int bytes = param.depth / 8;
+    std::vector <unsigned char> chunky (3 * plane);
+
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        for (int channel = 0; channel < 3; channel++)
+            for (int row = 0; row < param.lines; row++)
+                InterleaveChannel ((const unsigned char *) &(*data) [channel * plane + (Size) row * param.bytes_per_line],
+                                   &chunky [(Size) row * 3 * param.bytes_per_line], param.pixels_per_line, channel, bytes);
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    // Every sample has to end up in its place
+    for (Size i = 0; i < 3 * plane && run.iterations; i++) {
+        Size sample = i / bytes;
+        Size row = sample / (3 * param.pixels_per_line);
+        Size column = sample % (3 * param.pixels_per_line);
+        Size source = (column % 3) * plane + row * param.bytes_per_line + column / 3 * bytes + i % bytes;
+        if (chunky [i] != (unsigned char) (*data) [source]) {
+            fprintf (stderr, "InterleaveChannel misplaced byte %ld for %s/%d\n", (long) i, format.name, width);
+            run.iterations = 0;
+        }
+    }
+
+    DisposeHandle (data);
+    return run;
+}
+
+
+// Software brightness, contrast and gamma over the rows as they come from sane_read
+static BenchRun RunToneMap (const BenchFormat & format, int width) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!data) return run;
+    ToneMap tonemap (100, 200, 2.2, param.depth);
+
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        tonemap.Apply ((unsigned char *) *data, GetHandleSize (data));
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    DisposeHandle (data);
+    return run;
+}
+
+
+// The statistics counted on each sane_read, checked against a plain sum over the samples
+static BenchRun RunHistogram (const BenchFormat & format, int width) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!data) return run;
+    const unsigned char * samples = (const unsigned char *) *data;
+    Size size = GetHandleSize (data);
+    Histogram histogram;
+
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        histogram.Start ((format.format == SANE_FRAME_GRAY ? 1 : 3), param.depth);
+        histogram.Add (samples, size);
+        histogram.Finish ();
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    double sum = 0;
+    UInt64 count = 0;
+    if (param.depth == 1)
+        for (Size i = 0; i < size; i++)
+            for (int bit = 0; bit < 8; bit++, count++)
+                sum += (samples [i] >> bit) & 1;
+    else if (param.depth == 8)
+        for (Size i = 0; i < size; i++, count++)
+            sum += samples [i];
+    else
+        for (Size i = 0; i + 2 <= size; i += 2, count++) {
+            UInt16 sample;
+            memcpy (&sample, &samples [i], 2);
+            sum += sample;
+        }
+    double total = 0;
+    UInt64 counted = 0;
+    for (int c = 0; c < histogram.GetChannels (); c++) {
+        total += histogram.GetMean (c) * histogram.GetSamples (c);
+        counted += histogram.GetSamples (c);
+    }
+    if (counted != count || fabs (total - sum) > 1e-6 * (sum + 1)) {
+        fprintf (stderr, "Histogram counted %.0f in %llu samples instead of %.0f in %llu for %s/%d\n",
+                 total, (unsigned long long) counted, sum, (unsigned long long) count, format.name, width);
+        run.iterations = 0;
+    }
+
+    DisposeHandle (data);
+    return run;
+}
+
+
+// The statistics of a scan with the rows looked at for ink when blank pages are dropped, added
+// in pieces as sane_read returns them, and checked against a plain count of the ink between the margins
+static BenchRun RunBlankPage (const BenchFormat & format, int width) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!data) return run;
+    const unsigned char * samples = (const unsigned char *) *data;
+    Size size = GetHandleSize (data);
+    Histogram histogram;
+    bool blank = false;
+
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        histogram.Start ((format.format == SANE_FRAME_GRAY ? 1 : 3), param.depth);
+        BlankPage blankpage (param, histogram);
+        for (Size done = 0; done < size;)
+            done += histogram.Add (samples + done, std::min (size - done, (Size) 0x8001));
+        histogram.Finish ();
+        blank = blankpage.IsBlank (5);
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    int unit = (param.depth == 1 ? 1 : param.depth / 8) * (format.format == SANE_FRAME_RGB ? 3 : 1);
+    int units = (param.depth == 1 ? width / 8 : width);
+    Size first = units / 20 * unit;
+    Size last = (units - units / 20) * unit;
+    UInt64 ink = 0;
+    UInt64 inks = 0;
+    const std::vector <Histogram::RowCounts> & rows = histogram.GetRowCounts ();
+    for (int row = 0; row < param.lines; row++)
+        for (Size i = first; i < last; i += (param.depth == 16 ? 2 : 1)) {
+            const unsigned char * sample = &samples [(Size) row * param.bytes_per_line + i];
+            if (param.depth == 1)
+                for (int bit = 0; bit < 8; bit++) ink += (*sample >> bit) & 1;
+            else if (param.depth == 8)
+                ink += (*sample < 128);
+            else {
+                UInt16 sample16;
+                memcpy (&sample16, sample, 2);
+                ink += (sample16 < 0x8000);
+            }
+        }
+    for (size_t r = 0; r < rows.size (); r++) inks += rows [r].ink;
+    if (rows.size () != (size_t) param.lines || inks != ink || blank) {
+        fprintf (stderr, "Blank page rows counted %llu ink in %lu rows instead of %llu in %d for %s/%d\n",
+                 (unsigned long long) inks, (unsigned long) rows.size (), (unsigned long long) ink, param.lines,
+                 format.name, width);
+        run.iterations = 0;
+    }
+
+    DisposeHandle (data);
+    return run;
+}
+
+
+// The area a preview finds on the glass: a grey sheet in the middle of a white lid
+static BenchRun RunContentArea (const BenchFormat & format, int width) {
+
+    BenchRun run = { "", 0, 0, 0, 0, 0, 0 };
+
+    SANE_Parameters param;
+    Handle data = MakeData (format, width, param);
+    if (!data) return run;
+
+    int top = lines / 4;
+    int bottom = lines - lines / 4;
+    int left = width / 32 * 8;
+    int right = width / 32 * 24;
+    Size first = (Size) (format.depth == 1 ? left / 8 : left * format.depth / 8) *
+        (format.format == SANE_FRAME_RGB ? 3 : 1);
+    Size last = (Size) (format.depth == 1 ? right / 8 : right * format.depth / 8) *
+        (format.format == SANE_FRAME_RGB ? 3 : 1);
+    for (int row = 0; row < lines; row++) {
+        char * p = *data + (Size) row * param.bytes_per_line;
+        memset (p, (format.depth == 1 ? 0x00 : 0xFF), param.bytes_per_line);
+        if (row >= top && row < bottom)
+            memset (p + first, (format.depth == 1 ? 0xFF : 0x60), last - first);
+    }
+
+    int areatop = 0, arealeft = 0, areabottom = 0, arearight = 0;
+    double start = Now ();
+    unsigned long long startCycles = Cycles ();
+    do {
+        FindContentArea ((const unsigned char *) *data, param, &areatop, &arealeft, &areabottom, &arearight);
+        run.iterations++;
+        run.seconds = Now () - start;
+    }
+    while (run.seconds < minTime);
+    run.cycles = Cycles () - startCycles;
+
+    // The sheet with a little room around it
+    int ypad = std::max (2, lines / 100) + 1;
+    int xpad = std::max (2, width / 100) + 1;
+    if (areatop > top || areatop < top - ypad || areabottom < bottom || areabottom > bottom + ypad ||
+        arealeft > left || arealeft < left - xpad || arearight < right || arearight > right + xpad) {
+        fprintf (stderr, "Content area found at %d,%d to %d,%d instead of %d,%d to %d,%d for %s/%d\n",
+                 arealeft, areatop, arearight, areabottom, left, top, right, bottom, format.name, width);
+        run.iterations = 0;
+    }
+
+    DisposeHandle (data);
+    return run;
+}
+
+
+// Each kernel checks its result where it can and returns no iterations when it is wrong
+
+struct BenchKernel {
+    const char * name;
+    BenchRun (* run) (const BenchFormat & format, int width);
+    // Also for lineart, and for gray and RGB frames rather than the frames of a three-pass scan
+    bool lineart;
+    bool singlepass;
+};
+
+static const BenchKernel benchKernels [] = {
+    // The tone map is applied to every sample of gray and colour scans
+    { "ToneMap",     RunToneMap,     false, true  },
+    // Statistics are counted for every scan
+    { "Histogram",   RunHistogram,   true,  true  },
+    // and the ink of every page when blank pages are dropped
+    { "BlankPage",   RunBlankPage,   true,  true  },
+    // Previews are searched for what is on the glass
+    { "ContentArea", RunContentArea, true,  true  },
+    // The frames of a three-pass scan as they are stored while scanning
+    { "Interleave",  RunInterleave,  false, false }
+};
+
+
+static void Report (const BenchRun & run) {
+
+    double time = run.seconds / run.iterations;
+    const char * unit = "ms";
+    double scaled = time * 1e3;
+    if (scaled < 1) {
+        unit = "us";
+        scaled = time * 1e6;
+    }
+
+    printf ("%-36s %10.3f %s %10ld %10.3f MB/s", run.name.c_str (), scaled, unit, run.iterations,
+            run.bytes * run.iterations / run.seconds / (1024 * 1024));
+    if (run.cycles)
+        printf (" %10.3f cycles/pixel", run.cycles / run.iterations / run.pixels);
+    if ((compression != TWCP_NONE || run.name.compare (0, 9, "PackBits/") == 0) && run.written)
+        printf (" %7.1f%% size", 100 * run.written / run.bytes);
+    if (run.peak)
+        printf (" %5.2f resizes %10.0f kB peak", run.resizes, run.peak / 1024);
+    printf ("\n");
+    fflush (stdout);
+}
+
+
+static void WriteJson (FILE * file, const std::vector <BenchRun> & runs) {
+
+    fprintf (file, "{\n  \"context\": {\"lines\": %d, \"min_time\": %g},\n  \"benchmarks\": [\n", lines, minTime);
+    for (size_t i = 0; i < runs.size (); i++) {
+        double time = runs [i].seconds / runs [i].iterations;
+        fprintf (file, "    {\"name\": \"%s\", \"run_type\": \"iteration\", \"iterations\": %ld, "
+                 "\"real_time\": %.6g, \"cpu_time\": %.6g, \"time_unit\": \"ns\", "
+                 "\"bytes_per_second\": %.6g, \"cycles_per_pixel\": %.6g, \"bytes_written\": %.0f, "
+                 "\"resizes\": %.6g, \"peak_bytes\": %.0f}%s\n",
+                 runs [i].name.c_str (), runs [i].iterations, time * 1e9, time * 1e9,
+                 runs [i].bytes * runs [i].iterations / runs [i].seconds,
+                 runs [i].cycles / runs [i].iterations / runs [i].pixels, runs [i].written,
+                 runs [i].resizes, runs [i].peak, i + 1 < runs.size () ? "," : "");
+    }
+    fprintf (file, "  ]\n}\n");
+}
+
+
+static void Usage (const char * program) {
+
+    fprintf (stderr,
+             "Usage: %s [options]\n"
+             "  --formats LIST    gray1,gray8,gray16,rgb1,rgb8,rgb16,3pass1,3pass8,3pass16\n"
+             "  --widths LIST     page widths in pixels (default 300,600,1200,2400,4800,9600)\n"
+             "  --lines N         image height in lines (default 256)\n"
+             "  --layout L        default or native, the memory transfer layout (default default)\n"
+             "  --compression C   none, packbits, group4 or jpeg for the memory transfers (default none)\n"
+             "  --quality Q       ICAP_JPEGQUALITY, 1 to 100, or -3 to -1 for low to high (default -2)\n"
+             "  --filter TEXT     only run benchmarks whose name contains TEXT\n"
+             "  --min-time S      minimum run time per benchmark in seconds (default 0.5)\n"
+             "  --json FILE       write the results in Google Benchmark JSON format\n",
+             program);
+}
+
+
+int main (int argc, char ** argv) {
+
+    std::vector <std::string> formats = Split ("gray1,gray8,gray16,rgb1,rgb8,rgb16,3pass1,3pass8,3pass16");
+    std::vector <std::string> widths = Split ("300,600,1200,2400,4800,9600");
+    std::string filter;
+    const char * jsonPath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv [i];
+        if (i + 1 == argc) {
+            Usage (argv [0]);
+            return 2;
+        }
+        const char * value = argv [++i];
+        if (arg == "--formats") formats = Split (value);
+        else if (arg == "--widths") widths = Split (value);
+        else if (arg == "--lines") lines = atoi (value);
+        else if (arg == "--layout") nativeLayout = (strcmp (value, "native") == 0);
+        else if (arg == "--compression")
+            compression = (strcmp (value, "packbits") == 0 ? TWCP_PACKBITS :
+                           strcmp (value, "group4") == 0 ? TWCP_GROUP4 :
+                           strcmp (value, "jpeg") == 0 ? TWCP_JPEG : TWCP_NONE);
+        else if (arg == "--quality") jpegQuality = atoi (value);
+        else if (arg == "--filter") filter = value;
+        else if (arg == "--min-time") minTime = atof (value);
+        else if (arg == "--json") jsonPath = value;
+        else {
+            Usage (argv [0]);
+            return 2;
+        }
+    }
+    if (lines < 1) lines = 1;
+
+    printf ("%-36s %13s %10s %15s %s\n", "Benchmark", "Time", "Iterations", "Throughput",
+            Cycles () ? "  (TSC reference cycles)" : "");
+
+    std::vector <BenchRun> runs;
+
+    for (size_t f = 0; f < formats.size (); f++) {
+        const BenchFormat * format = NULL;
+        for (size_t i = 0; i < sizeof (benchFormats) / sizeof (benchFormats [0]); i++)
+            if (formats [f] == benchFormats [i].name) format = &benchFormats [i];
+        if (!format) {
+            fprintf (stderr, "Unknown format %s\n", formats [f].c_str ());
+            return 2;
+        }
+
+        for (size_t w = 0; w < widths.size (); w++) {
+            int width = atoi (widths [w].c_str ());
+            Image * image = MakeImage (*format, width, compression);
+            if (!image) {
+                fprintf (stderr, "Out of memory for %s/%d\n", format->name, width);
+                continue;
+            }
+
+            TW_IMAGEINFO imageinfo;
+            image->TwainImageInfo (&imageinfo);
+            double bytes = (double) imageinfo.ImageWidth * imageinfo.ImageLength * imageinfo.BitsPerPixel / 8;
+            double pixels = (double) imageinfo.ImageWidth * imageinfo.ImageLength;
+
+            // The sizes an application is offered: one line, a typical 64 kB strip, the whole image
+            TW_SETUPMEMXFER setupmemxfer;
+            image->TwainSetupMemXfer (&setupmemxfer);
+            TW_UINT32 strip = 0x10000 / setupmemxfer.MinBufSize * setupmemxfer.MinBufSize;
+            if (strip < setupmemxfer.MinBufSize) strip = setupmemxfer.MinBufSize;
+
+            std::vector <std::pair <std::string, TW_UINT32> > buffers;
+            buffers.push_back (std::make_pair (std::string ("min"), setupmemxfer.MinBufSize));
+            buffers.push_back (std::make_pair (std::string ("64k"), strip));
+            buffers.push_back (std::make_pair (std::string ("preferred"), setupmemxfer.Preferred));
+
+            // Three-pass images are only encoded once the scan is done, in the first memory transfer
+            bool encode = (compression == TWCP_JPEG && format->depth != 1 &&
+                           (format->format == SANE_FRAME_GRAY || format->format == SANE_FRAME_RGB));
+
+            for (size_t b = 0; b <= buffers.size () + 2; b++) {
+                BenchRun run;
+                std::string name = std::string (b < buffers.size () ? "MemXfer/" :
+                                                 b == buffers.size () ? "MakePict/" :
+                                                 b == buffers.size () + 1 ? "MakeTiff/" : "JpegEncode/") +
+                    format->name + "/" + widths [w] + (b < buffers.size () ? "/" + buffers [b].first : "");
+                if (b > buffers.size () + 1 && !encode) continue;
+                if (!filter.empty () && name.find (filter) == std::string::npos) continue;
+
+                if (b < buffers.size () && (compression == TWCP_PACKBITS || compression == TWCP_GROUP4) &&
+                    !CheckCompressed (*format, width, buffers [b].second))
+                    return 1;
+                if (b < buffers.size () && compression == TWCP_NONE && !CheckFlavor (*format, width, buffers [b].second))
+                    return 1;
+
+                if (b < buffers.size ())
+                    run = RunMemXfer (image, buffers [b].second);
+                else if (b <= buffers.size () + 1)
+                    run = RunNative (image, b > buffers.size ());
+                else
+                    run = RunJpegEncode (*format, width);
+
+                if (!run.iterations) {
+                    printf ("%-36s %13s\n", name.c_str (), "rejected");
+                    continue;
+                }
+                // Every byte of an uncompressed image has to come out of the memory transfers
+                double expected = (double) setupmemxfer.MinBufSize * imageinfo.ImageLength;
+                if (b < buffers.size () && compression == TWCP_NONE && !nativeLayout && run.written != expected) {
+                    fprintf (stderr, "%s transferred %.0f of %.0f bytes\n", name.c_str (), run.written, expected);
+                    return 1;
+                }
+
+                run.name = name;
+                run.bytes = bytes;
+                run.pixels = pixels;
+                Report (run);
+                runs.push_back (run);
+            }
+
+            // The same rows as MakePict packs them, text for lineart and a photo for 8 bit gray
+            if (format->format == SANE_FRAME_GRAY && format->depth != 16) {
+                for (int vector = 0; vector < 2; vector++) {
+                    std::string name = std::string ("PackBits/") + (format->depth == 1 ? "text/" : "photo/") +
+                        widths [w] + (vector ? "/vector" : "/platform");
+                    if (!filter.empty () && name.find (filter) == std::string::npos) continue;
+                    BenchRun run = RunPackBits (*format, width, vector);
+                    if (!run.iterations) return 1;
+                    run.name = name;
+                    run.bytes = bytes;
+                    run.pixels = pixels;
+                    Report (run);
+                    runs.push_back (run);
+                }
+            }
+
+            // The kernels that run on the rows as they come from the scanner
+            for (size_t k = 0; k < sizeof (benchKernels) / sizeof (benchKernels [0]); k++) {
+                const BenchKernel & kernel = benchKernels [k];
+                bool singlepass = (format->format == SANE_FRAME_GRAY || format->format == SANE_FRAME_RGB);
+                if (singlepass != kernel.singlepass || (format->depth == 1 && !kernel.lineart)) continue;
+                std::string name = std::string (kernel.name) + "/" + format->name + "/" + widths [w];
+                if (!filter.empty () && name.find (filter) == std::string::npos) continue;
+                BenchRun run = kernel.run (*format, width);
+                if (!run.iterations) return 1;
+                run.name = name;
+                run.bytes = bytes;
+                run.pixels = pixels;
+                Report (run);
+                runs.push_back (run);
+            }
+
+            delete image;
+        }
+    }
+
+    if (jsonPath) {
+        FILE * file = fopen (jsonPath, "w");
+        if (!file) {
+            perror (jsonPath);
+            return 1;
+        }
+        WriteJson (file, runs);
+        fclose (file);
+    }
+
+    return 0;
+}
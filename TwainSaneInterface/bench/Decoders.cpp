@@ -0,0 +1,223 @@
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "Decoders.h"
+
+
+const unsigned char * UnpackBitsRow (const unsigned char * src, const unsigned char * end,
+                                     unsigned char * dst, Size length) {
+
+    Size done = 0;
+    while (done < length && src < end) {
+        int n = (signed char) *src++;
+        if (n >= 0) {
+            if (done + n + 1 > length || src + n + 1 > end) return NULL;
+            memcpy (dst + done, src, n + 1);
+            src += n + 1;
+            done += n + 1;
+        }
+        else if (n != -128) {
+            if (done + 1 - n > length || src == end) return NULL;
+            memset (dst + done, *src++, 1 - n);
+            done += 1 - n;
+        }
+    }
+    return (done == length ? src : NULL);
+}
+
+
+bool LzwDecode (const unsigned char * src, Size srclength, unsigned char * dst, Size length) {
+
+    std::vector <std::string> table;
+    int width = 9;
+    Size bit = 0;
+    Size done = 0;
+    int old = -1;
+
+    for (;;) {
+        if (bit + width > 8 * srclength) return false;
+        int code = 0;
+        for (int i = 0; i < width; i++, bit++)
+            code = (code << 1) | ((src [bit / 8] >> (7 - bit % 8)) & 1);
+
+        // 256 clears the table, 257 ends the strip
+        if (code == 257) break;
+        if (code == 256) {
+            table.clear ();
+            for (int i = 0; i < 256; i++) table.push_back (std::string (1, (char) i));
+            table.push_back ("");
+            table.push_back ("");
+            width = 9;
+            old = -1;
+            continue;
+        }
+        if (table.empty ()) return false;
+
+        std::string entry;
+        if (code < (int) table.size ())
+            entry = table [code];
+        else if (code == (int) table.size () && old >= 0)
+            entry = table [old] + table [old] [0];
+        else
+            return false;
+        if (old >= 0) table.push_back (table [old] + entry [0]);
+        old = code;
+
+        if ((Size) (done + entry.size ()) > length) return false;
+        memcpy (dst + done, entry.data (), entry.size ());
+        done += entry.size ();
+
+        // The code gets longer one entry early, as in every TIFF writer
+        if ((int) table.size () + 1 >= (1 << width) && width < 12) width++;
+    }
+
+    return (done == length);
+}
+
+
+// The T.4 codes for runs of 0 to 63, then the make-up codes for 64 to 1728
+static const char * const whiteCodes [91] = {
+    "00110101", "000111", "0111", "1000", "1011", "1100", "1110", "1111",
+    "10011", "10100", "00111", "01000", "001000", "000011", "110100", "110101",
+    "101010", "101011", "0100111", "0001100", "0001000", "0010111", "0000011", "0000100",
+    "0101000", "0101011", "0010011", "0100100", "0011000", "00000010", "00000011", "00011010",
+    "00011011", "00010010", "00010011", "00010100", "00010101", "00010110", "00010111", "00101000",
+    "00101001", "00101010", "00101011", "00101100", "00101101", "00000100", "00000101", "00001010",
+    "00001011", "01010010", "01010011", "01010100", "01010101", "00100100", "00100101", "01011000",
+    "01011001", "01011010", "01011011", "01001010", "01001011", "00110010", "00110011", "00110100",
+    "11011", "10010", "010111", "0110111", "00110110", "00110111", "01100100", "01100101",
+    "01101000", "01100111", "011001100", "011001101", "011010010", "011010011", "011010100", "011010101",
+    "011010110", "011010111", "011011000", "011011001", "011011010", "011011011", "010011000", "010011001",
+    "010011010", "011000", "010011011"
+};
+
+static const char * const blackCodes [91] = {
+    "0000110111", "010", "11", "10", "011", "0011", "0010", "00011",
+    "000101", "000100", "0000100", "0000101", "0000111", "00000100", "00000111", "000011000",
+    "0000010111", "0000011000", "0000001000", "00001100111", "00001101000", "00001101100", "00000110111", "00000101000",
+    "00000010111", "00000011000", "000011001010", "000011001011", "000011001100", "000011001101", "000001101000",
+    "000001101001", "000001101010", "000001101011", "000011010010", "000011010011", "000011010100", "000011010101",
+    "000011010110", "000011010111", "000001101100", "000001101101", "000011011010", "000011011011", "000001010100",
+    "000001010101", "000001010110", "000001010111", "000001100100", "000001100101", "000001010010", "000001010011",
+    "000000100100", "000000110111", "000000111000", "000000100111", "000000101000", "000001011000", "000001011001",
+    "000000101011", "000000101100", "000001011010", "000001100110", "000001100111",
+    "0000001111", "000011001000", "000011001001", "000001011011", "000000110011", "000000110100", "000000110101",
+    "0000001101100", "0000001101101", "0000001001010", "0000001001011", "0000001001100", "0000001001101",
+    "0000001110010", "0000001110011", "0000001110100", "0000001110101", "0000001110110", "0000001110111",
+    "0000001010010", "0000001010011", "0000001010100", "0000001010101", "0000001011010", "0000001011011",
+    "0000001100100", "0000001100101"
+};
+
+// Make-up codes for 1792 to 2560, the same for both colours
+static const char * const extendedCodes [13] = {
+    "00000001000", "00000001100", "00000001101", "000000010010", "000000010011", "000000010100",
+    "000000010101", "000000010110", "000000010111", "000000011100", "000000011101", "000000011110",
+    "000000011111"
+};
+
+// The modes of T.6, vertical with a1 - b1 from -3 to 3
+enum { MODE_PASS = 100, MODE_HORIZONTAL, MODE_EOL };
+static const char * const modeCodes [10] = {
+    "0000010", "000010", "010", "1", "011", "000011", "0000011", "0001", "001", "000000000001"
+};
+
+
+Group4Decoder::Group4Decoder (const unsigned char * indata, Size insize, int inwidth) :
+                              data (indata), size (insize), bit (0), width (inwidth),
+                              reference (inwidth, 0), current (inwidth, 0) {
+
+    for (int i = 0; i < 91; i++) {
+        white [whiteCodes [i]] = (i < 64 ? i : (i - 63) * 64);
+        black [blackCodes [i]] = (i < 64 ? i : (i - 63) * 64);
+    }
+    for (int i = 0; i < 13; i++) {
+        white [extendedCodes [i]] = 1792 + 64 * i;
+        black [extendedCodes [i]] = 1792 + 64 * i;
+    }
+    for (int i = 0; i < 10; i++)
+        modes [modeCodes [i]] = (i < 7 ? i - 3 : MODE_PASS + i - 7);
+}
+
+
+// The value of the next code, or -1000 when no code matches
+int Group4Decoder::Code (const std::map <std::string, int> & codes) {
+
+    std::string code;
+    while (code.size () < 13 && bit < 8 * size) {
+        code += ((data [bit / 8] >> (7 - bit % 8)) & 1 ? '1' : '0');
+        bit++;
+        std::map <std::string, int>::const_iterator found = codes.find (code);
+        if (found != codes.end ()) return found->second;
+    }
+    return -1000;
+}
+
+
+// A run of make-up codes ended by a terminating code
+int Group4Decoder::Run (bool black) {
+
+    int run = 0;
+    for (;;) {
+        int length = Code (black ? this->black : white);
+        if (length < 0) return -1;
+        run += length;
+        if (length < 64) return run;
+    }
+}
+
+
+// The next row, with set bits for black
+bool Group4Decoder::DecodeRow (unsigned char * row) {
+
+    std::fill (current.begin (), current.end (), 0);
+
+    int a0 = -1;
+    int color = 0;
+    while (a0 < width) {
+        // b1 is the first change on the reference row to the right of a0 to the other colour, b2 the next
+        int b1 = a0 + 1;
+        while (b1 < width && !(reference [b1] != color && (b1 == 0 ? 0 : reference [b1 - 1]) == color)) b1++;
+        int b2 = b1 + 1;
+        while (b2 < width && reference [b2] == reference [b2 - 1]) b2++;
+        if (b2 > width) b2 = width;
+
+        int start = std::max (a0, 0);
+        int mode = Code (modes);
+        if (mode == MODE_PASS) {
+            std::fill (current.begin () + start, current.begin () + b2, color);
+            a0 = b2;
+        }
+        else if (mode == MODE_HORIZONTAL) {
+            int run1 = Run (color);
+            int run2 = Run (!color);
+            if (run1 < 0 || run2 < 0 || start + run1 + run2 > width) return false;
+            std::fill (current.begin () + start, current.begin () + start + run1, color);
+            std::fill (current.begin () + start + run1, current.begin () + start + run1 + run2, !color);
+            a0 = start + run1 + run2;
+        }
+        else if (mode >= -3 && mode <= 3) {
+            int a1 = b1 + mode;
+            if (a1 < start || a1 > width) return false;
+            std::fill (current.begin () + start, current.begin () + a1, color);
+            a0 = a1;
+            color = !color;
+        }
+        else
+            return false;
+    }
+
+    memset (row, 0, (width + 7) / 8);
+    for (int x = 0; x < width; x++)
+        if (current [x]) row [x / 8] |= 0x80 >> (x % 8);
+    reference.swap (current);
+    return true;
+}
+
+
+// The block ends with EOFB, two end of line codes
+bool Group4Decoder::AtEnd () {
+
+    return (Code (modes) == MODE_EOL && Code (modes) == MODE_EOL);
+}
@@ -0,0 +1,46 @@
+#ifndef SANE_DS_DECODERS_H
+#define SANE_DS_DECODERS_H
+
+#include "Platform.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Decoders for the compressed data the data source makes, for the checks of the benchmarks and
+// of format-check. They are written apart from the encoders in src and do not share their code
+// tables, so a wrong table shows up as a difference instead of a round trip.
+
+// One row of PackBits, the end of its data or NULL when it does not make exactly length bytes
+const unsigned char * UnpackBitsRow (const unsigned char * src, const unsigned char * end,
+                                     unsigned char * dst, Size length);
+
+// A TIFF LZW strip, which has to make exactly length bytes
+bool LzwDecode (const unsigned char * src, Size srclength, unsigned char * dst, Size length);
+
+// A block of CCITT Group 4 (T.6) rows, starting from an all white reference row. The rows come
+// out with set bits for black, as SANE delivers lineart.
+
+class Group4Decoder {
+
+public:
+    Group4Decoder (const unsigned char * indata, Size insize, int inwidth);
+    bool DecodeRow (unsigned char * row);
+    bool AtEnd ();
+
+private:
+    int Code (const std::map <std::string, int> & codes);
+    int Run (bool black);
+
+    const unsigned char * data;
+    Size size;
+    Size bit;
+    int width;
+    std::vector <unsigned char> reference;
+    std::vector <unsigned char> current;
+    std::map <std::string, int> white;
+    std::map <std::string, int> black;
+    std::map <std::string, int> modes;
+};
+
+#endif
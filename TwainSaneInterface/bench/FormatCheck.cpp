@@ -0,0 +1,802 @@
+// Checks of the files and recordings the data source writes, read back the way another program
+// would: multi-page TIFF and BigTIFF files through their chain of directories, PDF files through
+// the cross-reference table and the page tree, and a capture by replaying it and comparing it
+// with the live scan. Every strip and image stream is decoded and compared with the rows that
+// went in. The program exits with status 1 when a check fails.
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "Decoders.h"
+#include "FileJob.h"
+#include "ImageWriter.h"
+#include "SaneCapture.h"
+
+
+struct CheckFormat {
+    const char * name;
+    int samples;
+    int depth;
+};
+
+static const CheckFormat checkFormats [] = {
+    { "gray1",  1, 1  },
+    { "gray8",  1, 8  },
+    { "gray16", 1, 16 },
+    { "rgb8",   3, 8  },
+    { "rgb16",  3, 16 }
+};
+
+struct CheckCompression {
+    const char * name;
+    TW_UINT16 compression;
+};
+
+static const CheckCompression checkCompressions [] = {
+    { "none",     TWCP_NONE     },
+    { "packbits", TWCP_PACKBITS },
+    { "group4",   TWCP_GROUP4   },
+    { "lzw",      TWCP_LZW      },
+    { "zip",      TWCP_ZIP      },
+    { "jpeg",     TWCP_JPEG     }
+};
+
+// A page of a job, which is linked into the file or dropped again
+struct CheckPage {
+    const CheckFormat * format;
+    TW_UINT16 compression;
+    int width;
+    int height;
+    bool link;
+};
+
+static std::string directory = "/tmp";
+static bool verbose = false;
+
+
+static void Report (const std::string & name, bool ok) {
+
+    printf ("%-40s %s\n", name.c_str (), (ok ? "ok" : "FAILED"));
+    fflush (stdout);
+}
+
+
+// Says what is wrong, and fails the check
+static bool Wrong (const char * format, ...) {
+
+    va_list args;
+    va_start (args, format);
+    vfprintf (stderr, format, args);
+    va_end (args);
+    fprintf (stderr, "\n");
+    return false;
+}
+
+
+static Size RowBytes (const CheckPage & page) {
+
+    return ((Size) page.width * page.format->samples * page.format->depth + 7) / 8;
+}
+
+
+// The rows of a page as SANE would deliver them: lines of strokes for lineart and noisy
+// gradients for the rest, different on every page, with the bits past the end of a lineart row clear
+static void MakeRow (const CheckPage & page, int number, int row, unsigned char * data) {
+
+    Size bytes = RowBytes (page);
+    unsigned int seed = (number + 1) * 2654435761U + row * 40503U;
+    for (Size i = 0; i < bytes; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (page.format->depth == 1)
+            data [i] = (row % 16 < 10 && i % 5 != 0 ? (seed >> 16) & 0xFF : 0);
+        else
+            data [i] = (unsigned char) (i * 255 / bytes + ((seed >> 16) & 0x07));
+    }
+    if (page.format->depth == 1 && (page.width * page.format->samples) % 8)
+        data [bytes - 1] &= ~(0xFF >> ((page.width * page.format->samples) % 8));
+}
+
+
+// Compares decoded rows with the ones that went in, from row first on
+static bool SameRows (const CheckPage & page, int number, int first, const unsigned char * rows, int count) {
+
+    Size bytes = RowBytes (page);
+    std::vector <unsigned char> expected (bytes);
+    for (int row = 0; row < count; row++) {
+        MakeRow (page, number, first + row, &expected [0]);
+        if (memcmp (&rows [row * bytes], &expected [0], bytes) != 0)
+            return Wrong ("page %d, row %d differs", number, first + row);
+    }
+    return true;
+}
+
+
+// Writes the pages as a job, the way the file transfers of one session write them
+static bool WriteJob (const std::string & path, TW_UINT16 fileformat, const std::vector <CheckPage> & pages) {
+
+    FileJob * job = new FileJob (path, fileformat);
+    if (!job->IsOpen ()) {
+        delete job;
+        return Wrong ("can not create %s", path.c_str ());
+    }
+
+    SANE_Resolution res = { 300, 300, SANE_TYPE_INT };
+    bool ok = true;
+    for (size_t p = 0; ok && p < pages.size (); p++) {
+        const CheckPage & page = pages [p];
+        std::vector <unsigned char> row (RowBytes (page));
+        bool written;
+        {
+            ImageWriter writer (NULL, fileformat, page.compression, TWJQ_MEDIUM, page.width, page.height,
+                                page.format->samples, page.format->depth, res, job);
+            for (int r = 0; r < page.height; r++) {
+                MakeRow (page, p, r, &row [0]);
+                writer.WriteRow (&row [0]);
+            }
+            written = writer.Finish ();
+        }
+        if (written && page.link)
+            written = job->LinkPage ();
+        else
+            job->DropPage ();
+        if (!written) ok = Wrong ("page %lu of %s was not written", (unsigned long) p, path.c_str ());
+    }
+
+    // A PDF gets its page tree and cross-reference table now
+    delete job;
+    return ok;
+}
+
+
+static bool ReadAt (FILE * file, UInt64 offset, void * data, Size length) {
+
+    return (fseeko (file, offset, SEEK_SET) == 0 && fread (data, 1, length, file) == (size_t) length);
+}
+
+
+static UInt64 Get (const unsigned char * p, int bytes) {
+
+    UInt64 value = 0;
+    memcpy (&value, p, bytes);
+    return value;
+}
+
+
+// Reads a directory into its tags and values, rationals by their numerators
+static bool ReadDirectory (FILE * file, bool big, UInt64 offset, std::map <int, std::vector <UInt64> > & tags,
+                           UInt64 * next) {
+
+    unsigned char count [8];
+    if (!ReadAt (file, offset, count, (big ? 8 : 2))) return Wrong ("directory at %llu is past the end",
+                                                                    (unsigned long long) offset);
+    UInt64 entries = Get (count, (big ? 8 : 2));
+    Size entrysize = (big ? 20 : 12);
+    std::vector <unsigned char> directory (entries * entrysize + (big ? 8 : 4));
+    if (!ReadAt (file, offset + (big ? 8 : 2), &directory [0], directory.size ()))
+        return Wrong ("directory at %llu is cut off", (unsigned long long) offset);
+
+    int last = -1;
+    for (UInt64 i = 0; i < entries; i++) {
+        const unsigned char * entry = &directory [i * entrysize];
+        int tag = Get (entry, 2);
+        int type = Get (entry + 2, 2);
+        UInt64 values = Get (entry + 4, (big ? 8 : 4));
+        if (tag <= last) return Wrong ("tag %d out of order", tag);
+        last = tag;
+
+        Size size = (type == 3 ? 2 : type == 4 ? 4 : type == 5 || type == 16 ? 8 : 1);
+        std::vector <unsigned char> value (values * size + 8);
+        if (values * size <= (Size) (big ? 8 : 4))
+            memcpy (&value [0], entry + (big ? 12 : 8), (big ? 8 : 4));
+        else if (!ReadAt (file, Get (entry + (big ? 12 : 8), (big ? 8 : 4)), &value [0], values * size))
+            return Wrong ("value of tag %d is past the end", tag);
+
+        std::vector <UInt64> & list = tags [tag];
+        for (UInt64 v = 0; v < values; v++)
+            list.push_back (Get (&value [v * size], (type == 5 ? 4 : size)));
+    }
+
+    *next = Get (&directory [entries * entrysize], (big ? 8 : 4));
+    return true;
+}
+
+
+static bool Tag (std::map <int, std::vector <UInt64> > & tags, int tag, UInt64 expected, const char * name) {
+
+    if (tags [tag].empty ()) return Wrong ("%s missing", name);
+    for (size_t i = 0; i < tags [tag].size (); i++)
+        if (tags [tag] [i] != expected)
+            return Wrong ("%s is %llu, not %llu", name, (unsigned long long) tags [tag] [i],
+                          (unsigned long long) expected);
+    return true;
+}
+
+
+// Decodes every strip of a page and compares its rows
+static bool CheckTiffPage (FILE * file, UInt64 filesize, std::map <int, std::vector <UInt64> > & tags,
+                           const CheckPage & page, int number) {
+
+    TW_UINT16 compression = ImageWriter::FileCompression (TWFF_TIFF, page.compression, page.format->samples,
+                                                          page.format->depth);
+    int tiffcompression = (compression == TWCP_PACKBITS ? 32773 : compression == TWCP_GROUP4 ? 4 :
+                           compression == TWCP_LZW ? 5 : compression == TWCP_ZIP ? 8 : 1);
+
+    if (!Tag (tags, 256, page.width, "ImageWidth") || !Tag (tags, 257, page.height, "ImageLength") ||
+        !Tag (tags, 258, page.format->depth, "BitsPerSample") || !Tag (tags, 259, tiffcompression, "Compression") ||
+        !Tag (tags, 262, (page.format->samples == 3 ? 2 : page.format->depth == 1 ? 0 : 1), "Photometric") ||
+        !Tag (tags, 277, page.format->samples, "SamplesPerPixel") || !Tag (tags, 284, 1, "PlanarConfiguration"))
+        return false;
+    if (tags [278].empty () || tags [278] [0] == 0) return Wrong ("RowsPerStrip missing");
+
+    Size rowbytes = RowBytes (page);
+    int rowsperstrip = tags [278] [0];
+    size_t strips = (page.height + rowsperstrip - 1) / rowsperstrip;
+    std::vector <UInt64> & offsets = tags [273];
+    std::vector <UInt64> & counts = tags [279];
+    if (offsets.size () != strips || counts.size () != strips)
+        return Wrong ("%lu strip offsets and %lu byte counts for %lu strips", (unsigned long) offsets.size (),
+                      (unsigned long) counts.size (), (unsigned long) strips);
+    bool predictor = (!tags [317].empty () && tags [317] [0] == 2);
+
+    std::vector <unsigned char> packed;
+    std::vector <unsigned char> rows;
+    for (size_t s = 0; s < strips; s++) {
+        int first = s * rowsperstrip;
+        int count = std::min (rowsperstrip, page.height - first);
+        if (offsets [s] + counts [s] > filesize) return Wrong ("strip %lu is past the end", (unsigned long) s);
+        packed.resize (counts [s] + 1);
+        if (!ReadAt (file, offsets [s], &packed [0], counts [s])) return Wrong ("strip %lu unreadable", (unsigned long) s);
+        rows.resize (count * rowbytes);
+
+        bool ok = true;
+        if (tiffcompression == 1)
+            ok = (counts [s] == rows.size ()) && (memcpy (&rows [0], &packed [0], rows.size ()), true);
+        else if (tiffcompression == 32773) {
+            const unsigned char * src = &packed [0];
+            for (int r = 0; ok && r < count; r++)
+                ok = ((src = UnpackBitsRow (src, &packed [0] + counts [s], &rows [r * rowbytes], rowbytes)) != NULL);
+        }
+        else if (tiffcompression == 4) {
+            Group4Decoder group4 (&packed [0], counts [s], page.width);
+            for (int r = 0; ok && r < count; r++)
+                ok = group4.DecodeRow (&rows [r * rowbytes]);
+            if (ok) ok = group4.AtEnd ();
+        }
+        else if (tiffcompression == 5)
+            ok = LzwDecode (&packed [0], counts [s], &rows [0], rows.size ());
+        else {
+            uLongf length = rows.size ();
+            ok = (uncompress (&rows [0], &length, &packed [0], counts [s]) == Z_OK && length == rows.size ());
+        }
+        if (!ok) return Wrong ("strip %lu does not decode", (unsigned long) s);
+
+        // Horizontal differencing, sample by sample
+        if (predictor) {
+            for (int r = 0; r < count; r++) {
+                unsigned char * p = &rows [r * rowbytes];
+                int samples = page.format->samples;
+                if (page.format->depth == 8)
+                    for (Size i = samples; i < rowbytes; i++)
+                        p [i] += p [i - samples];
+                else
+                    for (Size i = samples; i < rowbytes / 2; i++) {
+                        UInt16 previous, sample;
+                        memcpy (&previous, &p [2 * (i - samples)], 2);
+                        memcpy (&sample, &p [2 * i], 2);
+                        sample += previous;
+                        memcpy (&p [2 * i], &sample, 2);
+                    }
+            }
+        }
+
+        if (!SameRows (page, number, first, &rows [0], count)) return false;
+    }
+    return true;
+}
+
+
+// Follows the chain of directories from the header and checks the pages that were linked
+static bool CheckTiff (const std::string & path, const std::vector <CheckPage> & pages, bool bigtiff) {
+
+    FILE * file = fopen (path.c_str (), "rb");
+    if (!file) return Wrong ("can not open %s", path.c_str ());
+    fseeko (file, 0, SEEK_END);
+    UInt64 filesize = ftello (file);
+
+    unsigned char header [16];
+    bool ok = ReadAt (file, 0, header, sizeof (header));
+    bool big = (ok && Get (&header [2], 2) == 43);
+#ifdef __BIG_ENDIAN__
+    if (ok && (header [0] != 'M' || header [1] != 'M')) ok = Wrong ("not a big endian TIFF");
+#else
+    if (ok && (header [0] != 'I' || header [1] != 'I')) ok = Wrong ("not a little endian TIFF");
+#endif
+    if (ok && big != bigtiff) ok = Wrong ("%s", (big ? "a BigTIFF below 4 GB" : "a classic TIFF past 4 GB"));
+    if (ok && big && (Get (&header [4], 2) != 8 || Get (&header [6], 2) != 0)) ok = Wrong ("bad BigTIFF header");
+    if (ok && !big && Get (&header [2], 2) != 42) ok = Wrong ("bad TIFF header");
+
+    UInt64 offset = (big ? Get (&header [8], 8) : Get (&header [4], 4));
+    size_t number = 0;
+    while (ok && offset != 0) {
+        while (number < pages.size () && !pages [number].link) number++;
+        if (number == pages.size ()) {
+            ok = Wrong ("more directories than pages");
+            break;
+        }
+        std::map <int, std::vector <UInt64> > tags;
+        UInt64 next;
+        ok = (ReadDirectory (file, big, offset, tags, &next) &&
+              CheckTiffPage (file, filesize, tags, pages [number], number));
+        if (!ok) Wrong ("in the directory of page %lu at %llu", (unsigned long) number, (unsigned long long) offset);
+        offset = next;
+        number++;
+    }
+    while (ok && number < pages.size ())
+        if (pages [number++].link) ok = Wrong ("fewer directories than pages");
+
+    fclose (file);
+    return ok;
+}
+
+
+static long Value (const std::string & dictionary, const char * key) {
+
+    size_t pos = dictionary.find (std::string (key) + " ");
+    return (pos == std::string::npos ? -1 : atol (dictionary.c_str () + pos + strlen (key) + 1));
+}
+
+
+// The references of an array or dictionary that follows key
+static std::vector <int> References (const std::string & dictionary, const char * key, char close) {
+
+    std::vector <int> references;
+    size_t pos = dictionary.find (key);
+    if (pos == std::string::npos) return references;
+    size_t end = dictionary.find (close, pos + strlen (key));
+    std::string list = dictionary.substr (pos + strlen (key), end - pos - strlen (key));
+    for (size_t r = list.find (" 0 R"); r != std::string::npos; r = list.find (" 0 R", r + 4)) {
+        size_t start = list.find_last_not_of ("0123456789", r - 1) + 1;
+        references.push_back (atoi (list.c_str () + start));
+    }
+    return references;
+}
+
+
+class PdfFile {
+
+public:
+    bool Load (const std::string & path);
+    bool Object (int number, std::string & dictionary, size_t * stream);
+    const std::string & Data () { return data; }
+
+private:
+    std::string data;
+    std::vector <size_t> offsets;
+};
+
+
+// Reads the file and its cross-reference table, from startxref at the end
+bool PdfFile::Load (const std::string & path) {
+
+    FILE * file = fopen (path.c_str (), "rb");
+    if (!file) return Wrong ("can not open %s", path.c_str ());
+    char buffer [0x10000];
+    size_t length;
+    while ((length = fread (buffer, 1, sizeof (buffer), file)) > 0) data.append (buffer, length);
+    fclose (file);
+
+    if (data.compare (0, 7, "%PDF-1.") != 0) return Wrong ("no PDF header");
+    if (data.size () < 6 || data.compare (data.size () - 6, 6, "%%EOF\n") != 0) return Wrong ("no %%%%EOF at the end");
+    size_t startxref = data.rfind ("startxref\n");
+    if (startxref == std::string::npos) return Wrong ("no startxref");
+    size_t xref = atoll (data.c_str () + startxref + 10);
+    unsigned long count;
+    int header;
+    if (xref >= data.size () || sscanf (data.c_str () + xref, "xref\n0 %lu\n%n", &count, &header) != 1)
+        return Wrong ("no cross-reference table at %lu", (unsigned long) xref);
+
+    const char * entries = data.c_str () + xref + header;
+    if (strncmp (entries, "0000000000 65535 f \n", 20) != 0) return Wrong ("bad first cross-reference entry");
+    offsets.assign (1, 0);
+    for (unsigned long i = 1; i < count; i++) {
+        const char * entry = entries + 20 * i;
+        if (entry + 20 > data.c_str () + data.size () || entry [10] != ' ' || strncmp (entry + 16, " n \n", 4) != 0)
+            return Wrong ("bad cross-reference entry %lu", i);
+        size_t offset = atoll (entry);
+        char object [32];
+        snprintf (object, sizeof (object), "%lu 0 obj\n", i);
+        if (offset >= data.size () || data.compare (offset, strlen (object), object) != 0)
+            return Wrong ("object %lu is not at %lu", i, (unsigned long) offset);
+        offsets.push_back (offset);
+    }
+
+    std::string trailer = data.substr (xref + header + 20 * count);
+    if (trailer.compare (0, 8, "trailer\n") != 0 || Value (trailer, "/Size") != (long) count)
+        return Wrong ("bad trailer");
+    return true;
+}
+
+
+// The dictionary of an object, and where its stream starts, with its /Length checked
+bool PdfFile::Object (int number, std::string & dictionary, size_t * stream) {
+
+    if (number <= 0 || number >= (int) offsets.size ()) return Wrong ("no object %d", number);
+    size_t start = offsets [number];
+    size_t end = data.find ("endobj", start);
+    size_t streamword = data.find ("stream\n", start);
+    if (end == std::string::npos) return Wrong ("object %d has no end", number);
+
+    *stream = 0;
+    if (streamword == std::string::npos || streamword > end)
+        dictionary = data.substr (start, end - start);
+    else {
+        dictionary = data.substr (start, streamword - start);
+        *stream = streamword + 7;
+
+        // A length that was not known when the stream began is an object of its own
+        long length = -1;
+        int generation;
+        char reference = 0;
+        size_t pos = dictionary.find ("/Length ");
+        if (pos != std::string::npos)
+            sscanf (dictionary.c_str () + pos, "/Length %ld %d %c", &length, &generation, &reference);
+        if (reference == 'R') {
+            std::string lengthobject;
+            size_t none;
+            if (!Object (length, lengthobject, &none)) return false;
+            length = atol (lengthobject.c_str () + lengthobject.find ('\n') + 1);
+        }
+        if (length < 0 || data.compare (*stream + length, 11, "\nendstream\n") != 0)
+            return Wrong ("the stream of object %d is not /Length long", number);
+    }
+    return true;
+}
+
+
+// Decodes the images of a page, top down, and compares their rows
+static bool CheckPdfPage (PdfFile & pdf, int pagesobject, int object, const CheckPage & page, int number) {
+
+    std::string dictionary;
+    size_t stream;
+    if (!pdf.Object (object, dictionary, &stream)) return false;
+    if (dictionary.find ("/Type /Page ") == std::string::npos || Value (dictionary, "/Parent") != pagesobject)
+        return Wrong ("object %d is not a page of the tree", object);
+
+    TW_UINT16 compression = ImageWriter::FileCompression (TWFF_PDF, page.compression, page.format->samples,
+                                                          page.format->depth);
+    Size rowbytes = RowBytes (page);
+    std::vector <int> images = References (dictionary, "/XObject <<", '>');
+    if (images.empty ()) return Wrong ("page %d has no images", number);
+
+    int row = 0;
+    for (size_t i = 0; i < images.size (); i++) {
+        if (!pdf.Object (images [i], dictionary, &stream) || !stream) return Wrong ("image %d is no stream", images [i]);
+        int height = Value (dictionary, "/Height");
+        if (Value (dictionary, "/Width") != page.width || height <= 0 || row + height > page.height)
+            return Wrong ("image %d is %ld by %d", images [i], Value (dictionary, "/Width"), height);
+        const unsigned char * data = (const unsigned char *) pdf.Data ().c_str () + stream;
+        Size length = pdf.Data ().find ("\nendstream\n", stream) - stream;
+
+        std::vector <unsigned char> rows (height * rowbytes);
+        bool ok = true;
+        if (compression == TWCP_GROUP4) {
+            if (dictionary.find ("/CCITTFaxDecode /DecodeParms << /K -1") == std::string::npos)
+                return Wrong ("image %d is not Group 4", images [i]);
+            Group4Decoder group4 (data, length, page.width);
+            for (int r = 0; ok && r < height; r++) ok = group4.DecodeRow (&rows [r * rowbytes]);
+            if (ok) ok = group4.AtEnd ();
+        }
+        else if (compression == TWCP_JPEG) {
+            // The stream of the encoder, the images have been checked by the benchmarks
+            if (dictionary.find ("/DCTDecode") == std::string::npos || length < 4 ||
+                data [0] != 0xFF || data [1] != 0xD8 || data [length - 2] != 0xFF || data [length - 1] != 0xD9)
+                return Wrong ("image %d is not a JFIF stream", images [i]);
+            row += height;
+            continue;
+        }
+        else {
+            if (dictionary.find ("/FlateDecode /DecodeParms << /Predictor 12") == std::string::npos)
+                return Wrong ("image %d is not deflated", images [i]);
+            std::vector <unsigned char> filtered (height * (rowbytes + 1));
+            uLongf size = filtered.size ();
+            ok = (uncompress (&filtered [0], &size, data, length) == Z_OK && size == filtered.size ());
+            // PNG filters, none or up, and 16 bit samples are big endian
+            for (int r = 0; ok && r < height; r++) {
+                const unsigned char * in = &filtered [r * (rowbytes + 1)];
+                unsigned char * out = &rows [r * rowbytes];
+                if (in [0] != 0 && in [0] != 2) ok = Wrong ("row %d has filter %d", r, in [0]);
+                for (Size b = 0; b < rowbytes; b++)
+                    out [b] = in [b + 1] + (in [0] == 2 && r > 0 ? out [b - rowbytes] : 0);
+            }
+#ifndef __BIG_ENDIAN__
+            if (page.format->depth == 16)
+                for (size_t b = 0; b < rows.size (); b += 2) std::swap (rows [b], rows [b + 1]);
+#endif
+        }
+        if (!ok) return Wrong ("image %d does not decode", images [i]);
+        if (!SameRows (page, number, row, &rows [0], height)) return false;
+        row += height;
+    }
+
+    if (row != page.height) return Wrong ("page %d has %d of %d rows", number, row, page.height);
+    return true;
+}
+
+
+// Follows the catalog to the page tree and checks the pages that were linked, in order
+static bool CheckPdf (const std::string & path, const std::vector <CheckPage> & pages) {
+
+    PdfFile pdf;
+    if (!pdf.Load (path)) return false;
+
+    const std::string & data = pdf.Data ();
+    std::string trailer = data.substr (data.rfind ("trailer\n"));
+    std::string catalog, tree;
+    size_t stream;
+    if (!pdf.Object (Value (trailer, "/Root"), catalog, &stream)) return false;
+    if (catalog.find ("/Type /Catalog") == std::string::npos) return Wrong ("no catalog");
+    int pagesobject = Value (catalog, "/Pages");
+    if (!pdf.Object (pagesobject, tree, &stream)) return false;
+
+    std::vector <int> kids = References (tree, "/Kids [", ']');
+    if (Value (tree, "/Count") != (long) kids.size ()) return Wrong ("/Count is not the number of /Kids");
+
+    size_t kid = 0;
+    for (size_t number = 0; number < pages.size (); number++) {
+        if (!pages [number].link) continue;
+        if (kid == kids.size ()) return Wrong ("fewer pages than linked");
+        if (!CheckPdfPage (pdf, pagesobject, kids [kid++], pages [number], number)) return false;
+    }
+    if (kid != kids.size ()) return Wrong ("more pages than linked");
+    return true;
+}
+
+
+// A job of three pages in one format and compression, the second dropped again, and a
+// page of each other format after them
+static std::vector <CheckPage> MakeJob (const CheckFormat & format, TW_UINT16 compression) {
+
+    std::vector <CheckPage> pages;
+    CheckPage page = { &format, compression, 1201, 150, true };
+    pages.push_back (page);
+    page.width = 640;
+    page.height = 37;
+    page.link = false;
+    pages.push_back (page);
+    page.width = 2550;
+    page.height = 400;
+    page.link = true;
+    pages.push_back (page);
+    for (size_t f = 0; f < sizeof (checkFormats) / sizeof (checkFormats [0]); f++) {
+        if (&checkFormats [f] == &format) continue;
+        CheckPage other = { &checkFormats [f], compression, 300, 20, true };
+        pages.push_back (other);
+    }
+    return pages;
+}
+
+
+// Pages of 1.5 GB, so the file turns into a BigTIFF with its third
+static bool CheckBigTiff () {
+
+    std::vector <CheckPage> pages;
+    for (int p = 0; p < 3; p++) {
+        CheckPage page = { &checkFormats [1], TWCP_NONE, 30000, 50000, true };
+        pages.push_back (page);
+    }
+    std::string path = directory + "/format-check-big.tif";
+    bool ok = WriteJob (path, TWFF_TIFFMULTI, pages) && CheckTiff (path, pages, true);
+    remove (path.c_str ());
+    return ok;
+}
+
+
+// Scans a page from a device and writes its parameters, option values and data to a file
+static bool Scan (const std::string & device, const std::string & path) {
+
+    SANE_Int version;
+    if (sane_init (&version, NULL) != SANE_STATUS_GOOD) return Wrong ("sane_init failed");
+    const SANE_Device ** devices;
+    sane_get_devices (&devices, SANE_TRUE);
+
+    SANE_Handle handle;
+    SANE_Status status = sane_open (device.c_str (), &handle);
+    if (status != SANE_STATUS_GOOD) {
+        sane_exit ();
+        return Wrong ("can not open %s: %s", device.c_str (), sane_strstatus (status));
+    }
+
+    FILE * file = fopen (path.c_str (), "wb");
+    if (!file) {
+        sane_close (handle);
+        sane_exit ();
+        return Wrong ("can not create %s", path.c_str ());
+    }
+
+    // The values of the active options, as a frontend reads them
+    SANE_Int options = 0;
+    sane_control_option (handle, 0, SANE_ACTION_GET_VALUE, &options, NULL);
+    for (SANE_Int option = 1; option < options; option++) {
+        const SANE_Option_Descriptor * descriptor = sane_get_option_descriptor (handle, option);
+        if (!descriptor || !SANE_OPTION_IS_ACTIVE (descriptor->cap) || !(descriptor->cap & SANE_CAP_SOFT_DETECT) ||
+            descriptor->type == SANE_TYPE_GROUP || descriptor->type == SANE_TYPE_BUTTON || descriptor->size <= 0)
+            continue;
+        std::vector <char> value (descriptor->size);
+        status = sane_control_option (handle, option, SANE_ACTION_GET_VALUE, &value [0], NULL);
+        fprintf (file, "option %d %s %d\n", option, (descriptor->name ? descriptor->name : ""), status);
+        fwrite (&value [0], 1, value.size (), file);
+    }
+
+    // Every frame, and its parameters before and after sane_start
+    bool ok = true;
+    for (int frame = 0; ok && frame < 3; frame++) {
+        SANE_Parameters param;
+        sane_get_parameters (handle, &param);
+        status = sane_start (handle);
+        if (status != SANE_STATUS_GOOD) {
+            ok = Wrong ("sane_start failed: %s", sane_strstatus (status));
+            break;
+        }
+        sane_get_parameters (handle, &param);
+        fprintf (file, "frame %d format %d last %d lines %d bytes %d pixels %d depth %d\n", frame, param.format,
+                 param.last_frame, param.lines, param.bytes_per_line, param.pixels_per_line, param.depth);
+        SANE_Byte buffer [0x8000];
+        SANE_Int length;
+        while ((status = sane_read (handle, buffer, sizeof (buffer), &length)) == SANE_STATUS_GOOD)
+            fwrite (buffer, 1, length, file);
+        fprintf (file, "end %d\n", status);
+        if (status != SANE_STATUS_EOF) ok = Wrong ("sane_read failed: %s", sane_strstatus (status));
+        if (param.last_frame) break;
+    }
+
+    sane_cancel (handle);
+    sane_close (handle);
+    sane_exit ();
+    if (fclose (file) != 0) ok = Wrong ("can not write %s", path.c_str ());
+    return ok;
+}
+
+
+// Each side in a process of its own, since the capture layer reads its settings once
+static bool ScanProcess (const char * variable, const std::string & value, const std::string & device,
+                         const std::string & path) {
+
+    fflush (stdout);
+    pid_t pid = fork ();
+    if (pid < 0) return Wrong ("fork failed");
+    if (pid == 0) {
+        unsetenv ("SANE_DS_CAPTURE");
+        unsetenv ("SANE_DS_REPLAY");
+        setenv ("SANE_DS_REPLAY_SCALE", "0", 1);
+        setenv (variable, value.c_str (), 1);
+        _exit (Scan (device, path) ? 0 : 1);
+    }
+    int status;
+    waitpid (pid, &status, 0);
+    return (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+}
+
+
+static bool ReadFile (const std::string & path, std::string & data) {
+
+    FILE * file = fopen (path.c_str (), "rb");
+    if (!file) return false;
+    char buffer [0x10000];
+    size_t length;
+    while ((length = fread (buffer, 1, sizeof (buffer), file)) > 0) data.append (buffer, length);
+    fclose (file);
+    return true;
+}
+
+
+// Records a scan of the device, replays the recording, and compares what the two sessions saw
+static bool CheckCapture (const std::string & device) {
+
+    std::string capture = directory + "/format-check.cap";
+    std::string live = directory + "/format-check.live";
+    std::string replay = directory + "/format-check.replay";
+
+    bool ok = (ScanProcess ("SANE_DS_CAPTURE", capture, device, live) &&
+               ScanProcess ("SANE_DS_REPLAY", capture, "replay:format-check", replay));
+    if (ok) {
+        std::string livedata, replaydata;
+        if (!ReadFile (live, livedata) || !ReadFile (replay, replaydata))
+            ok = Wrong ("the scans were not written");
+        else if (livedata.empty () || livedata != replaydata) {
+            size_t i = 0;
+            while (i < livedata.size () && i < replaydata.size () && livedata [i] == replaydata [i]) i++;
+            ok = Wrong ("the replayed session differs from the live one from byte %lu", (unsigned long) i);
+        }
+        else if (verbose)
+            fprintf (stderr, "%lu bytes of options, parameters and data alike\n", (unsigned long) livedata.size ());
+    }
+
+    remove (capture.c_str ());
+    remove (live.c_str ());
+    remove (replay.c_str ());
+    return ok;
+}
+
+
+static void Usage (const char * program) {
+
+    fprintf (stderr,
+             "Usage: %s [options]\n"
+             "  --dir DIR         where the files are written (default /tmp)\n"
+             "  --device NAME     SANE device to capture and replay (default test)\n"
+             "  --bigtiff         also write a 4.5 GB TIFF that turns into a BigTIFF\n"
+             "  -v                say more about what was checked\n",
+             program);
+}
+
+
+int main (int argc, char ** argv) {
+
+    std::string device = "test";
+    bool bigtiff = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv [i];
+        if (arg == "--bigtiff") bigtiff = true;
+        else if (arg == "-v") verbose = true;
+        else if (arg == "--dir" && i + 1 < argc) directory = argv [++i];
+        else if (arg == "--device" && i + 1 < argc) device = argv [++i];
+        else {
+            Usage (argv [0]);
+            return 2;
+        }
+    }
+
+    int failures = 0;
+
+    for (size_t c = 0; c < sizeof (checkCompressions) / sizeof (checkCompressions [0]); c++) {
+        for (size_t f = 0; f < sizeof (checkFormats) / sizeof (checkFormats [0]); f++) {
+            std::vector <CheckPage> pages = MakeJob (checkFormats [f], checkCompressions [c].compression);
+            std::string name = std::string (checkFormats [f].name) + "/" + checkCompressions [c].name;
+
+            // JPEG is only for PDF, TIFF files are written without it
+            if (checkCompressions [c].compression != TWCP_JPEG) {
+                std::string path = directory + "/format-check.tif";
+                bool ok = WriteJob (path, TWFF_TIFFMULTI, pages) && CheckTiff (path, pages, false);
+                Report ("TIFF/" + name, ok);
+                if (!ok) failures++;
+                remove (path.c_str ());
+            }
+
+            std::string path = directory + "/format-check.pdf";
+            bool ok = WriteJob (path, TWFF_PDF, pages) && CheckPdf (path, pages);
+            Report ("PDF/" + name, ok);
+            if (!ok) failures++;
+            remove (path.c_str ());
+        }
+    }
+
+    if (bigtiff) {
+        bool ok = CheckBigTiff ();
+        Report ("BigTIFF/gray8/none", ok);
+        if (!ok) failures++;
+    }
+
+    bool ok = CheckCapture (device);
+    Report ("Capture/" + device, ok);
+    if (!ok) failures++;
+
+    printf ("%d checks failed\n", failures);
+    return (failures ? 1 : 0);
+}
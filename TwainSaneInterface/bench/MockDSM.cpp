@@ -0,0 +1,844 @@
+// Mock data source manager: plays the part of a TWAIN application and its DSM, so that
+// DataSource::Entry can be exercised without a host application. It replays a script of
+// triplets, times every call, and checks each one against the TWAIN state machine.
+// See bench/scripts for the script format.
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "DataSource.h"
+
+TW_UINT16 DS_Entry (pTW_IDENTITY pOrigin,
+                    TW_UINT32    DG,
+                    TW_UINT16    DAT,
+                    TW_UINT16    MSG,
+                    TW_MEMREF    pData);
+
+
+// TWAIN 2.1, not in the Mac OS X headers
+#ifndef TWFF_PDF
+#define TWFF_PDF 10
+#endif
+
+
+struct Constant {
+    const char * name;
+    TW_UINT32 value;
+};
+
+#define CONSTANT(x) { #x, x }
+#define SIGNED_CONSTANT(x) { #x, (TW_UINT32) (TW_INT32) x }
+
+static const Constant constants [] = {
+    CONSTANT (CAP_XFERCOUNT),
+    CONSTANT (CAP_SUPPORTEDCAPS),
+    CONSTANT (CAP_INDICATORS),
+    CONSTANT (CAP_UICONTROLLABLE),
+    CONSTANT (CAP_DEVICEONLINE),
+    CONSTANT (CAP_ENABLEDSUIONLY),
+    CONSTANT (ICAP_COMPRESSION),
+    CONSTANT (ICAP_JPEGQUALITY),
+    CONSTANT (ICAP_PIXELTYPE),
+    CONSTANT (ICAP_UNITS),
+    CONSTANT (ICAP_XFERMECH),
+    CONSTANT (ICAP_BRIGHTNESS),
+    CONSTANT (ICAP_CONTRAST),
+    CONSTANT (ICAP_GAMMA),
+    CONSTANT (ICAP_PHYSICALWIDTH),
+    CONSTANT (ICAP_PHYSICALHEIGHT),
+    CONSTANT (ICAP_XNATIVERESOLUTION),
+    CONSTANT (ICAP_YNATIVERESOLUTION),
+    CONSTANT (ICAP_XRESOLUTION),
+    CONSTANT (ICAP_YRESOLUTION),
+    CONSTANT (ICAP_BITORDER),
+    CONSTANT (ICAP_PIXELFLAVOR),
+    CONSTANT (ICAP_PLANARCHUNKY),
+    CONSTANT (ICAP_BITDEPTH),
+    CONSTANT (ICAP_IMAGEFILEFORMAT),
+    CONSTANT (ICAP_SANE_NATIVEFORMAT),
+    CONSTANT (ICAP_SANE_BLANKPAGE),
+    CONSTANT (TWTY_INT8),
+    CONSTANT (TWTY_INT16),
+    CONSTANT (TWTY_INT32),
+    CONSTANT (TWTY_UINT8),
+    CONSTANT (TWTY_UINT16),
+    CONSTANT (TWTY_UINT32),
+    CONSTANT (TWTY_BOOL),
+    CONSTANT (TWTY_FIX32),
+    CONSTANT (TWSX_NATIVE),
+    CONSTANT (TWSX_MEMORY),
+    CONSTANT (TWSX_FILE),
+    CONSTANT (TWFF_PICT),
+    CONSTANT (TWFF_TIFF),
+    CONSTANT (TWFF_TIFFMULTI),
+    CONSTANT (TWFF_JFIF),
+    CONSTANT (TWFF_PNG),
+    CONSTANT (TWFF_PDF),
+    CONSTANT (TWPT_BW),
+    CONSTANT (TWPT_GRAY),
+    CONSTANT (TWPT_RGB),
+    CONSTANT (TWCP_NONE),
+    CONSTANT (TWCP_PACKBITS),
+    CONSTANT (TWCP_GROUP4),
+    CONSTANT (TWCP_JPEG),
+    CONSTANT (TWCP_LZW),
+    SIGNED_CONSTANT (TWJQ_LOW),
+    SIGNED_CONSTANT (TWJQ_MEDIUM),
+    SIGNED_CONSTANT (TWJQ_HIGH),
+    CONSTANT (TWUN_INCHES),
+    CONSTANT (TWPC_CHUNKY),
+    CONSTANT (TWPC_PLANAR),
+    CONSTANT (TWPF_CHOCOLATE),
+    CONSTANT (TWPF_VANILLA),
+    CONSTANT (TWBO_LSBFIRST),
+    CONSTANT (TWBO_MSBFIRST),
+    CONSTANT (TWRC_SUCCESS),
+    CONSTANT (TWRC_FAILURE),
+    CONSTANT (TWRC_CHECKSTATUS),
+    CONSTANT (TWRC_CANCEL),
+    CONSTANT (TWRC_XFERDONE),
+    CONSTANT (TWCC_SUCCESS),
+    CONSTANT (TWCC_BUMMER),
+    CONSTANT (TWCC_LOWMEMORY),
+    CONSTANT (TWCC_OPERATIONERROR),
+    CONSTANT (TWCC_CAPUNSUPPORTED),
+    CONSTANT (TWCC_BADPROTOCOL),
+    CONSTANT (TWCC_BADVALUE),
+    CONSTANT (TWCC_SEQERROR),
+    CONSTANT (TWCC_CAPBADOPERATION),
+    CONSTANT (TWCC_CAPSEQERROR)
+};
+
+#undef CONSTANT
+
+
+struct Triplet {
+    TW_UINT32 DG;
+    TW_UINT16 DAT;
+    TW_UINT16 MSG;
+    int minState;
+    int maxState;
+    const char * name;
+};
+
+// The states in which the TWAIN 1.9 specification allows each operation
+static const Triplet triplets [] = {
+    { DG_CONTROL, DAT_IDENTITY,        MSG_GET,            3, 7, "DG_CONTROL DAT_IDENTITY MSG_GET" },
+    { DG_CONTROL, DAT_IDENTITY,        MSG_OPENDS,         3, 3, "DG_CONTROL DAT_IDENTITY MSG_OPENDS" },
+    { DG_CONTROL, DAT_IDENTITY,        MSG_CLOSEDS,        4, 4, "DG_CONTROL DAT_IDENTITY MSG_CLOSEDS" },
+    { DG_CONTROL, DAT_CAPABILITY,      MSG_GET,            4, 7, "DG_CONTROL DAT_CAPABILITY MSG_GET" },
+    { DG_CONTROL, DAT_CAPABILITY,      MSG_GETCURRENT,     4, 7, "DG_CONTROL DAT_CAPABILITY MSG_GETCURRENT" },
+    { DG_CONTROL, DAT_CAPABILITY,      MSG_GETDEFAULT,     4, 7, "DG_CONTROL DAT_CAPABILITY MSG_GETDEFAULT" },
+    { DG_CONTROL, DAT_CAPABILITY,      MSG_QUERYSUPPORT,   4, 7, "DG_CONTROL DAT_CAPABILITY MSG_QUERYSUPPORT" },
+    { DG_CONTROL, DAT_CAPABILITY,      MSG_SET,            4, 4, "DG_CONTROL DAT_CAPABILITY MSG_SET" },
+    { DG_CONTROL, DAT_CAPABILITY,      MSG_RESET,          4, 4, "DG_CONTROL DAT_CAPABILITY MSG_RESET" },
+    { DG_CONTROL, DAT_USERINTERFACE,   MSG_ENABLEDS,       4, 4, "DG_CONTROL DAT_USERINTERFACE MSG_ENABLEDS" },
+    { DG_CONTROL, DAT_USERINTERFACE,   MSG_ENABLEDSUIONLY, 4, 4, "DG_CONTROL DAT_USERINTERFACE MSG_ENABLEDSUIONLY" },
+    { DG_CONTROL, DAT_USERINTERFACE,   MSG_DISABLEDS,      5, 5, "DG_CONTROL DAT_USERINTERFACE MSG_DISABLEDS" },
+    { DG_CONTROL, DAT_PENDINGXFERS,    MSG_GET,            4, 7, "DG_CONTROL DAT_PENDINGXFERS MSG_GET" },
+    { DG_CONTROL, DAT_PENDINGXFERS,    MSG_ENDXFER,        6, 7, "DG_CONTROL DAT_PENDINGXFERS MSG_ENDXFER" },
+    { DG_CONTROL, DAT_PENDINGXFERS,    MSG_RESET,          6, 6, "DG_CONTROL DAT_PENDINGXFERS MSG_RESET" },
+    { DG_CONTROL, DAT_SETUPMEMXFER,    MSG_GET,            4, 6, "DG_CONTROL DAT_SETUPMEMXFER MSG_GET" },
+    { DG_CONTROL, DAT_SETUPFILEXFER,   MSG_GET,            4, 6, "DG_CONTROL DAT_SETUPFILEXFER MSG_GET" },
+    { DG_CONTROL, DAT_SETUPFILEXFER,   MSG_GETDEFAULT,     4, 6, "DG_CONTROL DAT_SETUPFILEXFER MSG_GETDEFAULT" },
+    { DG_CONTROL, DAT_SETUPFILEXFER,   MSG_SET,            4, 6, "DG_CONTROL DAT_SETUPFILEXFER MSG_SET" },
+    { DG_CONTROL, DAT_SETUPFILEXFER,   MSG_RESET,          4, 6, "DG_CONTROL DAT_SETUPFILEXFER MSG_RESET" },
+    { DG_CONTROL, DAT_STATUS,          MSG_GET,            4, 7, "DG_CONTROL DAT_STATUS MSG_GET" },
+    { DG_CONTROL, DAT_XFERGROUP,       MSG_GET,            4, 6, "DG_CONTROL DAT_XFERGROUP MSG_GET" },
+    { DG_CONTROL, DAT_CUSTOMDSDATA,    MSG_GET,            4, 4, "DG_CONTROL DAT_CUSTOMDSDATA MSG_GET" },
+    { DG_IMAGE,   DAT_IMAGEINFO,       MSG_GET,            6, 7, "DG_IMAGE DAT_IMAGEINFO MSG_GET" },
+    { DG_IMAGE,   DAT_IMAGELAYOUT,     MSG_GET,            4, 6, "DG_IMAGE DAT_IMAGELAYOUT MSG_GET" },
+    { DG_IMAGE,   DAT_IMAGELAYOUT,     MSG_SET,            4, 4, "DG_IMAGE DAT_IMAGELAYOUT MSG_SET" },
+    { DG_IMAGE,   DAT_IMAGEMEMXFER,    MSG_GET,            6, 7, "DG_IMAGE DAT_IMAGEMEMXFER MSG_GET" },
+    { DG_IMAGE,   DAT_IMAGEFILEXFER,   MSG_GET,            6, 6, "DG_IMAGE DAT_IMAGEFILEXFER MSG_GET" },
+    { DG_IMAGE,   DAT_IMAGENATIVEXFER, MSG_GET,            6, 6, "DG_IMAGE DAT_IMAGENATIVEXFER MSG_GET" }
+};
+
+struct CallStats {
+    long count;
+    double total;
+    double min;
+    double max;
+};
+
+struct Line {
+    int number;
+    std::vector <std::string> words;
+};
+
+static TW_IDENTITY appIdentity;
+static int state = 3;
+static std::vector <TW_UINT16> callbacks;
+static std::map <std::string, CallStats> stats;
+static int violations = 0;
+static bool verbose = false;
+
+// Set by an "expect" line, checked against the next triplet
+static bool expecting = false;
+static TW_UINT16 expectRC;
+static TW_UINT16 expectCC;
+
+static double transferBytes = 0;
+static long transferImages = 0;
+
+
+static double Now () {
+
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static const char * ConstantName (TW_UINT32 value, const char * prefix) {
+
+    for (size_t i = 0; i < sizeof (constants) / sizeof (constants [0]); i++)
+        if (constants [i].value == value && strncmp (constants [i].name, prefix, strlen (prefix)) == 0)
+            return constants [i].name;
+    return "?";
+}
+
+
+static bool ParseValue (const std::string & word, TW_UINT32 * value) {
+
+    for (size_t i = 0; i < sizeof (constants) / sizeof (constants [0]); i++)
+        if (word == constants [i].name) {
+            *value = constants [i].value;
+            return true;
+        }
+    char * end;
+    *value = strtol (word.c_str (), &end, 0);
+    return (*end == '\0' && end != word.c_str ());
+}
+
+
+static TW_FIX32 FloatToFix32 (double value) {
+
+    TW_FIX32 fix32;
+    TW_INT32 whole = (TW_INT32) (value * 65536.0 + (value < 0 ? -0.5 : 0.5));
+    fix32.Whole = whole >> 16;
+    fix32.Frac = whole & 0xFFFF;
+    return fix32;
+}
+
+
+static double Fix32ToFloat (TW_FIX32 fix32) {
+
+    return fix32.Whole + fix32.Frac / 65536.0;
+}
+
+
+// The DSM side: the data source calls back when a transfer is ready or it wants to close.
+// Callbacks made during a call are handled once the call has returned, as they would be
+// when they arrive through the application's event loop.
+TW_UINT16 DSM_Entry (pTW_IDENTITY pOrigin, pTW_IDENTITY pDest, TW_UINT32 DG, TW_UINT16 DAT,
+                     TW_UINT16 MSG, TW_MEMREF pData) {
+
+    if (DG != DG_CONTROL || DAT != DAT_CALLBACK || MSG != MSG_INVOKE_CALLBACK) return TWRC_FAILURE;
+
+    callbacks.push_back (((pTW_CALLBACK) pData)->Message);
+
+    return TWRC_SUCCESS;
+}
+
+
+static void ProcessCallbacks () {
+
+    for (size_t i = 0; i < callbacks.size (); i++) {
+        TW_UINT16 message = callbacks [i];
+        const char * name = (message == MSG_XFERREADY ? "MSG_XFERREADY" :
+                             message == MSG_CLOSEDSREQ ? "MSG_CLOSEDSREQ" :
+                             message == MSG_CLOSEDSOK ? "MSG_CLOSEDSOK" : "MSG_?");
+
+        int newState = state;
+        if (message == MSG_XFERREADY && state == 5)
+            newState = 6;
+        else if ((message == MSG_CLOSEDSREQ || message == MSG_CLOSEDSOK) && state >= 5 && state <= 7)
+            newState = 5;
+        else {
+            fprintf (stderr, "state violation: callback %s in state %d\n", name, state);
+            violations++;
+        }
+
+        if (verbose) printf ("       callback %-39s state %d -> %d\n", name, state, newState);
+        state = newState;
+    }
+    callbacks.clear ();
+}
+
+
+// Makes one call into the data source, timed and checked against the state machine
+static TW_UINT16 Call (int lineNumber, TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData,
+                       TW_UINT16 * cc = NULL) {
+
+    const Triplet * triplet = NULL;
+    for (size_t i = 0; i < sizeof (triplets) / sizeof (triplets [0]); i++)
+        if (triplets [i].DG == DG && triplets [i].DAT == DAT && triplets [i].MSG == MSG)
+            triplet = &triplets [i];
+    bool legal = (triplet && state >= triplet->minState && state <= triplet->maxState);
+
+    int oldState = state;
+
+    double start = Now ();
+    TW_UINT16 rc = DS_Entry (&appIdentity, DG, DAT, MSG, pData);
+    double elapsed = Now () - start;
+
+    // Ask for the condition code the way an application would, outside the timing
+    TW_UINT16 condition = TWCC_SUCCESS;
+    if (rc == TWRC_FAILURE || rc == TWRC_CHECKSTATUS) {
+        TW_STATUS status;
+        if (DS_Entry (&appIdentity, DG_CONTROL, DAT_STATUS, MSG_GET, &status) == TWRC_SUCCESS)
+            condition = status.ConditionCode;
+    }
+    if (cc) *cc = condition;
+
+    std::string name = (triplet ? triplet->name : "unknown triplet");
+    CallStats & callstats = stats [name];
+    if (callstats.count == 0 || elapsed < callstats.min) callstats.min = elapsed;
+    if (elapsed > callstats.max) callstats.max = elapsed;
+    callstats.total += elapsed;
+    callstats.count++;
+
+    // State transitions that follow from the call itself, callbacks are handled in DSM_Entry
+    bool failed = (rc == TWRC_FAILURE);
+    if (!failed) {
+        if (DAT == DAT_IDENTITY && MSG == MSG_OPENDS) state = 4;
+        else if (DAT == DAT_IDENTITY && MSG == MSG_CLOSEDS) state = 3;
+        else if (DAT == DAT_USERINTERFACE && MSG != MSG_DISABLEDS && state == 4) state = 5;
+        else if (DAT == DAT_USERINTERFACE && MSG == MSG_DISABLEDS) state = 4;
+        else if (DAT == DAT_IMAGEMEMXFER || DAT == DAT_IMAGEFILEXFER || DAT == DAT_IMAGENATIVEXFER) state = 7;
+        else if (DAT == DAT_PENDINGXFERS && MSG == MSG_RESET) state = 5;
+        else if (DAT == DAT_PENDINGXFERS && MSG == MSG_ENDXFER)
+            state = (((pTW_PENDINGXFERS) pData)->Count != 0 ? 6 : 5);
+    }
+
+    if (verbose)
+        printf ("%5d  %-48s state %d -> %d  %-16s %-20s %9.3f ms\n", lineNumber, name.c_str (),
+                oldState, state, ConstantName (rc, "TWRC_"),
+                (condition != TWCC_SUCCESS ? ConstantName (condition, "TWCC_") : ""), elapsed * 1e3);
+
+    // Before it is opened the data source can not report a condition code
+    if (!legal && !(failed && (condition == TWCC_SEQERROR || oldState == 3))) {
+        fprintf (stderr, "line %d: state violation: %s accepted in state %d\n", lineNumber,
+                 name.c_str (), oldState);
+        violations++;
+    }
+    if (legal && failed && condition == TWCC_SEQERROR) {
+        fprintf (stderr, "line %d: state violation: %s rejected in state %d\n", lineNumber,
+                 name.c_str (), oldState);
+        violations++;
+    }
+
+    ProcessCallbacks ();
+
+    return rc;
+}
+
+
+// Checks the result of a call against the preceding "expect" line, or against success
+static bool Check (int lineNumber, TW_UINT16 rc, TW_UINT16 cc, TW_UINT16 success = TWRC_SUCCESS) {
+
+    if (expecting) {
+        expecting = false;
+        if (rc == expectRC && (rc != TWRC_FAILURE || expectCC == TWCC_SUCCESS || cc == expectCC))
+            return true;
+        fprintf (stderr, "line %d: expected %s %s, got %s %s\n", lineNumber,
+                 ConstantName (expectRC, "TWRC_"), ConstantName (expectCC, "TWCC_"),
+                 ConstantName (rc, "TWRC_"), ConstantName (cc, "TWCC_"));
+        return false;
+    }
+    if (rc == success || rc == TWRC_SUCCESS) return true;
+    fprintf (stderr, "line %d: %s %s\n", lineNumber, ConstantName (rc, "TWRC_"), ConstantName (cc, "TWCC_"));
+    return false;
+}
+
+
+static bool Capability (const Line & line) {
+
+    TW_UINT32 cap;
+    if (line.words.size () < 3 || !ParseValue (line.words [2], &cap)) {
+        fprintf (stderr, "line %d: cap <get|getcurrent|getdefault|querysupport|set|reset> <capability> "
+                 "[<type> <value>]\n", line.number);
+        return false;
+    }
+
+    std::string msgName = line.words [1];
+    TW_UINT16 MSG = (msgName == "get" ? MSG_GET : msgName == "getcurrent" ? MSG_GETCURRENT :
+                     msgName == "getdefault" ? MSG_GETDEFAULT : msgName == "querysupport" ? MSG_QUERYSUPPORT :
+                     msgName == "set" ? MSG_SET : msgName == "reset" ? MSG_RESET : 0);
+    if (!MSG) {
+        fprintf (stderr, "line %d: unknown capability operation %s\n", line.number, msgName.c_str ());
+        return false;
+    }
+
+    TW_CAPABILITY capability;
+    capability.Cap = cap;
+    capability.ConType = TWON_DONTCARE16;
+    capability.hContainer = NULL;
+
+    if (MSG == MSG_SET) {
+        TW_UINT32 type, value;
+        if (line.words.size () != 5 || !ParseValue (line.words [3], &type)) {
+            fprintf (stderr, "line %d: cap set needs a type and a value\n", line.number);
+            return false;
+        }
+        if (type == TWTY_FIX32) {
+            TW_FIX32 fix32 = FloatToFix32 (atof (line.words [4].c_str ()));
+            memcpy (&value, &fix32, sizeof (value));
+        }
+        else if (!ParseValue (line.words [4], &value)) {
+            fprintf (stderr, "line %d: bad value %s\n", line.number, line.words [4].c_str ());
+            return false;
+        }
+        capability.ConType = TWON_ONEVALUE;
+        capability.hContainer = (TW_HANDLE) NewHandle (sizeof (TW_ONEVALUE));
+        pTW_ONEVALUE onevalue = (pTW_ONEVALUE) *(Handle) capability.hContainer;
+        onevalue->ItemType = type;
+        onevalue->Item = value;
+    }
+
+    TW_UINT16 cc;
+    TW_UINT16 rc = Call (line.number, DG_CONTROL, DAT_CAPABILITY, MSG, &capability, &cc);
+
+    if (verbose && MSG != MSG_SET && rc == TWRC_SUCCESS && capability.hContainer &&
+        capability.ConType == TWON_ONEVALUE) {
+        pTW_ONEVALUE onevalue = (pTW_ONEVALUE) *(Handle) capability.hContainer;
+        if (onevalue->ItemType == TWTY_FIX32) {
+            TW_FIX32 fix32;
+            memcpy (&fix32, &onevalue->Item, sizeof (fix32));
+            printf ("       %s = %g\n", line.words [2].c_str (), Fix32ToFloat (fix32));
+        }
+        else
+            printf ("       %s = %u\n", line.words [2].c_str (), onevalue->Item);
+    }
+
+    if (capability.hContainer) DisposeHandle ((Handle) capability.hContainer);
+
+    return Check (line.number, rc, cc, TWRC_CHECKSTATUS);
+}
+
+
+// Memory transfer of one image, with the buffer size given as min, preferred, max or a byte count
+static bool MemXfer (int lineNumber, const std::string & size) {
+
+    TW_SETUPMEMXFER setupmemxfer;
+    TW_UINT16 cc;
+    TW_UINT16 rc = Call (lineNumber, DG_CONTROL, DAT_SETUPMEMXFER, MSG_GET, &setupmemxfer, &cc);
+    if (!Check (lineNumber, rc, cc)) return false;
+
+    TW_UINT32 length = setupmemxfer.Preferred;
+    if (size == "min") length = setupmemxfer.MinBufSize;
+    else if (size == "max") length = setupmemxfer.MaxBufSize;
+    else if (size != "preferred") length = strtoul (size.c_str (), NULL, 0);
+    if (length == 0 || length == TWON_DONTCARE32) length = 0x10000;
+
+    std::vector <char> memory (length);
+    TW_IMAGEMEMXFER imagememxfer;
+    do {
+        memset (&imagememxfer, 0, sizeof (imagememxfer));
+        imagememxfer.Memory.Flags = TWMF_APPOWNS | TWMF_POINTER;
+        imagememxfer.Memory.Length = length;
+        imagememxfer.Memory.TheMem = &memory [0];
+        rc = Call (lineNumber, DG_IMAGE, DAT_IMAGEMEMXFER, MSG_GET, &imagememxfer, &cc);
+        if (rc == TWRC_SUCCESS || rc == TWRC_XFERDONE) transferBytes += imagememxfer.BytesWritten;
+    }
+    while (rc == TWRC_SUCCESS);
+
+    if (rc != TWRC_XFERDONE) return Check (lineNumber, rc, cc, TWRC_XFERDONE);
+    transferImages++;
+    return true;
+}
+
+
+static bool NativeXfer (int lineNumber) {
+
+    Handle handle = NULL;
+    TW_UINT16 cc;
+    TW_UINT16 rc = Call (lineNumber, DG_IMAGE, DAT_IMAGENATIVEXFER, MSG_GET, &handle, &cc);
+    if (handle) {
+        transferBytes += GetHandleSize (handle);
+        DisposeHandle (handle);
+    }
+    if (rc == TWRC_XFERDONE) transferImages++;
+    return Check (lineNumber, rc, cc, TWRC_XFERDONE);
+}
+
+
+// File transfer of one image, to wherever DAT_SETUPFILEXFER points
+static bool FileXfer (int lineNumber) {
+
+    TW_SETUPFILEXFER setupfilexfer;
+    TW_UINT16 cc;
+    TW_UINT16 rc = Call (lineNumber, DG_CONTROL, DAT_SETUPFILEXFER, MSG_GET, &setupfilexfer, &cc);
+    if (!Check (lineNumber, rc, cc)) return false;
+
+    rc = Call (lineNumber, DG_IMAGE, DAT_IMAGEFILEXFER, MSG_GET, NULL, &cc);
+    if (rc == TWRC_XFERDONE) {
+        struct stat filestat;
+        if (stat (GetTwainString (setupfilexfer.FileName).c_str (), &filestat) == 0)
+            transferBytes += filestat.st_size;
+        transferImages++;
+    }
+    return Check (lineNumber, rc, cc, TWRC_XFERDONE);
+}
+
+
+static bool EndXfer (int lineNumber, TW_UINT16 * count) {
+
+    TW_PENDINGXFERS pendingxfers = { 0, 0 };
+    TW_UINT16 cc;
+    TW_UINT16 rc = Call (lineNumber, DG_CONTROL, DAT_PENDINGXFERS, MSG_ENDXFER, &pendingxfers, &cc);
+    if (count) *count = pendingxfers.Count;
+    return Check (lineNumber, rc, cc);
+}
+
+
+static bool Run (const std::vector <Line> & lines, size_t begin, size_t end);
+
+
+static bool RunLine (const std::vector <Line> & lines, size_t * index) {
+
+    const Line & line = lines [*index];
+    const std::string & command = line.words [0];
+    TW_UINT16 rc, cc;
+
+    if (command == "repeat") {
+        // Find the matching end
+        int depth = 0;
+        size_t last;
+        for (last = *index + 1; last < lines.size (); last++) {
+            if (lines [last].words [0] == "repeat") depth++;
+            if (lines [last].words [0] == "end" && depth-- == 0) break;
+        }
+        if (last == lines.size () || line.words.size () != 2) {
+            fprintf (stderr, "line %d: repeat <count> without end\n", line.number);
+            return false;
+        }
+        for (int i = 0; i < atoi (line.words [1].c_str ()); i++)
+            if (!Run (lines, *index + 1, last)) return false;
+        *index = last;
+        return true;
+    }
+
+    if (command == "expect") {
+        TW_UINT32 value;
+        expectRC = TWRC_SUCCESS;
+        expectCC = TWCC_SUCCESS;
+        for (size_t i = 1; i < line.words.size (); i++) {
+            if (!ParseValue (line.words [i], &value)) {
+                fprintf (stderr, "line %d: unknown return or condition code %s\n", line.number,
+                         line.words [i].c_str ());
+                return false;
+            }
+            if (line.words [i].compare (0, 5, "TWCC_") == 0)
+                expectCC = value;
+            else
+                expectRC = value;
+        }
+        expecting = true;
+        return true;
+    }
+
+    if (command == "app") {
+        if (line.words.size () != 2) return false;
+        SetTwainString (appIdentity.ProductName, line.words [1].c_str ());
+        return true;
+    }
+
+    if (command == "state") {
+        if (line.words.size () == 2 && atoi (line.words [1].c_str ()) == state) return true;
+        fprintf (stderr, "line %d: in state %d\n", line.number, state);
+        violations++;
+        return true;
+    }
+
+    if (command == "identity") {
+        TW_IDENTITY identity;
+        memset (&identity, 0, sizeof (identity));
+        rc = Call (line.number, DG_CONTROL, DAT_IDENTITY, MSG_GET, &identity, &cc);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "open" || command == "close") {
+        TW_IDENTITY identity;
+        memset (&identity, 0, sizeof (identity));
+        rc = Call (line.number, DG_CONTROL, DAT_IDENTITY, (command == "open" ? MSG_OPENDS : MSG_CLOSEDS),
+                   &identity, &cc);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "cap") return Capability (line);
+
+    if (command == "layout") {
+        TW_IMAGELAYOUT imagelayout;
+        memset (&imagelayout, 0, sizeof (imagelayout));
+        if (line.words.size () == 6 && line.words [1] == "set") {
+            imagelayout.Frame.Left = FloatToFix32 (atof (line.words [2].c_str ()));
+            imagelayout.Frame.Top = FloatToFix32 (atof (line.words [3].c_str ()));
+            imagelayout.Frame.Right = FloatToFix32 (atof (line.words [4].c_str ()));
+            imagelayout.Frame.Bottom = FloatToFix32 (atof (line.words [5].c_str ()));
+            rc = Call (line.number, DG_IMAGE, DAT_IMAGELAYOUT, MSG_SET, &imagelayout, &cc);
+        }
+        else
+            rc = Call (line.number, DG_IMAGE, DAT_IMAGELAYOUT, MSG_GET, &imagelayout, &cc);
+        return Check (line.number, rc, cc, TWRC_CHECKSTATUS);
+    }
+
+    if (command == "status") {
+        TW_STATUS status;
+        rc = Call (line.number, DG_CONTROL, DAT_STATUS, MSG_GET, &status, &cc);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "customdata") {
+        TW_CUSTOMDSDATA customdsdata = { 0, NULL };
+        rc = Call (line.number, DG_CONTROL, DAT_CUSTOMDSDATA, MSG_GET, &customdsdata, &cc);
+        if (customdsdata.hData) DisposeHandle ((Handle) customdsdata.hData);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "enable" || command == "enableuionly") {
+        TW_USERINTERFACE userinterface = { 0, 0, NULL };
+        userinterface.ShowUI = (line.words.size () > 1 && line.words [1] == "showui");
+        rc = Call (line.number, DG_CONTROL, DAT_USERINTERFACE,
+                   (command == "enable" ? MSG_ENABLEDS : MSG_ENABLEDSUIONLY), &userinterface, &cc);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "disable") {
+        TW_USERINTERFACE userinterface = { 0, 0, NULL };
+        rc = Call (line.number, DG_CONTROL, DAT_USERINTERFACE, MSG_DISABLEDS, &userinterface, &cc);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "pending") {
+        TW_PENDINGXFERS pendingxfers = { 0, 0 };
+        rc = Call (line.number, DG_CONTROL, DAT_PENDINGXFERS,
+                   (line.words.size () > 1 && line.words [1] == "reset" ? MSG_RESET : MSG_GET), &pendingxfers, &cc);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "setupmemxfer") {
+        TW_SETUPMEMXFER setupmemxfer;
+        rc = Call (line.number, DG_CONTROL, DAT_SETUPMEMXFER, MSG_GET, &setupmemxfer, &cc);
+        return Check (line.number, rc, cc);
+    }
+
+    // Without arguments the current setup is read back, otherwise the path and the file format are set
+    if (command == "setupfilexfer") {
+        TW_SETUPFILEXFER setupfilexfer;
+        memset (&setupfilexfer, 0, sizeof (setupfilexfer));
+        TW_UINT16 MSG = MSG_GET;
+        if (line.words.size () > 2) {
+            TW_UINT32 format;
+            if (!ParseValue (line.words [2], &format)) {
+                fprintf (stderr, "line %d: bad file format %s\n", line.number, line.words [2].c_str ());
+                return false;
+            }
+            SetTwainString (setupfilexfer.FileName, line.words [1].c_str ());
+            setupfilexfer.Format = format;
+            MSG = MSG_SET;
+        }
+        rc = Call (line.number, DG_CONTROL, DAT_SETUPFILEXFER, MSG, &setupfilexfer, &cc);
+        if (verbose && MSG == MSG_GET && rc == TWRC_SUCCESS)
+            printf ("       %s, format %d\n", GetTwainString (setupfilexfer.FileName).c_str (), setupfilexfer.Format);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "xfergroup") {
+        TW_UINT32 xfergroup;
+        rc = Call (line.number, DG_CONTROL, DAT_XFERGROUP, MSG_GET, &xfergroup, &cc);
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "imageinfo") {
+        TW_IMAGEINFO imageinfo;
+        rc = Call (line.number, DG_IMAGE, DAT_IMAGEINFO, MSG_GET, &imageinfo, &cc);
+        if (verbose && rc == TWRC_SUCCESS)
+            printf ("       %d x %d, %d bits per pixel, %g dpi\n", imageinfo.ImageWidth, imageinfo.ImageLength,
+                    imageinfo.BitsPerPixel, Fix32ToFloat (imageinfo.XResolution));
+        return Check (line.number, rc, cc);
+    }
+
+    if (command == "memxfer")
+        return MemXfer (line.number, line.words.size () > 1 ? line.words [1] : "preferred");
+
+    if (command == "nativexfer") return NativeXfer (line.number);
+
+    if (command == "filexfer") return FileXfer (line.number);
+
+    if (command == "endxfer") return EndXfer (line.number, NULL);
+
+    // The state 6 loop of an application: transfer until no images are pending
+    if (command == "transfer") {
+        std::string mech = (line.words.size () > 1 ? line.words [1] : "memory");
+        std::string size = (line.words.size () > 2 ? line.words [2] : "preferred");
+        if (state != 6) {
+            fprintf (stderr, "line %d: no transfer ready in state %d\n", line.number, state);
+            return false;
+        }
+        TW_UINT16 count;
+        do {
+            TW_IMAGEINFO imageinfo;
+            rc = Call (line.number, DG_IMAGE, DAT_IMAGEINFO, MSG_GET, &imageinfo, &cc);
+            if (!Check (line.number, rc, cc)) return false;
+            if (!(mech == "native" ? NativeXfer (line.number) :
+                  mech == "file" ? FileXfer (line.number) : MemXfer (line.number, size))) return false;
+            if (!EndXfer (line.number, &count)) return false;
+        }
+        while (count != 0);
+        return true;
+    }
+
+    fprintf (stderr, "line %d: unknown command %s\n", line.number, command.c_str ());
+    return false;
+}
+
+
+static bool Run (const std::vector <Line> & lines, size_t begin, size_t end) {
+
+    for (size_t index = begin; index < end; index++)
+        if (!RunLine (lines, &index)) return false;
+    return true;
+}
+
+
+static bool ReadScript (const char * path, std::vector <Line> & lines) {
+
+    FILE * file = fopen (path, "r");
+    if (!file) {
+        perror (path);
+        return false;
+    }
+
+    char buffer [1024];
+    int number = 0;
+    while (fgets (buffer, sizeof (buffer), file)) {
+        number++;
+        char * comment = strchr (buffer, '#');
+        if (comment) *comment = '\0';
+        Line line;
+        line.number = number;
+        for (char * word = strtok (buffer, " \t\r\n"); word; word = strtok (NULL, " \t\r\n"))
+            line.words.push_back (word);
+        if (!line.words.empty ()) lines.push_back (line);
+    }
+    fclose (file);
+
+    return true;
+}
+
+
+static void WriteJson (FILE * file, const char * script, bool ok, double seconds) {
+
+    fprintf (file, "{\"script\": \"%s\", \"ok\": %s, \"violations\": %d, \"seconds\": %.6f, "
+             "\"images\": %ld, \"bytes\": %.0f, \"calls\": [\n", script, ok ? "true" : "false",
+             violations, seconds, transferImages, transferBytes);
+    for (std::map <std::string, CallStats>::iterator it = stats.begin (); it != stats.end (); it++)
+        fprintf (file, "  {\"name\": \"%s\", \"count\": %ld, \"total_ms\": %.6f, \"mean_ms\": %.6f, "
+                 "\"min_ms\": %.6f, \"max_ms\": %.6f}%s\n", it->first.c_str (), it->second.count,
+                 it->second.total * 1e3, it->second.total * 1e3 / it->second.count, it->second.min * 1e3,
+                 it->second.max * 1e3, (++std::map <std::string, CallStats>::iterator (it) == stats.end () ? "" : ","));
+    fprintf (file, "]}\n");
+}
+
+
+static void Usage (const char * program) {
+
+    fprintf (stderr,
+             "Usage: %s [-v] [--json FILE] SCRIPT\n"
+             "  -v                print every call with its state transition and time\n"
+             "  --json FILE       write the call timings as JSON\n",
+             program);
+}
+
+
+int main (int argc, char ** argv) {
+
+    const char * jsonPath = NULL;
+    const char * script = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv [i];
+        if (arg == "-v")
+            verbose = true;
+        else if (arg == "--json" && i + 1 < argc)
+            jsonPath = argv [++i];
+        else if (arg [0] != '-' && !script)
+            script = argv [i];
+        else {
+            Usage (argv [0]);
+            return 2;
+        }
+    }
+    if (!script) {
+        Usage (argv [0]);
+        return 2;
+    }
+
+    std::vector <Line> lines;
+    if (!ReadScript (script, lines)) return 2;
+
+    memset (&appIdentity, 0, sizeof (appIdentity));
+    appIdentity.Id = 1;
+    appIdentity.ProtocolMajor = TWON_PROTOCOLMAJOR;
+    appIdentity.ProtocolMinor = TWON_PROTOCOLMINOR;
+    appIdentity.SupportedGroups = DG_CONTROL | DG_IMAGE;
+    SetTwainString (appIdentity.Manufacturer, "SANE.ds");
+    SetTwainString (appIdentity.ProductFamily, "Benchmarks");
+    SetTwainString (appIdentity.ProductName, "mock-dsm");
+
+    // Keep the user's preferences out of it, the device destructor writes them back
+    char configdir [] = "/tmp/sane-ds-mock.XXXXXX";
+    if (!mkdtemp (configdir)) {
+        perror ("mkdtemp");
+        return 1;
+    }
+    setenv ("XDG_CONFIG_HOME", configdir, 1);
+
+    double start = Now ();
+    bool ok = Run (lines, 0, lines.size ());
+    double seconds = Now () - start;
+
+    // Leave the data source closed like a well-behaved application would
+    if (state > 3) {
+        fprintf (stderr, "script ended in state %d\n", state);
+        ok = false;
+    }
+
+    unlink ((std::string (configdir) + "/twain-sane/preferences").c_str ());
+    rmdir ((std::string (configdir) + "/twain-sane").c_str ());
+    rmdir (configdir);
+
+    printf ("%-48s %8s %12s %12s %12s %12s\n", "call", "count", "total ms", "mean ms", "min ms", "max ms");
+    for (std::map <std::string, CallStats>::iterator it = stats.begin (); it != stats.end (); it++)
+        printf ("%-48s %8ld %12.3f %12.3f %12.3f %12.3f\n", it->first.c_str (), it->second.count,
+                it->second.total * 1e3, it->second.total * 1e3 / it->second.count, it->second.min * 1e3,
+                it->second.max * 1e3);
+    printf ("\n%ld images, %.1f MB in %.3f s, %d state violations\n", transferImages,
+            transferBytes / (1024 * 1024), seconds, violations);
+
+    if (jsonPath) {
+        FILE * file = fopen (jsonPath, "w");
+        if (!file) {
+            perror (jsonPath);
+            return 1;
+        }
+        WriteJson (file, script, ok && violations == 0, seconds);
+        fclose (file);
+    }
+
+    return (ok && violations == 0 ? 0 : 1);
+}
@@ -1,11 +1,13 @@
 #ifndef SANE_DS_ABOUT_H
 #define SANE_DS_ABOUT_H
 
-#include <Carbon/Carbon.h>
+#include "Platform.h"
 
 #include <sane/sane.h>
 
+#ifdef __APPLE__
 void About (WindowRef parent, SANE_Int saneversion);
+#endif
 void NoDevice ();
 
 #endif
@@ -0,0 +1,75 @@
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "BlankPage.h"
+
+
+// The spread of the samples on an empty sheet, from sensor noise and the paper itself
+#define BLANK_NOISE 8
+
+
+BlankPage::BlankPage (const SANE_Parameters & param, Histogram & inhistogram) : histogram (inhistogram),
+                                                                               depth (param.depth),
+                                                                               coverage (0),
+                                                                               deviation (0) {
+
+    // Lineart counts eight pixels at a time
+    Size unit = (depth == 1 ? 1 : depth / 8) * (param.format == SANE_FRAME_RGB ? 3 : 1);
+    Size units = (depth == 1 ? param.pixels_per_line / 8 : param.pixels_per_line);
+    Size margin = units / 20;
+    histogram.SetRowWindow (param.bytes_per_line, margin * unit, (units - margin) * unit);
+}
+
+
+UInt64 BlankPage::Count (int top, int bottom) {
+
+    const std::vector <Histogram::RowCounts> & rows = histogram.GetRowCounts ();
+    UInt64 ink = 0;
+    UInt64 samples = 0;
+    double sum = 0;
+    double squares = 0;
+    for (int r = top; r < bottom; r++) {
+        ink += rows [r].ink;
+        samples += rows [r].samples;
+        sum += rows [r].sum;
+        squares += rows [r].squares;
+    }
+
+    coverage = 0;
+    deviation = 0;
+    if (!samples) return 0;
+    coverage = (double) ink / samples;
+    double mean = sum / samples;
+    deviation = sqrt (std::max (0.0, squares / samples - mean * mean));
+    // in steps of 8 bit samples
+    if (depth == 16) deviation /= 256;
+    return samples;
+}
+
+
+bool BlankPage::IsBlank (int limit) {
+
+    int rows = histogram.GetRowCounts ().size ();
+    int margin = rows / 20;
+    if (!Count (margin, rows - margin)) return false;
+
+    double ink = std::min (limit, 1000) / 1000.0;
+    double spread = std::max ((double) BLANK_NOISE, 255 * sqrt (ink * (1 - ink)));
+    return (coverage <= ink && (depth == 1 || deviation <= spread));
+}
+
+
+double BlankPage::GetCoverage () {
+
+    return coverage;
+}
+
+
+double BlankPage::GetDeviation () {
+
+    return deviation;
+}
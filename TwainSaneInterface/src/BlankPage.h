@@ -0,0 +1,39 @@
+#ifndef SANE_DS_BLANKPAGE_H
+#define SANE_DS_BLANKPAGE_H
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include "Histogram.h"
+
+// Tells blank pages, such as the empty backs of a duplex feeder job, from pages with content.
+// The ink (samples darker than the middle) and the variation of the samples are taken from the
+// rows the histogram of the scan counts, which leave out a margin of a twentieth of the page on
+// each side, where the edges of the sheet, punch holes and shadows are. The top and bottom
+// margins are left out at the end, so pages of unknown length are judged the same way. The
+// deviation of 16 bit samples is in steps of 8 bit ones.
+
+class BlankPage {
+
+public:
+    // Sets the window of the histogram, which has been started for the scan
+    BlankPage (const SANE_Parameters & param, Histogram & inhistogram);
+
+    // A page is blank when at most limit tenths of a percent of its samples are ink, and they
+    // vary no more than that much ink would make them
+    bool IsBlank (int limit);
+    double GetCoverage ();
+    double GetDeviation ();
+
+private:
+    UInt64 Count (int top, int bottom);
+
+    Histogram & histogram;
+    int depth;
+
+    double coverage;
+    double deviation;
+};
+
+#endif
@@ -1,22 +1,27 @@
-#include <Carbon/Carbon.h>
+#include "Platform.h"
 
 #include "Buffer.h"
 
 
 Buffer::Buffer () : handle (NULL), size (0), delta (0), offset (0), memError (noErr),
-                    claimed (false) {}
+                    claimed (false), tag (MEMORY_BUFFER) {}
 
 
-Buffer::Buffer (Size insize) : size (insize), delta (insize), offset (0), claimed (false) {
+Buffer::Buffer (Size insize, MemoryTag intag) : size (insize), delta (insize), offset (0),
+                                                claimed (false), tag (intag) {
 
     handle = NewHandle (size);
     memError = MemError ();
+    if (handle) MemoryAllocated (tag, size);
 }
 
 
 Buffer::~Buffer () {
 
-    if (handle && !claimed) DisposeHandle (handle);
+    if (handle && !claimed) {
+        MemoryReleased (tag, GetHandleSize (handle));
+        DisposeHandle (handle);
+    }
 }
 
 
@@ -27,6 +32,7 @@ void Buffer::SetSize (Size insize) {
     delta = insize;
     handle = NewHandle (size);
     memError = MemError ();
+    if (handle) MemoryAllocated (tag, size);
 }
 
 
@@ -40,6 +46,7 @@ Size Buffer::CheckSize () {
         SetHandleSize (handle, size);
         memError = MemError ();
         if (memError) return 0;
+        MemoryResized (tag, size - delta, size);
     }
     return size - offset;
 }
@@ -53,6 +60,7 @@ Ptr Buffer::GetPtr (Size datasize) {
         size += delta;
         SetHandleSize (handle, size);
         memError = MemError ();
+        if (!memError) MemoryResized (tag, size - delta, size);
     }
     if (memError) return NULL;
     HLock (handle);
@@ -78,6 +86,7 @@ void Buffer::Write (void * data, Size datasize) {
         size += delta;
         SetHandleSize (handle, size);
         memError = MemError ();
+        if (!memError) MemoryResized (tag, size - delta, size);
     }
     if (memError) return;
     HLock (handle);
@@ -89,15 +98,24 @@ void Buffer::Write (void * data, Size datasize) {
 
 Handle Buffer::Claim () {
 
+    return Claim (tag);
+}
+
+
+Handle Buffer::Claim (MemoryTag newtag) {
+
     if (!handle) return NULL;
     if (claimed) return NULL;
     if (memError) return NULL;
     if (size != offset) {
+        Size oldsize = size;
         size = offset;
         SetHandleSize (handle, size);
         memError = MemError ();
         if (memError) return NULL;
+        MemoryResized (tag, oldsize, size);
     }
+    MemoryRetagged (tag, newtag, size);
     claimed = true;
     return handle;
 }
@@ -1,13 +1,15 @@
 #ifndef SANE_DS_BUFFER_H
 #define SANE_DS_BUFFER_H
 
-#include <Carbon/Carbon.h>
+#include "Platform.h"
+
+#include "MemoryAccount.h"
 
 class Buffer {
 
 public:
     Buffer ();
-    Buffer (Size insize);
+    Buffer (Size insize, MemoryTag intag = MEMORY_BUFFER);
     ~Buffer ();
     void SetSize (Size insize);
     Size CheckSize ();
@@ -15,6 +17,7 @@ public:
     void ReleasePtr (Size datasize);
     void Write (void * data, Size datasize);
     Handle Claim ();
+    Handle Claim (MemoryTag newtag);
 private:
     Handle handle;
     Size size;
@@ -22,6 +25,7 @@ private:
     Size offset;
     OSErr memError;
     bool claimed;
+    MemoryTag tag;
 };
 
 #endif
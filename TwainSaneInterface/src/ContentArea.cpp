@@ -0,0 +1,111 @@
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "ContentArea.h"
+
+
+// The least difference from the lid that counts as content, in 8 bit levels
+#define CONTENT_THRESHOLD 32
+
+
+// The lightness of each pixel of a row, 8 bits with 255 for white
+
+static void RowLightness (const unsigned char * row, const SANE_Parameters & param, unsigned char * light) {
+
+    bool rgb = (param.format == SANE_FRAME_RGB);
+    int width = param.pixels_per_line;
+
+    for (int x = 0; x < width; x++) {
+        int sample [3];
+        for (int c = 0; c < (rgb ? 3 : 1); c++) {
+            int i = (rgb ? 3 * x + c : x);
+            if (param.depth == 1) {
+                // Colour lineart bytes hold eight pixels of one channel, a set bit is black
+                Size byte = (rgb ? 3 * (x / 8) + c : x / 8);
+                sample [c] = (row [byte] & (0x80 >> (x % 8)) ? 0 : 255);
+            }
+            else if (param.depth == 8)
+                sample [c] = row [i];
+            else {
+                UInt16 value;
+                memcpy (&value, &row [2 * i], 2);
+                sample [c] = value >> 8;
+            }
+        }
+        light [x] = (rgb ? (77 * sample [0] + 150 * sample [1] + 29 * sample [2]) >> 8 : sample [0]);
+    }
+}
+
+
+// The first and last entry of at least least, or false when there is none
+
+static bool Span (const std::vector <int> & counts, int least, int * first, int * last) {
+
+    int n = counts.size ();
+    for (*first = 0; *first < n && counts [*first] < least; (*first)++);
+    if (*first == n) return false;
+    for (*last = n; counts [*last - 1] < least; (*last)--);
+    return true;
+}
+
+
+bool FindContentArea (const unsigned char * data, const SANE_Parameters & param,
+                      int * top, int * left, int * bottom, int * right) {
+
+    if (param.format != SANE_FRAME_GRAY && param.format != SANE_FRAME_RGB) return false;
+
+    int width = param.pixels_per_line;
+    int height = param.lines;
+    if (width < 8 || height < 8) return false;
+
+    std::vector <unsigned char> light ((Size) width * height);
+    for (int y = 0; y < height; y++)
+        RowLightness (data + (Size) y * param.bytes_per_line, param, &light [(Size) y * width]);
+
+    // The lid is the middle of the border of the preview, and its grain the middle spread
+    std::vector <unsigned char> border;
+    for (int x = 0; x < width; x++) {
+        border.push_back (light [x]);
+        border.push_back (light [(Size) (height - 1) * width + x]);
+    }
+    for (int y = 1; y < height - 1; y++) {
+        border.push_back (light [(Size) y * width]);
+        border.push_back (light [(Size) y * width + width - 1]);
+    }
+    std::nth_element (border.begin (), border.begin () + border.size () / 2, border.end ());
+    int lid = border [border.size () / 2];
+    for (size_t i = 0; i < border.size (); i++) border [i] = abs (border [i] - lid);
+    std::nth_element (border.begin (), border.begin () + border.size () / 2, border.end ());
+    int threshold = std::max (CONTENT_THRESHOLD, 4 * border [border.size () / 2]);
+
+    std::vector <int> rows (height, 0);
+    std::vector <int> columns (width, 0);
+    for (int y = 0; y < height - 1; y++) {
+        const unsigned char * p = &light [(Size) y * width];
+        for (int x = 0; x < width - 1; x++) {
+            int edge = abs (p [x + 1] - p [x]) + abs (p [x + width] - p [x]);
+            if (abs (p [x] - lid) > threshold || edge > threshold) {
+                rows [y]++;
+                columns [x]++;
+            }
+        }
+    }
+
+    // A row or column with a speck of dust on it is not content yet
+    int first, last;
+    if (!Span (rows, std::max (2, width / 100), &first, &last)) return false;
+    int pad = std::max (2, height / 100);
+    *top = std::max (0, first - pad);
+    *bottom = std::min (height, last + 1 + pad);
+    if (!Span (columns, std::max (2, height / 100), &first, &last)) return false;
+    pad = std::max (2, width / 100);
+    *left = std::max (0, first - pad);
+    *right = std::min (width, last + 1 + pad);
+    return true;
+}
@@ -0,0 +1,17 @@
+#ifndef SANE_DS_CONTENTAREA_H
+#define SANE_DS_CONTENTAREA_H
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+// Finds the documents or photos on the glass in a preview. The lid around them is taken from
+// the border of the preview; pixels that differ from it, or that sit on an edge such as the
+// shadow of a white sheet on a white lid, are content. The rows and columns holding content
+// are returned in pixels, bottom and right exclusive, with a little room to spare. Returns
+// false when nothing stands out. Three-pass lineart frames are not looked at.
+
+bool FindContentArea (const unsigned char * data, const SANE_Parameters & param,
+                      int * top, int * left, int * bottom, int * right);
+
+#endif
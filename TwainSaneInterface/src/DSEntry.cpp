@@ -1,4 +1,4 @@
-#include <TWAIN/TWAIN.h>
+#include "Platform.h"
 #include "DataSource.h"
 
 DataSource datasource;
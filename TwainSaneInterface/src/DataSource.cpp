@@ -1,10 +1,27 @@
-#include <Carbon/Carbon.h>
-#include <TWAIN/TWAIN.h>
+#include "Platform.h"
+
+#include <cstdlib>
+#include <cstring>
 
 #include "DataSource.h"
 #include "SaneDevice.h"
 #include "Image.h"
+#include "BlankPage.h"
+#include "ImageWriter.h"
+#include "FileJob.h"
 #include "Alerts.h"
+#include "Trace.h"
+#include "MemoryAccount.h"
+
+
+// The uncompressed size of an image, what a transfer of it has to move
+
+static double ImageBytes (Image * image) {
+
+    TW_IMAGEINFO imageinfo;
+    if (!image || image->TwainImageInfo (&imageinfo) != TWRC_SUCCESS) return 0;
+    return (double) ((imageinfo.ImageWidth * imageinfo.BitsPerPixel + 7) / 8) * imageinfo.ImageLength;
+}
 
 
 DataSource::DataSource () : origin (NULL),
@@ -12,12 +29,85 @@ DataSource::DataSource () : origin (NULL),
                             twainstatus (TWCC_SUCCESS),
                             state (STATE_3),
                             cap_XferMech (TWSX_NATIVE),
-                            indicators (true) {}
+                            cap_PixelFlavor (TWPF_CHOCOLATE),
+                            cap_PlanarChunky (TWPC_CHUNKY),
+                            cap_FullDepth (false),
+                            cap_Compression (TWCP_NONE),
+                            cap_JpegQuality (TWJQ_MEDIUM),
+                            cap_ImageFileFormat (TWFF_TIFF),
+                            cap_NativeFormat (DefaultNativeFormat ()),
+                            cap_Gamma (1),
+                            cap_BlankPage (0),
+                            fileName ("TWAIN.TMP"),
+                            fileJob (NULL),
+                            indicators (true),
+                            blankpages (0),
+                            blankbytes (0),
+                            xferbytes (0),
+                            xferseconds (0),
+                            xferstart (0) {}
 
 
 DataSource::~DataSource () {
 
+    EndFileJob ();
     if (sanedevice) delete sanedevice;
+    TraceFlush ();
+}
+
+
+#define TRACE_NAME(x) case x: return #x
+
+static const char * TraceDATName (TW_UINT16 DAT) {
+
+    switch (DAT) {
+        TRACE_NAME (DAT_CAPABILITY);
+        TRACE_NAME (DAT_IDENTITY);
+        TRACE_NAME (DAT_PENDINGXFERS);
+        TRACE_NAME (DAT_SETUPMEMXFER);
+        TRACE_NAME (DAT_SETUPFILEXFER);
+        TRACE_NAME (DAT_STATUS);
+        TRACE_NAME (DAT_USERINTERFACE);
+        TRACE_NAME (DAT_XFERGROUP);
+        TRACE_NAME (DAT_CUSTOMDSDATA);
+        TRACE_NAME (DAT_IMAGEINFO);
+        TRACE_NAME (DAT_IMAGELAYOUT);
+        TRACE_NAME (DAT_IMAGEMEMXFER);
+        TRACE_NAME (DAT_IMAGEFILEXFER);
+        TRACE_NAME (DAT_IMAGENATIVEXFER);
+        TRACE_NAME (DAT_PALETTE8);
+        default: return "DAT_?";
+    }
+}
+
+
+static const char * TraceMSGName (TW_UINT16 MSG) {
+
+    switch (MSG) {
+        TRACE_NAME (MSG_GET);
+        TRACE_NAME (MSG_GETCURRENT);
+        TRACE_NAME (MSG_GETDEFAULT);
+        TRACE_NAME (MSG_SET);
+        TRACE_NAME (MSG_RESET);
+        TRACE_NAME (MSG_QUERYSUPPORT);
+        TRACE_NAME (MSG_OPENDS);
+        TRACE_NAME (MSG_CLOSEDS);
+        TRACE_NAME (MSG_ENDXFER);
+        TRACE_NAME (MSG_DISABLEDS);
+        TRACE_NAME (MSG_ENABLEDS);
+        TRACE_NAME (MSG_ENABLEDSUIONLY);
+        default: return "MSG_?";
+    }
+}
+
+#undef TRACE_NAME
+
+
+// Containers are handed over to the application, so they only show up in the allocation counts
+static void CapabilityContainer (Handle container) {
+
+    MemoryAllocated (MEMORY_CAPABILITY, GetHandleSize (container));
+    MemoryReleased (MEMORY_CAPABILITY, GetHandleSize (container));
 }
 
 
@@ -27,6 +117,9 @@ TW_UINT16 DataSource::Entry (pTW_IDENTITY pOrigin,
                              TW_UINT16    MSG,
                              TW_MEMREF    pData) {
 
+    TraceScope trace ("twain", "%s %s %s", (DG == DG_IMAGE ? "DG_IMAGE" : "DG_CONTROL"),
+                      TraceDATName (DAT), TraceMSGName (MSG));
+
     origin = pOrigin;
 
     if (DG != DG_CONTROL || DAT != DAT_STATUS) twainstatus = TWCC_SUCCESS;
@@ -63,6 +156,11 @@ TW_UINT16 DataSource::Entry (pTW_IDENTITY pOrigin,
                     return SetupMemXfer (MSG, (pTW_SETUPMEMXFER) pData);
                     break;
 
+                case DAT_SETUPFILEXFER:
+
+                    return SetupFileXfer (MSG, (pTW_SETUPFILEXFER) pData);
+                    break;
+
                 case DAT_STATUS:
 
                     return Status (MSG, (pTW_STATUS) pData);
@@ -109,9 +207,14 @@ TW_UINT16 DataSource::Entry (pTW_IDENTITY pOrigin,
                     return ImageMemXfer (MSG, (pTW_IMAGEMEMXFER) pData);
                     break;
 
+                case DAT_IMAGEFILEXFER:
+
+                    return ImageFileXfer (MSG);
+                    break;
+
                 case DAT_IMAGENATIVEXFER:
 
-                    return ImageNativeXfer (MSG, (pTW_UINT32) pData);
+                    return ImageNativeXfer (MSG, (Handle *) pData);
                     break;
 
                 case DAT_PALETTE8:
@@ -136,6 +239,9 @@ TW_UINT16 DataSource::Entry (pTW_IDENTITY pOrigin,
 
 TW_UINT16 DataSource::CallBack (TW_UINT16 MSG) {
 
+    TraceInstant ("twain", "CallBack %s", (MSG == MSG_XFERREADY ? "MSG_XFERREADY" :
+                                           MSG == MSG_CLOSEDSREQ ? "MSG_CLOSEDSREQ" : "MSG_CLOSEDSOK"));
+
     TW_CALLBACK callback = { NULL, 0, MSG };
 
     switch (MSG) {
@@ -143,6 +249,8 @@ TW_UINT16 DataSource::CallBack (TW_UINT16 MSG) {
         case MSG_XFERREADY:
 
             if (state != STATE_5) return SetStatus (TWCC_SEQERROR);
+            if (!DropBlankPages ()) return CallBack (MSG_CLOSEDSREQ);
+            xferstart = MonotonicNanoseconds ();
             state = STATE_6;
             return DSM_Entry (origin, NULL, DG_CONTROL, DAT_CALLBACK,
                               MSG_INVOKE_CALLBACK, (TW_MEMREF) &callback);
@@ -180,6 +288,8 @@ TW_UINT16 DataSource::CallBack (TW_UINT16 MSG) {
 
 TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
 
+    TraceScope trace ("twain", "Capability 0x%04x", capability->Cap);
+
     switch (MSG) {
 
         case MSG_GET:
@@ -239,22 +349,253 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
 
             switch (MSG) {
 
-                case MSG_GET:
+                case MSG_GET: {
+
+                    // Group 4 only applies to bitonal images and JPEG to the others, they are
+                    // otherwise sent uncompressed. LZW and ZIP are for TIFF file transfers.
+                    TW_UINT16 compressions [] = { TWCP_NONE, TWCP_PACKBITS, TWCP_GROUP4, TWCP_JPEG,
+                                                  TWCP_LZW, TWCP_ZIP };
+                    TW_UINT32 current = 0;
+                    for (TW_UINT32 i = 0; i < sizeof (compressions) / sizeof (TW_UINT16); i++)
+                        if (compressions [i] == cap_Compression) current = i;
+                    return BuildEnumeration (capability, TWTY_UINT16,
+                                             sizeof (compressions) / sizeof (TW_UINT16),
+                                             current, 0, compressions);
+                    break;
+                }
+
                 case MSG_GETCURRENT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, cap_Compression);
+                    break;
+
                 case MSG_GETDEFAULT:
 
                     return BuildOneValue (capability, TWTY_UINT16, TWCP_NONE);
                     break;
 
+                case MSG_SET:
+
+                    if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
+                    if (((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWCP_NONE &&
+                        ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWCP_PACKBITS &&
+                        ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWCP_GROUP4 &&
+                        ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWCP_JPEG &&
+                        ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWCP_LZW &&
+                        ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWCP_ZIP)
+                        return SetStatus (TWCC_BADVALUE);
+                    cap_Compression = ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item;
+                    return TWRC_SUCCESS;
+                    break;
+
+                case MSG_RESET:
+
+                    cap_Compression = TWCP_NONE;
+                    return BuildOneValue (capability, TWTY_UINT16, cap_Compression);
+                    break;
+
                 case MSG_QUERYSUPPORT:
 
-                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET |
-                                          TWQC_GETDEFAULT | TWQC_GETCURRENT);
+                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET | TWQC_SET |
+                                          TWQC_GETDEFAULT | TWQC_GETCURRENT | TWQC_RESET);
                     break;
 
                 default:
+                    // All cases handled
+                    break;
+            }
 
-                    return SetStatus (TWCC_CAPBADOPERATION);
+        case ICAP_JPEGQUALITY:
+
+            switch (MSG) {
+
+                case MSG_GET:
+                case MSG_GETCURRENT:
+
+                    return BuildOneValue (capability, TWTY_INT16, (TW_UINT32) (TW_INT32) cap_JpegQuality);
+                    break;
+
+                case MSG_GETDEFAULT:
+
+                    return BuildOneValue (capability, TWTY_INT16, (TW_UINT32) (TW_INT32) TWJQ_MEDIUM);
+                    break;
+
+                case MSG_SET: {
+
+                    if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
+                    TW_INT16 quality = (TW_INT16) ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item;
+                    if (quality < TWJQ_UNKNOWN || quality == 0 || quality > 100) return SetStatus (TWCC_BADVALUE);
+                    cap_JpegQuality = (quality == TWJQ_UNKNOWN ? TWJQ_MEDIUM : quality);
+                    return TWRC_SUCCESS;
+                    break;
+                }
+
+                case MSG_RESET:
+
+                    cap_JpegQuality = TWJQ_MEDIUM;
+                    return BuildOneValue (capability, TWTY_INT16, (TW_UINT32) (TW_INT32) cap_JpegQuality);
+                    break;
+
+                case MSG_QUERYSUPPORT:
+
+                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET | TWQC_SET |
+                                          TWQC_GETDEFAULT | TWQC_GETCURRENT | TWQC_RESET);
+                    break;
+
+                default:
+                    // All cases handled
+                    break;
+            }
+
+        case ICAP_IMAGEFILEFORMAT:
+
+            switch (MSG) {
+
+                case MSG_GET: {
+
+                    TW_UINT16 formats [] = { TWFF_TIFF, TWFF_TIFFMULTI, TWFF_JFIF, TWFF_PNG, TWFF_PDF };
+                    TW_UINT32 current = 0;
+                    for (TW_UINT32 i = 0; i < sizeof (formats) / sizeof (TW_UINT16); i++)
+                        if (formats [i] == cap_ImageFileFormat) current = i;
+                    return BuildEnumeration (capability, TWTY_UINT16,
+                                             sizeof (formats) / sizeof (TW_UINT16),
+                                             current, 0, formats);
+                    break;
+                }
+
+                case MSG_GETCURRENT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, cap_ImageFileFormat);
+                    break;
+
+                case MSG_GETDEFAULT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, TWFF_TIFF);
+                    break;
+
+                case MSG_SET:
+
+                    if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
+                    if (!ImageWriter::Supported (((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item))
+                        return SetStatus (TWCC_BADVALUE);
+                    if (cap_ImageFileFormat != ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item)
+                        EndFileJob ();
+                    cap_ImageFileFormat = ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item;
+                    return TWRC_SUCCESS;
+                    break;
+
+                case MSG_RESET:
+
+                    if (cap_ImageFileFormat != TWFF_TIFF) EndFileJob ();
+                    cap_ImageFileFormat = TWFF_TIFF;
+                    return BuildOneValue (capability, TWTY_UINT16, cap_ImageFileFormat);
+                    break;
+
+                case MSG_QUERYSUPPORT:
+
+                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET | TWQC_SET |
+                                          TWQC_GETDEFAULT | TWQC_GETCURRENT | TWQC_RESET);
+                    break;
+
+                default:
+                    // All cases handled
+                    break;
+            }
+
+        case ICAP_SANE_NATIVEFORMAT:
+
+            switch (MSG) {
+
+                case MSG_GET: {
+
+                    TW_UINT16 formats [] = { TWFF_PICT, TWFF_TIFF };
+                    return BuildEnumeration (capability, TWTY_UINT16, sizeof (formats) / sizeof (TW_UINT16),
+                                             (cap_NativeFormat == TWFF_TIFF ? 1 : 0),
+                                             (DefaultNativeFormat () == TWFF_TIFF ? 1 : 0), formats);
+                    break;
+                }
+
+                case MSG_GETCURRENT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, cap_NativeFormat);
+                    break;
+
+                case MSG_GETDEFAULT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, DefaultNativeFormat ());
+                    break;
+
+                case MSG_SET:
+
+                    if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
+                    if (((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWFF_PICT &&
+                        ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWFF_TIFF)
+                        return SetStatus (TWCC_BADVALUE);
+                    cap_NativeFormat = ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item;
+                    return TWRC_SUCCESS;
+                    break;
+
+                case MSG_RESET:
+
+                    cap_NativeFormat = DefaultNativeFormat ();
+                    return BuildOneValue (capability, TWTY_UINT16, cap_NativeFormat);
+                    break;
+
+                case MSG_QUERYSUPPORT:
+
+                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET | TWQC_SET |
+                                          TWQC_GETDEFAULT | TWQC_GETCURRENT | TWQC_RESET);
+                    break;
+
+                default:
+                    // All cases handled
+                    break;
+            }
+
+        case ICAP_SANE_BLANKPAGE:
+
+            // The most ink a blank page has, in tenths of a percent, 0 keeps every page
+            switch (MSG) {
+
+                case MSG_GET:
+
+                    return BuildRange (capability, TWTY_UINT16, (TW_UINT32) 0, (TW_UINT32) 1000, (TW_UINT32) 1,
+                                       (TW_UINT32) 0, (TW_UINT32) cap_BlankPage);
+                    break;
+
+                case MSG_GETCURRENT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, cap_BlankPage);
+                    break;
+
+                case MSG_GETDEFAULT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, (TW_UINT32) 0);
+                    break;
+
+                case MSG_SET:
+
+                    if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
+                    if (((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item > 1000)
+                        return SetStatus (TWCC_BADVALUE);
+                    cap_BlankPage = ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item;
+                    return TWRC_SUCCESS;
+                    break;
+
+                case MSG_RESET:
+
+                    cap_BlankPage = 0;
+                    return BuildOneValue (capability, TWTY_UINT16, cap_BlankPage);
+                    break;
+
+                case MSG_QUERYSUPPORT:
+
+                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET | TWQC_SET |
+                                          TWQC_GETDEFAULT | TWQC_GETCURRENT | TWQC_RESET);
+                    break;
+
+                default:
+                    // All cases handled
                     break;
             }
 
@@ -335,10 +676,13 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
 
                 case MSG_GET: {
 
-                    TW_UINT16 mechs [] =  { TWSX_NATIVE, TWSX_MEMORY };
+                    TW_UINT16 mechs [] =  { TWSX_NATIVE, TWSX_MEMORY, TWSX_FILE };
+                    TW_UINT32 current = 0;
+                    for (TW_UINT32 i = 0; i < sizeof (mechs) / sizeof (TW_UINT16); i++)
+                        if (mechs [i] == cap_XferMech) current = i;
                     return BuildEnumeration (capability, TWTY_UINT16,
                                              sizeof (mechs) / sizeof (TW_UINT16),
-                                             (cap_XferMech == TWSX_NATIVE ? 0 : 1), 0, mechs);
+                                             current, 0, mechs);
                     break;
                 }
 
@@ -356,7 +700,8 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
 
                     if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
                     cap_XferMech = ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item;
-                    if (cap_XferMech != TWSX_NATIVE && cap_XferMech != TWSX_MEMORY) {
+                    if (cap_XferMech != TWSX_NATIVE && cap_XferMech != TWSX_MEMORY &&
+                        cap_XferMech != TWSX_FILE) {
                         cap_XferMech = TWSX_NATIVE;
                         return TWRC_CHECKSTATUS;
                     }
@@ -389,6 +734,10 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
                     TW_UINT16 caps [] = {
                         CAP_XFERCOUNT,
                         ICAP_COMPRESSION,
+                        ICAP_JPEGQUALITY,
+                        ICAP_IMAGEFILEFORMAT,
+                        ICAP_SANE_NATIVEFORMAT,
+                        ICAP_SANE_BLANKPAGE,
                         ICAP_PIXELTYPE,
                         ICAP_UNITS,
                         ICAP_XFERMECH,
@@ -399,6 +748,7 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
                         CAP_ENABLEDSUIONLY,
                         ICAP_BRIGHTNESS,
                         ICAP_CONTRAST,
+                        ICAP_GAMMA,
                         ICAP_PHYSICALWIDTH,
                         ICAP_PHYSICALHEIGHT,
                         ICAP_XNATIVERESOLUTION,
@@ -605,6 +955,49 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
                     break;
             }
 
+        case ICAP_GAMMA:
+
+            // Applied in software along with brightness and contrast, 1 leaves the samples as scanned
+            switch (MSG) {
+
+                case MSG_GET:
+                case MSG_GETCURRENT:
+
+                    return BuildOneValue (capability, TWTY_FIX32, S2T (SANE_FIX (cap_Gamma)));
+                    break;
+
+                case MSG_GETDEFAULT:
+
+                    return BuildOneValue (capability, TWTY_FIX32, S2T (SANE_FIX (1.0)));
+                    break;
+
+                case MSG_SET: {
+
+                    if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
+                    double gamma = SANE_UNFIX (T2S (*((TW_FIX32*) &(((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item))));
+                    if (gamma <= 0) return SetStatus (TWCC_BADVALUE);
+                    cap_Gamma = gamma;
+                    return TWRC_SUCCESS;
+                    break;
+                }
+
+                case MSG_RESET:
+
+                    cap_Gamma = 1;
+                    return BuildOneValue (capability, TWTY_FIX32, S2T (SANE_FIX (cap_Gamma)));
+                    break;
+
+                case MSG_QUERYSUPPORT:
+
+                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET | TWQC_SET |
+                                          TWQC_GETDEFAULT | TWQC_GETCURRENT | TWQC_RESET);
+                    break;
+
+                default:
+                    // All cases handled
+                    break;
+            }
+
         case ICAP_PHYSICALWIDTH:
 
             switch (MSG) {
@@ -812,22 +1205,49 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
 
             switch (MSG) {
 
-                case MSG_GET:
+                case MSG_GET: {
+
+                    TW_UINT16 flavors [] = { TWPF_CHOCOLATE, TWPF_VANILLA };
+                    return BuildEnumeration (capability, TWTY_UINT16,
+                                             sizeof (flavors) / sizeof (TW_UINT16),
+                                             (cap_PixelFlavor == TWPF_CHOCOLATE ? 0 : 1), 0, flavors);
+                    break;
+                }
+
                 case MSG_GETCURRENT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, cap_PixelFlavor);
+                    break;
+
                 case MSG_GETDEFAULT:
 
                     return BuildOneValue (capability, TWTY_UINT16, TWPF_CHOCOLATE);
                     break;
 
+                case MSG_SET:
+
+                    if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
+                    if (((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWPF_CHOCOLATE &&
+                        ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWPF_VANILLA)
+                        return SetStatus (TWCC_BADVALUE);
+                    cap_PixelFlavor = ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item;
+                    return TWRC_SUCCESS;
+                    break;
+
+                case MSG_RESET:
+
+                    cap_PixelFlavor = TWPF_CHOCOLATE;
+                    return BuildOneValue (capability, TWTY_UINT16, cap_PixelFlavor);
+                    break;
+
                 case MSG_QUERYSUPPORT:
 
-                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET |
-                                          TWQC_GETDEFAULT | TWQC_GETCURRENT);
+                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET | TWQC_SET |
+                                          TWQC_GETDEFAULT | TWQC_GETCURRENT | TWQC_RESET);
                     break;
 
                 default:
-
-                    return SetStatus (TWCC_CAPBADOPERATION);
+                    // All cases handled
                     break;
             }
 
@@ -835,22 +1255,49 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
 
             switch (MSG) {
 
-                case MSG_GET:
+                case MSG_GET: {
+
+                    TW_UINT16 layouts [] = { TWPC_CHUNKY, TWPC_PLANAR };
+                    return BuildEnumeration (capability, TWTY_UINT16,
+                                             sizeof (layouts) / sizeof (TW_UINT16),
+                                             (cap_PlanarChunky == TWPC_CHUNKY ? 0 : 1), 0, layouts);
+                    break;
+                }
+
                 case MSG_GETCURRENT:
+
+                    return BuildOneValue (capability, TWTY_UINT16, cap_PlanarChunky);
+                    break;
+
                 case MSG_GETDEFAULT:
 
                     return BuildOneValue (capability, TWTY_UINT16, TWPC_CHUNKY);
                     break;
 
+                case MSG_SET:
+
+                    if (capability->ConType != TWON_ONEVALUE) return SetStatus (TWCC_BADVALUE);
+                    if (((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWPC_CHUNKY &&
+                        ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item != TWPC_PLANAR)
+                        return SetStatus (TWCC_BADVALUE);
+                    cap_PlanarChunky = ((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item;
+                    return TWRC_SUCCESS;
+                    break;
+
+                case MSG_RESET:
+
+                    cap_PlanarChunky = TWPC_CHUNKY;
+                    return BuildOneValue (capability, TWTY_UINT16, cap_PlanarChunky);
+                    break;
+
                 case MSG_QUERYSUPPORT:
 
-                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET |
-                                          TWQC_GETDEFAULT | TWQC_GETCURRENT);
+                    return BuildOneValue (capability, TWTY_INT32, TWQC_GET | TWQC_SET |
+                                          TWQC_GETDEFAULT | TWQC_GETCURRENT | TWQC_RESET);
                     break;
 
                 default:
-
-                    return SetStatus (TWCC_CAPBADOPERATION);
+                    // All cases handled
                     break;
             }
 
@@ -873,13 +1320,19 @@ TW_UINT16 DataSource::Capability (TW_UINT16 MSG, pTW_CAPABILITY capability) {
                     return sanedevice->GetBitDepthDefault (capability);
                     break;
 
-                case MSG_SET:
+                case MSG_SET: {
 
-                    return sanedevice->SetBitDepth (capability);
+                    TW_UINT16 result = sanedevice->SetBitDepth (capability);
+                    // Samples are only transferred at 16 bits to applications that ask for it
+                    if (result != TWRC_FAILURE)
+                        cap_FullDepth = (((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item == 16);
+                    return result;
                     break;
+                }
 
                 case MSG_RESET:
 
+                    cap_FullDepth = false;
                     return sanedevice->SetBitDepth (NULL);
                     break;
 
@@ -910,26 +1363,16 @@ TW_UINT16 DataSource::Identity (TW_UINT16 MSG, pTW_IDENTITY identity) {
 
             if (state < STATE_3 || state > STATE_7) return SetStatus (TWCC_SEQERROR);
 
-            CFStringRef text;
-
-            CFBundleRef bundle;
-            bundle = CFBundleGetBundleWithIdentifier (BNDLNAME);
-
             UInt32 version;
-            version = CFBundleGetVersionNumber (bundle);
+            version = BundleVersionNumber ();
             identity->Version.MajorNum =
                 10 * ((version & 0xF0000000) >> 28) + ((version & 0x0F000000) >> 24);
             identity->Version.MinorNum = (version & 0x00F00000) >> 20;
 
-            text = CFBundleCopyLocalizedString (bundle, CFSTR ("twain-language"), NULL, NULL);
-            identity->Version.Language = CFStringGetIntValue (text);
-            CFRelease (text);
-            text = CFBundleCopyLocalizedString (bundle, CFSTR ("twain-country"), NULL, NULL);
-            identity->Version.Country = CFStringGetIntValue (text);
-            CFRelease (text);
+            identity->Version.Language = atoi (LocalizedString ("twain-language").c_str ());
+            identity->Version.Country = atoi (LocalizedString ("twain-country").c_str ());
 
-            text = (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, CFSTR ("CFBundleVersion"));
-            CFStringGetPascalString (text, identity->Version.Info, sizeof (TW_STR32), kCFStringEncodingASCII);
+            SetTwainString (identity->Version.Info, BundleVersionString ().substr (0, sizeof (TW_STR32) - 2).c_str ());
 
             identity->ProtocolMajor = TWON_PROTOCOLMAJOR;
             identity->ProtocolMinor = TWON_PROTOCOLMINOR;
@@ -939,9 +1382,9 @@ TW_UINT16 DataSource::Identity (TW_UINT16 MSG, pTW_IDENTITY identity) {
             // ... or the TWAINBridge used by Image Capture will refuse to use the interface
             // According to the TWAIN standard any string is localizable (using the locale’s default encoding)
             // ... but I guess Apple doesn’t read the standard the same way I do
-            strcpy ((char *) identity->Manufacturer, (char *) "\pMattias Ellert");
-            strcpy ((char *) identity->ProductFamily, (char *) "\pSANE");
-            strcpy ((char *) identity->ProductName, (char *) "\pSANE"); // This one is in the DeviceInfo.plist file
+            SetTwainString (identity->Manufacturer, "Mattias Ellert");
+            SetTwainString (identity->ProductFamily, "SANE");
+            SetTwainString (identity->ProductName, "SANE"); // This one is in the DeviceInfo.plist file
 
             return TWRC_SUCCESS;
             break;
@@ -953,7 +1396,7 @@ TW_UINT16 DataSource::Identity (TW_UINT16 MSG, pTW_IDENTITY identity) {
             if (!sanedevice) return SetStatus (TWCC_LOWMEMORY);
             if (!sanedevice->GetSaneHandle ()) {
                 // Don’t put up the No Device alert when called from TWAINBridge
-                if (!origin || strncasecmp ((char *) origin->ProductName, (char *) "\pTWAINBridge", 12) != 0)
+                if (!origin || !EqualTwainString (origin->ProductName, "TWAINBridge"))
                     NoDevice ();
                 delete sanedevice;
                 sanedevice = NULL;
@@ -966,9 +1409,12 @@ TW_UINT16 DataSource::Identity (TW_UINT16 MSG, pTW_IDENTITY identity) {
         case MSG_CLOSEDS:
 
             if (state != STATE_4) return SetStatus (TWCC_SEQERROR);
+            EndFileJob ();
             if (sanedevice) delete sanedevice;
             sanedevice = NULL;
             state = STATE_3;
+            TraceFlush ();
+            MemoryFlush ();
             return TWRC_SUCCESS;
             break;
 
@@ -987,12 +1433,19 @@ TW_UINT16 DataSource::PendingXfers (TW_UINT16 MSG, pTW_PENDINGXFERS pendingxfers
         case MSG_ENDXFER:
 
             if (state < STATE_6 || state > STATE_7) return SetStatus (TWCC_SEQERROR);
-            if (state == STATE_7) sanedevice->DequeueImage ();
+            if (state == STATE_7) {
+                xferbytes += ImageBytes (sanedevice->GetImage ());
+                xferseconds += (MonotonicNanoseconds () - xferstart) / 1e9;
+                sanedevice->DequeueImage ();
+            }
             pendingxfers->Count = (sanedevice->GetImage () ? 1 : 0);
             if (pendingxfers->Count != 0)
                 state = STATE_6;
-            else
+            else {
+                // The last page is in, so the application can open the multi-page file now
+                EndFileJob ();
                 state = STATE_5;
+            }
             return TWRC_SUCCESS;
             break;
 
@@ -1007,6 +1460,7 @@ TW_UINT16 DataSource::PendingXfers (TW_UINT16 MSG, pTW_PENDINGXFERS pendingxfers
 
             if (state != STATE_6) return SetStatus (TWCC_SEQERROR);
             pendingxfers->Count = 0;
+            EndFileJob ();
             state = STATE_5;
             return TWRC_SUCCESS;
             break;
@@ -1033,7 +1487,65 @@ TW_UINT16 DataSource::SetupMemXfer (TW_UINT16 MSG, pTW_SETUPMEMXFER setupmemxfer
                 return TWRC_SUCCESS;
             }
             else
-                return sanedevice->GetImage()->TwainSetupMemXfer (setupmemxfer);
+                return GetImage ()->TwainSetupMemXfer (setupmemxfer);
+            break;
+
+        default:
+
+            return SetStatus (TWCC_BADPROTOCOL);
+            break;
+    }
+}
+
+
+TW_UINT16 DataSource::SetupFileXfer (TW_UINT16 MSG, pTW_SETUPFILEXFER setupfilexfer) {
+
+    switch (MSG) {
+
+        case MSG_GET:
+
+            if (state < STATE_4 || state > STATE_6) return SetStatus (TWCC_SEQERROR);
+            SetTwainString (setupfilexfer->FileName, fileName.c_str ());
+            setupfilexfer->Format = cap_ImageFileFormat;
+            setupfilexfer->VRefNum = 0;
+            return TWRC_SUCCESS;
+            break;
+
+        case MSG_GETDEFAULT:
+
+            if (state < STATE_4 || state > STATE_6) return SetStatus (TWCC_SEQERROR);
+            SetTwainString (setupfilexfer->FileName, "TWAIN.TMP");
+            setupfilexfer->Format = TWFF_TIFF;
+            setupfilexfer->VRefNum = 0;
+            return TWRC_SUCCESS;
+            break;
+
+        case MSG_SET:
+
+            // The volume reference number has no meaning here, the name is a path
+            if (state < STATE_4 || state > STATE_6) return SetStatus (TWCC_SEQERROR);
+            if (!ImageWriter::Supported (setupfilexfer->Format)) return SetStatus (TWCC_BADVALUE);
+            {
+                // A new file name starts a new multi-page TIFF
+                std::string name = GetTwainString (setupfilexfer->FileName);
+                if (name.empty ()) name = "TWAIN.TMP";
+                if (name != fileName || setupfilexfer->Format != cap_ImageFileFormat) EndFileJob ();
+                fileName = name;
+            }
+            cap_ImageFileFormat = setupfilexfer->Format;
+            return TWRC_SUCCESS;
+            break;
+
+        case MSG_RESET:
+
+            if (state < STATE_4 || state > STATE_6) return SetStatus (TWCC_SEQERROR);
+            EndFileJob ();
+            fileName = "TWAIN.TMP";
+            cap_ImageFileFormat = TWFF_TIFF;
+            SetTwainString (setupfilexfer->FileName, fileName.c_str ());
+            setupfilexfer->Format = cap_ImageFileFormat;
+            setupfilexfer->VRefNum = 0;
+            return TWRC_SUCCESS;
             break;
 
         default:
@@ -1072,6 +1584,8 @@ TW_UINT16 DataSource::UserInterface (TW_UINT16 MSG, pTW_USERINTERFACE userinterf
         case MSG_DISABLEDS:
 
             if (state != STATE_5) return SetStatus (TWCC_SEQERROR);
+            EndFileJob ();
+            ReportBlankPages ();
             sanedevice->HideUI ();
             state = STATE_4;
             return TWRC_SUCCESS;
@@ -1081,6 +1595,8 @@ TW_UINT16 DataSource::UserInterface (TW_UINT16 MSG, pTW_USERINTERFACE userinterf
 
             if (state != STATE_4) return SetStatus (TWCC_SEQERROR);
             uionly = false;
+            // Without a user interface the scan starts right away
+            if (!sanedevice->CanShowUI ()) userinterface->ShowUI = false;
             if (userinterface->ShowUI) {
                 sanedevice->ShowUI (uionly);
                 userinterface->ModalUI = false;
@@ -1089,8 +1605,11 @@ TW_UINT16 DataSource::UserInterface (TW_UINT16 MSG, pTW_USERINTERFACE userinterf
             if (!userinterface->ShowUI) {
                 if (sanedevice->Scan (true, indicators))
                     CallBack (MSG_XFERREADY);
-                else
+                else {
+                    // A failed MSG_ENABLEDS leaves the source in state 4
+                    state = STATE_4;
                     return SetStatus (TWCC_OPERATIONERROR);
+                }
             }
             return TWRC_SUCCESS;
             break;
@@ -1098,6 +1617,7 @@ TW_UINT16 DataSource::UserInterface (TW_UINT16 MSG, pTW_USERINTERFACE userinterf
         case MSG_ENABLEDSUIONLY:
 
             if (state != STATE_4) return SetStatus (TWCC_SEQERROR);
+            if (!sanedevice->CanShowUI ()) return SetStatus (TWCC_BADPROTOCOL);
             uionly = true;
             sanedevice->ShowUI (uionly);
             userinterface->ModalUI = false;
@@ -1170,7 +1690,7 @@ TW_UINT16 DataSource::ImageInfo (TW_UINT16 MSG, pTW_IMAGEINFO imageinfo) {
         case MSG_GET:
 
             if (state < STATE_6 || state > STATE_7) return SetStatus (TWCC_SEQERROR);
-            return sanedevice->GetImage()->TwainImageInfo (imageinfo);
+            return GetImage ()->TwainImageInfo (imageinfo);
             break;
 
         default:
@@ -1208,17 +1728,56 @@ TW_UINT16 DataSource::ImageLayout (TW_UINT16 MSG, pTW_IMAGELAYOUT imagelayout) {
 
 TW_UINT16 DataSource::ImageMemXfer (TW_UINT16 MSG, pTW_IMAGEMEMXFER imagememxfer) {
 
+    TraceScope trace ("twain", "ImageMemXfer");
+
     switch (MSG) {
 
         case MSG_GET:
 
             if (state < STATE_6 || state > STATE_7) return SetStatus (TWCC_SEQERROR);
             if (state == STATE_6) {
+                // The rows of an image that was transferred before may be gone
+                if (sanedevice->GetImage ()->IsReleased ()) return SetStatus (TWCC_SEQERROR);
                 state = STATE_7;
                 writtenlines = 0;
+                // The image is dequeued after this transfer, the application has its own copy
+                GetImage ()->ReleaseTransferredRows ();
             }
-            return sanedevice->GetImage()->TwainImageMemXfer (imagememxfer, &writtenlines);
+            // Until MSG_ENDXFER, starting over would read the released rows
+            else if (GetImage ()->IsTransferDone (writtenlines)) return SetStatus (TWCC_SEQERROR);
+            return GetImage ()->TwainImageMemXfer (imagememxfer, &writtenlines);
+            break;
+
+        default:
+
+            return SetStatus (TWCC_BADPROTOCOL);
+            break;
+    }
+}
+
+
+TW_UINT16 DataSource::ImageFileXfer (TW_UINT16 MSG) {
+
+    TraceScope trace ("twain", "ImageFileXfer");
+
+    switch (MSG) {
+
+        case MSG_GET: {
+
+            if (state != STATE_6 || cap_XferMech != TWSX_FILE) return SetStatus (TWCC_SEQERROR);
+            if (!sanedevice->GetImage ()) return SetStatus (TWCC_SEQERROR);
+            if (sanedevice->GetImage ()->IsReleased ()) return SetStatus (TWCC_SEQERROR);
+            FileJob * job = NULL;
+            if (FileJob::MultiPage (cap_ImageFileFormat) && !(job = GetFileJob ()))
+                return SetStatus (TWCC_OPERATIONERROR);
+            TW_UINT16 status = TWCC_SUCCESS;
+            TW_UINT16 retval = GetImage ()->TwainImageFileXfer (fileName, cap_ImageFileFormat, cap_Compression,
+                                                                cap_JpegQuality, job, &status);
+            if (retval != TWRC_XFERDONE) return SetStatus (status);
+            state = STATE_7;
+            return TWRC_XFERDONE;
             break;
+        }
 
         default:
 
@@ -1228,7 +1787,9 @@ TW_UINT16 DataSource::ImageMemXfer (TW_UINT16 MSG, pTW_IMAGEMEMXFER imagememxfer
 }
 
 
-TW_UINT16 DataSource::ImageNativeXfer (TW_UINT16 MSG, pTW_UINT32 handle) {
+TW_UINT16 DataSource::ImageNativeXfer (TW_UINT16 MSG, Handle * handle) {
+
+    TraceScope trace ("twain", "ImageNativeXfer");
 
     switch (MSG) {
 
@@ -1236,7 +1797,16 @@ TW_UINT16 DataSource::ImageNativeXfer (TW_UINT16 MSG, pTW_UINT32 handle) {
 
             if (state != STATE_6) return SetStatus (TWCC_SEQERROR);
             if (!sanedevice->GetImage ()) return SetStatus (TWCC_SEQERROR);
-            *handle = (TW_UINT32) sanedevice->GetImage ()->MakePict ();
+            if (sanedevice->GetImage ()->IsReleased ()) return SetStatus (TWCC_SEQERROR);
+            // The TIFF has the bit depth the application negotiated, as in DAT_IMAGEINFO
+            if (cap_NativeFormat == TWFF_TIFF)
+                *handle = GetImage ()->MakeTiff ();
+            else
+                *handle = (Handle) sanedevice->GetImage ()->MakePict ();
+            // Out of memory, or too large for a PICT (32767 pixels) or a TIFF (4 GB)
+            if (!*handle) return SetStatus (TWCC_LOWMEMORY);
+            // The application owns the picture from here on
+            MemoryReleased (MEMORY_PICT, GetHandleSize (*handle));
             state = STATE_7;
             return TWRC_XFERDONE;
             break;
@@ -1249,6 +1819,14 @@ TW_UINT16 DataSource::ImageNativeXfer (TW_UINT16 MSG, pTW_UINT32 handle) {
 }
 
 
+TW_UINT16 DataSource::DefaultNativeFormat () {
+
+    std::string format;
+    if (PreferenceGetString ("Native Format", format) && format == "TIFF") return TWFF_TIFF;
+    return TWFF_PICT;
+}
+
+
 TW_UINT16 DataSource::Palette8 (TW_UINT16 MSG, pTW_PALETTE8 palette8) {
 
     switch (MSG) {
@@ -1256,7 +1834,7 @@ TW_UINT16 DataSource::Palette8 (TW_UINT16 MSG, pTW_PALETTE8 palette8) {
         case MSG_GET:
 
             if (state < STATE_4 || state > STATE_6) return SetStatus (TWCC_SEQERROR);
-            return sanedevice->GetImage()->TwainPalette8 (palette8, &twainstatus);
+            return GetImage ()->TwainPalette8 (palette8, &twainstatus);
             break;
 
         default:
@@ -1267,6 +1845,126 @@ TW_UINT16 DataSource::Palette8 (TW_UINT16 MSG, pTW_PALETTE8 palette8) {
 }
 
 
+// The image to transfer, set up for the layout the application negotiated
+
+Image * DataSource::GetImage () {
+
+    Image * image = sanedevice->GetImage ();
+    if (image) image->SetTransferLayout (cap_PixelFlavor, cap_PlanarChunky, cap_FullDepth, GetMemoryCompression (),
+                                         cap_JpegQuality);
+    return image;
+}
+
+
+// The compression for memory transfers, so the scan can already encode while it reads
+
+TW_UINT16 DataSource::GetMemoryCompression () {
+
+    return (cap_XferMech == TWSX_MEMORY ? cap_Compression : TWCP_NONE);
+}
+
+
+TW_INT16 DataSource::GetJpegQuality () {
+
+    return cap_JpegQuality;
+}
+
+
+double DataSource::GetGamma () {
+
+    return cap_Gamma;
+}
+
+
+TW_UINT16 DataSource::GetBlankPageLimit () {
+
+    return cap_BlankPage;
+}
+
+
+// Drops the queued page while it is blank. A document feeder goes on to the next sheet, and
+// false is returned when no page is left.
+
+bool DataSource::DropBlankPages () {
+
+    while (cap_BlankPage) {
+        Image * image = sanedevice->GetImage ();
+        BlankPage * blankpage = (image ? image->GetBlankPage () : NULL);
+        if (!blankpage || !blankpage->IsBlank (cap_BlankPage)) break;
+
+        TraceInstant ("twain", "Blank page dropped, %.3f%% ink, deviation %.2f",
+                      blankpage->GetCoverage () * 100, blankpage->GetDeviation ());
+        blankpages++;
+        blankbytes += ImageBytes (image);
+        sanedevice->DequeueImage ();
+
+        if (!sanedevice->IsFeeder () || !sanedevice->Scan (true, indicators)) break;
+    }
+
+    return (sanedevice->GetImage () != NULL);
+}
+
+
+// What dropping blank pages saved while the source was enabled. The transfer time is estimated
+// from the rate of the pages transferred since the source was opened.
+
+void DataSource::ReportBlankPages () {
+
+    if (blankpages) {
+        double seconds = (xferbytes ? blankbytes * xferseconds / xferbytes : 0);
+        TraceInstant ("twain", "%d blank pages dropped, %.0f bytes and about %.3f s of transfers saved",
+                      blankpages, blankbytes, seconds);
+    }
+
+    blankpages = 0;
+    blankbytes = 0;
+}
+
+
+// Where a file transfer goes, so the scan can write the file while it reads
+
+bool DataSource::GetFileSetup (std::string & filename, TW_UINT16 * format, TW_UINT16 * compression,
+                               TW_INT16 * jpegquality, FileJob ** job) {
+
+    if (cap_XferMech != TWSX_FILE) return false;
+    filename = fileName;
+    *format = cap_ImageFileFormat;
+    *compression = cap_Compression;
+    *jpegquality = cap_JpegQuality;
+    *job = NULL;
+    if (FileJob::MultiPage (cap_ImageFileFormat) && !(*job = GetFileJob ())) return false;
+    return true;
+}
+
+
+// The multi-page TIFF or PDF the pages are added to, the file is created with its first page
+
+FileJob * DataSource::GetFileJob () {
+
+    if (!fileJob) {
+        fileJob = new FileJob (fileName, cap_ImageFileFormat);
+        if (!fileJob->IsOpen ()) {
+            delete fileJob;
+            fileJob = NULL;
+        }
+    }
+    return fileJob;
+}
+
+
+void DataSource::EndFileJob () {
+
+    if (!fileJob) return;
+
+    // A page written ahead into the job is written again if it is transferred after all
+    if (sanedevice && sanedevice->GetImage ()) sanedevice->GetImage ()->DiscardFileWriter ();
+
+    // A PDF gets its page tree and cross-reference table now
+    delete fileJob;
+    fileJob = NULL;
+}
+
+
 static const short ItemSize[] = {
     sizeof (TW_INT8),
     sizeof (TW_INT16),
@@ -1294,6 +1992,7 @@ TW_UINT16 DataSource::BuildArray (pTW_CAPABILITY capability, TW_UINT16 type,
     capability->hContainer = (TW_HANDLE) NewHandle (sizeof (TW_ARRAY) - sizeof (TW_UINT8) +
                                         numItems * ItemSize [type]);
     if (!capability->hContainer) return SetStatus (TWCC_LOWMEMORY);
+    CapabilityContainer ((Handle) capability->hContainer);
 
     capability->ConType = TWON_ARRAY;
 
@@ -1315,6 +2014,7 @@ TW_UINT16 DataSource::BuildEnumeration (pTW_CAPABILITY capability, TW_UINT16 typ
     capability->hContainer = (TW_HANDLE) NewHandle (sizeof (TW_ENUMERATION) - sizeof (TW_UINT8) +
                                         numItems * ItemSize [type]);
     if (!capability->hContainer) return SetStatus (TWCC_LOWMEMORY);
+    CapabilityContainer ((Handle) capability->hContainer);
 
     capability->ConType = TWON_ENUMERATION;
 
@@ -1335,6 +2035,7 @@ TW_UINT16 DataSource::BuildOneValue (pTW_CAPABILITY capability, TW_UINT16 type,
 
     capability->hContainer = (TW_HANDLE) NewHandle (sizeof (TW_ONEVALUE));
     if (!capability->hContainer) return SetStatus (TWCC_LOWMEMORY);
+    CapabilityContainer ((Handle) capability->hContainer);
 
     capability->ConType = TWON_ONEVALUE;
 
@@ -1352,6 +2053,7 @@ TW_UINT16 DataSource::BuildOneValue (pTW_CAPABILITY capability, TW_UINT16 type,
 
     capability->hContainer = (TW_HANDLE) NewHandle (sizeof (TW_ONEVALUE));
     if (!capability->hContainer) return SetStatus (TWCC_LOWMEMORY);
+    CapabilityContainer ((Handle) capability->hContainer);
 
     capability->ConType = TWON_ONEVALUE;
 
@@ -1371,6 +2073,7 @@ TW_UINT16 DataSource::BuildRange (pTW_CAPABILITY capability, TW_UINT16 type,
 
     capability->hContainer = (TW_HANDLE) NewHandle (sizeof(TW_RANGE));
     if (!capability->hContainer) return SetStatus (TWCC_LOWMEMORY);
+    CapabilityContainer ((Handle) capability->hContainer);
 
     capability->ConType = TWON_RANGE;
 
@@ -1394,6 +2097,7 @@ TW_UINT16 DataSource::BuildRange (pTW_CAPABILITY capability, TW_UINT16 type,
 
     capability->hContainer = (TW_HANDLE) NewHandle (sizeof(TW_RANGE));
     if (!capability->hContainer) return SetStatus (TWCC_LOWMEMORY);
+    CapabilityContainer ((Handle) capability->hContainer);
 
     capability->ConType = TWON_RANGE;
 
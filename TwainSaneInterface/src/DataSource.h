@@ -1,9 +1,24 @@
 #ifndef SANE_DS_DATASOURCE_H
 #define SANE_DS_DATASOURCE_H
 
-#include <TWAIN/TWAIN.h>
+#include "Platform.h"
+
+#include <cstdio>
+#include <string>
 
 class SaneDevice;
+class Image;
+class FileJob;
+
+// Custom capability for the payload of native transfers: a PICT (TWFF_PICT), or an uncompressed
+// TIFF (TWFF_TIFF) that is cheaper to make and to read. The "Native Format" preference, PICT or
+// TIFF, sets the default.
+#define ICAP_SANE_NATIVEFORMAT (CAP_CUSTOMBASE + 1)
+
+// Custom capability that drops blank pages before they are offered for transfer, such as the
+// empty backs of a duplex feeder job: the most ink a page may have to count as blank, in tenths
+// of a percent (0 to 1000). 0, the default, keeps every page.
+#define ICAP_SANE_BLANKPAGE (CAP_CUSTOMBASE + 2)
 
 class DataSource {
 
@@ -28,12 +43,19 @@ public:
                           TW_FIX32 step, TW_FIX32 defvalue, TW_FIX32 value);
     TW_UINT16 BuildOneValue (pTW_CAPABILITY capability, TW_UINT16 type, TW_UINT32 value);
     TW_UINT16 BuildOneValue (pTW_CAPABILITY capability, TW_UINT16 type, TW_FIX32 value);
+    TW_UINT16 GetMemoryCompression ();
+    TW_INT16 GetJpegQuality ();
+    double GetGamma ();
+    TW_UINT16 GetBlankPageLimit ();
+    bool GetFileSetup (std::string & filename, TW_UINT16 * format, TW_UINT16 * compression,
+                       TW_INT16 * jpegquality, FileJob ** job);
 
 private:
     TW_UINT16 Capability (TW_UINT16 MSG, pTW_CAPABILITY capability);
     TW_UINT16 Identity (TW_UINT16 MSG, pTW_IDENTITY identity);
     TW_UINT16 PendingXfers (TW_UINT16 MSG, pTW_PENDINGXFERS pendingxfers);
     TW_UINT16 SetupMemXfer (TW_UINT16 MSG, pTW_SETUPMEMXFER setupmemxfer);
+    TW_UINT16 SetupFileXfer (TW_UINT16 MSG, pTW_SETUPFILEXFER setupfilexfer);
     TW_UINT16 Status (TW_UINT16 MSG, pTW_STATUS status);
     TW_UINT16 UserInterface (TW_UINT16 MSG, pTW_USERINTERFACE userinterface);
     TW_UINT16 XferGroup (TW_UINT16 MSG, pTW_UINT32 xfergroup);
@@ -41,8 +63,15 @@ private:
     TW_UINT16 ImageInfo (TW_UINT16 MSG, pTW_IMAGEINFO imageinfo);
     TW_UINT16 ImageLayout (TW_UINT16 MSG, pTW_IMAGELAYOUT imagelayout);
     TW_UINT16 ImageMemXfer (TW_UINT16 MSG, pTW_IMAGEMEMXFER imagememxfer);
-    TW_UINT16 ImageNativeXfer (TW_UINT16 MSG, pTW_UINT32 handle);
+    TW_UINT16 ImageFileXfer (TW_UINT16 MSG);
+    TW_UINT16 ImageNativeXfer (TW_UINT16 MSG, Handle * handle);
     TW_UINT16 Palette8 (TW_UINT16 MSG, pTW_PALETTE8 palette8);
+    TW_UINT16 DefaultNativeFormat ();
+    Image * GetImage ();
+    FileJob * GetFileJob ();
+    void EndFileJob ();
+    bool DropBlankPages ();
+    void ReportBlankPages ();
 
     pTW_IDENTITY origin;
     SaneDevice * sanedevice;
@@ -57,10 +86,28 @@ private:
     } state;
 
     TW_UINT16 cap_XferMech;
+    TW_UINT16 cap_PixelFlavor;
+    TW_UINT16 cap_PlanarChunky;
+    bool cap_FullDepth;
+    TW_UINT16 cap_Compression;
+    TW_INT16 cap_JpegQuality;
+    TW_UINT16 cap_ImageFileFormat;
+    TW_UINT16 cap_NativeFormat;
+    double cap_Gamma;
+    TW_UINT16 cap_BlankPage;
+    std::string fileName;
+    FileJob * fileJob;
 
     TW_UINT32 writtenlines;
     bool uionly;
     bool indicators;
+
+    // Blank pages dropped while the source is enabled, and the pages transferred to compare
+    int blankpages;
+    double blankbytes;
+    double xferbytes;
+    double xferseconds;
+    unsigned long long xferstart;
 };
 
 #endif
@@ -0,0 +1,80 @@
+#include "Platform.h"
+
+#include "FileJob.h"
+#include "ImageWriter.h"
+#include "PdfWriter.h"
+#include "TiffWriter.h"
+
+
+FileJob::FileJob (const std::string & inpath, TW_UINT16 informat) : path (inpath),
+                                                                    file (NULL),
+                                                                    tiff (NULL),
+                                                                    pdf (NULL) {
+
+    file = fopen (path.c_str (), "w+b");
+    if (!file) return;
+    if (informat == TWFF_PDF)
+        pdf = new PdfWriter (file);
+    else
+        tiff = new TiffWriter (file);
+}
+
+
+FileJob::~FileJob () {
+
+    if (!file) return;
+
+    bool empty = (GetPages () == 0);
+    if (pdf) {
+        if (!empty) pdf->Finish ();
+        delete pdf;
+    }
+    if (tiff) delete tiff;
+    fclose (file);
+    if (empty) remove (path.c_str ());
+}
+
+
+bool FileJob::IsOpen () {
+
+    return (file != NULL);
+}
+
+
+TiffWriter * FileJob::GetTiff () {
+
+    return tiff;
+}
+
+
+PdfWriter * FileJob::GetPdf () {
+
+    return pdf;
+}
+
+
+bool FileJob::LinkPage () {
+
+    return (pdf ? pdf->LinkPage () : tiff->LinkPage ());
+}
+
+
+void FileJob::DropPage () {
+
+    if (pdf)
+        pdf->DropPage ();
+    else
+        tiff->DropPage ();
+}
+
+
+int FileJob::GetPages () {
+
+    return (pdf ? pdf->GetPages () : tiff ? tiff->GetPages () : 0);
+}
+
+
+bool FileJob::MultiPage (TW_UINT16 format) {
+
+    return (format == TWFF_TIFFMULTI || format == TWFF_PDF);
+}
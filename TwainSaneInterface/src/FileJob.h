@@ -0,0 +1,37 @@
+#ifndef SANE_DS_FILEJOB_H
+#define SANE_DS_FILEJOB_H
+
+#include "Platform.h"
+
+#include <cstdio>
+#include <string>
+
+class PdfWriter;
+class TiffWriter;
+
+// The file of a multi-page transfer, a TIFF or a PDF, which collects the pages transferred
+// while the source stays enabled. The file is completed when the job is deleted, and a job
+// that did not get any pages leaves no file behind.
+
+class FileJob {
+
+public:
+    FileJob (const std::string & inpath, TW_UINT16 informat);
+    ~FileJob ();
+    bool IsOpen ();
+    TiffWriter * GetTiff ();
+    PdfWriter * GetPdf ();
+    bool LinkPage ();
+    void DropPage ();
+    int GetPages ();
+
+    static bool MultiPage (TW_UINT16 format);
+
+private:
+    std::string path;
+    FILE * file;
+    TiffWriter * tiff;
+    PdfWriter * pdf;
+};
+
+#endif
@@ -0,0 +1,219 @@
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "FileWriter.h"
+#include "FileJob.h"
+#include "ImageWriter.h"
+#include "JpegEncoder.h"
+#include "Trace.h"
+
+
+// Enough to ride out a slow strip without holding up the scanner
+#define RING_SIZE 0x400000
+
+
+FileWriter::FileWriter (const std::string & inpath, TW_UINT16 informat, TW_UINT16 incompression,
+                        TW_INT16 injpegquality, const SANE_Parameters & inparam, const SANE_Resolution & inres,
+                        FileJob * injob) : temppath (inpath + ".part"),
+                                              format (informat),
+                                              compression (incompression),
+                                              jpegquality (injpegquality),
+                                              param (inparam),
+                                              res (inres),
+                                              job (injob),
+                                              file (NULL),
+                                              writer (NULL),
+                                              running (false),
+                                              written (false),
+                                              committed (false),
+                                              ring (std::max ((Size) RING_SIZE, (Size) 16 * inparam.bytes_per_line)),
+                                              head (0),
+                                              tail (0),
+                                              closed (false),
+                                              finished (false),
+                                              cancelled (false) {
+
+    pthread_mutex_init (&mutex, NULL);
+    pthread_cond_init (&readable, NULL);
+    pthread_cond_init (&writable, NULL);
+}
+
+
+FileWriter::~FileWriter () {
+
+    if (running) Cancel ();
+    if (writer) delete writer;
+    if (file) fclose (file);
+    if (!committed) {
+        if (job)
+            job->DropPage ();
+        else
+            remove (temppath.c_str ());
+    }
+
+    pthread_cond_destroy (&writable);
+    pthread_cond_destroy (&readable);
+    pthread_mutex_destroy (&mutex);
+}
+
+
+bool FileWriter::Start () {
+
+    if (!job) {
+        file = fopen (temppath.c_str (), "wb");
+        if (!file) return false;
+    }
+
+    writer = new ImageWriter (file, format, compression, jpegquality, param.pixels_per_line, param.lines,
+                              (param.format == SANE_FRAME_GRAY ? 1 : 3), param.depth, res, job);
+
+    if (pthread_create (&thread, NULL, Run, this) != 0) return false;
+    running = true;
+    return true;
+}
+
+
+void * FileWriter::Run (void * arg) {
+
+    ((FileWriter *) arg)->Encode ();
+    return NULL;
+}
+
+
+// The writer thread: one row at a time out of the ring, copied only when it wraps around
+void FileWriter::Encode () {
+
+    Size rowbytes = param.bytes_per_line;
+    Size size = ring.size ();
+    std::vector <char> wrapped (rowbytes);
+
+    for (int row = 0; row < param.lines; row++) {
+
+        pthread_mutex_lock (&mutex);
+        while (tail - head < rowbytes && !closed && !cancelled)
+            pthread_cond_wait (&readable, &mutex);
+        bool available = (!cancelled && tail - head >= rowbytes);
+        pthread_mutex_unlock (&mutex);
+        if (!available) break;
+
+        Size start = head % size;
+        const char * data = &ring [start];
+        if (start + rowbytes > size) {
+            memcpy (&wrapped [0], &ring [start], size - start);
+            memcpy (&wrapped [size - start], &ring [0], rowbytes - (size - start));
+            data = &wrapped [0];
+        }
+        writer->WriteRow ((const unsigned char *) data);
+
+        pthread_mutex_lock (&mutex);
+        head += rowbytes;
+        pthread_cond_signal (&writable);
+        pthread_mutex_unlock (&mutex);
+    }
+
+    // Anything the backend sends past the last row is dropped
+    pthread_mutex_lock (&mutex);
+    finished = true;
+    bool finish = !cancelled;
+    pthread_cond_signal (&writable);
+    pthread_mutex_unlock (&mutex);
+
+    if (finish) written = writer->Finish ();
+}
+
+
+// Called from the scan loop with what sane_read returned, waits while the ring is full
+void FileWriter::Write (const char * data, Size length) {
+
+    Size size = ring.size ();
+
+    while (length > 0) {
+
+        pthread_mutex_lock (&mutex);
+        while (tail - head == size && !finished && !cancelled)
+            pthread_cond_wait (&writable, &mutex);
+        bool stop = (finished || cancelled);
+        Size space = size - (tail - head);
+        pthread_mutex_unlock (&mutex);
+        if (stop) return;
+
+        Size start = tail % size;
+        Size chunk = std::min (length, std::min (space, size - start));
+        memcpy (&ring [start], data, chunk);
+
+        pthread_mutex_lock (&mutex);
+        tail += chunk;
+        pthread_cond_signal (&readable);
+        pthread_mutex_unlock (&mutex);
+
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+
+// The end of the scan, the writer finishes on its own
+void FileWriter::Close () {
+
+    pthread_mutex_lock (&mutex);
+    closed = true;
+    pthread_cond_signal (&readable);
+    pthread_mutex_unlock (&mutex);
+}
+
+
+bool FileWriter::Wait () {
+
+    if (running) {
+        TraceScope trace ("convert", "File wait");
+        Close ();
+        pthread_join (thread, NULL);
+        running = false;
+        delete writer;
+        writer = NULL;
+        if (file && fclose (file) != 0) written = false;
+        file = NULL;
+    }
+    return written;
+}
+
+
+void FileWriter::Cancel () {
+
+    pthread_mutex_lock (&mutex);
+    cancelled = true;
+    pthread_cond_broadcast (&readable);
+    pthread_cond_broadcast (&writable);
+    pthread_mutex_unlock (&mutex);
+
+    pthread_join (thread, NULL);
+    running = false;
+}
+
+
+// Whether the file being written is what the transfer asks for
+bool FileWriter::Matches (TW_UINT16 informat, TW_UINT16 incompression, TW_INT16 injpegquality,
+                          FileJob * injob) {
+
+    int samples = (param.format == SANE_FRAME_GRAY ? 1 : 3);
+    return (informat == format && injob == job &&
+            ImageWriter::FileCompression (informat, incompression, samples, param.depth) ==
+            ImageWriter::FileCompression (format, compression, samples, param.depth) &&
+            (format != TWFF_JFIF || JpegEncoder::Quality (injpegquality) == JpegEncoder::Quality (jpegquality)));
+}
+
+
+// Moves the file into place, or adds the page to the job
+bool FileWriter::Commit (const std::string & target) {
+
+    if (!Wait ()) return false;
+    if (job)
+        committed = job->LinkPage ();
+    else
+        committed = (rename (temppath.c_str (), target.c_str ()) == 0);
+    return committed;
+}
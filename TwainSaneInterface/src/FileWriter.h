@@ -0,0 +1,71 @@
+#ifndef SANE_DS_FILEWRITER_H
+#define SANE_DS_FILEWRITER_H
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <pthread.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "SaneDevice.h"
+
+class ImageWriter;
+class FileJob;
+
+// Writes a file transfer while the image is being scanned. The scan loop copies what
+// sane_read returns into a ring, and a thread of its own takes the rows out of the ring
+// and encodes them into a file next to the one the application asked for. When the
+// transfer comes, the file only needs to be finished and moved into place. A page of a
+// multi-page TIFF or PDF is written into the job's file instead, and linked into it at the
+// transfer.
+
+class FileWriter {
+
+public:
+    FileWriter (const std::string & inpath, TW_UINT16 informat, TW_UINT16 incompression,
+                TW_INT16 injpegquality, const SANE_Parameters & inparam, const SANE_Resolution & inres,
+                FileJob * injob = NULL);
+    ~FileWriter ();
+    bool Start ();
+    void Write (const char * data, Size length);
+    void Close ();
+    bool Wait ();
+    bool Matches (TW_UINT16 informat, TW_UINT16 incompression, TW_INT16 injpegquality, FileJob * injob);
+    bool Commit (const std::string & target);
+
+private:
+    static void * Run (void * arg);
+    void Encode ();
+    void Cancel ();
+
+    std::string temppath;
+    TW_UINT16 format;
+    TW_UINT16 compression;
+    TW_INT16 jpegquality;
+    SANE_Parameters param;
+    SANE_Resolution res;
+    FileJob * job;
+
+    FILE * file;
+    ImageWriter * writer;
+    pthread_t thread;
+    bool running;
+    bool written;
+    bool committed;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+    std::vector <char> ring;
+    Size head;
+    Size tail;
+    bool closed;
+    bool finished;
+    bool cancelled;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "Platform.h"
+
+#include <cstring>
+
+#include "Group4.h"
+
+
+struct Group4Code {
+    unsigned short code;
+    unsigned char length;
+};
+
+// T.4 terminating codes for runs of 0 to 63
+static const Group4Code whiteTerminating [64] = {
+    { 0x35, 8 }, { 0x07, 6 }, { 0x07, 4 }, { 0x08, 4 }, { 0x0B, 4 }, { 0x0C, 4 }, { 0x0E, 4 }, { 0x0F, 4 },
+    { 0x13, 5 }, { 0x14, 5 }, { 0x07, 5 }, { 0x08, 5 }, { 0x08, 6 }, { 0x03, 6 }, { 0x34, 6 }, { 0x35, 6 },
+    { 0x2A, 6 }, { 0x2B, 6 }, { 0x27, 7 }, { 0x0C, 7 }, { 0x08, 7 }, { 0x17, 7 }, { 0x03, 7 }, { 0x04, 7 },
+    { 0x28, 7 }, { 0x2B, 7 }, { 0x13, 7 }, { 0x24, 7 }, { 0x18, 7 }, { 0x02, 8 }, { 0x03, 8 }, { 0x1A, 8 },
+    { 0x1B, 8 }, { 0x12, 8 }, { 0x13, 8 }, { 0x14, 8 }, { 0x15, 8 }, { 0x16, 8 }, { 0x17, 8 }, { 0x28, 8 },
+    { 0x29, 8 }, { 0x2A, 8 }, { 0x2B, 8 }, { 0x2C, 8 }, { 0x2D, 8 }, { 0x04, 8 }, { 0x05, 8 }, { 0x0A, 8 },
+    { 0x0B, 8 }, { 0x52, 8 }, { 0x53, 8 }, { 0x54, 8 }, { 0x55, 8 }, { 0x24, 8 }, { 0x25, 8 }, { 0x58, 8 },
+    { 0x59, 8 }, { 0x5A, 8 }, { 0x5B, 8 }, { 0x4A, 8 }, { 0x4B, 8 }, { 0x32, 8 }, { 0x33, 8 }, { 0x34, 8 }
+};
+
+static const Group4Code blackTerminating [64] = {
+    { 0x37, 10 }, { 0x02, 3 }, { 0x03, 2 }, { 0x02, 2 }, { 0x03, 3 }, { 0x03, 4 }, { 0x02, 4 }, { 0x03, 5 },
+    { 0x05, 6 }, { 0x04, 6 }, { 0x04, 7 }, { 0x05, 7 }, { 0x07, 7 }, { 0x04, 8 }, { 0x07, 8 }, { 0x18, 9 },
+    { 0x17, 10 }, { 0x18, 10 }, { 0x08, 10 }, { 0x67, 11 }, { 0x68, 11 }, { 0x6C, 11 }, { 0x37, 11 }, { 0x28, 11 },
+    { 0x17, 11 }, { 0x18, 11 }, { 0xCA, 12 }, { 0xCB, 12 }, { 0xCC, 12 }, { 0xCD, 12 }, { 0x68, 12 }, { 0x69, 12 },
+    { 0x6A, 12 }, { 0x6B, 12 }, { 0xD2, 12 }, { 0xD3, 12 }, { 0xD4, 12 }, { 0xD5, 12 }, { 0xD6, 12 }, { 0xD7, 12 },
+    { 0x6C, 12 }, { 0x6D, 12 }, { 0xDA, 12 }, { 0xDB, 12 }, { 0x54, 12 }, { 0x55, 12 }, { 0x56, 12 }, { 0x57, 12 },
+    { 0x64, 12 }, { 0x65, 12 }, { 0x52, 12 }, { 0x53, 12 }, { 0x24, 12 }, { 0x37, 12 }, { 0x38, 12 }, { 0x27, 12 },
+    { 0x28, 12 }, { 0x58, 12 }, { 0x59, 12 }, { 0x2B, 12 }, { 0x2C, 12 }, { 0x5A, 12 }, { 0x66, 12 }, { 0x67, 12 }
+};
+
+// Make-up codes for runs of 64 to 1728, in steps of 64
+static const Group4Code whiteMakeUp [27] = {
+    { 0x1B, 5 }, { 0x12, 5 }, { 0x17, 6 }, { 0x37, 7 }, { 0x36, 8 }, { 0x37, 8 }, { 0x64, 8 }, { 0x65, 8 },
+    { 0x68, 8 }, { 0x67, 8 }, { 0xCC, 9 }, { 0xCD, 9 }, { 0xD2, 9 }, { 0xD3, 9 }, { 0xD4, 9 }, { 0xD5, 9 },
+    { 0xD6, 9 }, { 0xD7, 9 }, { 0xD8, 9 }, { 0xD9, 9 }, { 0xDA, 9 }, { 0xDB, 9 }, { 0x98, 9 }, { 0x99, 9 },
+    { 0x9A, 9 }, { 0x18, 6 }, { 0x9B, 9 }
+};
+
+static const Group4Code blackMakeUp [27] = {
+    { 0x0F, 10 }, { 0xC8, 12 }, { 0xC9, 12 }, { 0x5B, 12 }, { 0x33, 12 }, { 0x34, 12 }, { 0x35, 12 }, { 0x6C, 13 },
+    { 0x6D, 13 }, { 0x4A, 13 }, { 0x4B, 13 }, { 0x4C, 13 }, { 0x4D, 13 }, { 0x72, 13 }, { 0x73, 13 }, { 0x74, 13 },
+    { 0x75, 13 }, { 0x76, 13 }, { 0x77, 13 }, { 0x52, 13 }, { 0x53, 13 }, { 0x54, 13 }, { 0x55, 13 }, { 0x5A, 13 },
+    { 0x5B, 13 }, { 0x64, 13 }, { 0x65, 13 }
+};
+
+// Make-up codes for runs of 1792 to 2560, the same for both colours
+static const Group4Code extendedMakeUp [13] = {
+    { 0x08, 11 }, { 0x0C, 11 }, { 0x0D, 11 }, { 0x12, 12 }, { 0x13, 12 }, { 0x14, 12 }, { 0x15, 12 },
+    { 0x16, 12 }, { 0x17, 12 }, { 0x1C, 12 }, { 0x1D, 12 }, { 0x1E, 12 }, { 0x1F, 12 }
+};
+
+// Vertical mode for a1 - b1 from -3 to 3
+static const Group4Code vertical [7] = {
+    { 0x02, 7 }, { 0x02, 6 }, { 0x02, 3 }, { 0x01, 1 }, { 0x03, 3 }, { 0x03, 6 }, { 0x03, 7 }
+};
+
+static const Group4Code pass = { 0x01, 4 };
+static const Group4Code horizontal = { 0x01, 3 };
+
+
+static inline int Pixel (const unsigned char * row, int x, int width) {
+
+    if (x >= width) return 0;
+    return (row [x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+
+// The first position from start on whose pixel is not colour, or width if there is none
+
+static int FindChange (const unsigned char * row, int start, int width, int color) {
+
+    if (start >= width) return width;
+
+    unsigned char flip = (color ? 0xFF : 0x00);
+    int x = start & ~7;
+    unsigned char bits = (row [x >> 3] ^ flip) & (0xFF >> (start & 7));
+    while (!bits) {
+        x += 8;
+        if (x >= width) return width;
+        bits = row [x >> 3] ^ flip;
+    }
+    x += __builtin_clz (bits) - 24;
+    return (x < width ? x : width);
+}
+
+
+Group4Encoder::Group4Encoder (Ptr indest, Size insize, int inwidth) : dest ((unsigned char *) indest),
+                                                                      size (insize),
+                                                                      used (0),
+                                                                      bitbuffer (0),
+                                                                      bitcount (0),
+                                                                      width (inwidth),
+                                                                      reference ((inwidth + 7) / 8, 0) {}
+
+
+bool Group4Encoder::HasRoom () {
+
+    return (used + WorstRow (width) + Trailer () <= size);
+}
+
+
+void Group4Encoder::PutBits (unsigned int bits, int length) {
+
+    bitbuffer = (bitbuffer << length) | bits;
+    bitcount += length;
+    while (bitcount >= 8) {
+        bitcount -= 8;
+        dest [used++] = (unsigned char) (bitbuffer >> bitcount);
+    }
+}
+
+
+void Group4Encoder::PutRun (int run, bool black) {
+
+    while (run >= 2560 + 64) {
+        PutBits (extendedMakeUp [12].code, extendedMakeUp [12].length);
+        run -= 2560;
+    }
+    if (run >= 1792) {
+        const Group4Code & code = extendedMakeUp [(run - 1792) / 64];
+        PutBits (code.code, code.length);
+        run %= 64;
+    }
+    else if (run >= 64) {
+        const Group4Code & code = (black ? blackMakeUp : whiteMakeUp) [run / 64 - 1];
+        PutBits (code.code, code.length);
+        run %= 64;
+    }
+    const Group4Code & code = (black ? blackTerminating : whiteTerminating) [run];
+    PutBits (code.code, code.length);
+}
+
+
+void Group4Encoder::EncodeRow (const unsigned char * row) {
+
+    const unsigned char * ref = &reference [0];
+
+    int a0 = 0;
+    int a1 = (Pixel (row, 0, width) ? 0 : FindChange (row, 0, width, 0));
+    int b1 = (Pixel (ref, 0, width) ? 0 : FindChange (ref, 0, width, 0));
+
+    for (;;) {
+        int b2 = (b1 < width ? FindChange (ref, b1, width, Pixel (ref, b1, width)) : width);
+        if (b2 < a1) {
+            PutBits (pass.code, pass.length);
+            a0 = b2;
+        }
+        else if (a1 - b1 >= -3 && a1 - b1 <= 3) {
+            PutBits (vertical [a1 - b1 + 3].code, vertical [a1 - b1 + 3].length);
+            a0 = a1;
+        }
+        else {
+            int a2 = (a1 < width ? FindChange (row, a1, width, Pixel (row, a1, width)) : width);
+            bool black = (a0 + a1 != 0 && Pixel (row, a0, width));
+            PutBits (horizontal.code, horizontal.length);
+            PutRun (a1 - a0, black);
+            PutRun (a2 - a1, !black);
+            a0 = a2;
+        }
+        if (a0 >= width) break;
+
+        int color = Pixel (row, a0, width);
+        a1 = FindChange (row, a0, width, color);
+        b1 = FindChange (ref, a0, width, !color);
+        b1 = FindChange (ref, b1, width, color);
+    }
+
+    memcpy (&reference [0], row, reference.size ());
+}
+
+
+Size Group4Encoder::Finish () {
+
+    // EOFB is two EOL codes
+    PutBits (0x001, 12);
+    PutBits (0x001, 12);
+    if (bitcount) PutBits (0, 8 - bitcount);
+    return used;
+}
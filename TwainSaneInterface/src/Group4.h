@@ -0,0 +1,38 @@
+#ifndef SANE_DS_GROUP4_H
+#define SANE_DS_GROUP4_H
+
+#include "Platform.h"
+
+#include <vector>
+
+// CCITT Group 4 (T.6) encoder for bitonal rows with set bits for black, as SANE delivers them.
+// Each encoder makes one self-contained block, starting from an all white reference row and
+// ending with EOFB, so every memory transfer buffer can be decoded on its own.
+
+class Group4Encoder {
+
+public:
+    Group4Encoder (Ptr indest, Size insize, int inwidth);
+    bool HasRoom ();
+    void EncodeRow (const unsigned char * row);
+    Size Finish ();
+
+    // The longest a row can get, 7 bits per pixel for vertical mode plus the first code
+    static Size WorstRow (int width) { return (7 * (Size) width + 7) / 8 + 2; }
+    // EOFB and the final byte
+    static Size Trailer () { return 4; }
+
+private:
+    void PutBits (unsigned int bits, int length);
+    void PutRun (int run, bool black);
+
+    unsigned char * dest;
+    Size size;
+    Size used;
+    unsigned int bitbuffer;
+    int bitcount;
+    int width;
+    std::vector <unsigned char> reference;
+};
+
+#endif
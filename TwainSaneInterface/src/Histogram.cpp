@@ -0,0 +1,520 @@
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define HISTOGRAM_NEON
+#endif
+
+#include "Histogram.h"
+
+
+// The partial tables are 32 bit, and are added to the counts before any bin could overflow.
+// The sums of squares of as many 16 bit samples also still fit in 64 bits.
+#define PARTIAL_LIMIT 0x40000000
+
+
+static inline unsigned int Sample16 (const unsigned char * data, Size i) {
+
+    UInt16 sample;
+    memcpy (&sample, &data [2 * i], 2);
+    return sample;
+}
+
+
+static UInt64 CountBits (const unsigned char * data, Size length) {
+
+    UInt64 bits = 0;
+    Size i = 0;
+
+#if defined (__SSE2__)
+    // Bits of each byte by halving, summed across the bytes by psadbw
+    const __m128i m1 = _mm_set1_epi8 (0x55);
+    const __m128i m2 = _mm_set1_epi8 (0x33);
+    const __m128i m4 = _mm_set1_epi8 (0x0F);
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (data + i));
+        v = _mm_sub_epi8 (v, _mm_and_si128 (_mm_srli_epi16 (v, 1), m1));
+        v = _mm_add_epi8 (_mm_and_si128 (v, m2), _mm_and_si128 (_mm_srli_epi16 (v, 2), m2));
+        v = _mm_and_si128 (_mm_add_epi8 (v, _mm_srli_epi16 (v, 4)), m4);
+        __m128i total = _mm_sad_epu8 (v, _mm_setzero_si128 ());
+        bits += _mm_cvtsi128_si32 (total) + _mm_cvtsi128_si32 (_mm_srli_si128 (total, 8));
+    }
+#elif defined (HISTOGRAM_NEON)
+    for (; i + 16 <= length; i += 16) {
+        uint64x2_t total = vpaddlq_u32 (vpaddlq_u16 (vpaddlq_u8 (vcntq_u8 (vld1q_u8 (data + i)))));
+        bits += vgetq_lane_u64 (total, 0) + vgetq_lane_u64 (total, 1);
+    }
+#endif
+
+    for (; i < length; i++) {
+        unsigned char byte = data [i];
+        while (byte) {
+            byte &= byte - 1;
+            bits++;
+        }
+    }
+    return bits;
+}
+
+
+// Sum, sum of squares, minimum and maximum of 16 bit samples of one channel, and the samples
+// below the middle
+static void SumSamples (const unsigned char * data, Size samples, UInt64 & sum, UInt64 & squares, UInt64 & ink,
+                        unsigned int & min, unsigned int & max) {
+
+    Size i = 0;
+
+#if defined (__SSE2__)
+    // SSE2 compares and multiplies signed words, so the samples are taken less 32768 and the
+    // sums put right at the end. The square of a pair is at most 2^31, exact as unsigned.
+    if (samples >= 8) {
+        const __m128i bias = _mm_set1_epi16 ((short) 0x8000);
+        const __m128i ones = _mm_set1_epi16 (1);
+        const __m128i zero = _mm_setzero_si128 ();
+        __m128i lowest = _mm_set1_epi16 (0x7FFF);
+        __m128i highest = bias;
+        __m128i squares64 = zero;
+        SInt64 biased = 0;
+        while (i + 8 <= samples) {
+            // The pairs of signed sums stay within 32 bits for 32768 rounds, and so do the
+            // counts of dark samples within 16
+            __m128i sum32 = zero;
+            __m128i dark16 = zero;
+            for (Size rounds = 0; i + 8 <= samples && rounds < 32768; i += 8, rounds++) {
+                __m128i v = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (data + 2 * i)), bias);
+                lowest = _mm_min_epi16 (lowest, v);
+                highest = _mm_max_epi16 (highest, v);
+                dark16 = _mm_sub_epi16 (dark16, _mm_cmplt_epi16 (v, zero));
+                sum32 = _mm_add_epi32 (sum32, _mm_madd_epi16 (v, ones));
+                __m128i square = _mm_madd_epi16 (v, v);
+                squares64 = _mm_add_epi64 (squares64, _mm_unpacklo_epi32 (square, zero));
+                squares64 = _mm_add_epi64 (squares64, _mm_unpackhi_epi32 (square, zero));
+            }
+            SInt32 lanes [4];
+            _mm_storeu_si128 ((__m128i *) lanes, sum32);
+            biased += (SInt64) lanes [0] + lanes [1] + lanes [2] + lanes [3];
+            _mm_storeu_si128 ((__m128i *) lanes, _mm_add_epi32 (_mm_unpacklo_epi16 (dark16, zero),
+                                                                _mm_unpackhi_epi16 (dark16, zero)));
+            ink += lanes [0] + lanes [1] + lanes [2] + lanes [3];
+        }
+        UInt64 lanes64 [2];
+        _mm_storeu_si128 ((__m128i *) lanes64, squares64);
+        // v = s + 32768, so v^2 = s^2 + 65536 s + 2^30
+        sum += (UInt64) (biased + (SInt64) i * 32768);
+        squares += lanes64 [0] + lanes64 [1] + (UInt64) (65536 * biased + (SInt64) i * 0x40000000);
+
+        SInt16 words [8];
+        _mm_storeu_si128 ((__m128i *) words, lowest);
+        for (int k = 0; k < 8; k++) min = std::min (min, (unsigned int) (words [k] + 32768));
+        _mm_storeu_si128 ((__m128i *) words, highest);
+        for (int k = 0; k < 8; k++) max = std::max (max, (unsigned int) (words [k] + 32768));
+    }
+#elif defined (HISTOGRAM_NEON)
+    if (samples >= 8) {
+        uint16x8_t lowest = vdupq_n_u16 (0xFFFF);
+        uint16x8_t highest = vdupq_n_u16 (0);
+        uint64x2_t sum64 = vdupq_n_u64 (0);
+        uint64x2_t squares64 = vdupq_n_u64 (0);
+        uint64x2_t ink64 = vdupq_n_u64 (0);
+        for (; i + 8 <= samples; i += 8) {
+            uint16x8_t v = vreinterpretq_u16_u8 (vld1q_u8 (data + 2 * i));
+            lowest = vminq_u16 (lowest, v);
+            highest = vmaxq_u16 (highest, v);
+            ink64 = vpadalq_u32 (ink64, vpaddlq_u16 (vshrq_n_u16 (vcltq_u16 (v, vdupq_n_u16 (0x8000)), 15)));
+            sum64 = vpadalq_u32 (sum64, vpaddlq_u16 (v));
+            squares64 = vpadalq_u32 (squares64, vmull_u16 (vget_low_u16 (v), vget_low_u16 (v)));
+            squares64 = vpadalq_u32 (squares64, vmull_u16 (vget_high_u16 (v), vget_high_u16 (v)));
+        }
+        sum += vgetq_lane_u64 (sum64, 0) + vgetq_lane_u64 (sum64, 1);
+        squares += vgetq_lane_u64 (squares64, 0) + vgetq_lane_u64 (squares64, 1);
+        ink += vgetq_lane_u64 (ink64, 0) + vgetq_lane_u64 (ink64, 1);
+        min = std::min (min, (unsigned int) vminvq_u16 (lowest));
+        max = std::max (max, (unsigned int) vmaxvq_u16 (highest));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        UInt16 sample;
+        memcpy (&sample, &data [2 * i], 2);
+        sum += sample;
+        squares += (UInt64) sample * sample;
+        ink += (sample < 0x8000);
+        min = std::min (min, (unsigned int) sample);
+        max = std::max (max, (unsigned int) sample);
+    }
+}
+
+
+// Sum, sum of squares and the samples below the middle of 8 bit samples
+static void SumSamples8 (const unsigned char * data, Size samples, UInt64 & sum, UInt64 & squares, UInt64 & ink) {
+
+    Size i = 0;
+
+#if defined (__SSE2__)
+    // psadbw sums the bytes and the dark masks, the squares of four samples stay within 32 bits
+    // for 16384 rounds
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i bias = _mm_set1_epi8 ((char) 0x80);
+    const __m128i ones = _mm_set1_epi8 (1);
+    __m128i sum64 = zero;
+    __m128i ink64 = zero;
+    __m128i squares64 = zero;
+    while (i + 16 <= samples) {
+        __m128i squares32 = zero;
+        for (Size rounds = 0; i + 16 <= samples && rounds < 16384; i += 16, rounds++) {
+            __m128i v = _mm_loadu_si128 ((const __m128i *) (data + i));
+            sum64 = _mm_add_epi64 (sum64, _mm_sad_epu8 (v, zero));
+            __m128i dark = _mm_and_si128 (_mm_cmplt_epi8 (_mm_xor_si128 (v, bias), zero), ones);
+            ink64 = _mm_add_epi64 (ink64, _mm_sad_epu8 (dark, zero));
+            __m128i low = _mm_unpacklo_epi8 (v, zero);
+            __m128i high = _mm_unpackhi_epi8 (v, zero);
+            squares32 = _mm_add_epi32 (squares32, _mm_madd_epi16 (low, low));
+            squares32 = _mm_add_epi32 (squares32, _mm_madd_epi16 (high, high));
+        }
+        squares64 = _mm_add_epi64 (squares64, _mm_unpacklo_epi32 (squares32, zero));
+        squares64 = _mm_add_epi64 (squares64, _mm_unpackhi_epi32 (squares32, zero));
+    }
+    UInt64 lanes [2];
+    _mm_storeu_si128 ((__m128i *) lanes, sum64);
+    sum += lanes [0] + lanes [1];
+    _mm_storeu_si128 ((__m128i *) lanes, ink64);
+    ink += lanes [0] + lanes [1];
+    _mm_storeu_si128 ((__m128i *) lanes, squares64);
+    squares += lanes [0] + lanes [1];
+#elif defined (HISTOGRAM_NEON)
+    uint64x2_t sum64 = vdupq_n_u64 (0);
+    uint64x2_t ink64 = vdupq_n_u64 (0);
+    uint64x2_t squares64 = vdupq_n_u64 (0);
+    for (; i + 16 <= samples; i += 16) {
+        uint8x16_t v = vld1q_u8 (data + i);
+        sum64 = vpadalq_u32 (sum64, vpaddlq_u16 (vpaddlq_u8 (v)));
+        ink64 = vpadalq_u32 (ink64, vpaddlq_u16 (vpaddlq_u8 (vshrq_n_u8 (vcltq_u8 (v, vdupq_n_u8 (0x80)), 7))));
+        uint32x4_t squares32 = vpaddlq_u16 (vmull_u8 (vget_low_u8 (v), vget_low_u8 (v)));
+        squares32 = vpadalq_u16 (squares32, vmull_u8 (vget_high_u8 (v), vget_high_u8 (v)));
+        squares64 = vpadalq_u32 (squares64, squares32);
+    }
+    sum += vgetq_lane_u64 (sum64, 0) + vgetq_lane_u64 (sum64, 1);
+    ink += vgetq_lane_u64 (ink64, 0) + vgetq_lane_u64 (ink64, 1);
+    squares += vgetq_lane_u64 (squares64, 0) + vgetq_lane_u64 (squares64, 1);
+#endif
+
+    for (; i < samples; i++) {
+        unsigned int sample = data [i];
+        sum += sample;
+        squares += sample * sample;
+        ink += (sample < 0x80);
+    }
+}
+
+
+Histogram::Histogram () {
+
+    Start (1, 8);
+}
+
+
+void Histogram::Start (int inchannels, int indepth) {
+
+    channels = inchannels;
+    depth = indepth;
+    position = 0;
+
+    partial.assign (4 * channels * 256, 0);
+    partialsamples = 0;
+    counts.assign (channels * 256, 0);
+
+    rowbytes = 0;
+    rowoffset = 0;
+    nextrow [0] = nextrow [1] = nextrow [2] = 0;
+    row.ink = row.samples = row.sum = row.squares = 0;
+    rows.clear ();
+
+    for (int c = 0; c < 3; c++) {
+        samples [c] = 0;
+        sum [c] = 0;
+        sumsquares [c] = 0;
+        min [c] = (depth == 16 ? 65535 : depth == 1 ? 1 : 255);
+        max [c] = 0;
+    }
+}
+
+
+void Histogram::SetRowWindow (Size inrowbytes, Size infirst, Size inlast) {
+
+    rowbytes = inrowbytes;
+    first = std::min (infirst, rowbytes);
+    last = std::max (first, std::min (inlast, rowbytes));
+    rowoffset = 0;
+}
+
+
+Size Histogram::Add (const unsigned char * data, Size length, int channel) {
+
+    if (depth == 16) length &= ~(Size) 1;
+    if (rowbytes <= 0) return Count (data, length, channel, false);
+
+    // Split at the edges of the window and the ends of the rows
+    Size done = 0;
+    while (done < length) {
+        Size edge = (rowoffset < first ? first : rowoffset < last ? last : rowbytes);
+        Size piece = std::min (length - done, edge - rowoffset);
+        Count (data + done, piece, channel, (rowoffset >= first && rowoffset < last));
+        done += piece;
+        rowoffset += piece;
+        if (rowoffset == rowbytes) {
+            int r = nextrow [channel < 0 ? 0 : channel]++;
+            if (r >= (int) rows.size ()) {
+                RowCounts empty = { 0, 0, 0, 0 };
+                rows.push_back (empty);
+            }
+            rows [r].ink += row.ink;
+            rows [r].samples += row.samples;
+            rows [r].sum += row.sum;
+            rows [r].squares += row.squares;
+            row.ink = row.samples = row.sum = row.squares = 0;
+            rowoffset = 0;
+        }
+    }
+    return done;
+}
+
+
+Size Histogram::Count (const unsigned char * data, Size length, int channel, bool inwindow) {
+
+    int c = (channel >= 0 && channels == 3 ? channel : 0);
+    bool rotate = (channel < 0 && channels == 3);
+
+    if (depth == 1) {
+        // Each byte is eight pixels of one channel, and a set bit is black
+        UInt64 windowblack = 0;
+        if (!rotate) {
+            UInt64 black = CountBits (data, length);
+            counts [c * 256 + 1] += black;
+            counts [c * 256 + 0] += (UInt64) length * 8 - black;
+            samples [c] += (UInt64) length * 8;
+            windowblack = black;
+        }
+        else {
+            c = position % 3;
+            for (Size i = 0; i < length; i++) {
+                UInt64 black = CountBits (data + i, 1);
+                counts [c * 256 + 1] += black;
+                counts [c * 256 + 0] += 8 - black;
+                samples [c] += 8;
+                windowblack += black;
+                if (++c == 3) c = 0;
+            }
+        }
+        if (inwindow) AddToRow ((UInt64) length * 8, windowblack, windowblack, windowblack);
+        position += length;
+        return length;
+    }
+
+    int bytes = depth / 8;
+    Size n = length / bytes;
+    if (rotate) c = position % 3;
+
+    for (Size done = 0; done < n;) {
+        if (partialsamples >= PARTIAL_LIMIT) Fold ();
+        Size block = std::min (n - done, (Size) (PARTIAL_LIMIT - partialsamples));
+        const unsigned char * s = data + done * bytes;
+        int shift = depth - 8;
+        Size stride = channels * 256;
+
+        // The bins take the high byte of 16 bit samples, which are in host order
+        #define SAMPLE(k) (depth == 8 ? s [k] : Sample16 (s, k) >> shift)
+
+        if (!rotate) {
+            UInt32 * table = &partial [c * 256];
+            Size i = 0;
+            for (; i + 4 <= block; i += 4) {
+                table [SAMPLE (i + 0)]++;
+                table [stride + SAMPLE (i + 1)]++;
+                table [2 * stride + SAMPLE (i + 2)]++;
+                table [3 * stride + SAMPLE (i + 3)]++;
+            }
+            for (; i < block; i++)
+                table [SAMPLE (i)]++;
+            samples [c] += block;
+            if (depth == 16) {
+                UInt64 blocksum = 0;
+                UInt64 blocksquares = 0;
+                UInt64 ink = 0;
+                SumSamples (s, block, blocksum, blocksquares, ink, min [c], max [c]);
+                sum [c] += blocksum;
+                sumsquares [c] += blocksquares;
+                if (inwindow) AddToRow (block, blocksum, blocksquares, ink);
+            }
+        }
+        else {
+            // Chunky samples: up to the next pixel one at a time, then whole pixels
+            UInt32 * table = &partial [0];
+            UInt64 blocksum [3] = { 0, 0, 0 };
+            UInt64 blocksquares [3] = { 0, 0, 0 };
+            Size i = 0;
+            Size pixels = 0;
+            for (; i < block; i++) {
+                if (c == 0 && i + 3 <= block) {
+                    pixels = (block - i) / 3;
+                    break;
+                }
+                table [c * 256 + SAMPLE (i)]++;
+                samples [c]++;
+                if (++c == 3) c = 0;
+            }
+            for (Size p = 0; p < pixels; p++, i += 3) {
+                UInt32 * t = table + (p & 3) * stride;
+                t [SAMPLE (i + 0)]++;
+                t [256 + SAMPLE (i + 1)]++;
+                t [512 + SAMPLE (i + 2)]++;
+            }
+            for (int k = 0; k < 3; k++) samples [k] += pixels;
+            for (; i < block; i++) {
+                table [c * 256 + SAMPLE (i)]++;
+                samples [c]++;
+                if (++c == 3) c = 0;
+            }
+            if (depth == 16) {
+                int k = (position + done) % 3;
+                UInt64 ink = 0;
+                for (i = 0; i < block; i++) {
+                    unsigned int sample = Sample16 (s, i);
+                    blocksum [k] += sample;
+                    blocksquares [k] += (UInt64) sample * sample;
+                    min [k] = std::min (min [k], sample);
+                    max [k] = std::max (max [k], sample);
+                    ink += (sample < 0x8000);
+                    if (++k == 3) k = 0;
+                }
+                for (k = 0; k < 3; k++) {
+                    sum [k] += blocksum [k];
+                    sumsquares [k] += blocksquares [k];
+                }
+                if (inwindow)
+                    AddToRow (block, blocksum [0] + blocksum [1] + blocksum [2],
+                              blocksquares [0] + blocksquares [1] + blocksquares [2], ink);
+            }
+        }
+
+        #undef SAMPLE
+
+        // 8 bit samples only have their bins counted, the window of a row is summed while it
+        // is still in the cache
+        if (inwindow && depth == 8) {
+            UInt64 blocksum = 0;
+            UInt64 blocksquares = 0;
+            UInt64 ink = 0;
+            SumSamples8 (s, block, blocksum, blocksquares, ink);
+            AddToRow (block, blocksum, blocksquares, ink);
+        }
+
+        partialsamples += block;
+        done += block;
+    }
+
+    position += n;
+    return n * bytes;
+}
+
+
+void Histogram::AddToRow (UInt64 insamples, UInt64 insum, UInt64 insquares, UInt64 inink) {
+
+    row.samples += insamples;
+    row.sum += insum;
+    row.squares += insquares;
+    row.ink += inink;
+}
+
+
+void Histogram::Fold () {
+
+    Size stride = channels * 256;
+    for (Size k = 0; k < 4; k++)
+        for (Size bin = 0; bin < stride; bin++)
+            counts [bin] += partial [k * stride + bin];
+    std::fill (partial.begin (), partial.end (), 0);
+    partialsamples = 0;
+}
+
+
+void Histogram::Finish () {
+
+    Fold ();
+    if (depth == 16) return;
+
+    // 8 bit and lineart samples are their bins, so the rest follows from the counts
+    for (int c = 0; c < channels; c++) {
+        sum [c] = 0;
+        sumsquares [c] = 0;
+        for (int bin = 0; bin < 256; bin++) {
+            UInt64 count = counts [c * 256 + bin];
+            if (!count) continue;
+            sum [c] += (double) bin * count;
+            sumsquares [c] += (double) bin * bin * count;
+            if ((unsigned int) bin < min [c]) min [c] = bin;
+            if ((unsigned int) bin > max [c]) max [c] = bin;
+        }
+    }
+}
+
+
+int Histogram::GetChannels () {
+
+    return channels;
+}
+
+
+int Histogram::GetDepth () {
+
+    return depth;
+}
+
+
+const std::vector <Histogram::RowCounts> & Histogram::GetRowCounts () {
+
+    return rows;
+}
+
+
+UInt64 Histogram::GetSamples (int channel) {
+
+    return samples [channel];
+}
+
+
+UInt64 Histogram::GetCount (int channel, int bin) {
+
+    return counts [channel * 256 + bin];
+}
+
+
+unsigned int Histogram::GetMin (int channel) {
+
+    return (samples [channel] ? min [channel] : 0);
+}
+
+
+unsigned int Histogram::GetMax (int channel) {
+
+    return max [channel];
+}
+
+
+double Histogram::GetMean (int channel) {
+
+    if (!samples [channel]) return 0;
+    return sum [channel] / samples [channel];
+}
+
+
+double Histogram::GetVariance (int channel) {
+
+    if (!samples [channel]) return 0;
+    double mean = sum [channel] / samples [channel];
+    return std::max (0.0, sumsquares [channel] / samples [channel] - mean * mean);
+}
@@ -0,0 +1,78 @@
+#ifndef SANE_DS_HISTOGRAM_H
+#define SANE_DS_HISTOGRAM_H
+
+#include "Platform.h"
+
+#include <vector>
+
+// Per-channel histogram, minimum, maximum, mean and variance of an image, counted on each
+// sane_read while the samples are still in the cache. The histogram has 256 bins: 16 bit
+// samples go by their high byte, and lineart has 0 for white and 1 for black, so the mean of
+// a lineart channel is its ink coverage. Minimum, maximum, mean and variance are in the units
+// of the samples. Colour lineart bytes hold eight pixels of one channel, as the transfers
+// read them. A window of columns can be counted row by row as well, see SetRowWindow.
+
+class Histogram {
+
+public:
+    Histogram ();
+    void Start (int inchannels, int indepth);
+    // Counts the whole samples in length bytes and returns how many bytes that is. Chunky
+    // samples go to the channels in turn, the samples of a three-pass frame to its channel.
+    Size Add (const unsigned char * data, Size length, int channel = -1);
+    void Finish ();
+
+    // The samples between the byte offsets first and last of each row of rowbytes bytes are
+    // also counted row by row, for telling blank pages. The rows of a three-pass frame are
+    // added to the same rows of the other frames. Call after Start.
+    struct RowCounts {
+        UInt64 ink;
+        UInt64 samples;
+        UInt64 sum;
+        UInt64 squares;
+    };
+    void SetRowWindow (Size inrowbytes, Size infirst, Size inlast);
+    const std::vector <RowCounts> & GetRowCounts ();
+
+    int GetChannels ();
+    int GetDepth ();
+    UInt64 GetSamples (int channel);
+    UInt64 GetCount (int channel, int bin);
+    unsigned int GetMin (int channel);
+    unsigned int GetMax (int channel);
+    double GetMean (int channel);
+    double GetVariance (int channel);
+
+private:
+    Size Count (const unsigned char * data, Size length, int channel, bool inwindow);
+    void Fold ();
+    void AddToRow (UInt64 insamples, UInt64 insum, UInt64 insquares, UInt64 inink);
+
+    int channels;
+    int depth;
+    UInt64 position;
+
+    // Four tables of channels x 256 bins that take turns, so that runs of the same value do
+    // not wait on each other's increments, added to the counts now and then
+    std::vector <UInt32> partial;
+    UInt32 partialsamples;
+    std::vector <UInt64> counts;
+
+    UInt64 samples [3];
+    double sum [3];
+    double sumsquares [3];
+    unsigned int min [3];
+    unsigned int max [3];
+
+    // The window of the current row and of the rows done, in the units of the samples. Ink is
+    // the samples darker than the middle, or black lineart.
+    Size rowbytes;
+    Size first;
+    Size last;
+    Size rowoffset;
+    int nextrow [3];
+    RowCounts row;
+    std::vector <RowCounts> rows;
+};
+
+#endif
@@ -1,31 +1,135 @@
-#include <Carbon/Carbon.h>
-#include "MissingQD.h"
-#include <TWAIN/TWAIN.h>
-#include <libkern/OSByteOrder.h>
+#include "Platform.h"
 
 #include <sane/sane.h>
 
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cstring>
 #include <map>
+#include <vector>
 
 #include "DataSource.h"
 #include "SaneDevice.h"
 #include "Image.h"
 #include "Buffer.h"
+#include "BlankPage.h"
+#include "ContentArea.h"
+#include "FileJob.h"
+#include "FileWriter.h"
+#include "Group4.h"
+#include "ImageWriter.h"
+#include "JpegEncoder.h"
+#include "PackBits.h"
+#include "Trace.h"
+
+
+// The rows of a PackedBitsRect are packed in strips of about this size
+#define PICT_STRIP 0x40000
+
+// Threads packing strips, on top of the one making the picture
+#define PICT_MAXTHREADS 4
+
+// How the pages of rows a memory transfer has handed over are given back, on Mac OS X the
+// way its malloc does it
+#ifdef MADV_FREE_REUSABLE
+#define IMAGE_RELEASE MADV_FREE_REUSABLE
+#else
+#define IMAGE_RELEASE MADV_DONTNEED
+#endif
 
+// TIFF field types
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_RATIONAL 5
+
+
+struct Image::PictStrip {
+    Image * image;
+    int origo;
+    short rowBytes;
+    Size lastoffset;
+    int first;
+    int rows;
+    std::vector <unsigned char> row;
+    std::vector <unsigned char> packed;
+    Size length;
+};
+
+
+Image::Image () : imagedata (NULL),
+                  pixelflavor (TWPF_CHOCOLATE),
+                  planarchunky (TWPC_CHUNKY),
+                  fulldepth (false),
+                  compression (TWCP_NONE),
+                  jpegquality (TWJQ_MEDIUM),
+                  releaserows (false),
+                  released (0),
+                  jpegdata (NULL),
+                  filewriter (NULL),
+                  blankpage (NULL) {
+
+    releasedto [0] = releasedto [1] = releasedto [2] = 0;
+}
 
-Image::Image () : imagedata (NULL) {}
+
+// Takes over image data that did not come from a scan, as used by the converter benchmarks.
+// Three-pass data is expected in red, green, blue order.
+
+Image::Image (const SANE_Parameters & inparam, const SANE_Rect & inbounds, const SANE_Resolution & inres,
+              Handle indata) : imagedata (indata),
+                               bounds (inbounds),
+                               res (inres),
+                               param (inparam),
+                               pixelflavor (TWPF_CHOCOLATE),
+                               planarchunky (TWPC_CHUNKY),
+                               fulldepth (false),
+                               compression (TWCP_NONE),
+                               jpegquality (TWJQ_MEDIUM),
+                               releaserows (false),
+                               released (0),
+                               jpegdata (NULL),
+                               filewriter (NULL),
+                               blankpage (NULL) {
+
+    releasedto [0] = releasedto [1] = releasedto [2] = 0;
+
+    if (imagedata) MemoryAllocated (MEMORY_IMAGE, GetHandleSize (imagedata));
+
+    if (param.format != SANE_FRAME_GRAY && param.format != SANE_FRAME_RGB) {
+        frame [SANE_FRAME_RED] = 0;
+        frame [SANE_FRAME_GREEN] = 1;
+        frame [SANE_FRAME_BLUE] = 2;
+    }
+}
 
 
 Image::~Image () {
 
-    if (imagedata) DisposeHandle (imagedata);
+    if (imagedata) {
+        MemoryReleased (MEMORY_IMAGE, GetHandleSize (imagedata) - released);
+        DisposeHandle (imagedata);
+    }
+    if (jpegdata) {
+        MemoryReleased (MEMORY_COMPRESSED, GetHandleSize (jpegdata));
+        DisposeHandle (jpegdata);
+    }
+    if (filewriter) delete filewriter;
+    if (blankpage) delete blankpage;
 }
 
 
-PicHandle Image::MakePict () {
+PicHandle Image::MakePict (MemoryTag tag) {
+
+    TraceScope trace ("convert", "MakePict");
+
+    // QuickDraw coordinates are 16 bits
+    if (param.pixels_per_line > 32767 || param.lines > 32767) return NULL;
 
-    Buffer pict (0x8000 + GetHandleSize (imagedata));	// Estimate, should be OK for most cases
+    // Allocated once, and only shrunk at the end when rows are packed
+    Buffer pict (PictSize (), tag);
 
     short widthpt;
     short heightpt;
@@ -67,7 +171,7 @@ PicHandle Image::MakePict () {
     }
 
     short shortval;
-    long longval;
+    SInt32 longval;
     Fixed fixedval;
     Rect rectval;
 
@@ -98,7 +202,7 @@ PicHandle Image::MakePict () {
     rectval.right = OSSwapHostToBigInt16 (widthpx);
     pict.Write (&rectval, sizeof (Rect));
     longval = OSSwapHostToBigInt32 (0x00000000);		// reserved
-    pict.Write (&longval, sizeof (long));
+    pict.Write (&longval, sizeof (SInt32));
     shortval = OSSwapHostToBigInt16 (0x001E);			// Default hilite opcode
     pict.Write (&shortval, sizeof (short));
     shortval = OSSwapHostToBigInt16 (0x0001);			// Clip region opcode
@@ -141,7 +245,7 @@ PicHandle Image::MakePict () {
         pict.Write (&shortval, sizeof (short));
 
         PixMap pm;
-        pm.baseAddr = (Ptr) OSSwapHostToBigInt32 (0x000000FF);	// Fake pointer (only for DirectBits)
+        pm.baseAddr = (Ptr) (uintptr_t) OSSwapHostToBigInt32 (0x000000FF);	// Fake pointer (only for DirectBits)
         pm.rowBytes = OSSwapHostToBigInt16 (rowBytes | 0x8000);	// Set high bit for PixMap
         pm.bounds = srcRect;
         pm.pmVersion = OSSwapHostToBigInt16 (0);
@@ -189,13 +293,13 @@ PicHandle Image::MakePict () {
             }
         }
 
-        pm.pmTable = (CTabHandle) OSSwapHostToBigInt32 (0);
-        pm.pmExt = (void *) OSSwapHostToBigInt32 (0);
+        pm.pmTable = (CTabHandle) (uintptr_t) OSSwapHostToBigInt32 (0);
+        pm.pmExt = (void *) (uintptr_t) OSSwapHostToBigInt32 (0);
 
         if (param.format != SANE_FRAME_GRAY && param.depth != 1)
             pict.Write (&pm, sizeof (PixMap));
         else
-            pict.Write (&pm.rowBytes, sizeof (PixMap) - sizeof (Ptr));	// skip the baseAddr field
+            pict.Write (&pm.rowBytes, sizeof (PixMap) - sizeof (pm.baseAddr));	// skip the baseAddr field
 
         if (param.format == SANE_FRAME_GRAY || param.depth == 1) {
             ColorTable ct;
@@ -304,111 +408,328 @@ PicHandle Image::MakePict () {
 
         else {
 
-            Ptr row = NULL;
-            if (!(rowBytes < 8)) {
-                row = new char [rowBytes];
-                assert (row);
+            // The rows are converted and packed a strip at a time, a few strips at once where
+            // there are processors to spare, and then added to the picture in order
+            int rows = (lastoffset + param.bytes_per_line - 1) / param.bytes_per_line;
+            int rowsperstrip = std::max (1, PICT_STRIP / rowBytes);
+
+            long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+            std::vector <PictStrip> strips (std::max (1L, std::min ((long) PICT_MAXTHREADS, cpus - 1) + 1));
+            std::vector <pthread_t> threads (strips.size ());
+
+            for (int first = 0; first < rows; ) {
+                size_t count = 0;
+                for (; count < strips.size () && first < rows; count++, first += rowsperstrip) {
+                    PictStrip & strip = strips [count];
+                    strip.image = this;
+                    strip.origo = origo;
+                    strip.rowBytes = rowBytes;
+                    strip.lastoffset = lastoffset;
+                    strip.first = first;
+                    strip.rows = std::min (rowsperstrip, rows - first);
+                }
+
+                std::vector <bool> started (count, false);
+                for (size_t i = 1; i < count; i++)
+                    started [i] = (pthread_create (&threads [i], NULL, PackPictStrip, &strips [i]) == 0);
+                PackPictStrip (&strips [0]);
+                for (size_t i = 1; i < count; i++) {
+                    if (started [i])
+                        pthread_join (threads [i], NULL);
+                    else
+                        PackPictStrip (&strips [i]);
+                }
+
+                for (size_t i = 0; i < count; i++)
+                    pict.Write (&strips [i].packed [0], strips [i].length);
             }
+        }
+    }
 
-            while (offset < lastoffset) {
+    shortval = OSSwapHostToBigInt16 (0x00FF);					// End Of Pict opcode
+    pict.Write (&shortval, sizeof (short));
 
-                if (rowBytes < 8) {
-                    row = pict.GetPtr (rowBytes);
-                    assert (row);
-                }
+    PicHandle picture = (PicHandle) pict.Claim ();
+    if (!picture) return NULL;
+
+    // Set the picture size
+    *(short *) & *((Handle) picture) [0] = OSSwapHostToBigInt16 (GetHandleSize ((Handle) picture) & 0xFFFF);
+
+    return picture;
+}
+
+
+// The size of the picture MakePict makes, exact unless rows are packed, and then the most
+// the packed rows can take
+
+Size Image::PictSize () {
+
+    int bits_per_pixel = ((param.format == SANE_FRAME_GRAY) ? 1 : 4);
+    if (param.depth != 1) bits_per_pixel *= 8;
+    int maxwidth = 0x2000 / bits_per_pixel * 8;
+    bool direct = (param.format != SANE_FRAME_GRAY && param.depth != 1);
+
+    Size lastoffset = GetHandleSize (imagedata);
+    if (param.format != SANE_FRAME_RGB && param.format != SANE_FRAME_GRAY) lastoffset /= 3;
+    Size rows = (lastoffset + param.bytes_per_line - 1) / param.bytes_per_line;
+
+    // Size, frame, version, header, hilite and clip region, and the end of picture opcode
+    Size size = 10 * sizeof (short) + 3 * sizeof (Rect) + 2 * sizeof (Fixed) + sizeof (SInt32);
+
+    for (int origo = 0; origo < param.pixels_per_line; origo += maxwidth) {
+
+        int width = std::min (param.pixels_per_line - origo, maxwidth);
+        short rowBytes = ((width * bits_per_pixel + 7) / 8 + 3) & ~3;
+
+        // Opcode, pixmap, rectangles and transfer mode, PackedBitsRect leaves out the base address
+        size += sizeof (short) + sizeof (PixMap) + 2 * sizeof (Rect) + sizeof (short);
+        if (!direct) size -= sizeof (((PixMap *) NULL)->baseAddr);
+
+        if (direct)
+            size += rows * (rowBytes * 3 / 4);
+        else {
+            int ctSize = (param.format != SANE_FRAME_GRAY ? 7 : param.depth != 1 ? 255 : 1);
+            size += sizeof (ColorTable) + ctSize * sizeof (ColorSpec);
+            if (rowBytes < 8)
+                size += rows * rowBytes;
+            else
+                size += rows * ((rowBytes > 250 ? sizeof (unsigned short) : sizeof (unsigned char)) +
+                                PackBitsBound (rowBytes));
+        }
+    }
+
+    return size;
+}
+
+// Converts a row of a PackedBitsRect into the pixels of the picture, inverted gray or lineart
+// with the bits of the three colours together
+
+void Image::MakePictRow (Size offset, Size lastoffset, int origo, short rowBytes, Ptr row) {
 
-                if (param.format == SANE_FRAME_GRAY) {
-                    for (int i = 0; i < rowBytes; i++)
-                        if (param.depth == 16 && i < (param.pixels_per_line - origo))
+    if (param.format == SANE_FRAME_GRAY) {
+        for (int i = 0; i < rowBytes; i++)
+            if (param.depth == 16 && i < (param.pixels_per_line - origo))
 #ifdef __BIG_ENDIAN__
-                            row [i] = ~(*imagedata) [offset + 2 * (origo + i)];
+                row [i] = ~(*imagedata) [offset + 2 * (origo + i)];
 #else
-                            row [i] = ~(*imagedata) [offset + 2 * (origo + i) + 1];
+                row [i] = ~(*imagedata) [offset + 2 * (origo + i) + 1];
 #endif
-                        else if (param.depth == 8 && i < (param.pixels_per_line - origo))
-                            row [i] = ~(*imagedata) [offset + origo + i];
-                        else if (param.depth == 1 && i < (param.pixels_per_line - origo + 7) / 8)
-                            row [i] = (*imagedata) [offset + origo / 8 + i];
-                        else
-                            row [i] = 0;
-                }
-                else {
-                    for (int i = 0; 4 * i < rowBytes; i++) {
+            else if (param.depth == 8 && i < (param.pixels_per_line - origo))
+                row [i] = ~(*imagedata) [offset + origo + i];
+            else if (param.depth == 1 && i < (param.pixels_per_line - origo + 7) / 8)
+                row [i] = (*imagedata) [offset + origo / 8 + i];
+            else
+                row [i] = 0;
+    }
+    else {
+        for (int i = 0; 4 * i < rowBytes; i++) {
 
-                        char c0, c1 ,c2;
+            char c0, c1 ,c2;
 
-                        if (param.format == SANE_FRAME_RGB) {
-                            c0 = ~(*imagedata) [offset + 3 * (origo / 8 + i)];
-                            c1 = ~(*imagedata) [offset + 3 * (origo / 8 + i) + 1];
-                            c2 = ~(*imagedata) [offset + 3 * (origo / 8 + i) + 2];
-                        }
-                        else {
-                            c0 = ~(*imagedata) [frame [SANE_FRAME_RED] * lastoffset +
-                                                offset + origo / 8 + i];
-                            c1 = ~(*imagedata) [frame [SANE_FRAME_GREEN] * lastoffset +
-                                                offset + origo / 8 + i];
-                            c2 = ~(*imagedata) [frame [SANE_FRAME_BLUE] * lastoffset +
-                                                offset + origo / 8 + i];
-                        }
-                        row [4 * i + 0] =
-                            ((c0 & 0x80) ? 0x40 : 0) + ((c0 & 0x40) ? 0x04 : 0) +
-                            ((c1 & 0x80) ? 0x20 : 0) + ((c1 & 0x40) ? 0x02 : 0) +
-                            ((c2 & 0x80) ? 0x10 : 0) + ((c2 & 0x40) ? 0x01 : 0);
-                        row [4 * i + 1] =
-                            ((c0 & 0x20) ? 0x40 : 0) + ((c0 & 0x10) ? 0x04 : 0) +
-                            ((c1 & 0x20) ? 0x20 : 0) + ((c1 & 0x10) ? 0x02 : 0) +
-                            ((c2 & 0x20) ? 0x10 : 0) + ((c2 & 0x10) ? 0x01 : 0);
-                        row [4 * i + 2] =
-                            ((c0 & 0x08) ? 0x40 : 0) + ((c0 & 0x04) ? 0x04 : 0) +
-                            ((c1 & 0x08) ? 0x20 : 0) + ((c1 & 0x04) ? 0x02 : 0) +
-                            ((c2 & 0x08) ? 0x10 : 0) + ((c2 & 0x04) ? 0x01 : 0);
-                        row [4 * i + 3] =
-                            ((c0 & 0x02) ? 0x40 : 0) + ((c0 & 0x01) ? 0x04 : 0) +
-                            ((c1 & 0x02) ? 0x20 : 0) + ((c1 & 0x01) ? 0x02 : 0) +
-                            ((c2 & 0x02) ? 0x10 : 0) + ((c2 & 0x01) ? 0x01 : 0);
-                    }
-                }
+            if (param.format == SANE_FRAME_RGB) {
+                c0 = ~(*imagedata) [offset + 3 * (origo / 8 + i)];
+                c1 = ~(*imagedata) [offset + 3 * (origo / 8 + i) + 1];
+                c2 = ~(*imagedata) [offset + 3 * (origo / 8 + i) + 2];
+            }
+            else {
+                c0 = ~(*imagedata) [frame [SANE_FRAME_RED] * lastoffset +
+                                    offset + origo / 8 + i];
+                c1 = ~(*imagedata) [frame [SANE_FRAME_GREEN] * lastoffset +
+                                    offset + origo / 8 + i];
+                c2 = ~(*imagedata) [frame [SANE_FRAME_BLUE] * lastoffset +
+                                    offset + origo / 8 + i];
+            }
+            row [4 * i + 0] =
+                ((c0 & 0x80) ? 0x40 : 0) + ((c0 & 0x40) ? 0x04 : 0) +
+                ((c1 & 0x80) ? 0x20 : 0) + ((c1 & 0x40) ? 0x02 : 0) +
+                ((c2 & 0x80) ? 0x10 : 0) + ((c2 & 0x40) ? 0x01 : 0);
+            row [4 * i + 1] =
+                ((c0 & 0x20) ? 0x40 : 0) + ((c0 & 0x10) ? 0x04 : 0) +
+                ((c1 & 0x20) ? 0x20 : 0) + ((c1 & 0x10) ? 0x02 : 0) +
+                ((c2 & 0x20) ? 0x10 : 0) + ((c2 & 0x10) ? 0x01 : 0);
+            row [4 * i + 2] =
+                ((c0 & 0x08) ? 0x40 : 0) + ((c0 & 0x04) ? 0x04 : 0) +
+                ((c1 & 0x08) ? 0x20 : 0) + ((c1 & 0x04) ? 0x02 : 0) +
+                ((c2 & 0x08) ? 0x10 : 0) + ((c2 & 0x04) ? 0x01 : 0);
+            row [4 * i + 3] =
+                ((c0 & 0x02) ? 0x40 : 0) + ((c0 & 0x01) ? 0x04 : 0) +
+                ((c1 & 0x02) ? 0x20 : 0) + ((c1 & 0x01) ? 0x02 : 0) +
+                ((c2 & 0x02) ? 0x10 : 0) + ((c2 & 0x01) ? 0x01 : 0);
+        }
+    }
+}
 
-                offset += param.bytes_per_line;
 
-                if (rowBytes < 8)
-                    pict.ReleasePtr (rowBytes);
-                else if (rowBytes > 250) {
-                    Ptr packed = pict.GetPtr (sizeof (unsigned short) +
-                                              rowBytes + (rowBytes + 126) / 127);
-                    assert (packed);
-                    Ptr src = row;
-                    Ptr dst = & packed [sizeof (unsigned short)];
-                    PackBits (&src, &dst, rowBytes);
-                    *(unsigned short *) packed = OSSwapHostToBigInt16 (dst - & packed [sizeof (unsigned short)]);
-                    pict.ReleasePtr (sizeof (unsigned short) + *(unsigned short *) packed);
-                }
-                else {
-                    Ptr packed = pict.GetPtr (sizeof (unsigned char) +
-                                              rowBytes + (rowBytes + 126) / 127);
-                    assert (packed);
-                    Ptr src = row;
-                    Ptr dst = & packed [sizeof (unsigned char)];
-                    PackBits (&src, &dst, rowBytes);
-                    *(unsigned char *) packed = dst - & packed [sizeof (unsigned char)];
-                    pict.ReleasePtr (sizeof (unsigned char) + *(unsigned char *) packed);
-                }
-            }
+// Converts and packs the rows of a strip, each with its packed size in front as PICT wants it
+
+void * Image::PackPictStrip (void * arg) {
+
+    PictStrip & strip = * (PictStrip *) arg;
+    short rowBytes = strip.rowBytes;
+    int bytes_per_line = strip.image->param.bytes_per_line;
 
-            if (!(rowBytes < 8)) delete[] row;
+    strip.row.resize (rowBytes);
+    strip.packed.resize (strip.rows * (sizeof (unsigned short) + PackBitsBound (rowBytes)));
+    unsigned char * row = &strip.row [0];
+    unsigned char * dst = &strip.packed [0];
+
+    for (int r = 0; r < strip.rows; r++) {
+        Size offset = (Size) (strip.first + r) * bytes_per_line;
+        if (rowBytes < 8) {
+            strip.image->MakePictRow (offset, strip.lastoffset, strip.origo, rowBytes, (Ptr) dst);
+            dst += rowBytes;
+            continue;
+        }
+        strip.image->MakePictRow (offset, strip.lastoffset, strip.origo, rowBytes, (Ptr) row);
+        if (rowBytes > 250) {
+            unsigned short packedBytes = PackBitsRow (row, rowBytes, dst + sizeof (unsigned short));
+            // The byte count is big endian
+            dst [0] = packedBytes >> 8;
+            dst [1] = packedBytes;
+            dst += sizeof (unsigned short) + packedBytes;
+        }
+        else {
+            unsigned char packedBytes = PackBitsRow (row, rowBytes, dst + sizeof (unsigned char));
+            dst [0] = packedBytes;
+            dst += sizeof (unsigned char) + packedBytes;
         }
     }
 
-    shortval = OSSwapHostToBigInt16 (0x00FF);					// End Of Pict opcode
-    pict.Write (&shortval, sizeof (short));
+    strip.length = dst - &strip.packed [0];
+    return NULL;
+}
 
-    PicHandle picture = (PicHandle) pict.Claim ();
-    assert (picture);
 
-    // Set the picture size
-    *(short *) & *((Handle) picture) [0] = OSSwapHostToBigInt16 (GetHandleSize ((Handle) picture) & 0xFFFF);
+// One entry of a TIFF directory in host byte order, the value in place when it fits
+static void TiffEntry (unsigned char * & p, UInt16 tag, UInt16 type, UInt32 count, UInt32 value) {
 
-    return picture;
+    UInt16 shortval;
+    memcpy (&p [0], &tag, 2);
+    memcpy (&p [2], &type, 2);
+    memcpy (&p [4], &count, 4);
+    memset (&p [8], 0, 4);
+    if (type == TIFF_SHORT && count <= 2) {
+        shortval = value;
+        memcpy (&p [8], &shortval, 2);
+    }
+    else
+        memcpy (&p [8], &value, 4);
+    p += 12;
+}
+
+
+// An uncompressed TIFF for native transfers to applications that would rather not decode a
+// PICT. It is one strip, or one strip per plane for three-pass frames, so the rows are copied
+// as they are in a single pass. Only colour lineart, which becomes 8-bit RGB as in TIFF files,
+// and 16-bit samples that were not negotiated are converted on the way.
+
+Handle Image::MakeTiff (MemoryTag tag) {
+
+    TraceScope trace ("convert", "MakeTiff");
+
+    bool threepass = (param.format != SANE_FRAME_GRAY && param.format != SANE_FRAME_RGB);
+    int samples = (param.format == SANE_FRAME_GRAY ? 1 : 3);
+    int depth = (param.depth == 1 ? (samples == 1 ? 1 : 8) : (param.depth == 16 && fulldepth) ? 16 : 8);
+    int planes = (threepass ? 3 : 1);
+
+    Size lastoffset = GetHandleSize (imagedata);
+    if (threepass) lastoffset /= 3;
+    int rows = lastoffset / param.bytes_per_line;
+    Size rowbytes = ((Size) param.pixels_per_line * (samples / planes) * depth + 7) / 8;
+    Size planebytes = rows * rowbytes;
+
+    // Header, directory, bits per sample, resolutions and strip arrays, then the pixels
+    const int entries = 13;
+    Size bitsoffset = 8 + 2 + entries * 12 + 4;
+    Size resoffset = bitsoffset + 8;
+    Size stripsoffset = resoffset + 16;
+    Size dataoffset = stripsoffset + 8 * planes;
+
+    // and the offsets 32 bits
+    if ((UInt64) dataoffset + (UInt64) planes * planebytes > 0xFFFFFFFFULL) return NULL;
+
+    Buffer tiff (dataoffset + planes * planebytes, tag);
+    unsigned char * base = (unsigned char *) tiff.GetPtr (dataoffset + planes * planebytes);
+    if (!base) return NULL;
+
+#ifdef __BIG_ENDIAN__
+    memcpy (base, "MM", 2);
+#else
+    memcpy (base, "II", 2);
+#endif
+    UInt16 magic = 42;
+    UInt32 longval = 8;
+    memcpy (&base [2], &magic, 2);
+    memcpy (&base [4], &longval, 4);
+
+    unsigned char * p = &base [8];
+    UInt16 count = entries;
+    memcpy (p, &count, 2);
+    p += 2;
+    TiffEntry (p, 256, TIFF_LONG, 1, param.pixels_per_line);                   // ImageWidth
+    TiffEntry (p, 257, TIFF_LONG, 1, rows);                                     // ImageLength
+    TiffEntry (p, 258, TIFF_SHORT, samples, (samples == 1 ? depth : bitsoffset));   // BitsPerSample
+    TiffEntry (p, 259, TIFF_SHORT, 1, 1);                                       // Compression, none
+    TiffEntry (p, 262, TIFF_SHORT, 1, (samples == 3 ? 2 : depth == 1 ? 0 : 1)); // PhotometricInterpretation
+    TiffEntry (p, 273, TIFF_LONG, planes, (planes == 1 ? dataoffset : stripsoffset));   // StripOffsets
+    TiffEntry (p, 277, TIFF_SHORT, 1, samples);                                 // SamplesPerPixel
+    TiffEntry (p, 278, TIFF_LONG, 1, rows);                                     // RowsPerStrip
+    TiffEntry (p, 279, TIFF_LONG, planes, (planes == 1 ? planebytes : stripsoffset + 4 * planes));
+                                                                                // StripByteCounts
+    TiffEntry (p, 282, TIFF_RATIONAL, 1, resoffset);                            // XResolution
+    TiffEntry (p, 283, TIFF_RATIONAL, 1, resoffset + 8);                        // YResolution
+    TiffEntry (p, 284, TIFF_SHORT, 1, (planes == 1 ? 1 : 2));                   // PlanarConfiguration
+    TiffEntry (p, 296, TIFF_SHORT, 1, 2);                                       // ResolutionUnit, inches
+    longval = 0;
+    memcpy (p, &longval, 4);
+
+    UInt16 bits [4] = { (UInt16) depth, (UInt16) depth, (UInt16) depth, 0 };
+    memcpy (&base [bitsoffset], bits, sizeof (bits));
+
+    // SANE_Fixed is a fraction of 65536
+    UInt32 resolution [4] = { (UInt32) res.h, 1, (UInt32) res.v, 1 };
+    if (res.type != SANE_TYPE_INT) resolution [1] = resolution [3] = 65536;
+    memcpy (&base [resoffset], resolution, sizeof (resolution));
+
+    for (int plane = 0; plane < planes; plane++) {
+        UInt32 strip [2] = { (UInt32) (dataoffset + plane * planebytes), (UInt32) planebytes };
+        memcpy (&base [stripsoffset + 4 * plane], &strip [0], 4);
+        memcpy (&base [stripsoffset + 4 * (planes + plane)], &strip [1], 4);
+    }
+
+#ifdef __BIG_ENDIAN__
+    const int high = 0;
+#else
+    const int high = 1;
+#endif
+
+    SANE_Frame frames [] = { SANE_FRAME_RED, SANE_FRAME_GREEN, SANE_FRAME_BLUE };
+    for (int plane = 0; plane < planes; plane++) {
+
+        const unsigned char * src =
+            (const unsigned char *) &(*imagedata) [threepass ? frame [frames [plane]] * lastoffset : 0];
+        unsigned char * dest = &base [dataoffset + plane * planebytes];
+
+        if (depth == param.depth && rowbytes == (Size) param.bytes_per_line)
+            memcpy (dest, src, planebytes);
+
+        else for (int row = 0; row < rows; row++, src += param.bytes_per_line, dest += rowbytes) {
+            if (depth == param.depth)
+                memcpy (dest, src, rowbytes);
+            else if (param.depth == 1) {
+                // Lineart bits are set for black
+                for (Size i = 0; i < rowbytes; i++)
+                    dest [i] = (((src [i >> 3] >> (7 - (i & 7))) & 1) ? 0x00 : 0xFF);
+            }
+            else {
+                for (Size i = 0; i < rowbytes; i++)
+                    dest [i] = src [2 * i + high];
+            }
+        }
+    }
+
+    tiff.ReleasePtr (dataoffset + planes * planebytes);
+    return tiff.Claim ();
 }
 
 
@@ -434,9 +755,10 @@ TW_UINT16 Image::TwainImageInfo (pTW_IMAGEINFO imageinfo) {
             imageinfo->PixelType = TWPT_BW;
         }
         else {
+            TW_INT16 depth = ((param.depth == 16 && fulldepth) ? 16 : 8);
             imageinfo->SamplesPerPixel = 1;
-            imageinfo->BitsPerSample [0] = 8;
-            imageinfo->BitsPerPixel = 8;
+            imageinfo->BitsPerSample [0] = depth;
+            imageinfo->BitsPerPixel = depth;
             imageinfo->PixelType = TWPT_GRAY;
         }
     }
@@ -448,17 +770,18 @@ TW_UINT16 Image::TwainImageInfo (pTW_IMAGEINFO imageinfo) {
             imageinfo->PixelType = TWPT_PALETTE;
         }
         else {
+            TW_INT16 depth = ((param.depth == 16 && fulldepth) ? 16 : 8);
             imageinfo->SamplesPerPixel = 3;
-            imageinfo->BitsPerSample [0] = 8;
-            imageinfo->BitsPerSample [1] = 8;
-            imageinfo->BitsPerSample [2] = 8;
-            imageinfo->BitsPerPixel = 24;
+            imageinfo->BitsPerSample [0] = depth;
+            imageinfo->BitsPerSample [1] = depth;
+            imageinfo->BitsPerSample [2] = depth;
+            imageinfo->BitsPerPixel = 3 * depth;
             imageinfo->PixelType = TWPT_RGB;
         }
     }
 
-    imageinfo->Planar = TWPC_CHUNKY;
-    imageinfo->Compression = TWCP_NONE;
+    imageinfo->Planar = (IsPlanar () ? TWPC_PLANAR : TWPC_CHUNKY);
+    imageinfo->Compression = TransferCompression ();
 
     return TWRC_SUCCESS;
 }
@@ -494,57 +817,236 @@ TW_UINT16 Image::TwainImageLayout (pTW_IMAGELAYOUT imagelayout) {
 
 
 
-TW_UINT16 Image::TwainSetupMemXfer (pTW_SETUPMEMXFER setupmemxfer) {
+void Image::SetTransferLayout (TW_UINT16 inpixelflavor, TW_UINT16 inplanarchunky, bool infulldepth,
+                               TW_UINT16 incompression, TW_INT16 injpegquality) {
+
+    pixelflavor = inpixelflavor;
+    planarchunky = inplanarchunky;
+    fulldepth = infulldepth;
+    compression = incompression;
+    jpegquality = injpegquality;
+
+    // JPEG carries 8 bit chunky samples, with 0 for black
+    if (compression == TWCP_JPEG) {
+        pixelflavor = TWPF_CHOCOLATE;
+        planarchunky = TWPC_CHUNKY;
+        fulldepth = false;
+    }
+}
+
+
+Histogram & Image::GetHistogram () {
+
+    return histogram;
+}
+
+
+BlankPage * Image::GetBlankPage () {
+
+    return blankpage;
+}
+
+
+// The part of the scanned area that holds what is on the glass, in the units of the bounds,
+// rounded outwards to whole pixels
+
+bool Image::FindContentArea (SANE_Rect * area) {
+
+    if (!imagedata || param.bytes_per_line <= 0) return false;
+
+    SANE_Parameters content = param;
+    content.lines = std::min ((Size) param.lines, GetHandleSize (imagedata) / param.bytes_per_line);
+
+    int top, left, bottom, right;
+    if (!::FindContentArea ((const unsigned char *) *imagedata, content,
+                            &top, &left, &bottom, &right)) return false;
+
+    long long width = bounds.right - bounds.left;
+    long long height = bounds.bottom - bounds.top;
+    *area = bounds;
+    area->left   = bounds.left + left * width / content.pixels_per_line;
+    area->right  = bounds.left + (right * width + content.pixels_per_line - 1) / content.pixels_per_line;
+    area->top    = bounds.top + top * height / content.lines;
+    area->bottom = bounds.top + (bottom * height + content.lines - 1) / content.lines;
+    return true;
+}
+
+
+// Planar transfers send the red, green and blue planes one after the other, as rows of their own
+
+bool Image::IsPlanar () {
+
+    return (planarchunky == TWPC_PLANAR && param.format != SANE_FRAME_GRAY && param.depth != 1);
+}
+
+
+// Group 4 is only for bitonal images and JPEG only for the others, they are otherwise sent uncompressed,
+// as are those only used for files
+
+TW_UINT16 Image::TransferCompression () {
+
+    if (compression != TWCP_PACKBITS && compression != TWCP_GROUP4 && compression != TWCP_JPEG)
+        return TWCP_NONE;
+    if (compression == TWCP_GROUP4 && (param.format != SANE_FRAME_GRAY || param.depth != 1))
+        return TWCP_NONE;
+    if (compression == TWCP_JPEG && param.depth == 1)
+        return TWCP_NONE;
+    return compression;
+}
+
+
+// The compression of the memory transfer itself, a JPEG not encoded while scanning is encoded
+// now, and the image is sent uncompressed if that fails
+
+TW_UINT16 Image::MemXferCompression () {
+
+    TW_UINT16 xfercompression = TransferCompression ();
+    if (xfercompression == TWCP_JPEG && !jpegdata) EncodeJpeg ();
+    if (xfercompression == TWCP_JPEG && !jpegdata) return TWCP_NONE;
+    return xfercompression;
+}
+
+
+// Encodes the image when it could not be done while scanning, for three-pass scans or
+// unknown heights
+
+void Image::EncodeJpeg () {
+
+    TraceScope trace ("convert", "JPEG encode");
+
+    JpegEncoder jpeg (param.pixels_per_line, param.lines, (param.format == SANE_FRAME_GRAY ? 1 : 3),
+                      JpegEncoder::Quality (jpegquality), res);
+
+    if (param.format == SANE_FRAME_GRAY || param.format == SANE_FRAME_RGB) {
+        for (int row = 0; row < param.lines; row++)
+            jpeg.WriteRow ((const unsigned char *) &(*imagedata) [(Size) row * param.bytes_per_line], param.depth);
+    }
+    else {
+        std::vector <char> interleaved (3 * param.pixels_per_line + 12);
+        for (int row = 0; row < param.lines; row++) {
+            ConvertRows (&interleaved [0], row, 1);
+            jpeg.WriteRow ((const unsigned char *) &interleaved [0], 8);
+        }
+    }
+
+    SetJpegData (jpeg.Finish ());
+}
+
+
+void Image::SetJpegData (Handle data) {
+
+    if (jpegdata) {
+        MemoryReleased (MEMORY_COMPRESSED, GetHandleSize (jpegdata));
+        DisposeHandle (jpegdata);
+    }
+    jpegdata = data;
+}
+
+
+void Image::TransferRowSize (TW_UINT32 & bytes_per_line, TW_UINT32 & fixed_bytes_per_line) {
+
+    TW_UINT32 bits_per_sample = ((param.depth == 16 && fulldepth) ? 16 : 8);
 
     TW_UINT32 bits_per_pixel;
     if (param.format == SANE_FRAME_GRAY)
-        bits_per_pixel = (param.depth == 1 ? 1 : 8);
+        bits_per_pixel = (param.depth == 1 ? 1 : bits_per_sample);
+    else if (param.depth == 1)
+        bits_per_pixel = 8;
     else
-        bits_per_pixel = (param.depth == 1 ? 8 : 24);
+        bits_per_pixel = (IsPlanar () ? bits_per_sample : 3 * bits_per_sample);
 
-    TW_UINT32 bytes_per_line = (param.pixels_per_line * bits_per_pixel + 7) / 8;
+    bytes_per_line = (param.pixels_per_line * bits_per_pixel + 7) / 8;
 
-    TW_UINT32 fixed_bytes_per_line;
-    if (param.format == SANE_FRAME_GRAY || param.depth == 1)
+    if (param.format == SANE_FRAME_GRAY || param.depth == 1 || IsPlanar ())
         fixed_bytes_per_line = ((bytes_per_line + 3) / 4) * 4;
     else
         fixed_bytes_per_line = ((bytes_per_line + 11) / 12) * 12;
+}
 
-    setupmemxfer->MinBufSize = fixed_bytes_per_line;
-    setupmemxfer->MaxBufSize = param.lines * fixed_bytes_per_line;
-    setupmemxfer->Preferred  = param.lines * fixed_bytes_per_line;
 
-    return TWRC_SUCCESS;
+// The most a compressed row can take, with the end of the data for the last one
+
+TW_UINT32 Image::CompressedRowSize (TW_UINT32 fixed_bytes_per_line) {
+
+    if (TransferCompression () == TWCP_GROUP4)
+        return Group4Encoder::WorstRow (param.pixels_per_line) + Group4Encoder::Trailer ();
+    else
+        return fixed_bytes_per_line + (fixed_bytes_per_line + 127) / 128;
 }
 
 
-TW_UINT16 Image::TwainImageMemXfer (pTW_IMAGEMEMXFER imagememxfer, pTW_UINT32 yoffset) {
+// Whole rows, at most 2 GB, as a buffer size any application can take
 
-    TW_UINT32 bits_per_pixel;
-    if (param.format == SANE_FRAME_GRAY)
-        bits_per_pixel = (param.depth == 1 ? 1 : 8);
-    else
-        bits_per_pixel = (param.depth == 1 ? 8 : 24);
+static TW_UINT32 StripSize (UInt64 rows, TW_UINT32 rowbytes) {
+
+    return (TW_UINT32) std::min (rows, (UInt64) 0x7FFFFFFF / rowbytes) * rowbytes;
+}
 
-    TW_UINT32 bytes_per_line = (param.pixels_per_line * bits_per_pixel + 7) / 8;
 
+TW_UINT16 Image::TwainSetupMemXfer (pTW_SETUPMEMXFER setupmemxfer) {
+
+    TW_UINT32 bytes_per_line;
     TW_UINT32 fixed_bytes_per_line;
-    if (param.format == SANE_FRAME_GRAY || param.depth == 1)
-        fixed_bytes_per_line = ((bytes_per_line + 3) / 4) * 4;
-    else
-        fixed_bytes_per_line = ((bytes_per_line + 11) / 12) * 12;
+    TransferRowSize (bytes_per_line, fixed_bytes_per_line);
+
+    TW_UINT16 xfercompression = MemXferCompression ();
 
-    if (*yoffset == 0) {
+    // A strip never spans two planes, so one plane is the most that is ever transferred at once
+    if (xfercompression == TWCP_JPEG) {
+        setupmemxfer->MinBufSize = fixed_bytes_per_line;
+        setupmemxfer->MaxBufSize = std::max ((TW_UINT32) GetHandleSize (jpegdata), fixed_bytes_per_line);
+        setupmemxfer->Preferred  = std::max ((TW_UINT32) GetHandleSize (jpegdata), fixed_bytes_per_line);
+    }
+    else if (xfercompression == TWCP_NONE) {
+        setupmemxfer->MinBufSize = fixed_bytes_per_line;
+        setupmemxfer->MaxBufSize = StripSize (param.lines, fixed_bytes_per_line);
+        setupmemxfer->Preferred  = StripSize (param.lines, fixed_bytes_per_line);
+    }
+    else {
+        // Compressed strips take rows for as long as the worst case still fits, so the
+        // uncompressed size is usually enough for the whole image
+        TW_UINT32 worst = CompressedRowSize (fixed_bytes_per_line);
+        setupmemxfer->MinBufSize = worst;
+        setupmemxfer->MaxBufSize = StripSize (param.lines, worst);
+        setupmemxfer->Preferred  = std::max (worst, StripSize (param.lines, fixed_bytes_per_line));
+    }
+
+    return TWRC_SUCCESS;
+}
+
+
+TW_UINT16 Image::TwainImageMemXfer (pTW_IMAGEMEMXFER imagememxfer, pTW_UINT32 yoffset) {
+
+    TW_UINT32 bytes_per_line;
+    TW_UINT32 fixed_bytes_per_line;
+    TransferRowSize (bytes_per_line, fixed_bytes_per_line);
+
+    // A backend that ended the scan before the first row leaves nothing to transfer
+    if (param.lines <= 0) {
         imagememxfer->Compression = TWCP_NONE;
         imagememxfer->BytesPerRow = fixed_bytes_per_line;
         imagememxfer->Columns = param.pixels_per_line;
+        imagememxfer->Rows = 0;
+        imagememxfer->XOffset = 0;
+        imagememxfer->YOffset = 0;
+        imagememxfer->BytesWritten = 0;
+        return TWRC_XFERDONE;
+    }
+
+    TW_UINT16 xfercompression = MemXferCompression ();
+
+    // Planar rows count through the three planes
+    TW_UINT32 rows = (IsPlanar () ? 3 * param.lines : param.lines);
+    TW_UINT32 row = *yoffset % param.lines;
+
+    if (*yoffset == 0 || xfercompression != TWCP_NONE) {
+        imagememxfer->Compression = xfercompression;
+        imagememxfer->BytesPerRow = fixed_bytes_per_line;
+        imagememxfer->Columns = param.pixels_per_line;
         imagememxfer->Rows = param.lines;
     }
     imagememxfer->XOffset = 0;
-    imagememxfer->YOffset = *yoffset;
-
-    TW_UINT32 linestowrite = imagememxfer->Memory.Length / fixed_bytes_per_line;
-    if (*yoffset + linestowrite > param.lines) linestowrite = param.lines - *yoffset;
+    imagememxfer->YOffset = row;
 
     Ptr memory;
 
@@ -553,31 +1055,209 @@ TW_UINT16 Image::TwainImageMemXfer (pTW_IMAGEMEMXFER imagememxfer, pTW_UINT32 yo
         memory = *(Handle) imagememxfer->Memory.TheMem;
     }
     else // if (imagememxfer->Memory->Flags & TWMF_POINTER)
-        memory = imagememxfer->Memory.TheMem;
+        memory = (Ptr) imagememxfer->Memory.TheMem;
+
+    TW_UINT32 linestowrite = 0;
+
+    if (xfercompression == TWCP_JPEG) {
+
+        // The JFIF stream is handed out in pieces, and the offset counts its bytes
+        Size jpegsize = GetHandleSize (jpegdata);
+        Size length = std::min ((Size) imagememxfer->Memory.Length, jpegsize - (Size) *yoffset);
+        memcpy (memory, &(*jpegdata) [*yoffset], length);
+        if (releaserows && *yoffset == 0) {
+            // The stream is all that is transferred, the rows are not needed any more
+            int planes = (param.format == SANE_FRAME_GRAY || param.format == SANE_FRAME_RGB ? 1 : 3);
+            for (int plane = 0; plane < planes; plane++)
+                ReleaseRows (plane, param.lines);
+        }
+        imagememxfer->YOffset = 0;
+        imagememxfer->BytesWritten = length;
+        *yoffset += length;
+
+        if (imagememxfer->Memory.Flags & TWMF_HANDLE)
+            HUnlock ((Handle) imagememxfer->Memory.TheMem);
+
+        return ((*yoffset == jpegsize) ? TWRC_XFERDONE : TWRC_SUCCESS);
+    }
+
+    else if (xfercompression == TWCP_NONE) {
+
+        linestowrite = imagememxfer->Memory.Length / fixed_bytes_per_line;
+        if (*yoffset + linestowrite > rows) linestowrite = rows - *yoffset;
+        if (row + linestowrite > (TW_UINT32) param.lines) linestowrite = param.lines - row;
+
+        TraceScope trace ("convert", "MemXfer strip %lu+%lu", (unsigned long) *yoffset, (unsigned long) linestowrite);
+        ConvertRows (memory, *yoffset, linestowrite);
+        imagememxfer->BytesWritten = fixed_bytes_per_line * linestowrite;
+    }
+
+    else {
+
+        TraceScope trace ("convert", "MemXfer %s strip %lu", (xfercompression == TWCP_GROUP4 ? "Group4" : "PackBits"),
+                          (unsigned long) *yoffset);
+
+        // Rows are compressed one at a time for as long as the worst case still fits
+        std::vector <char> converted (fixed_bytes_per_line);
+        TW_UINT32 worst = CompressedRowSize (fixed_bytes_per_line);
+
+        if (xfercompression == TWCP_GROUP4) {
+            // The encoder takes the lineart rows as they came from the backend, whatever the pixel flavor
+            Group4Encoder encoder (memory, imagememxfer->Memory.Length, param.pixels_per_line);
+            while (row + linestowrite < (TW_UINT32) param.lines && encoder.HasRoom ()) {
+                encoder.EncodeRow ((const unsigned char *)
+                                   &(*imagedata) [(Size) (row + linestowrite) * param.bytes_per_line]);
+                linestowrite++;
+            }
+            imagememxfer->BytesWritten = encoder.Finish ();
+        }
+        else {
+            unsigned char * dst = (unsigned char *) memory;
+            while (row + linestowrite < (TW_UINT32) param.lines &&
+                   (dst - (unsigned char *) memory) + worst <= imagememxfer->Memory.Length) {
+                ConvertRows (&converted [0], *yoffset + linestowrite, 1);
+                // In pieces as the PackBits of QuickDraw would take them, so the bytes stay the same
+                for (TW_UINT32 done = 0; done < fixed_bytes_per_line; done += 0x4000)
+                    dst += PackBitsRow ((const unsigned char *) &converted [done],
+                                        std::min (fixed_bytes_per_line - done, (TW_UINT32) 0x4000), dst);
+                linestowrite++;
+            }
+            imagememxfer->BytesWritten = dst - (unsigned char *) memory;
+        }
+
+        imagememxfer->Rows = linestowrite;
+    }
+
+    if (imagememxfer->Memory.Flags & TWMF_HANDLE)
+        HUnlock ((Handle) imagememxfer->Memory.TheMem);
+
+    // The rows are read in order, those of chunky data once for each plane of a planar transfer
+    if (releaserows) {
+        bool threepass = (param.format != SANE_FRAME_RGB && param.format != SANE_FRAME_GRAY);
+        TW_UINT32 plane = *yoffset / param.lines;
+        SANE_Frame planes [] = { SANE_FRAME_RED, SANE_FRAME_GREEN, SANE_FRAME_BLUE };
+        if (!IsPlanar ())
+            for (int i = 0; i < (threepass ? 3 : 1); i++)
+                ReleaseRows (i, row + linestowrite);
+        else if (threepass)
+            ReleaseRows (frame [planes [plane]], row + linestowrite);
+        else if (plane == 2)
+            ReleaseRows (0, row + linestowrite);
+    }
+
+    *yoffset += linestowrite;
+
+    return ((*yoffset == rows) ? TWRC_XFERDONE : TWRC_SUCCESS);
+}
+
+
+// Memory transfers may give the rows they have handed over back to the system. Only for an
+// image that is transferred once, as from the data source: what is left of those rows is
+// undefined, zeros after MADV_DONTNEED but anything after MADV_FREE_REUSABLE.
+
+void Image::ReleaseTransferredRows () {
+
+    releaserows = true;
+}
+
+
+// Once rows may have been released, no other transfer or picture can be made from the image
+
+bool Image::IsReleased () {
+
+    return releaserows;
+}
+
+
+// Whether a memory transfer has handed over everything at yoffset, a further one would start
+// over at the first row
+
+bool Image::IsTransferDone (TW_UINT32 yoffset) {
+
+    if (TransferCompression () == TWCP_JPEG && jpegdata) return (yoffset >= (TW_UINT32) GetHandleSize (jpegdata));
+    if (param.lines <= 0) return true;
+    return (yoffset >= (TW_UINT32) (IsPlanar () ? 3 * param.lines : param.lines));
+}
+
+
+// Releases the whole pages among the first rows of one of the stored planes
+
+void Image::ReleaseRows (int plane, TW_UINT32 rows) {
 
-    Size offset = *yoffset * param.bytes_per_line;
-    if (param.format != SANE_FRAME_RGB && param.format != SANE_FRAME_GRAY) offset /= 3;
     Size lastoffset = GetHandleSize (imagedata);
-    if (param.format != SANE_FRAME_RGB && param.format != SANE_FRAME_GRAY) lastoffset /= 3;
+    if (param.format != SANE_FRAME_GRAY && param.format != SANE_FRAME_RGB) lastoffset /= 3;
+
+    uintptr_t pagesize = sysconf (_SC_PAGESIZE);
+    uintptr_t base = (uintptr_t) &(*imagedata) [plane * lastoffset];
+    uintptr_t start = (base + releasedto [plane] + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t end = (base + std::min ((Size) rows * param.bytes_per_line, lastoffset)) & ~(pagesize - 1);
+    if (end <= start) return;
+
+    if (madvise ((void *) start, end - start, IMAGE_RELEASE) == 0) {
+        MemoryReleased (MEMORY_IMAGE, end - start);
+        released += end - start;
+    }
+    releasedto [plane] = end - base;
+}
+
+
+// Converts lines rows, starting at row yoffset of the transfer, into the negotiated layout
 
-    TW_UINT32 writtenlines;
-    for (writtenlines = 0; writtenlines < linestowrite; writtenlines++) {
+void Image::ConvertRows (Ptr memory, TW_UINT32 yoffset, TW_UINT32 linestowrite) {
 
-        if (param.format == SANE_FRAME_GRAY) {
+    TW_UINT32 bytes_per_line;
+    TW_UINT32 fixed_bytes_per_line;
+    TransferRowSize (bytes_per_line, fixed_bytes_per_line);
+
+    bool threepass = (param.format != SANE_FRAME_RGB && param.format != SANE_FRAME_GRAY);
+    bool planar = IsPlanar ();
+
+    TW_UINT32 plane = (planar ? yoffset / param.lines : 0);
+    TW_UINT32 row = yoffset - plane * param.lines;
 
-            for (int i = 0; i < bytes_per_line; i++) {
+    // Three-pass frames are stored one after the other, each with its own rows
+    Size offset = (Size) row * param.bytes_per_line;
+    Size lastoffset = GetHandleSize (imagedata);
+    if (threepass) lastoffset /= 3;
+
+    SANE_Frame planes [] = { SANE_FRAME_RED, SANE_FRAME_GREEN, SANE_FRAME_BLUE };
+    if (planar && threepass) offset += frame [planes [plane]] * lastoffset;
 
-                if (param.depth == 16)
 #ifdef __BIG_ENDIAN__
-                    memory [writtenlines * fixed_bytes_per_line + i] = (*imagedata) [offset + 2 * i];
+    const int high = 0;
 #else
-                    memory [writtenlines * fixed_bytes_per_line + i] = (*imagedata) [offset + 2 * i + 1];
+    const int high = 1;
 #endif
-                else if (param.depth == 8)
-                    memory [writtenlines * fixed_bytes_per_line + i] = (*imagedata) [offset + i];
-                else if (param.depth == 1)
-                    memory [writtenlines * fixed_bytes_per_line + i] = ~(*imagedata) [offset + i];
-            }
+
+    // SANE sets lineart bits for black, TWAIN chocolate has zero for black. Vanilla has zero
+    // for white in every pixel type, colour lineart then counts its palette from white.
+    bool invert = ((param.format == SANE_FRAME_GRAY && param.depth == 1) != (pixelflavor == TWPF_VANILLA));
+
+    // The samples only need copying when they are already in the negotiated layout, the
+    // pixel flavor is applied to the converted row afterwards
+    bool samelayout;
+    if (param.format == SANE_FRAME_GRAY)
+        samelayout = (param.depth != 16 || fulldepth);
+    else if (param.depth == 1)
+        samelayout = false;
+    else
+        samelayout = ((param.depth != 16 || fulldepth) && threepass == planar);
+
+    if (samelayout && !invert && fixed_bytes_per_line == param.bytes_per_line)
+        memcpy (memory, &(*imagedata) [offset], linestowrite * fixed_bytes_per_line);
+
+    else for (TW_UINT32 writtenlines = 0; writtenlines < linestowrite; writtenlines++) {
+
+        Ptr dest = &memory [writtenlines * fixed_bytes_per_line];
+
+        if (samelayout)
+            memcpy (dest, &(*imagedata) [offset], bytes_per_line);
+
+        else if (param.format == SANE_FRAME_GRAY) {
+
+            // Only reaches here when the 16 bit samples are reduced
+            for (int i = 0; i < bytes_per_line; i++)
+                dest [i] = (*imagedata) [offset + 2 * i + high];
         }
 
         else if (param.depth == 1) {
@@ -599,7 +1279,7 @@ TW_UINT16 Image::TwainImageMemXfer (pTW_IMAGEMEMXFER imagememxfer, pTW_UINT32 yo
 
                 for (int j = 0; j < 8 && 8 * i + j < bytes_per_line; j++) {
 
-                    memory [writtenlines * fixed_bytes_per_line + 8 * i + j] =
+                    dest [8 * i + j] =
                         (((c0 << j) & 0x80) ? 4 : 0) +
                         (((c1 << j) & 0x80) ? 2 : 0) +
                         (((c2 << j) & 0x80) ? 1 : 0);
@@ -607,66 +1287,74 @@ TW_UINT16 Image::TwainImageMemXfer (pTW_IMAGEMEMXFER imagememxfer, pTW_UINT32 yo
             }
         }
 
+        else if (param.format == SANE_FRAME_RGB && !planar) {
+
+            // Only reaches here when the 16 bit samples are reduced
+            for (int i = 0; i < bytes_per_line; i++)
+                dest [i] = (*imagedata) [offset + 2 * i + high];
+        }
+
         else if (param.format == SANE_FRAME_RGB) {
 
-            for (int i = 0; i < bytes_per_line; i++) {
+            // Split one colour out of the chunky data
+            if (param.depth == 8)
+                for (int i = 0; i < param.pixels_per_line; i++)
+                    dest [i] = (*imagedata) [offset + 3 * i + plane];
+            else if (fulldepth)
+                for (int i = 0; i < param.pixels_per_line; i++) {
+                    dest [2 * i + 0] = (*imagedata) [offset + 2 * (3 * i + plane) + 0];
+                    dest [2 * i + 1] = (*imagedata) [offset + 2 * (3 * i + plane) + 1];
+                }
+            else
+                for (int i = 0; i < param.pixels_per_line; i++)
+                    dest [i] = (*imagedata) [offset + 2 * (3 * i + plane) + high];
+        }
+
+        else if (planar) {
 
-                if (param.depth == 8)
-                    memory [writtenlines * fixed_bytes_per_line + i] = (*imagedata) [offset + i];
-                else if (param.depth == 16)
-#ifdef __BIG_ENDIAN__
-                    memory [writtenlines * fixed_bytes_per_line + i] = (*imagedata) [offset + 2 * i];
-#else
-                    memory [writtenlines * fixed_bytes_per_line + i] = (*imagedata) [offset + 2 * i + 1];
-#endif
-            }
+            // Only reaches here when the 16 bit samples are reduced
+            for (int i = 0; i < bytes_per_line; i++)
+                dest [i] = (*imagedata) [offset + 2 * i + high];
         }
 
         else {
 
-            for (int i = 0; i < bytes_per_line / 3; i++) {
+            Size red   = frame [SANE_FRAME_RED]   * lastoffset + offset;
+            Size green = frame [SANE_FRAME_GREEN] * lastoffset + offset;
+            Size blue  = frame [SANE_FRAME_BLUE]  * lastoffset + offset;
 
-                if (param.depth == 8) {
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 0] =
-                        (*imagedata) [frame [SANE_FRAME_RED]   * lastoffset + offset + i];
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 1] =
-                        (*imagedata) [frame [SANE_FRAME_GREEN] * lastoffset + offset + i];
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 2] =
-                        (*imagedata) [frame [SANE_FRAME_BLUE]  * lastoffset + offset + i];
+            if (param.depth == 8)
+                for (int i = 0; i < param.pixels_per_line; i++) {
+                    dest [3 * i + 0] = (*imagedata) [red   + i];
+                    dest [3 * i + 1] = (*imagedata) [green + i];
+                    dest [3 * i + 2] = (*imagedata) [blue  + i];
                 }
-                else if (param.depth == 16) {
-#ifdef __BIG_ENDIAN__
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 0] =
-                        (*imagedata) [frame [SANE_FRAME_RED]   * lastoffset + offset + 2 * i];
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 1] =
-                        (*imagedata) [frame [SANE_FRAME_GREEN] * lastoffset + offset + 2 * i];
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 2] =
-                        (*imagedata) [frame [SANE_FRAME_BLUE]  * lastoffset + offset + 2 * i];
-#else
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 0] =
-                        (*imagedata) [frame [SANE_FRAME_RED]   * lastoffset + offset + 2 * i + 1];
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 1] =
-                        (*imagedata) [frame [SANE_FRAME_GREEN] * lastoffset + offset + 2 * i + 1];
-                    memory [writtenlines * fixed_bytes_per_line + 3 * i + 2] =
-                        (*imagedata) [frame [SANE_FRAME_BLUE]  * lastoffset + offset + 2 * i + 1];
-#endif
+            else if (fulldepth)
+                for (int i = 0; i < param.pixels_per_line; i++) {
+                    memcpy (&dest [6 * i + 0], &(*imagedata) [red   + 2 * i], 2);
+                    memcpy (&dest [6 * i + 2], &(*imagedata) [green + 2 * i], 2);
+                    memcpy (&dest [6 * i + 4], &(*imagedata) [blue  + 2 * i], 2);
+                }
+            else
+                for (int i = 0; i < param.pixels_per_line; i++) {
+                    dest [3 * i + 0] = (*imagedata) [red   + 2 * i + high];
+                    dest [3 * i + 1] = (*imagedata) [green + 2 * i + high];
+                    dest [3 * i + 2] = (*imagedata) [blue  + 2 * i + high];
                 }
-            }
         }
 
+        if (invert && param.format != SANE_FRAME_GRAY && param.depth == 1)
+            for (TW_UINT32 i = 0; i < bytes_per_line; i++)
+                dest [i] = 7 - dest [i];
+        else if (invert)
+            for (TW_UINT32 i = 0; i < bytes_per_line; i++)
+                dest [i] = ~dest [i];
+
         for (int i = bytes_per_line; i < fixed_bytes_per_line; i++)
-            memory [writtenlines * fixed_bytes_per_line + i] = 0;
+            dest [i] = 0;
 
         offset += param.bytes_per_line;
     }
-
-    if (imagememxfer->Memory.Flags & TWMF_HANDLE)
-        HUnlock ((Handle) imagememxfer->Memory.TheMem);
-
-    imagememxfer->BytesWritten = fixed_bytes_per_line * writtenlines;
-    *yoffset += writtenlines;
-
-    return ((*yoffset == param.lines) ? TWRC_XFERDONE : TWRC_SUCCESS);
 }
 
 
@@ -676,10 +1364,11 @@ TW_UINT16 Image::TwainPalette8 (pTW_PALETTE8 palette8, pTW_UINT16 twainstatus) {
         palette8->NumColors = 256;
         palette8->PaletteType = TWPA_RGB;
         for (int i = 0; i < 8; i++) {
+            int c = (pixelflavor == TWPF_VANILLA ? 7 - i : i);
             palette8->Colors [i].Index = i;
-            palette8->Colors [i].Channel1 = (i & 4 ? 0 : 255);
-            palette8->Colors [i].Channel2 = (i & 2 ? 0 : 255);
-            palette8->Colors [i].Channel3 = (i & 1 ? 0 : 255);
+            palette8->Colors [i].Channel1 = (c & 4 ? 0 : 255);
+            palette8->Colors [i].Channel2 = (c & 2 ? 0 : 255);
+            palette8->Colors [i].Channel3 = (c & 1 ? 0 : 255);
         }
         for (int i = 8; i < 256; i++) {
             palette8->Colors [i].Index = i;
@@ -694,3 +1383,101 @@ TW_UINT16 Image::TwainPalette8 (pTW_PALETTE8 palette8, pTW_UINT16 twainstatus) {
         return TWRC_FAILURE;
     }
 }
+
+
+// One row of a three-pass image the way a single-pass RGB frame would have it
+
+void Image::InterleaveRow (int row, unsigned char * dest) {
+
+    Size lastoffset = GetHandleSize (imagedata) / 3;
+    Size offset = (Size) row * param.bytes_per_line;
+    const unsigned char * planes [3] = {
+        (const unsigned char *) &(*imagedata) [frame [SANE_FRAME_RED]   * lastoffset + offset],
+        (const unsigned char *) &(*imagedata) [frame [SANE_FRAME_GREEN] * lastoffset + offset],
+        (const unsigned char *) &(*imagedata) [frame [SANE_FRAME_BLUE]  * lastoffset + offset]
+    };
+
+    if (param.depth == 1) {
+        memset (dest, 0, (3 * param.pixels_per_line + 7) / 8);
+        for (int i = 0; i < 3 * param.pixels_per_line; i++) {
+            int pixel = i / 3;
+            if ((planes [i % 3] [pixel >> 3] >> (7 - (pixel & 7))) & 1)
+                dest [i >> 3] |= 0x80 >> (i & 7);
+        }
+    }
+    else {
+        int bytes = param.depth / 8;
+        for (int i = 0; i < param.pixels_per_line; i++)
+            for (int c = 0; c < 3; c++)
+                memcpy (&dest [(3 * i + c) * bytes], &planes [c] [i * bytes], bytes);
+    }
+}
+
+
+TW_UINT16 Image::TwainImageFileXfer (const std::string & filename, TW_UINT16 format, TW_UINT16 filecompression,
+                                     TW_INT16 filejpegquality, FileJob * job, pTW_UINT16 twainstatus) {
+
+    TraceScope trace ("convert", "ImageFileXfer");
+
+    // Usually the file is already written and only has to be moved into place
+    if (filewriter) {
+        bool committed = (filewriter->Matches (format, filecompression, filejpegquality, job) &&
+                          filewriter->Commit (filename));
+        delete filewriter;
+        filewriter = NULL;
+        if (committed) return TWRC_XFERDONE;
+    }
+
+    // A page of a multi-page TIFF or PDF goes into the file of the job
+    FILE * file = NULL;
+    if (!job) {
+        file = fopen (filename.c_str (), "wb");
+        if (!file) {
+            *twainstatus = TWCC_OPERATIONERROR;
+            return TWRC_FAILURE;
+        }
+    }
+
+    bool threepass = (param.format != SANE_FRAME_GRAY && param.format != SANE_FRAME_RGB);
+    std::vector <unsigned char> interleaved (threepass ? 3 * param.bytes_per_line : 0);
+
+    bool written;
+    {
+        ImageWriter writer (file, format, filecompression, filejpegquality, param.pixels_per_line, param.lines,
+                            (param.format == SANE_FRAME_GRAY ? 1 : 3), param.depth, res, job);
+        for (int row = 0; row < param.lines; row++) {
+            if (threepass) {
+                InterleaveRow (row, &interleaved [0]);
+                writer.WriteRow (&interleaved [0]);
+            }
+            else
+                writer.WriteRow ((const unsigned char *) &(*imagedata) [(Size) row * param.bytes_per_line]);
+        }
+        written = writer.Finish ();
+    }
+
+    if (job) {
+        if (written) written = job->LinkPage ();
+        if (!written) job->DropPage ();
+    }
+    else {
+        if (fclose (file) != 0) written = false;
+        if (!written) remove (filename.c_str ());
+    }
+
+    if (!written) {
+        *twainstatus = TWCC_OPERATIONERROR;
+        return TWRC_FAILURE;
+    }
+
+    return TWRC_XFERDONE;
+}
+
+
+// The page is written again at its transfer, if it is still wanted
+
+void Image::DiscardFileWriter () {
+
+    if (filewriter) delete filewriter;
+    filewriter = NULL;
+}
@@ -1,35 +1,94 @@
 #ifndef SANE_DS_IMAGE_H
 #define SANE_DS_IMAGE_H
 
-#include <Carbon/Carbon.h>
-#include <TWAIN/TWAIN.h>
+#include "Platform.h"
 
 #include <sane/sane.h>
 
 #include <map>
+#include <string>
 
 #include "SaneDevice.h"
+#include "MemoryAccount.h"
+#include "Histogram.h"
 
+class FileWriter;
+class FileJob;
+class BlankPage;
 
 class Image {
 
 public:
     Image ();
+    Image (const SANE_Parameters & inparam, const SANE_Rect & inbounds, const SANE_Resolution & inres,
+           Handle indata);
     ~Image ();
-    PicHandle MakePict ();
+    PicHandle MakePict (MemoryTag tag = MEMORY_PICT);
+    Handle MakeTiff (MemoryTag tag = MEMORY_PICT);
     TW_UINT16 TwainImageInfo (pTW_IMAGEINFO imageinfo);
     TW_UINT16 TwainImageLayout (pTW_IMAGELAYOUT imagelayout);
     TW_UINT16 TwainSetupMemXfer (pTW_SETUPMEMXFER setupmemxfer);
     TW_UINT16 TwainImageMemXfer (pTW_IMAGEMEMXFER imagememxfer, pTW_UINT32 yoffset);
     TW_UINT16 TwainPalette8 (pTW_PALETTE8 palette8, pTW_UINT16 twainstatus);
+    TW_UINT16 TwainImageFileXfer (const std::string & filename, TW_UINT16 format, TW_UINT16 filecompression,
+                                  TW_INT16 filejpegquality, FileJob * job, pTW_UINT16 twainstatus);
+    void DiscardFileWriter ();
+    void ReleaseTransferredRows ();
+    bool IsReleased ();
+    bool IsTransferDone (TW_UINT32 yoffset);
+    void SetTransferLayout (TW_UINT16 inpixelflavor, TW_UINT16 inplanarchunky, bool infulldepth,
+                            TW_UINT16 incompression, TW_INT16 injpegquality = TWJQ_MEDIUM);
+    Histogram & GetHistogram ();
+    BlankPage * GetBlankPage ();
+    bool FindContentArea (SANE_Rect * area);
 
 private:
+    struct PictStrip;
+
+    Size PictSize ();
+    void MakePictRow (Size offset, Size lastoffset, int origo, short rowBytes, Ptr row);
+    static void * PackPictStrip (void * arg);
+    bool IsPlanar ();
+    TW_UINT16 TransferCompression ();
+    TW_UINT16 MemXferCompression ();
+    void TransferRowSize (TW_UINT32 & bytes_per_line, TW_UINT32 & fixed_bytes_per_line);
+    TW_UINT32 CompressedRowSize (TW_UINT32 fixed_bytes_per_line);
+    void ConvertRows (Ptr memory, TW_UINT32 yoffset, TW_UINT32 linestowrite);
+    void EncodeJpeg ();
+    void SetJpegData (Handle data);
+    void InterleaveRow (int row, unsigned char * dest);
+    void ReleaseRows (int plane, TW_UINT32 rows);
+
     Handle imagedata;
     SANE_Rect bounds;
     SANE_Resolution res;
     SANE_Parameters param;
     std::map <SANE_Frame, int> frame;
 
+    // The layout negotiated for memory transfers
+    TW_UINT16 pixelflavor;
+    TW_UINT16 planarchunky;
+    bool fulldepth;
+    TW_UINT16 compression;
+    TW_INT16 jpegquality;
+
+    // Rows that memory transfers have handed over can go back to the system, the bytes released.
+    // What is left of them is undefined, so the image is not transferred again.
+    bool releaserows;
+    Size releasedto [3];
+    Size released;
+
+    // The JFIF stream, made while scanning when possible
+    Handle jpegdata;
+
+    // The file for a file transfer, written while scanning when possible
+    FileWriter * filewriter;
+
+    // Counted while scanning, empty for data that did not come from a scan
+    Histogram histogram;
+    // and the ink of the page, when blank pages are dropped
+    BlankPage * blankpage;
+
     friend Image * SaneDevice::Scan (bool queue, bool indicators);
 };
 
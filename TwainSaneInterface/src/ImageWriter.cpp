@@ -0,0 +1,285 @@
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <cstring>
+
+#include "ImageWriter.h"
+#include "FileJob.h"
+#include "JpegEncoder.h"
+#include "PdfWriter.h"
+#include "TiffWriter.h"
+#include "Trace.h"
+
+
+// PNG IDAT chunks of about this size
+#define WRITER_CHUNK 0x10000
+
+
+static void PutBig32 (unsigned char * p, UInt32 value) {
+
+    p [0] = value >> 24;
+    p [1] = value >> 16;
+    p [2] = value >> 8;
+    p [3] = value;
+}
+
+
+ImageWriter::ImageWriter (FILE * infile, TW_UINT16 informat, TW_UINT16 incompression, TW_INT16 injpegquality,
+                          int inwidth, int inheight, int insamples, int indepth, const SANE_Resolution & inres,
+                          FileJob * injob) : file (infile),
+                                             format (informat),
+                                             compression (FileCompression (informat, incompression,
+                                                                           insamples, indepth)),
+                                             width (inwidth),
+                                             height (inheight),
+                                             samples (insamples),
+                                             depth (indepth),
+                                             failed (false),
+                                             rows (0),
+                                             tiff (injob ? injob->GetTiff () : NULL),
+                                             pdf (injob ? injob->GetPdf () : NULL),
+                                             job (injob != NULL),
+                                             zstreaminit (false),
+                                             jpeg (NULL) {
+
+    // Colour lineart, and lineart for JPEG, is written with 8 bit samples, except in PDF
+    filedepth = ((depth == 1 && format != TWFF_PDF && (samples == 3 || format == TWFF_JFIF)) ? 8 : depth);
+    filerowbytes = ((Size) width * samples * filedepth + 7) / 8;
+    row.resize (filerowbytes);
+
+    if (inres.type == SANE_TYPE_INT) {
+        xdpi = inres.h;
+        ydpi = inres.v;
+    }
+    else {
+        xdpi = SANE_UNFIX (inres.h);
+        ydpi = SANE_UNFIX (inres.v);
+    }
+
+    if (format == TWFF_JFIF) {
+        jpeg = new JpegEncoder (width, height, samples, JpegEncoder::Quality (injpegquality), inres, file);
+    }
+
+    else if (format == TWFF_PNG) {
+        static const unsigned char signature [8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        Write (signature, sizeof (signature));
+
+        unsigned char ihdr [13];
+        PutBig32 (&ihdr [0], width);
+        PutBig32 (&ihdr [4], height);
+        ihdr [8] = filedepth;
+        ihdr [9] = (samples == 3 ? 2 : 0);
+        ihdr [10] = ihdr [11] = ihdr [12] = 0;
+        WritePngChunk ("IHDR", ihdr, sizeof (ihdr));
+
+        unsigned char phys [9];
+        PutBig32 (&phys [0], lround (xdpi / 0.0254));
+        PutBig32 (&phys [4], lround (ydpi / 0.0254));
+        phys [8] = 1;
+        WritePngChunk ("pHYs", phys, sizeof (phys));
+
+        memset (&zstream, 0, sizeof (zstream));
+        if (deflateInit (&zstream, Z_DEFAULT_COMPRESSION) == Z_OK)
+            zstreaminit = true;
+        else
+            failed = true;
+        previous.assign (filerowbytes, 0);
+        filtered.resize (filerowbytes + 1);
+        deflated.resize (WRITER_CHUNK);
+        zstream.next_out = &deflated [0];
+        zstream.avail_out = deflated.size ();
+    }
+
+    else if (format == TWFF_PDF) {
+        if (!pdf) pdf = new PdfWriter (file);
+        pdf->StartPage (compression, injpegquality, width, height, samples, depth, inres);
+    }
+
+    else {
+        if (!tiff) tiff = new TiffWriter (file);
+        tiff->StartPage (compression, width, height, samples, filedepth, xdpi, ydpi);
+    }
+}
+
+
+ImageWriter::~ImageWriter () {
+
+    if (jpeg) delete jpeg;
+    if (tiff && !job) delete tiff;
+    if (pdf && !job) delete pdf;
+    if (zstreaminit) deflateEnd (&zstream);
+}
+
+
+bool ImageWriter::Supported (TW_UINT16 format) {
+
+    return (format == TWFF_TIFF || format == TWFF_TIFFMULTI || format == TWFF_PNG || format == TWFF_JFIF ||
+            format == TWFF_PDF);
+}
+
+
+TW_UINT16 ImageWriter::FileCompression (TW_UINT16 format, TW_UINT16 compression, int samples, int depth) {
+
+    if (format == TWFF_JFIF) return TWCP_JPEG;
+    if (format == TWFF_PNG) return TWCP_PNG;
+    if (format == TWFF_PDF) {
+        if (samples == 1 && depth == 1) return TWCP_GROUP4;
+        return ((compression == TWCP_JPEG && depth != 1) ? TWCP_JPEG : TWCP_ZIP);
+    }
+
+    switch (compression) {
+        case TWCP_PACKBITS:
+        case TWCP_LZW:
+        case TWCP_ZIP:
+            return compression;
+        case TWCP_GROUP4:
+            return ((samples == 1 && depth == 1) ? TWCP_GROUP4 : TWCP_NONE);
+        default:
+            return TWCP_NONE;
+    }
+}
+
+
+void ImageWriter::Write (const void * data, Size length) {
+
+    if (failed) return;
+    if (fwrite (data, 1, length, file) != (size_t) length) failed = true;
+}
+
+
+void ImageWriter::ConvertRow (const unsigned char * data) {
+
+    if (filedepth != depth) {
+        // Lineart bits are set for black, as in the palette of the native transfer
+        for (Size i = 0; i < filerowbytes; i++)
+            row [i] = (((data [i >> 3] >> (7 - (i & 7))) & 1) ? 0x00 : 0xFF);
+    }
+    else if (depth == 1 && format == TWFF_PNG) {
+        // PNG has zero for black
+        for (Size i = 0; i < filerowbytes; i++)
+            row [i] = ~data [i];
+    }
+#ifndef __BIG_ENDIAN__
+    else if (depth == 16 && format == TWFF_PNG) {
+        // PNG samples are big endian, TIFF is written in host order
+        for (Size i = 0; i < filerowbytes; i += 2) {
+            row [i] = data [i + 1];
+            row [i + 1] = data [i];
+        }
+    }
+#endif
+    else
+        memcpy (&row [0], data, filerowbytes);
+}
+
+
+void ImageWriter::WriteRow (const unsigned char * data) {
+
+    if (failed || (height > 0 && rows >= height)) return;
+    rows++;
+
+    if (format == TWFF_JFIF) {
+        if (filedepth == depth)
+            jpeg->WriteRow (data, depth);
+        else {
+            ConvertRow (data);
+            jpeg->WriteRow (&row [0], filedepth);
+        }
+    }
+
+    else if (format == TWFF_PNG) {
+        ConvertRow (data);
+        // The Up filter, lineart is left unfiltered
+        if (filedepth == 1) {
+            filtered [0] = 0;
+            memcpy (&filtered [1], &row [0], filerowbytes);
+        }
+        else {
+            filtered [0] = 2;
+            for (Size i = 0; i < filerowbytes; i++)
+                filtered [i + 1] = row [i] - previous [i];
+            previous.swap (row);
+        }
+        zstream.next_in = &filtered [0];
+        zstream.avail_in = filerowbytes + 1;
+        DeflatePng (Z_NO_FLUSH);
+    }
+
+    else if (format == TWFF_PDF)
+        pdf->WriteRow (data);
+
+    else {
+        if (filedepth == depth)
+            tiff->WriteRow (data);
+        else {
+            ConvertRow (data);
+            tiff->WriteRow (&row [0]);
+        }
+    }
+}
+
+
+void ImageWriter::WritePngChunk (const char * type, const unsigned char * data, Size length) {
+
+    unsigned char header [8];
+    PutBig32 (&header [0], length);
+    memcpy (&header [4], type, 4);
+    uLong crc = crc32 (0, &header [4], 4);
+    if (length) crc = crc32 (crc, data, length);
+    unsigned char trailer [4];
+    PutBig32 (trailer, crc);
+
+    Write (header, sizeof (header));
+    if (length) Write (data, length);
+    Write (trailer, sizeof (trailer));
+}
+
+
+// Deflated data goes out in IDAT chunks once they are full, and all of it at the end
+void ImageWriter::DeflatePng (int flush) {
+
+    for (;;) {
+        int status = deflate (&zstream, flush);
+        if (status == Z_STREAM_ERROR) {
+            failed = true;
+            return;
+        }
+        if (zstream.avail_out == 0 || flush == Z_FINISH) {
+            Size length = deflated.size () - zstream.avail_out;
+            if (length) WritePngChunk ("IDAT", &deflated [0], length);
+            zstream.next_out = &deflated [0];
+            zstream.avail_out = deflated.size ();
+        }
+        if (flush == Z_FINISH ? status == Z_STREAM_END : zstream.avail_in == 0 && zstream.avail_out != 0)
+            break;
+    }
+}
+
+
+bool ImageWriter::Finish () {
+
+    TraceScope trace ("convert", "File finish");
+
+    if (format == TWFF_JFIF) {
+        jpeg->Finish ();
+        if (jpeg->Failed ()) failed = true;
+    }
+    else if (format == TWFF_PNG) {
+        if (zstreaminit && !failed) {
+            zstream.avail_in = 0;
+            DeflatePng (Z_FINISH);
+        }
+        WritePngChunk ("IEND", NULL, 0);
+    }
+    else if (format == TWFF_PDF) {
+        if (!pdf->EndPage () || (!job && (!pdf->LinkPage () || !pdf->Finish ())))
+            failed = true;
+    }
+    else if (!tiff->EndPage () || (!job && !tiff->LinkPage ()))
+        failed = true;
+
+    if (height > 0 && rows < height) failed = true;
+    if (file && fflush (file) != 0) failed = true;
+    return !failed;
+}
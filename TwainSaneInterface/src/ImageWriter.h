@@ -0,0 +1,83 @@
+#ifndef SANE_DS_IMAGEWRITER_H
+#define SANE_DS_IMAGEWRITER_H
+
+#include "Platform.h"
+
+#include <cstdio>
+#include <vector>
+
+#include <zlib.h>
+
+#include "SaneDevice.h"
+
+class FileJob;
+class JpegEncoder;
+class PdfWriter;
+class TiffWriter;
+
+// TWAIN 2.0 and 2.1, not in the Mac OS X headers
+#ifndef TWCP_ZIP
+#define TWCP_ZIP 13
+#endif
+#ifndef TWFF_PDF
+#define TWFF_PDF 10
+#endif
+
+// Streaming encoder for file transfers: TIFF (uncompressed, PackBits, Group 4, LZW or Deflate),
+// PNG, JFIF and PDF. It takes the rows as SANE delivers them for single-pass frames, gray or
+// chunky RGB in 1, 8 or 16 bits, and writes each strip to the file as soon as it is complete.
+// A page of a multi-page TIFF or PDF goes to the job's writer, which the caller links or drops.
+
+class ImageWriter {
+
+public:
+    ImageWriter (FILE * infile, TW_UINT16 informat, TW_UINT16 incompression, TW_INT16 injpegquality,
+                 int inwidth, int inheight, int insamples, int indepth, const SANE_Resolution & inres,
+                 FileJob * injob = NULL);
+    ~ImageWriter ();
+    void WriteRow (const unsigned char * data);
+    bool Finish ();
+
+    static bool Supported (TW_UINT16 format);
+    // The compression actually used, TIFF falls back to none where the one asked for does not apply,
+    // PDF has Group 4 for lineart and JPEG or Deflate for the rest
+    static TW_UINT16 FileCompression (TW_UINT16 format, TW_UINT16 compression, int samples, int depth);
+
+private:
+    void Write (const void * data, Size length);
+    void ConvertRow (const unsigned char * data);
+    void WritePngChunk (const char * type, const unsigned char * data, Size length);
+    void DeflatePng (int flush);
+
+    FILE * file;
+    TW_UINT16 format;
+    TW_UINT16 compression;
+    int width;
+    int height;
+    int samples;
+    int depth;
+    int filedepth;
+    Size filerowbytes;
+    double xdpi;
+    double ydpi;
+    bool failed;
+    int rows;
+    std::vector <unsigned char> row;
+
+    // TIFF and PDF
+    TiffWriter * tiff;
+    PdfWriter * pdf;
+    bool job;
+
+    // PNG
+    z_stream zstream;
+    bool zstreaminit;
+    std::vector <unsigned char> previous;
+    std::vector <unsigned char> filtered;
+    std::vector <unsigned char> deflated;
+
+    // JFIF
+    JpegEncoder * jpeg;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "Platform.h"
+
+#if defined (__SSSE3__)
+#include <tmmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define INTERLEAVE_NEON
+#endif
+
+#include "Interleave.h"
+
+
+void InterleaveChannel (const unsigned char * src, unsigned char * dest, Size samples, int channel, int bytes) {
+
+    Size i = 0;
+
+#if defined (__SSSE3__)
+    // Where each byte of 48 chunky bytes comes from in 16 bytes of the frame, negative for
+    // the bytes of the other two channels, which are kept
+    signed char index [48];
+    for (int j = 0; j < 48; j++) {
+        int sample = j / bytes;
+        index [j] = (sample % 3 == channel ? (sample / 3) * bytes + j % bytes : -1);
+    }
+    __m128i shuffle [3];
+    __m128i keep [3];
+    for (int k = 0; k < 3; k++) {
+        shuffle [k] = _mm_loadu_si128 ((const __m128i *) &index [16 * k]);
+        keep [k] = _mm_cmplt_epi8 (shuffle [k], _mm_setzero_si128 ());
+    }
+
+    Size step = 16 / bytes;
+    for (; i + step <= samples; i += step) {
+        __m128i frame = _mm_loadu_si128 ((const __m128i *) (src + i * bytes));
+        unsigned char * d = dest + 3 * i * bytes;
+        for (int k = 0; k < 3; k++) {
+            __m128i chunky = _mm_and_si128 (keep [k], _mm_loadu_si128 ((const __m128i *) (d + 16 * k)));
+            _mm_storeu_si128 ((__m128i *) (d + 16 * k), _mm_or_si128 (chunky, _mm_shuffle_epi8 (frame, shuffle [k])));
+        }
+    }
+#elif defined (INTERLEAVE_NEON)
+    if (bytes == 1)
+        for (; i + 16 <= samples; i += 16) {
+            uint8x16x3_t chunky = vld3q_u8 (dest + 3 * i);
+            chunky.val [channel] = vld1q_u8 (src + i);
+            vst3q_u8 (dest + 3 * i, chunky);
+        }
+    else
+        for (; i + 8 <= samples; i += 8) {
+            uint16x8x3_t chunky = vld3q_u16 ((const uint16_t *) (dest + 6 * i));
+            chunky.val [channel] = vreinterpretq_u16_u8 (vld1q_u8 (src + 2 * i));
+            vst3q_u16 ((uint16_t *) (dest + 6 * i), chunky);
+        }
+#endif
+
+    if (bytes == 1)
+        for (; i < samples; i++)
+            dest [3 * i + channel] = src [i];
+    else
+        for (; i < samples; i++) {
+            dest [2 * (3 * i + channel) + 0] = src [2 * i + 0];
+            dest [2 * (3 * i + channel) + 1] = src [2 * i + 1];
+        }
+}
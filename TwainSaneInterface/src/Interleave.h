@@ -0,0 +1,14 @@
+#ifndef SANE_DS_INTERLEAVE_H
+#define SANE_DS_INTERLEAVE_H
+
+#include "Platform.h"
+
+// Stores one row of a three-pass frame into its channel of a chunky RGB row, leaving the
+// other two channels as they are. The samples go 16 bytes at a time with SSSE3 shuffles or
+// NEON structure stores where the compiler has them.
+
+// samples samples of bytes (1 or 2) bytes each from src go to every third sample of dest,
+// starting at channel (0 for red, 1 for green, 2 for blue). dest holds 3 * samples samples.
+void InterleaveChannel (const unsigned char * src, unsigned char * dest, Size samples, int channel, int bytes);
+
+#endif
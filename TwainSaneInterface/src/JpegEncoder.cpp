@@ -0,0 +1,169 @@
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include "JpegEncoder.h"
+#include "Trace.h"
+
+#include <jerror.h>
+
+
+JpegEncoder::JpegEncoder (int width, int height, int components, int quality,
+                          const SANE_Resolution & res, FILE * file) : failed (false),
+                                                                      output (NULL),
+                                                                      chunk (0x10000),
+                                                                      row (width * components) {
+
+    // About the size of a page at quality 75
+    if (!file) output = new Buffer ((Size) width * height * components / 16 + 0x10000, MEMORY_COMPRESSED);
+
+    cinfo.mem = NULL;
+    cinfo.err = jpeg_std_error (&jerr);
+    jerr.error_exit = ErrorExit;
+    cinfo.client_data = this;
+
+    if (setjmp (failure)) {
+        failed = true;
+        return;
+    }
+
+    jpeg_create_compress (&cinfo);
+
+    if (file)
+        jpeg_stdio_dest (&cinfo, file);
+    else {
+        destination.init_destination = InitDestination;
+        destination.empty_output_buffer = EmptyOutputBuffer;
+        destination.term_destination = TermDestination;
+        cinfo.dest = &destination;
+    }
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = components;
+    cinfo.in_color_space = (components == 3 ? JCS_RGB : JCS_GRAYSCALE);
+    jpeg_set_defaults (&cinfo);
+    jpeg_set_quality (&cinfo, quality, TRUE);
+
+    cinfo.density_unit = 1;
+    if (res.type == SANE_TYPE_INT) {
+        cinfo.X_density = res.h;
+        cinfo.Y_density = res.v;
+    }
+    else {
+        cinfo.X_density = lround (SANE_UNFIX (res.h));
+        cinfo.Y_density = lround (SANE_UNFIX (res.v));
+    }
+
+    jpeg_start_compress (&cinfo, TRUE);
+}
+
+
+JpegEncoder::~JpegEncoder () {
+
+    jpeg_destroy_compress (&cinfo);
+    if (output) delete output;
+}
+
+
+// Rows past the height given to the constructor are dropped
+
+void JpegEncoder::WriteRow (const unsigned char * data, int depth) {
+
+    if (failed || cinfo.next_scanline >= cinfo.image_height) return;
+
+    JSAMPROW rowpointer = (JSAMPROW) data;
+
+    if (depth == 16) {
+#ifdef __BIG_ENDIAN__
+        const int high = 0;
+#else
+        const int high = 1;
+#endif
+        for (size_t i = 0; i < row.size (); i++)
+            row [i] = data [2 * i + high];
+        rowpointer = &row [0];
+    }
+
+    if (setjmp (failure)) {
+        failed = true;
+        return;
+    }
+
+    jpeg_write_scanlines (&cinfo, &rowpointer, 1);
+}
+
+
+// The JFIF stream, or NULL if the encoder failed, did not get all the rows or wrote to a file
+
+Handle JpegEncoder::Finish () {
+
+    TraceScope trace ("convert", "JPEG finish");
+
+    if (failed || cinfo.next_scanline < cinfo.image_height) {
+        failed = true;
+        return NULL;
+    }
+
+    if (setjmp (failure)) {
+        failed = true;
+        return NULL;
+    }
+
+    jpeg_finish_compress (&cinfo);
+
+    if (failed || !output) return NULL;
+    return output->Claim ();
+}
+
+
+bool JpegEncoder::Failed () {
+
+    return failed;
+}
+
+
+int JpegEncoder::Quality (TW_INT16 twainquality) {
+
+    switch (twainquality) {
+        case TWJQ_LOW:    return 50;
+        case TWJQ_MEDIUM: return 75;
+        case TWJQ_HIGH:   return 90;
+        default:          break;
+    }
+    if (twainquality < 1 || twainquality > 100) return 75;
+    return twainquality;
+}
+
+
+void JpegEncoder::InitDestination (j_compress_ptr cinfo) {
+
+    JpegEncoder * encoder = (JpegEncoder *) cinfo->client_data;
+    cinfo->dest->next_output_byte = (JOCTET *) encoder->output->GetPtr (encoder->chunk);
+    cinfo->dest->free_in_buffer = encoder->chunk;
+    if (!cinfo->dest->next_output_byte) ERREXIT (cinfo, JERR_OUT_OF_MEMORY);
+}
+
+
+boolean JpegEncoder::EmptyOutputBuffer (j_compress_ptr cinfo) {
+
+    JpegEncoder * encoder = (JpegEncoder *) cinfo->client_data;
+    encoder->output->ReleasePtr (encoder->chunk);
+    InitDestination (cinfo);
+    return TRUE;
+}
+
+
+void JpegEncoder::TermDestination (j_compress_ptr cinfo) {
+
+    JpegEncoder * encoder = (JpegEncoder *) cinfo->client_data;
+    encoder->output->ReleasePtr (encoder->chunk - cinfo->dest->free_in_buffer);
+}
+
+
+void JpegEncoder::ErrorExit (j_common_ptr cinfo) {
+
+    JpegEncoder * encoder = (JpegEncoder *) cinfo->client_data;
+    (*cinfo->err->output_message) (cinfo);
+    longjmp (encoder->failure, 1);
+}
@@ -0,0 +1,51 @@
+#ifndef SANE_DS_JPEGENCODER_H
+#define SANE_DS_JPEGENCODER_H
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <cstdio>
+#include <csetjmp>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "Buffer.h"
+#include "SaneDevice.h"
+
+// Streaming JFIF encoder, fed one row at a time while the image is still being scanned.
+// Rows are 8 bit gray or chunky RGB; 16 bit rows are reduced to their high bytes.
+// The stream goes to memory, or to a file when one is given.
+
+class JpegEncoder {
+
+public:
+    JpegEncoder (int width, int height, int components, int quality, const SANE_Resolution & res,
+                 FILE * file = NULL);
+    ~JpegEncoder ();
+    void WriteRow (const unsigned char * data, int depth);
+    Handle Finish ();
+    bool Failed ();
+
+    // Maps ICAP_JPEGQUALITY to the libjpeg quality scale
+    static int Quality (TW_INT16 twainquality);
+
+private:
+    static void InitDestination (j_compress_ptr cinfo);
+    static boolean EmptyOutputBuffer (j_compress_ptr cinfo);
+    static void TermDestination (j_compress_ptr cinfo);
+    static void ErrorExit (j_common_ptr cinfo);
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_destination_mgr destination;
+    jmp_buf failure;
+    bool failed;
+
+    Buffer * output;
+    Size chunk;
+    std::vector <unsigned char> row;
+};
+
+#endif
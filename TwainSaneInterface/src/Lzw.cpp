@@ -0,0 +1,101 @@
+#include "Platform.h"
+
+#include "Lzw.h"
+
+
+#define LZW_CLEAR 256
+#define LZW_EOI 257
+#define LZW_FIRST 258
+#define LZW_MAX 4095
+#define LZW_HASHSIZE 8192
+
+
+LzwEncoder::LzwEncoder () : hashkey (LZW_HASHSIZE),
+                            hashcode (LZW_HASHSIZE),
+                            prefix (-1),
+                            next (LZW_FIRST),
+                            width (9),
+                            bitbuffer (0),
+                            bitcount (0) {
+
+    Reset ();
+}
+
+
+void LzwEncoder::Reset () {
+
+    for (int i = 0; i < LZW_HASHSIZE; i++) hashkey [i] = -1;
+    next = LZW_FIRST;
+}
+
+
+void LzwEncoder::PutCode (int code, std::vector <unsigned char> & out) {
+
+    bitbuffer = (bitbuffer << width) | code;
+    bitcount += width;
+    while (bitcount >= 8) {
+        bitcount -= 8;
+        out.push_back ((unsigned char) (bitbuffer >> bitcount));
+    }
+}
+
+
+void LzwEncoder::Encode (const unsigned char * data, Size length, std::vector <unsigned char> & out) {
+
+    if (length == 0) return;
+
+    Size i = 0;
+    if (prefix < 0) {
+        PutCode (LZW_CLEAR, out);
+        prefix = data [i++];
+    }
+
+    for (; i < length; i++) {
+        int key = (prefix << 8) | data [i];
+        unsigned int slot = ((unsigned int) key * 2654435761U) >> 19;
+        while (hashkey [slot] != -1 && hashkey [slot] != key)
+            slot = (slot + 1) & (LZW_HASHSIZE - 1);
+        if (hashkey [slot] == key) {
+            prefix = hashcode [slot];
+            continue;
+        }
+
+        PutCode (prefix, out);
+        hashkey [slot] = key;
+        hashcode [slot] = next++;
+        prefix = data [i];
+
+        // Readers change the code width one code early, and the table is cleared before it overflows
+        if (next == LZW_MAX - 1) {
+            PutCode (LZW_CLEAR, out);
+            Reset ();
+            width = 9;
+        }
+        else if (next > (1 << width) - 1)
+            width++;
+    }
+}
+
+
+void LzwEncoder::Finish (std::vector <unsigned char> & out) {
+
+    if (prefix < 0)
+        PutCode (LZW_CLEAR, out);
+    else {
+        PutCode (prefix, out);
+        if (++next == LZW_MAX - 1) {
+            PutCode (LZW_CLEAR, out);
+            width = 9;
+        }
+        else if (next > (1 << width) - 1)
+            width++;
+    }
+    PutCode (LZW_EOI, out);
+    if (bitcount) out.push_back ((unsigned char) (bitbuffer << (8 - bitcount)));
+
+    prefix = -1;
+    bitbuffer = 0;
+    bitcount = 0;
+    Reset ();
+    width = 9;
+}
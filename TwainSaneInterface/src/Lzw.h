@@ -0,0 +1,31 @@
+#ifndef SANE_DS_LZW_H
+#define SANE_DS_LZW_H
+
+#include "Platform.h"
+
+#include <vector>
+
+// TIFF LZW encoder, with the early code width change that TIFF readers expect.
+// Each encoder makes one strip, starting with a clear code and ending with EOI.
+
+class LzwEncoder {
+
+public:
+    LzwEncoder ();
+    void Encode (const unsigned char * data, Size length, std::vector <unsigned char> & out);
+    void Finish (std::vector <unsigned char> & out);
+
+private:
+    void PutCode (int code, std::vector <unsigned char> & out);
+    void Reset ();
+
+    std::vector <int> hashkey;
+    std::vector <short> hashcode;
+    int prefix;
+    int next;
+    int width;
+    unsigned int bitbuffer;
+    int bitcount;
+};
+
+#endif
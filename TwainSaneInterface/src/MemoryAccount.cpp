@@ -0,0 +1,195 @@
+#include <pthread.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "MemoryAccount.h"
+#include "Platform.h"
+#include "Trace.h"
+
+
+struct MemoryStats {
+    volatile long long current;
+    volatile long long peak;
+    volatile long long allocations;
+    volatile long long allocated;
+    volatile long long resizes;
+};
+
+static const char * memoryTagName [MEMORY_TAGS] = {
+    "buffer",
+    "image",
+    "pict",
+    "preview",
+    "capability",
+    "compressed"
+};
+
+static MemoryStats memoryTags [MEMORY_TAGS];
+static MemoryStats memoryTotal;
+static volatile int memoryOverBudget = 0;
+
+static pthread_once_t memoryOnce = PTHREAD_ONCE_INIT;
+static long long memoryBudget = 0;
+
+
+static void MemoryInit () {
+
+    const char * budget = getenv ("SANE_DS_MEMORY_BUDGET");
+    if (budget && *budget)
+        memoryBudget = atoll (budget) * 1024 * 1024;
+    else {
+        long value;
+        if (PreferenceGetInt ("Memory Budget", &value) && value > 0)
+            memoryBudget = (long long) value * 1024 * 1024;
+    }
+}
+
+
+long long MemoryBudget () {
+
+    pthread_once (&memoryOnce, MemoryInit);
+    return memoryBudget;
+}
+
+
+static void MemoryPeak (volatile long long * peak, long long value) {
+
+    long long old = *peak;
+    while (value > old && !__sync_bool_compare_and_swap (peak, old, value))
+        old = *peak;
+}
+
+
+static void MemoryChange (MemoryTag tag, long long bytes) {
+
+    long long current = __sync_add_and_fetch (&memoryTags [tag].current, bytes);
+    MemoryPeak (&memoryTags [tag].peak, current);
+
+    long long total = __sync_add_and_fetch (&memoryTotal.current, bytes);
+    MemoryPeak (&memoryTotal.peak, total);
+
+    TraceCounter ("memory", total);
+
+    long long budget = MemoryBudget ();
+    if (!budget) return;
+
+    if (total > budget) {
+        if (__sync_bool_compare_and_swap (&memoryOverBudget, 0, 1)) {
+            fprintf (stderr, "SANE.ds: memory budget of %lld MB exceeded (%lld MB, %s)\n",
+                     budget / (1024 * 1024), total / (1024 * 1024), memoryTagName [tag]);
+            TraceInstant ("memory", "budget exceeded by %s", memoryTagName [tag]);
+        }
+    }
+    else
+        __sync_bool_compare_and_swap (&memoryOverBudget, 1, 0);
+}
+
+
+void MemoryAllocated (MemoryTag tag, long long bytes) {
+
+    __sync_add_and_fetch (&memoryTags [tag].allocations, 1);
+    __sync_add_and_fetch (&memoryTags [tag].allocated, bytes);
+    __sync_add_and_fetch (&memoryTotal.allocations, 1);
+    __sync_add_and_fetch (&memoryTotal.allocated, bytes);
+    MemoryChange (tag, bytes);
+}
+
+
+void MemoryReleased (MemoryTag tag, long long bytes) {
+
+    MemoryChange (tag, -bytes);
+}
+
+
+void MemoryResized (MemoryTag tag, long long oldbytes, long long newbytes) {
+
+    __sync_add_and_fetch (&memoryTags [tag].resizes, 1);
+    __sync_add_and_fetch (&memoryTotal.resizes, 1);
+    if (newbytes > oldbytes) {
+        __sync_add_and_fetch (&memoryTags [tag].allocated, newbytes - oldbytes);
+        __sync_add_and_fetch (&memoryTotal.allocated, newbytes - oldbytes);
+    }
+    MemoryChange (tag, newbytes - oldbytes);
+}
+
+
+void MemoryRetagged (MemoryTag from, MemoryTag to, long long bytes) {
+
+    if (from == to) return;
+    __sync_add_and_fetch (&memoryTags [to].allocations, 1);
+    __sync_add_and_fetch (&memoryTags [to].allocated, bytes);
+    MemoryChange (to, bytes);
+    MemoryChange (from, -bytes);
+}
+
+
+long long MemoryCurrent () {
+
+    return memoryTotal.current;
+}
+
+
+// For the benchmarks: the resizes so far and the peak since the last reset, of a tag or of
+// all of them for MEMORY_TAGS
+
+static MemoryStats & Stats (MemoryTag tag) {
+
+    return (tag == MEMORY_TAGS ? memoryTotal : memoryTags [tag]);
+}
+
+
+long long MemoryResizes (MemoryTag tag) {
+
+    return Stats (tag).resizes;
+}
+
+
+long long MemoryPeak (MemoryTag tag) {
+
+    return Stats (tag).peak;
+}
+
+
+void MemoryResetPeak (MemoryTag tag) {
+
+    Stats (tag).peak = Stats (tag).current;
+}
+
+
+bool MemoryOverBudget () {
+
+    return memoryOverBudget;
+}
+
+
+static void MemoryPrint (FILE * file, const char * name, const MemoryStats & stats) {
+
+    fprintf (file, "%-12s %14lld %14lld %12lld %16lld %10lld\n", name,
+             stats.current, stats.peak, stats.allocations, stats.allocated, stats.resizes);
+}
+
+
+void MemoryReport (FILE * file) {
+
+    fprintf (file, "%-12s %14s %14s %12s %16s %10s\n", "tag", "current", "peak", "allocations", "allocated",
+             "resizes");
+    for (int i = 0; i < MEMORY_TAGS; i++)
+        MemoryPrint (file, memoryTagName [i], memoryTags [i]);
+    MemoryPrint (file, "total", memoryTotal);
+    if (MemoryBudget ())
+        fprintf (file, "budget %lld bytes, %s\n", MemoryBudget (),
+                 memoryTotal.peak > MemoryBudget () ? "exceeded" : "not exceeded");
+}
+
+
+void MemoryFlush () {
+
+    const char * path = getenv ("SANE_DS_MEMORY");
+    if (!path || !*path) return;
+
+    FILE * file = fopen (path, "w");
+    if (!file) return;
+    MemoryReport (file);
+    fclose (file);
+}
@@ -0,0 +1,36 @@
+#ifndef SANE_DS_MEMORYACCOUNT_H
+#define SANE_DS_MEMORYACCOUNT_H
+
+#include <cstdio>
+
+// Accounting of the large allocations made during a session, by subsystem.
+// The budget is taken from SANE_DS_MEMORY_BUDGET or the "Memory Budget" preference (in MB).
+// Set SANE_DS_MEMORY to a file path to get a report when the source is closed.
+
+enum MemoryTag {
+    MEMORY_BUFFER,
+    MEMORY_IMAGE,
+    MEMORY_PICT,
+    MEMORY_PREVIEW,
+    MEMORY_CAPABILITY,
+    MEMORY_COMPRESSED,
+    MEMORY_TAGS
+};
+
+void MemoryAllocated (MemoryTag tag, long long bytes);
+void MemoryReleased (MemoryTag tag, long long bytes);
+void MemoryResized (MemoryTag tag, long long oldbytes, long long newbytes);
+void MemoryRetagged (MemoryTag from, MemoryTag to, long long bytes);
+
+long long MemoryCurrent ();
+// Per tag, MEMORY_TAGS for the total
+long long MemoryResizes (MemoryTag tag);
+long long MemoryPeak (MemoryTag tag);
+void MemoryResetPeak (MemoryTag tag);
+long long MemoryBudget ();
+bool MemoryOverBudget ();
+
+void MemoryReport (FILE * file);
+void MemoryFlush ();
+
+#endif
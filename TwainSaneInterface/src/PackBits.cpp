@@ -0,0 +1,121 @@
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define PACKBITS_NEON
+#endif
+
+#include "PackBits.h"
+
+
+// PackBits runs and literals are at most this long
+#define PACKBITS_MAX 128
+
+
+#if defined (__SSE2__)
+
+// One bit for each of the 16 bytes where the compare is true
+static inline unsigned int EqualMask (__m128i compare) {
+
+    return _mm_movemask_epi8 (compare);
+}
+
+#elif defined (PACKBITS_NEON)
+
+// Four bits for each of the 16 bytes where the compare is true
+static inline unsigned long long EqualMask (uint8x16_t compare) {
+
+    return vget_lane_u64 (vreinterpret_u64_u8 (vshrn_n_u16 (vreinterpretq_u16_u8 (compare), 4)), 0);
+}
+
+#endif
+
+
+// The number of bytes from p on that are the same as p [0], at most avail
+
+static inline Size RunLength (const unsigned char * p, Size avail) {
+
+    Size n = 1;
+
+#if defined (__SSE2__)
+    __m128i value = _mm_set1_epi8 (p [0]);
+    for (; n + 16 <= avail; n += 16) {
+        unsigned int differ = EqualMask (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (p + n)), value)) ^ 0xFFFF;
+        if (differ) return n + __builtin_ctz (differ);
+    }
+#elif defined (PACKBITS_NEON)
+    uint8x16_t value = vdupq_n_u8 (p [0]);
+    for (; n + 16 <= avail; n += 16) {
+        unsigned long long differ = ~EqualMask (vceqq_u8 (vld1q_u8 (p + n), value));
+        if (differ) return n + __builtin_ctzll (differ) / 4;
+    }
+#endif
+
+    while (n < avail && p [n] == p [0]) n++;
+    return n;
+}
+
+
+// The length of a literal starting at p: up to the next run of three, the end or the longest
+// literal, whatever comes first. avail is what is left of the row.
+
+static inline Size LiteralLength (const unsigned char * p, Size avail) {
+
+    Size limit = std::min (avail, (Size) PACKBITS_MAX);
+    // Where a run of three can still start
+    Size starts = (avail > 2 ? std::min (avail - 2, (Size) PACKBITS_MAX) : 0);
+    Size n = 1;
+
+#if defined (__SSE2__)
+    for (; n + 16 <= starts; n += 16) {
+        __m128i a = _mm_loadu_si128 ((const __m128i *) (p + n));
+        __m128i b = _mm_loadu_si128 ((const __m128i *) (p + n + 1));
+        __m128i c = _mm_loadu_si128 ((const __m128i *) (p + n + 2));
+        unsigned int triple = EqualMask (_mm_and_si128 (_mm_cmpeq_epi8 (a, b), _mm_cmpeq_epi8 (b, c)));
+        if (triple) return n + __builtin_ctz (triple);
+    }
+#elif defined (PACKBITS_NEON)
+    for (; n + 16 <= starts; n += 16) {
+        uint8x16_t a = vld1q_u8 (p + n);
+        uint8x16_t b = vld1q_u8 (p + n + 1);
+        uint8x16_t c = vld1q_u8 (p + n + 2);
+        unsigned long long triple = EqualMask (vandq_u8 (vceqq_u8 (a, b), vceqq_u8 (b, c)));
+        if (triple) return n + __builtin_ctzll (triple) / 4;
+    }
+#endif
+
+    for (; n < starts; n++)
+        if (p [n] == p [n + 1] && p [n + 1] == p [n + 2]) return n;
+    return limit;
+}
+
+
+Size PackBitsRow (const unsigned char * src, Size length, unsigned char * dest) {
+
+    const unsigned char * end = src + length;
+    unsigned char * dst = dest;
+
+    while (src < end) {
+        Size avail = end - src;
+        Size run = RunLength (src, std::min (avail, (Size) PACKBITS_MAX));
+        if (run > 1) {
+            *dst++ = 1 - run;
+            *dst++ = *src;
+            src += run;
+        }
+        else {
+            Size literal = LiteralLength (src, avail);
+            *dst++ = literal - 1;
+            memcpy (dst, src, literal);
+            dst += literal;
+            src += literal;
+        }
+    }
+
+    return dst - dest;
+}
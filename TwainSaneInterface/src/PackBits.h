@@ -0,0 +1,18 @@
+#ifndef SANE_DS_PACKBITS_H
+#define SANE_DS_PACKBITS_H
+
+#include "Platform.h"
+
+// PackBits encoder that makes the same bytes as the PackBits of QuickDraw, and of its stand-in
+// in PlatformPosix, but looks for runs 16 bytes at a time with SSE2 or NEON compares where
+// the compiler has them. It only writes to the memory it is given, so the strips of an image
+// can be packed by several threads at once.
+
+// Packs length bytes from src into dest and returns the packed size. dest needs room for
+// PackBitsBound (length) bytes.
+Size PackBitsRow (const unsigned char * src, Size length, unsigned char * dest);
+
+// One count byte for every 127 bytes, more than a row can ever grow to
+inline Size PackBitsBound (Size length) { return length + (length + 126) / 127; }
+
+#endif
@@ -0,0 +1,447 @@
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+
+#include "PdfWriter.h"
+#include "Group4.h"
+#include "JpegEncoder.h"
+#include "Trace.h"
+
+
+// Bitonal pages are cut into strips of about this size, each a Group 4 image of its own
+#define PDF_STRIP 0x10000
+
+// Deflated data is written in pieces of this size
+#define PDF_CHUNK 0x10000
+
+// Written by Finish, the first objects of the document
+#define PDF_CATALOG 1
+#define PDF_PAGES 2
+
+
+// Numbers in points, written without help from the locale
+static std::string Real (double value) {
+
+    long long fixed = llround (value * 1000);
+    char text [32];
+    snprintf (text, sizeof (text), "%lld.%03lld", fixed / 1000, fixed % 1000);
+    return text;
+}
+
+
+PdfWriter::PdfWriter (FILE * infile) : file (infile),
+                                       failed (false),
+                                       position (0),
+                                       offsets (PDF_PAGES + 1, 0),
+                                       compression (TWCP_NONE),
+                                       width (0),
+                                       height (0),
+                                       samples (1),
+                                       depth (1),
+                                       xdpi (72),
+                                       ydpi (72),
+                                       rowbytes (0),
+                                       rows (0),
+                                       pagestart (0),
+                                       firstobject (0),
+                                       inpage (false),
+                                       pageobject (0),
+                                       lengthobject (0),
+                                       streamstart (0),
+                                       jpeg (NULL),
+                                       zstreaminit (false),
+                                       rowsperstrip (0),
+                                       striprows (0) {
+
+    // The comment with high bytes tells file transfer programs that the file is binary
+    Print ("%%PDF-1.5\n%%\xE2\xE3\xCF\xD3\n");
+}
+
+
+PdfWriter::~PdfWriter () {
+
+    if (inpage) DropPage ();
+    EndEncoders ();
+}
+
+
+bool PdfWriter::Failed () {
+
+    return failed;
+}
+
+
+int PdfWriter::GetPages () {
+
+    return pageobjects.size ();
+}
+
+
+void PdfWriter::Write (const void * data, Size length) {
+
+    if (failed) return;
+    if (fwrite (data, 1, length, file) != (size_t) length) failed = true;
+    position += length;
+}
+
+
+void PdfWriter::Write (const std::string & text) {
+
+    Write (text.data (), text.size ());
+}
+
+
+void PdfWriter::Print (const char * format, ...) {
+
+    char text [256];
+    va_list args;
+    va_start (args, format);
+    int length = vsnprintf (text, sizeof (text), format, args);
+    va_end (args);
+    Write (text, std::min (length, (int) sizeof (text) - 1));
+}
+
+
+int PdfWriter::NewObject () {
+
+    offsets.push_back (0);
+    return offsets.size () - 1;
+}
+
+
+void PdfWriter::BeginObject (int object) {
+
+    offsets [object] = position;
+    Print ("%d 0 obj\n", object);
+}
+
+
+void PdfWriter::StartPage (TW_UINT16 incompression, TW_INT16 injpegquality, int inwidth, int inheight,
+                           int insamples, int indepth, const SANE_Resolution & inres) {
+
+    if (inpage) DropPage ();
+
+    compression = incompression;
+    width = inwidth;
+    height = inheight;
+    samples = insamples;
+    depth = indepth;
+    if (inres.type == SANE_TYPE_INT) {
+        xdpi = inres.h;
+        ydpi = inres.v;
+    }
+    else {
+        xdpi = SANE_UNFIX (inres.h);
+        ydpi = SANE_UNFIX (inres.v);
+    }
+    if (xdpi <= 0) xdpi = 72;
+    if (ydpi <= 0) ydpi = 72;
+    rowbytes = ((Size) width * samples * depth + 7) / 8;
+
+    rows = 0;
+    pagestart = position;
+    firstobject = offsets.size ();
+    inpage = true;
+    pageobject = 0;
+    images.clear ();
+    imagerows.clear ();
+
+    if (compression == TWCP_GROUP4) {
+        rowsperstrip = std::max ((Size) 1, PDF_STRIP / rowbytes);
+        if (height > 0 && rowsperstrip > height) rowsperstrip = height;
+        strip.resize (rowsperstrip * rowbytes);
+        striprows = 0;
+        return;
+    }
+
+    // One image for the whole page, its height has to be known up front
+    if (height <= 0) return;
+    BeginImage (height, 0);
+
+    if (compression == TWCP_JPEG) {
+        // libjpeg writes through the same stream, the position is picked up again at the end
+        if (fflush (file) != 0) failed = true;
+        jpeg = new JpegEncoder (width, height, samples, JpegEncoder::Quality (injpegquality), inres, file);
+    }
+    else {
+        memset (&zstream, 0, sizeof (zstream));
+        if (deflateInit (&zstream, Z_DEFAULT_COMPRESSION) == Z_OK)
+            zstreaminit = true;
+        else
+            failed = true;
+        previous.assign (rowbytes, 0);
+        swapped.resize (rowbytes);
+        filtered.resize (rowbytes + 1);
+        deflated.resize (PDF_CHUNK);
+        zstream.next_out = &deflated [0];
+        zstream.avail_out = deflated.size ();
+    }
+}
+
+
+// The dictionary of an image of the page, with its length given when it is already known
+
+void PdfWriter::BeginImage (int count, Size length) {
+
+    int object = NewObject ();
+    images.push_back (object);
+    imagerows.push_back (count);
+
+    BeginObject (object);
+    Print ("<< /Type /XObject /Subtype /Image /Width %d /Height %d /ColorSpace /%s",
+           width, count, (samples == 3 ? "DeviceRGB" : "DeviceGray"));
+
+    if (compression == TWCP_GROUP4)
+        Print (" /BitsPerComponent 1 /Filter /CCITTFaxDecode /DecodeParms << /K -1 /Columns %d /Rows %d >>",
+               width, count);
+    else if (compression == TWCP_JPEG)
+        Print (" /BitsPerComponent 8 /Filter /DCTDecode");
+    else {
+        // Rows are Up filtered as in PNG, lineart bits are set for black
+        Print (" /BitsPerComponent %d /Filter /FlateDecode", depth);
+        Print (" /DecodeParms << /Predictor 12 /Colors %d /BitsPerComponent %d /Columns %d >>",
+               samples, depth, width);
+        if (depth == 1) Print (samples == 3 ? " /Decode [1 0 1 0 1 0]" : " /Decode [1 0]");
+    }
+
+    if (length)
+        Print (" /Length %lu >>\nstream\n", (unsigned long) length);
+    else {
+        lengthobject = NewObject ();
+        Print (" /Length %d 0 R >>\nstream\n", lengthobject);
+    }
+    streamstart = position;
+}
+
+
+// Closes the stream of an image written while its length was not known
+
+void PdfWriter::EndImage () {
+
+    UInt64 length = position - streamstart;
+    Print ("\nendstream\nendobj\n");
+    BeginObject (lengthobject);
+    Print ("%llu\nendobj\n", (unsigned long long) length);
+}
+
+
+void PdfWriter::WriteRow (const unsigned char * data) {
+
+    if (!inpage || pageobject || failed || (height > 0 && rows >= height)) return;
+
+    if (compression == TWCP_GROUP4) {
+        memcpy (&strip [striprows * rowbytes], data, rowbytes);
+        if (++striprows == rowsperstrip) WriteStrip ();
+    }
+
+    else if (jpeg)
+        jpeg->WriteRow (data, depth);
+
+    else if (zstreaminit) {
+        if (depth == 1) {
+            filtered [0] = 0;
+            memcpy (&filtered [1], data, rowbytes);
+        }
+        else {
+            const unsigned char * row = data;
+#ifndef __BIG_ENDIAN__
+            // PDF samples are big endian
+            if (depth == 16) {
+                for (Size i = 0; i < rowbytes; i += 2) {
+                    swapped [i] = data [i + 1];
+                    swapped [i + 1] = data [i];
+                }
+                row = &swapped [0];
+            }
+#endif
+            filtered [0] = 2;
+            for (Size i = 0; i < rowbytes; i++)
+                filtered [i + 1] = row [i] - previous [i];
+            memcpy (&previous [0], row, rowbytes);
+        }
+        zstream.next_in = &filtered [0];
+        zstream.avail_in = rowbytes + 1;
+        Deflate (Z_NO_FLUSH);
+    }
+
+    rows++;
+}
+
+
+void PdfWriter::WriteStrip () {
+
+    TraceScope trace ("convert", "PDF strip");
+
+    packed.resize (striprows * Group4Encoder::WorstRow (width) + Group4Encoder::Trailer ());
+    Group4Encoder g4 ((Ptr) &packed [0], packed.size (), width);
+    for (int r = 0; r < striprows; r++)
+        g4.EncodeRow (&strip [r * rowbytes]);
+    Size length = g4.Finish ();
+
+    BeginImage (striprows, length);
+    Write (&packed [0], length);
+    Print ("\nendstream\nendobj\n");
+    striprows = 0;
+}
+
+
+void PdfWriter::Deflate (int flush) {
+
+    for (;;) {
+        int status = deflate (&zstream, flush);
+        if (status == Z_STREAM_ERROR) {
+            failed = true;
+            return;
+        }
+        if (zstream.avail_out == 0 || flush == Z_FINISH) {
+            Write (&deflated [0], deflated.size () - zstream.avail_out);
+            zstream.next_out = &deflated [0];
+            zstream.avail_out = deflated.size ();
+        }
+        if (flush == Z_FINISH ? status == Z_STREAM_END : zstream.avail_in == 0 && zstream.avail_out != 0)
+            break;
+    }
+}
+
+
+void PdfWriter::EndEncoders () {
+
+    if (jpeg) delete jpeg;
+    jpeg = NULL;
+    if (zstreaminit) deflateEnd (&zstream);
+    zstreaminit = false;
+}
+
+
+// Writes the rest of the images, the contents and the page object
+
+bool PdfWriter::EndPage () {
+
+    TraceScope trace ("convert", "PDF page");
+
+    if (!inpage || pageobject) return false;
+
+    bool complete = (rows > 0 && (height <= 0 || rows == height));
+
+    if (compression == TWCP_GROUP4) {
+        if (striprows) WriteStrip ();
+    }
+    else if (jpeg) {
+        jpeg->Finish ();
+        if (jpeg->Failed ()) complete = false;
+        if (fflush (file) != 0) failed = true;
+        off_t end = ftello (file);
+        if (end < 0) failed = true;
+        position = end;
+        EndImage ();
+    }
+    else if (zstreaminit) {
+        zstream.avail_in = 0;
+        Deflate (Z_FINISH);
+        EndImage ();
+    }
+    else
+        complete = false;
+    EndEncoders ();
+
+    if (!complete || failed) return false;
+
+    // The images are stacked from the top of the page down
+    double pagewidth = width * 72 / xdpi;
+    double pageheight = rows * 72 / ydpi;
+    std::string contents;
+    std::string resources;
+    int above = 0;
+    for (size_t i = 0; i < images.size (); i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "/Im%lu", (unsigned long) i);
+        above += imagerows [i];
+        contents += "q " + Real (pagewidth) + " 0 0 " + Real (imagerows [i] * 72 / ydpi) + " 0 " +
+                    Real ((rows - above) * 72 / ydpi) + " cm " + name + " Do Q\n";
+        char reference [32];
+        snprintf (reference, sizeof (reference), " %d 0 R", images [i]);
+        resources += std::string (" ") + name + reference;
+    }
+
+    int contentsobject = NewObject ();
+    BeginObject (contentsobject);
+    Print ("<< /Length %lu >>\nstream\n", (unsigned long) contents.size ());
+    Write (contents);
+    Print ("endstream\nendobj\n");
+
+    int object = NewObject ();
+    BeginObject (object);
+    Print ("<< /Type /Page /Parent %d 0 R /MediaBox [0 0 ", PDF_PAGES);
+    Write (Real (pagewidth) + " " + Real (pageheight));
+    Print ("]\n/Resources << /XObject <<");
+    Write (resources);
+    Print (" >> >>\n/Contents %d 0 R >>\nendobj\n", contentsobject);
+
+    if (failed) return false;
+    pageobject = object;
+    return true;
+}
+
+
+bool PdfWriter::LinkPage () {
+
+    if (!inpage || !pageobject) return false;
+    pageobjects.push_back (pageobject);
+    inpage = false;
+    pageobject = 0;
+    if (fflush (file) != 0) failed = true;
+    return !failed;
+}
+
+
+// Cuts the file back to where the page started
+
+void PdfWriter::DropPage () {
+
+    if (!inpage) return;
+
+    EndEncoders ();
+    inpage = false;
+    pageobject = 0;
+    offsets.resize (firstobject);
+    if (failed) return;
+    position = pagestart;
+    if (fflush (file) != 0 || ftruncate (fileno (file), pagestart) != 0 || fseeko (file, pagestart, SEEK_SET) != 0)
+        failed = true;
+}
+
+
+// The catalog, the page tree, the cross-reference table and the trailer
+
+bool PdfWriter::Finish () {
+
+    TraceScope trace ("convert", "PDF finish");
+
+    if (inpage) DropPage ();
+
+    BeginObject (PDF_CATALOG);
+    Print ("<< /Type /Catalog /Pages %d 0 R >>\nendobj\n", PDF_PAGES);
+
+    BeginObject (PDF_PAGES);
+    Print ("<< /Type /Pages /Count %lu /Kids [", (unsigned long) pageobjects.size ());
+    for (size_t i = 0; i < pageobjects.size (); i++)
+        Print ((i % 10 == 9 ? "%d 0 R\n" : "%d 0 R "), pageobjects [i]);
+    Print ("] >>\nendobj\n");
+
+    UInt64 xref = position;
+    Print ("xref\n0 %lu\n0000000000 65535 f \n", (unsigned long) offsets.size ());
+    for (size_t i = 1; i < offsets.size (); i++)
+        Print ("%010llu 00000 n \n", (unsigned long long) offsets [i]);
+    Print ("trailer\n<< /Size %lu /Root %d 0 R >>\nstartxref\n%llu\n%%%%EOF\n",
+           (unsigned long) offsets.size (), PDF_CATALOG, (unsigned long long) xref);
+
+    if (fflush (file) != 0) failed = true;
+    return !failed;
+}
@@ -0,0 +1,92 @@
+#ifndef SANE_DS_PDFWRITER_H
+#define SANE_DS_PDFWRITER_H
+
+#include "Platform.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "SaneDevice.h"
+
+class JpegEncoder;
+
+// Streaming PDF writer for one or more pages, each page one image. Bitonal pages are cut into
+// strips that are Group 4 encoded and embedded as CCITTFaxDecode images as they are, JPEG
+// pages are the JFIF stream of the encoder written straight into the image object, and
+// everything else is deflated. The objects of a page go to the file while it is scanned, and
+// as with the TIFF writer a page only becomes part of the document once it is linked.
+// The page tree, the cross-reference table and the trailer are written by Finish. Only the
+// offsets of the objects are kept until then, so memory use hardly grows with the job.
+
+class PdfWriter {
+
+public:
+    PdfWriter (FILE * infile);
+    ~PdfWriter ();
+    void StartPage (TW_UINT16 incompression, TW_INT16 injpegquality, int inwidth, int inheight, int insamples,
+                    int indepth, const SANE_Resolution & inres);
+    void WriteRow (const unsigned char * data);
+    bool EndPage ();
+    bool LinkPage ();
+    void DropPage ();
+    bool Finish ();
+    bool Failed ();
+    int GetPages ();
+
+private:
+    void Write (const void * data, Size length);
+    void Write (const std::string & text);
+    void Print (const char * format, ...);
+    int NewObject ();
+    void BeginObject (int object);
+    void BeginImage (int count, Size length);
+    void EndImage ();
+    void WriteStrip ();
+    void Deflate (int flush);
+    void EndEncoders ();
+
+    FILE * file;
+    bool failed;
+    UInt64 position;
+    std::vector <UInt64> offsets;
+    std::vector <int> pageobjects;
+
+    // The page being written
+    TW_UINT16 compression;
+    int width;
+    int height;
+    int samples;
+    int depth;
+    double xdpi;
+    double ydpi;
+    Size rowbytes;
+    int rows;
+    UInt64 pagestart;
+    int firstobject;
+    bool inpage;
+    int pageobject;
+    std::vector <int> images;
+    std::vector <int> imagerows;
+
+    // The image being written as one stream
+    int lengthobject;
+    UInt64 streamstart;
+    JpegEncoder * jpeg;
+    z_stream zstream;
+    bool zstreaminit;
+    std::vector <unsigned char> previous;
+    std::vector <unsigned char> swapped;
+    std::vector <unsigned char> filtered;
+    std::vector <unsigned char> deflated;
+
+    // The Group 4 strip being filled
+    int rowsperstrip;
+    int striprows;
+    std::vector <unsigned char> strip;
+    std::vector <unsigned char> packed;
+};
+
+#endif
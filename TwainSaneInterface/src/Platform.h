@@ -0,0 +1,37 @@
+#ifndef SANE_DS_PLATFORM_H
+#define SANE_DS_PLATFORM_H
+
+// The core (DataSource, SaneDevice, Image, Buffer) only depends on the host through this file:
+// memory handles, preferences and localization. Carbon on Mac OS X, PlatformPosix elsewhere.
+
+#ifdef __APPLE__
+#include <Carbon/Carbon.h>
+#include <TWAIN/TWAIN.h>
+#include <libkern/OSByteOrder.h>
+#include "MissingQD.h"
+#else
+#include <twain.h>
+#include "PlatformPosix.h"
+#endif
+
+#include <string>
+
+bool PreferenceGetInt (const char * key, long * value);
+bool PreferenceGetString (const char * key, std::string & value);
+void PreferenceSetInt (const char * key, long value);
+void PreferenceSetString (const char * key, const std::string & value);
+void PreferencesSynchronize ();
+
+// Nanoseconds from a clock that only runs forward, for timing: not set back by changes of the date
+UInt64 MonotonicNanoseconds ();
+
+std::string LocalizedString (const char * key);
+UInt32 BundleVersionNumber ();
+std::string BundleVersionString ();
+
+// TWAIN strings are Pascal strings on Mac OS X and C strings elsewhere
+void SetTwainString (void * twainstring, const char * string);
+bool EqualTwainString (const void * twainstring, const char * string);
+std::string GetTwainString (const void * twainstring);
+
+#endif
@@ -0,0 +1,133 @@
+#include <Carbon/Carbon.h>
+#include <mach/mach_time.h>
+
+#include <string>
+
+#include "Platform.h"
+#include "SaneDevice.h"
+
+
+bool PreferenceGetInt (const char * key, long * value) {
+
+    CFStringRef cfkey = CFStringCreateWithCString (NULL, key, kCFStringEncodingUTF8);
+    Boolean valid;
+    CFIndex cfvalue = CFPreferencesGetAppIntegerValue (cfkey, BNDLNAME, &valid);
+    CFRelease (cfkey);
+    if (valid) *value = cfvalue;
+    return valid;
+}
+
+
+bool PreferenceGetString (const char * key, std::string & value) {
+
+    CFStringRef cfkey = CFStringCreateWithCString (NULL, key, kCFStringEncodingUTF8);
+    CFStringRef cfvalue = (CFStringRef) CFPreferencesCopyAppValue (cfkey, BNDLNAME);
+    CFRelease (cfkey);
+    if (!cfvalue) return false;
+    bool valid = false;
+    if (CFGetTypeID (cfvalue) == CFStringGetTypeID ()) {
+        CFIndex size = CFStringGetMaximumSizeForEncoding (CFStringGetLength (cfvalue),
+                                                          kCFStringEncodingUTF8) + 1;
+        char * s = new char [size];
+        if (CFStringGetCString (cfvalue, s, size, kCFStringEncodingUTF8)) {
+            value = s;
+            valid = true;
+        }
+        delete[] s;
+    }
+    CFRelease (cfvalue);
+    return valid;
+}
+
+
+void PreferenceSetInt (const char * key, long value) {
+
+    CFStringRef cfkey = CFStringCreateWithCString (NULL, key, kCFStringEncodingUTF8);
+    CFNumberRef cfvalue = CFNumberCreate (NULL, kCFNumberLongType, &value);
+    CFPreferencesSetAppValue (cfkey, cfvalue, BNDLNAME);
+    CFRelease (cfvalue);
+    CFRelease (cfkey);
+}
+
+
+void PreferenceSetString (const char * key, const std::string & value) {
+
+    CFStringRef cfkey = CFStringCreateWithCString (NULL, key, kCFStringEncodingUTF8);
+    CFStringRef cfvalue = CFStringCreateWithCString (NULL, value.c_str (), kCFStringEncodingUTF8);
+    CFPreferencesSetAppValue (cfkey, cfvalue, BNDLNAME);
+    CFRelease (cfvalue);
+    CFRelease (cfkey);
+}
+
+
+void PreferencesSynchronize () {
+
+    CFPreferencesAppSynchronize (BNDLNAME);
+}
+
+
+UInt64 MonotonicNanoseconds () {
+
+    static mach_timebase_info_data_t timebase = { 0, 0 };
+    if (timebase.denom == 0) mach_timebase_info (&timebase);
+    return mach_absolute_time () * timebase.numer / timebase.denom;
+}
+
+
+static std::string CreateStdString (CFStringRef text) {
+
+    std::string s;
+    if (!text) return s;
+    CFIndex size = CFStringGetMaximumSizeForEncoding (CFStringGetLength (text), kCFStringEncodingUTF8) + 1;
+    char * c = new char [size];
+    if (CFStringGetCString (text, c, size, kCFStringEncodingUTF8)) s = c;
+    delete[] c;
+    return s;
+}
+
+
+std::string LocalizedString (const char * key) {
+
+    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (BNDLNAME);
+    CFStringRef cfkey = CFStringCreateWithCString (NULL, key, kCFStringEncodingUTF8);
+    CFStringRef text = CFBundleCopyLocalizedString (bundle, cfkey, NULL, NULL);
+    CFRelease (cfkey);
+    std::string s = CreateStdString (text);
+    if (text) CFRelease (text);
+    return s;
+}
+
+
+UInt32 BundleVersionNumber () {
+
+    return CFBundleGetVersionNumber (CFBundleGetBundleWithIdentifier (BNDLNAME));
+}
+
+
+std::string BundleVersionString () {
+
+    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (BNDLNAME);
+    return CreateStdString ((CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, CFSTR ("CFBundleVersion")));
+}
+
+
+void SetTwainString (void * twainstring, const char * string) {
+
+    unsigned char * p = (unsigned char *) twainstring;
+    p [0] = strlen (string);
+    memcpy (&p [1], string, p [0]);
+}
+
+
+bool EqualTwainString (const void * twainstring, const char * string) {
+
+    const unsigned char * p = (const unsigned char *) twainstring;
+    return (p [0] == strlen (string) && strncasecmp ((const char *) &p [1], string, p [0]) == 0);
+}
+
+
+std::string GetTwainString (const void * twainstring) {
+
+    const unsigned char * p = (const unsigned char *) twainstring;
+    return std::string ((const char *) &p [1], p [0]);
+}
@@ -0,0 +1,322 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include "Platform.h"
+#include "Alerts.h"
+
+#ifndef SANE_DS_VERSION
+#define SANE_DS_VERSION "3.6"
+#endif
+
+
+// A handle points at the first member of its master block, as on Mac OS
+
+struct MasterBlock {
+    Ptr ptr;
+    Size size;
+};
+
+static OSErr memError = noErr;
+
+
+Handle NewHandle (Size size) {
+
+    MasterBlock * block = (MasterBlock *) malloc (sizeof (MasterBlock));
+    if (block) {
+        block->ptr = (Ptr) malloc (size > 0 ? size : 1);
+        block->size = size;
+        if (!block->ptr) {
+            free (block);
+            block = NULL;
+        }
+    }
+    memError = (block ? noErr : memFullErr);
+    return (Handle) block;
+}
+
+
+void DisposeHandle (Handle handle) {
+
+    if (!handle) return;
+    MasterBlock * block = (MasterBlock *) handle;
+    free (block->ptr);
+    free (block);
+    memError = noErr;
+}
+
+
+Size GetHandleSize (Handle handle) {
+
+    if (!handle) {
+        memError = nilHandleErr;
+        return 0;
+    }
+    memError = noErr;
+    return ((MasterBlock *) handle)->size;
+}
+
+
+void SetHandleSize (Handle handle, Size size) {
+
+    if (!handle) {
+        memError = nilHandleErr;
+        return;
+    }
+    MasterBlock * block = (MasterBlock *) handle;
+    Ptr ptr = (Ptr) realloc (block->ptr, size > 0 ? size : 1);
+    if (!ptr) {
+        memError = memFullErr;
+        return;
+    }
+    block->ptr = ptr;
+    block->size = size;
+    memError = noErr;
+}
+
+
+void HLock (Handle handle) {}
+
+
+void HUnlock (Handle handle) {}
+
+
+OSErr MemError () {
+
+    return memError;
+}
+
+
+void PackBits (Ptr * srcPtr, Ptr * dstPtr, short srcBytes) {
+
+    const unsigned char * src = (const unsigned char *) *srcPtr;
+    const unsigned char * end = src + srcBytes;
+    unsigned char * dst = (unsigned char *) *dstPtr;
+
+    while (src < end) {
+        const unsigned char * run = src + 1;
+        while (run < end && run - src < 128 && *run == *src) run++;
+        if (run - src > 1) {
+            *dst++ = 1 - (run - src);
+            *dst++ = *src;
+            src = run;
+        }
+        else {
+            // Literal bytes up to the next run of at least three
+            const unsigned char * lit = src + 1;
+            while (lit < end && lit - src < 128 &&
+                   !(lit + 2 < end && lit [0] == lit [1] && lit [1] == lit [2])) lit++;
+            *dst++ = (lit - src) - 1;
+            memcpy (dst, src, lit - src);
+            dst += lit - src;
+            src = lit;
+        }
+    }
+
+    *srcPtr = (Ptr) src;
+    *dstPtr = (Ptr) dst;
+}
+
+
+// Preferences are kept as key=value lines in $XDG_CONFIG_HOME/twain-sane/preferences
+
+static std::map <std::string, std::string> * preferences = NULL;
+static bool preferencesChanged = false;
+
+
+static std::string PreferencesPath () {
+
+    std::string path;
+    const char * config = getenv ("XDG_CONFIG_HOME");
+    if (config && *config)
+        path = config;
+    else {
+        const char * home = getenv ("HOME");
+        path = std::string (home ? home : ".") + "/.config";
+    }
+    return path + "/twain-sane";
+}
+
+
+static std::string PreferencesEscape (const std::string & s) {
+
+    std::string escaped;
+    for (size_t i = 0; i < s.size (); i++)
+        switch (s [i]) {
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            case '=':
+                escaped += "\\e";
+                break;
+            default:
+                escaped += s [i];
+                break;
+        }
+    return escaped;
+}
+
+
+static std::string PreferencesUnescape (const std::string & s) {
+
+    std::string unescaped;
+    for (size_t i = 0; i < s.size (); i++)
+        if (s [i] == '\\' && i + 1 < s.size ()) {
+            i++;
+            unescaped += (s [i] == 'n' ? '\n' : s [i] == 'e' ? '=' : s [i]);
+        }
+        else
+            unescaped += s [i];
+    return unescaped;
+}
+
+
+static std::map <std::string, std::string> & Preferences () {
+
+    if (preferences) return *preferences;
+
+    preferences = new std::map <std::string, std::string>;
+
+    FILE * file = fopen ((PreferencesPath () + "/preferences").c_str (), "r");
+    if (!file) return *preferences;
+
+    std::string line;
+    int c;
+    while ((c = getc (file)) != EOF) {
+        if (c != '\n') {
+            line += (char) c;
+            continue;
+        }
+        size_t eq = line.find ('=');
+        if (eq != std::string::npos)
+            (*preferences) [PreferencesUnescape (line.substr (0, eq))] = PreferencesUnescape (line.substr (eq + 1));
+        line.clear ();
+    }
+    fclose (file);
+
+    return *preferences;
+}
+
+
+bool PreferenceGetInt (const char * key, long * value) {
+
+    std::string s;
+    if (!PreferenceGetString (key, s)) return false;
+    char * end;
+    *value = strtol (s.c_str (), &end, 10);
+    return (end != s.c_str () && *end == '\0');
+}
+
+
+bool PreferenceGetString (const char * key, std::string & value) {
+
+    std::map <std::string, std::string>::iterator it = Preferences ().find (key);
+    if (it == Preferences ().end ()) return false;
+    value = it->second;
+    return true;
+}
+
+
+void PreferenceSetInt (const char * key, long value) {
+
+    char s [32];
+    snprintf (s, sizeof (s), "%ld", value);
+    PreferenceSetString (key, s);
+}
+
+
+void PreferenceSetString (const char * key, const std::string & value) {
+
+    Preferences () [key] = value;
+    preferencesChanged = true;
+}
+
+
+void PreferencesSynchronize () {
+
+    if (!preferencesChanged) return;
+
+    std::string path = PreferencesPath ();
+    mkdir (path.substr (0, path.rfind ('/')).c_str (), 0755);
+    if (mkdir (path.c_str (), 0755) != 0 && errno != EEXIST) return;
+
+    std::string tmp = path + "/preferences.new";
+    FILE * file = fopen (tmp.c_str (), "w");
+    if (!file) return;
+    for (std::map <std::string, std::string>::iterator it = Preferences ().begin ();
+         it != Preferences ().end (); it++)
+        fprintf (file, "%s=%s\n", PreferencesEscape (it->first).c_str (),
+                 PreferencesEscape (it->second).c_str ());
+    if (fclose (file) == 0 && rename (tmp.c_str (), (path + "/preferences").c_str ()) == 0)
+        preferencesChanged = false;
+}
+
+
+UInt64 MonotonicNanoseconds () {
+
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (UInt64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Only the strings the core needs, with the values from English.lproj
+
+std::string LocalizedString (const char * key) {
+
+    if (strcmp (key, "sane-localization") == 0) return "en_US";
+    if (strcmp (key, "twain-language") == 0) return "13";
+    if (strcmp (key, "twain-country") == 0) return "1";
+    if (strcmp (key, "No image source explanation") == 0)
+        return "No image source was found by the SANE library.";
+    return key;
+}
+
+
+UInt32 BundleVersionNumber () {
+
+    // Same layout as CFBundleGetVersionNumber: major version in BCD, then minor and bug fix digits
+    int major = 0, minor = 0, bugfix = 0;
+    sscanf (SANE_DS_VERSION, "%d.%d.%d", &major, &minor, &bugfix);
+    return ((major / 10 % 10) << 28) | ((major % 10) << 24) | ((minor % 10) << 20) | ((bugfix % 10) << 16);
+}
+
+
+std::string BundleVersionString () {
+
+    return SANE_DS_VERSION;
+}
+
+
+void SetTwainString (void * twainstring, const char * string) {
+
+    strcpy ((char *) twainstring, string);
+}
+
+
+bool EqualTwainString (const void * twainstring, const char * string) {
+
+    return strcasecmp ((const char *) twainstring, string) == 0;
+}
+
+
+std::string GetTwainString (const void * twainstring) {
+
+    return (const char *) twainstring;
+}
+
+
+void NoDevice () {
+
+    fprintf (stderr, "SANE.ds: %s\n", LocalizedString ("No image source explanation").c_str ());
+}
@@ -0,0 +1,127 @@
+#ifndef SANE_DS_PLATFORMPOSIX_H
+#define SANE_DS_PLATFORMPOSIX_H
+
+// The parts of the Memory Manager and QuickDraw used by the core, for hosts without Carbon.
+// Handles keep the Mac OS semantics: a handle may move when resized, but not otherwise.
+
+#include <endian.h>
+#include <stdint.h>
+#include <strings.h>
+
+// Carbon.h brings these in on Mac OS X
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ && !defined (__BIG_ENDIAN__)
+#define __BIG_ENDIAN__ 1
+#endif
+
+typedef uint8_t  UInt8;
+typedef int8_t   SInt8;
+typedef uint16_t UInt16;
+typedef int16_t  SInt16;
+typedef uint32_t UInt32;
+typedef int32_t  SInt32;
+typedef uint64_t UInt64;
+typedef int64_t  SInt64;
+typedef unsigned char Boolean;
+typedef SInt32 Fixed;
+typedef SInt16 OSErr;
+typedef SInt32 OSStatus;
+typedef long Size;
+typedef char * Ptr;
+typedef Ptr * Handle;
+
+enum {
+    noErr      = 0,
+    memFullErr = -108,
+    nilHandleErr = -109
+};
+
+Handle NewHandle (Size size);
+void DisposeHandle (Handle handle);
+Size GetHandleSize (Handle handle);
+void SetHandleSize (Handle handle, Size size);
+void HLock (Handle handle);
+void HUnlock (Handle handle);
+OSErr MemError ();
+
+#define OSSwapHostToBigInt16(x) htobe16 (x)
+#define OSSwapHostToBigInt32(x) htobe32 (x)
+#define OSSwapBigToHostInt16(x) be16toh (x)
+#define OSSwapBigToHostInt32(x) be32toh (x)
+
+// QuickDraw picture structures, with the 68k alignment and 32 bit pointers of the PICT format
+
+#pragma pack(push, 2)
+
+struct QDPtr32 {
+    UInt32 value;
+    QDPtr32 & operator= (const void * p) { value = (UInt32) (uintptr_t) p; return *this; }
+};
+
+struct Rect {
+    SInt16 top;
+    SInt16 left;
+    SInt16 bottom;
+    SInt16 right;
+};
+
+struct RGBColor {
+    UInt16 red;
+    UInt16 green;
+    UInt16 blue;
+};
+
+struct ColorSpec {
+    SInt16 value;
+    RGBColor rgb;
+};
+
+struct ColorTable {
+    SInt32 ctSeed;
+    SInt16 ctFlags;
+    SInt16 ctSize;
+    ColorSpec ctTable [1];
+};
+
+typedef ColorTable ** CTabHandle;
+
+struct PixMap {
+    QDPtr32 baseAddr;
+    SInt16 rowBytes;
+    Rect bounds;
+    SInt16 pmVersion;
+    SInt16 packType;
+    SInt32 packSize;
+    Fixed hRes;
+    Fixed vRes;
+    SInt16 pixelType;
+    SInt16 pixelSize;
+    SInt16 cmpCount;
+    SInt16 cmpSize;
+    UInt32 pixelFormat;
+    QDPtr32 pmTable;
+    QDPtr32 pmExt;
+};
+
+#pragma pack(pop)
+
+typedef Handle PicHandle;
+
+enum {
+    srcCopy = 0
+};
+
+enum {
+    k1MonochromePixelFormat = 0x00000001,
+    k4IndexedPixelFormat    = 0x00000004,
+    k8IndexedPixelFormat    = 0x00000008,
+    k32ARGBPixelFormat      = 0x00000020
+};
+
+void PackBits (Ptr * srcPtr, Ptr * dstPtr, short srcBytes);
+
+#endif
@@ -9,6 +9,7 @@ extern "C" {
 #include "SaneCallback.h"
 #include "MakeControls.h"
 #include "SaneDevice.h"
+#include "SaneProfile.h"
 
 
 const EventTypeSpec commandProcessEvent [] = { { kEventClassCommand, kEventCommandProcess } };
@@ -0,0 +1,734 @@
+#define SANE_DS_CAPTURE_IMPLEMENTATION
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+#include <sane/saneopts.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "SaneCapture.h"
+
+
+// A capture file starts with a magic line, followed by records of a tag byte and little
+// endian fields. Strings and byte blocks are stored as a 32 bit length and the bytes.
+//   'D' device: name, vendor, model, type
+//   'O' options: count, then for each option its descriptor and its current value
+//   'S' sane_start: duration (64 bit ns), status
+//   'P' sane_get_parameters: duration, status, format, last_frame, bytes_per_line,
+//       pixels_per_line, lines, depth
+//   'R' sane_read: duration, status, data
+//   'C' sane_cancel
+
+#define CAPTURE_MAGIC "SANE.ds capture 1\n"
+
+static pthread_mutex_t captureMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void CapturePut (FILE * file, unsigned long long value, int bytes) {
+
+    for (int i = 0; i < bytes; i++)
+        putc ((value >> (8 * i)) & 0xFF, file);
+}
+
+
+static void CapturePutBytes (FILE * file, const void * data, size_t length) {
+
+    CapturePut (file, length, 4);
+    if (length) fwrite (data, 1, length, file);
+}
+
+
+static void CapturePutString (FILE * file, const char * string) {
+
+    CapturePutBytes (file, string, string ? strlen (string) : 0);
+}
+
+
+static bool CaptureGet (FILE * file, unsigned long long * value, int bytes) {
+
+    *value = 0;
+    for (int i = 0; i < bytes; i++) {
+        int c = getc (file);
+        if (c == EOF) return false;
+        *value |= (unsigned long long) c << (8 * i);
+    }
+    return true;
+}
+
+
+static bool CaptureGetInt (FILE * file, SANE_Word * value) {
+
+    unsigned long long v;
+    if (!CaptureGet (file, &v, 4)) return false;
+    *value = (SANE_Word) (unsigned int) v;
+    return true;
+}
+
+
+static bool CaptureGetBytes (FILE * file, std::string & data) {
+
+    unsigned long long length;
+    if (!CaptureGet (file, &length, 4) || length > 0x7FFFFFFF) return false;
+    data.resize (length);
+    return (length == 0 || fread (&data [0], 1, length, file) == length);
+}
+
+
+// Recording, one file for each handle a scan is started on: the first one is the file given,
+// the next ones that name with .2, .3 and so on appended
+
+static const char * capturePath = NULL;
+static int captureCount = 0;
+static std::map <SANE_Handle, FILE *> * captureFiles = NULL;
+static std::map <SANE_Handle, std::string> * captureNames = NULL;
+static const SANE_Device ** captureDevices = NULL;
+
+
+static FILE * CaptureFile (SANE_Handle handle) {
+
+    std::map <SANE_Handle, FILE *>::iterator it = captureFiles->find (handle);
+    return (it == captureFiles->end () ? NULL : it->second);
+}
+
+
+static FILE * CaptureDevice (SANE_Handle handle) {
+
+    FILE * captureFile = CaptureFile (handle);
+    if (captureFile) return captureFile;
+
+    std::string path = capturePath;
+    if (++captureCount > 1) {
+        char suffix [16];
+        snprintf (suffix, sizeof (suffix), ".%d", captureCount);
+        path += suffix;
+    }
+    captureFile = fopen (path.c_str (), "wb");
+    if (!captureFile) return NULL;
+    (*captureFiles) [handle] = captureFile;
+
+    fputs (CAPTURE_MAGIC, captureFile);
+
+    std::string name = (*captureNames) [handle];
+    const SANE_Device * device = NULL;
+    for (int i = 0; captureDevices && captureDevices [i]; i++)
+        if (name == captureDevices [i]->name) device = captureDevices [i];
+
+    putc ('D', captureFile);
+    CapturePutString (captureFile, name.c_str ());
+    CapturePutString (captureFile, device ? device->vendor : "");
+    CapturePutString (captureFile, device ? device->model : "");
+    CapturePutString (captureFile, device ? device->type : "");
+    return captureFile;
+}
+
+
+static void CaptureOptions (SANE_Handle handle, FILE * captureFile) {
+
+    SANE_Int count = 0;
+    sane_control_option (handle, 0, SANE_ACTION_GET_VALUE, &count, NULL);
+
+    putc ('O', captureFile);
+    CapturePut (captureFile, count > 1 ? count - 1 : 0, 4);
+
+    for (SANE_Int option = 1; option < count; option++) {
+        const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (handle, option);
+        SANE_Option_Descriptor empty;
+        if (!optdesc) {
+            memset (&empty, 0, sizeof (empty));
+            empty.type = SANE_TYPE_GROUP;
+            optdesc = &empty;
+        }
+
+        CapturePutString (captureFile, optdesc->name);
+        CapturePutString (captureFile, optdesc->title);
+        CapturePutString (captureFile, optdesc->desc);
+        CapturePut (captureFile, optdesc->type, 4);
+        CapturePut (captureFile, optdesc->unit, 4);
+        CapturePut (captureFile, optdesc->size, 4);
+        CapturePut (captureFile, optdesc->cap, 4);
+        CapturePut (captureFile, optdesc->constraint_type, 4);
+
+        switch (optdesc->constraint_type) {
+            case SANE_CONSTRAINT_RANGE:
+                CapturePut (captureFile, optdesc->constraint.range->min, 4);
+                CapturePut (captureFile, optdesc->constraint.range->max, 4);
+                CapturePut (captureFile, optdesc->constraint.range->quant, 4);
+                break;
+            case SANE_CONSTRAINT_WORD_LIST:
+                for (SANE_Int i = 0; i <= optdesc->constraint.word_list [0]; i++)
+                    CapturePut (captureFile, optdesc->constraint.word_list [i], 4);
+                break;
+            case SANE_CONSTRAINT_STRING_LIST: {
+                SANE_Int strings = 0;
+                while (optdesc->constraint.string_list [strings]) strings++;
+                CapturePut (captureFile, strings, 4);
+                for (SANE_Int i = 0; i < strings; i++)
+                    CapturePutString (captureFile, optdesc->constraint.string_list [i]);
+                break;
+            }
+            default:
+                break;
+        }
+
+        // Every option with a value gets one, so that it can be read and set on replay even if it
+        // only becomes active later. Those the backend does not give out are recorded as zeros.
+        bool valued = (optdesc->type != SANE_TYPE_GROUP && optdesc->type != SANE_TYPE_BUTTON &&
+                       optdesc->size > 0);
+        std::vector <char> value (valued ? optdesc->size : 1, 0);
+        if (valued && sane_control_option (handle, option, SANE_ACTION_GET_VALUE, &value [0], NULL) !=
+            SANE_STATUS_GOOD)
+            value.assign (value.size (), 0);
+        CapturePutBytes (captureFile, &value [0], valued ? optdesc->size : 0);
+    }
+}
+
+
+// Replay of recorded devices
+
+struct ReplayOption {
+    SANE_Option_Descriptor descriptor;
+    std::string name;
+    std::string title;
+    std::string desc;
+    std::vector <std::string> strings;
+    std::vector <SANE_String_Const> stringList;
+    std::vector <SANE_Word> wordList;
+    SANE_Range range;
+    std::string value;
+};
+
+struct ReplayChunk {
+    unsigned long long duration;
+    SANE_Status status;
+    std::string data;
+};
+
+struct ReplayFrame {
+    unsigned long long duration;
+    SANE_Status status;
+    SANE_Parameters param;
+    std::vector <ReplayChunk> chunks;
+};
+
+struct ReplayDevice {
+    SANE_Device device;
+    std::string name;
+    std::string vendor;
+    std::string model;
+    std::string type;
+    std::vector <ReplayOption *> options;
+    std::vector <ReplayFrame> frames;
+};
+
+struct ReplayHandle {
+    ReplayDevice * device;
+    std::vector <std::string> values;
+    size_t frame;
+    size_t chunk;
+    size_t offset;
+    bool scanning;
+};
+
+static std::vector <ReplayDevice *> * replayDevices = NULL;
+static std::map <SANE_Handle, ReplayHandle *> * replayHandles = NULL;
+static std::vector <const SANE_Device *> * deviceList = NULL;
+static double replayScale = 1;
+
+
+static bool ReplayReadOptions (FILE * file, ReplayDevice * device) {
+
+    SANE_Word count;
+    if (!CaptureGetInt (file, &count)) return false;
+
+    for (SANE_Word i = 0; i < count; i++) {
+        ReplayOption * option = new ReplayOption;
+        device->options.push_back (option);
+
+        SANE_Option_Descriptor & optdesc = option->descriptor;
+        memset (&optdesc, 0, sizeof (optdesc));
+
+        SANE_Word type, unit, constraint;
+        if (!CaptureGetBytes (file, option->name) || !CaptureGetBytes (file, option->title) ||
+            !CaptureGetBytes (file, option->desc) || !CaptureGetInt (file, &type) ||
+            !CaptureGetInt (file, &unit) || !CaptureGetInt (file, &optdesc.size) ||
+            !CaptureGetInt (file, &optdesc.cap) || !CaptureGetInt (file, &constraint)) return false;
+
+        optdesc.name = option->name.c_str ();
+        optdesc.title = option->title.c_str ();
+        optdesc.desc = option->desc.c_str ();
+        optdesc.type = (SANE_Value_Type) type;
+        optdesc.unit = (SANE_Unit) unit;
+        optdesc.constraint_type = (SANE_Constraint_Type) constraint;
+
+        switch (optdesc.constraint_type) {
+            case SANE_CONSTRAINT_RANGE:
+                if (!CaptureGetInt (file, &option->range.min) || !CaptureGetInt (file, &option->range.max) ||
+                    !CaptureGetInt (file, &option->range.quant)) return false;
+                optdesc.constraint.range = &option->range;
+                break;
+            case SANE_CONSTRAINT_WORD_LIST: {
+                SANE_Word words;
+                if (!CaptureGetInt (file, &words) || words < 0) return false;
+                option->wordList.push_back (words);
+                for (SANE_Word w = 0; w < words; w++) {
+                    SANE_Word word;
+                    if (!CaptureGetInt (file, &word)) return false;
+                    option->wordList.push_back (word);
+                }
+                optdesc.constraint.word_list = &option->wordList [0];
+                break;
+            }
+            case SANE_CONSTRAINT_STRING_LIST: {
+                SANE_Word strings;
+                if (!CaptureGetInt (file, &strings) || strings < 0) return false;
+                option->strings.resize (strings);
+                for (SANE_Word s = 0; s < strings; s++)
+                    if (!CaptureGetBytes (file, option->strings [s])) return false;
+                for (SANE_Word s = 0; s < strings; s++)
+                    option->stringList.push_back (option->strings [s].c_str ());
+                option->stringList.push_back (NULL);
+                optdesc.constraint.string_list = &option->stringList [0];
+                break;
+            }
+            default:
+                break;
+        }
+
+        if (!CaptureGetBytes (file, option->value)) return false;
+    }
+
+    return true;
+}
+
+
+static ReplayDevice * ReplayLoad (const std::string & path) {
+
+    FILE * file = fopen (path.c_str (), "rb");
+    if (!file) return NULL;
+
+    char magic [sizeof (CAPTURE_MAGIC)];
+    if (!fgets (magic, sizeof (magic), file) || strcmp (magic, CAPTURE_MAGIC) != 0) {
+        fclose (file);
+        return NULL;
+    }
+
+    ReplayDevice * device = new ReplayDevice;
+    bool ok = true;
+    bool haveOptions = false;
+    int tag;
+
+    while (ok && (tag = getc (file)) != EOF) {
+        unsigned long long duration;
+        SANE_Word status;
+        switch (tag) {
+            case 'D': {
+                std::string ignored;
+                ok = (CaptureGetBytes (file, ignored) && CaptureGetBytes (file, device->vendor) &&
+                      CaptureGetBytes (file, device->model) && CaptureGetBytes (file, device->type));
+                break;
+            }
+            case 'O':
+                // The device gets the options as they were at the first scan
+                if (!haveOptions)
+                    ok = ReplayReadOptions (file, device);
+                else {
+                    ReplayDevice later;
+                    ok = ReplayReadOptions (file, &later);
+                    for (size_t i = 0; i < later.options.size (); i++) delete later.options [i];
+                }
+                haveOptions = true;
+                break;
+            case 'S': {
+                ReplayFrame frame;
+                ok = (CaptureGet (file, &duration, 8) && CaptureGetInt (file, &status));
+                frame.duration = duration;
+                frame.status = (SANE_Status) status;
+                memset (&frame.param, 0, sizeof (frame.param));
+                device->frames.push_back (frame);
+                break;
+            }
+            case 'P': {
+                SANE_Word format, last_frame;
+                SANE_Parameters param;
+                ok = (CaptureGet (file, &duration, 8) && CaptureGetInt (file, &status) &&
+                      CaptureGetInt (file, &format) && CaptureGetInt (file, &last_frame) &&
+                      CaptureGetInt (file, &param.bytes_per_line) && CaptureGetInt (file, &param.pixels_per_line) &&
+                      CaptureGetInt (file, &param.lines) && CaptureGetInt (file, &param.depth));
+                param.format = (SANE_Frame) format;
+                param.last_frame = last_frame;
+                if (ok && status == SANE_STATUS_GOOD && !device->frames.empty ())
+                    device->frames.back ().param = param;
+                break;
+            }
+            case 'R': {
+                ReplayChunk chunk;
+                ok = (CaptureGet (file, &duration, 8) && CaptureGetInt (file, &status) &&
+                      CaptureGetBytes (file, chunk.data));
+                chunk.duration = duration;
+                chunk.status = (SANE_Status) status;
+                if (ok && !device->frames.empty ()) device->frames.back ().chunks.push_back (chunk);
+                break;
+            }
+            case 'C':
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+    fclose (file);
+
+    if (!ok || device->frames.empty ()) {
+        for (size_t i = 0; i < device->options.size (); i++) delete device->options [i];
+        delete device;
+        return NULL;
+    }
+
+    std::string base = path.substr (path.rfind ('/') + 1);
+    device->name = "replay:" + base.substr (0, base.rfind ('.'));
+    device->device.name = device->name.c_str ();
+    device->device.vendor = device->vendor.c_str ();
+    device->device.model = device->model.c_str ();
+    device->device.type = device->type.c_str ();
+
+    return device;
+}
+
+
+static void ReplayWait (unsigned long long duration) {
+
+    if (replayScale <= 0 || duration == 0) return;
+    unsigned long long ns = (unsigned long long) (duration * replayScale);
+    struct timespec ts = { (time_t) (ns / 1000000000ULL), (long) (ns % 1000000000ULL) };
+    while (nanosleep (&ts, &ts) != 0);
+}
+
+
+static ReplayHandle * ReplayFind (SANE_Handle handle) {
+
+    pthread_mutex_lock (&captureMutex);
+    std::map <SANE_Handle, ReplayHandle *>::iterator it = replayHandles->find (handle);
+    ReplayHandle * replay = (it == replayHandles->end () ? NULL : it->second);
+    pthread_mutex_unlock (&captureMutex);
+    return replay;
+}
+
+
+SANE_Status SaneCaptureInit (SANE_Int * version_code, SANE_Auth_Callback authorize) {
+
+    if (!replayDevices) {
+        replayDevices = new std::vector <ReplayDevice *>;
+        replayHandles = new std::map <SANE_Handle, ReplayHandle *>;
+        captureFiles = new std::map <SANE_Handle, FILE *>;
+        captureNames = new std::map <SANE_Handle, std::string>;
+        deviceList = new std::vector <const SANE_Device *>;
+
+        const char * path = getenv ("SANE_DS_CAPTURE");
+        if (path && *path) capturePath = strdup (path);
+
+        const char * scale = getenv ("SANE_DS_REPLAY_SCALE");
+        if (scale && *scale) replayScale = atof (scale);
+
+        const char * replay = getenv ("SANE_DS_REPLAY");
+        std::string paths = (replay ? replay : "");
+        for (size_t pos = 0; pos < paths.size (); ) {
+            size_t colon = paths.find (':', pos);
+            if (colon == std::string::npos) colon = paths.size ();
+            if (colon > pos) {
+                ReplayDevice * device = ReplayLoad (paths.substr (pos, colon - pos));
+                if (device)
+                    replayDevices->push_back (device);
+                else
+                    fprintf (stderr, "SANE.ds: can not replay %s\n", paths.substr (pos, colon - pos).c_str ());
+            }
+            pos = colon + 1;
+        }
+    }
+
+    return sane_init (version_code, authorize);
+}
+
+
+void SaneCaptureExit () {
+
+    if (captureFiles) {
+        for (std::map <SANE_Handle, FILE *>::iterator it = captureFiles->begin (); it != captureFiles->end (); it++)
+            fclose (it->second);
+        captureFiles->clear ();
+    }
+    sane_exit ();
+}
+
+
+SANE_Status SaneCaptureGetDevices (const SANE_Device *** device_list, SANE_Bool local_only) {
+
+    SANE_Status status = sane_get_devices (device_list, local_only);
+    if (status != SANE_STATUS_GOOD) return status;
+
+    captureDevices = *device_list;
+    if (replayDevices->empty ()) return status;
+
+    // The backend's devices followed by the recorded ones
+    deviceList->clear ();
+    for (int i = 0; (*device_list) [i]; i++) deviceList->push_back ((*device_list) [i]);
+    for (size_t i = 0; i < replayDevices->size (); i++) deviceList->push_back (&(*replayDevices) [i]->device);
+    deviceList->push_back (NULL);
+    *device_list = &(*deviceList) [0];
+
+    return status;
+}
+
+
+SANE_Status SaneCaptureOpen (SANE_String_Const devicename, SANE_Handle * handle) {
+
+    for (size_t i = 0; i < replayDevices->size (); i++) {
+        ReplayDevice * device = (*replayDevices) [i];
+        if (device->name != devicename) continue;
+        ReplayHandle * replay = new ReplayHandle;
+        replay->device = device;
+        for (size_t o = 0; o < device->options.size (); o++)
+            replay->values.push_back (device->options [o]->value);
+        replay->frame = device->frames.size () - 1;
+        replay->chunk = 0;
+        replay->offset = 0;
+        replay->scanning = false;
+        *handle = (SANE_Handle) replay;
+        pthread_mutex_lock (&captureMutex);
+        (*replayHandles) [*handle] = replay;
+        pthread_mutex_unlock (&captureMutex);
+        return SANE_STATUS_GOOD;
+    }
+
+    SANE_Status status = sane_open (devicename, handle);
+    if (status == SANE_STATUS_GOOD && capturePath) {
+        pthread_mutex_lock (&captureMutex);
+        (*captureNames) [*handle] = devicename;
+        pthread_mutex_unlock (&captureMutex);
+    }
+    return status;
+}
+
+
+void SaneCaptureClose (SANE_Handle handle) {
+
+    ReplayHandle * replay = ReplayFind (handle);
+    if (replay) {
+        pthread_mutex_lock (&captureMutex);
+        replayHandles->erase (handle);
+        pthread_mutex_unlock (&captureMutex);
+        delete replay;
+        return;
+    }
+
+    pthread_mutex_lock (&captureMutex);
+    FILE * captureFile = CaptureFile (handle);
+    if (captureFile) {
+        fclose (captureFile);
+        captureFiles->erase (handle);
+    }
+    captureNames->erase (handle);
+    pthread_mutex_unlock (&captureMutex);
+
+    sane_close (handle);
+}
+
+
+const SANE_Option_Descriptor * SaneCaptureGetOptionDescriptor (SANE_Handle handle, SANE_Int option) {
+
+    ReplayHandle * replay = ReplayFind (handle);
+    if (!replay) return sane_get_option_descriptor (handle, option);
+
+    static SANE_Option_Descriptor count = { SANE_NAME_NUM_OPTIONS, SANE_TITLE_NUM_OPTIONS,
+                                            SANE_DESC_NUM_OPTIONS, SANE_TYPE_INT, SANE_UNIT_NONE,
+                                            sizeof (SANE_Word), SANE_CAP_SOFT_DETECT,
+                                            SANE_CONSTRAINT_NONE, { NULL } };
+    if (option == 0) return &count;
+    if (option < 0 || option > (SANE_Int) replay->device->options.size ()) return NULL;
+    return &replay->device->options [option - 1]->descriptor;
+}
+
+
+SANE_Status SaneCaptureControlOption (SANE_Handle handle, SANE_Int option, SANE_Action action,
+                                      void * value, SANE_Int * info) {
+
+    ReplayHandle * replay = ReplayFind (handle);
+    if (!replay) return sane_control_option (handle, option, action, value, info);
+
+    if (info) *info = 0;
+
+    if (option == 0) {
+        if (action != SANE_ACTION_GET_VALUE) return SANE_STATUS_INVAL;
+        *(SANE_Word *) value = replay->device->options.size () + 1;
+        return SANE_STATUS_GOOD;
+    }
+    if (option < 0 || option > (SANE_Int) replay->device->options.size ()) return SANE_STATUS_INVAL;
+
+    // Values can be read and changed, but the image data is always the recorded one. Options
+    // without a value in the recording, groups and buttons, have nothing to read or set.
+    std::string & stored = replay->values [option - 1];
+    switch (action) {
+        case SANE_ACTION_GET_VALUE:
+            if (stored.empty ()) return SANE_STATUS_INVAL;
+            memcpy (value, stored.data (), stored.size ());
+            return SANE_STATUS_GOOD;
+        case SANE_ACTION_SET_VALUE:
+            if (stored.empty ()) return SANE_STATUS_INVAL;
+            stored.assign ((const char *) value, stored.size ());
+            return SANE_STATUS_GOOD;
+        default:
+            return SANE_STATUS_GOOD;
+    }
+}
+
+
+SANE_Status SaneCaptureGetParameters (SANE_Handle handle, SANE_Parameters * params) {
+
+    ReplayHandle * replay = ReplayFind (handle);
+    if (replay) {
+        size_t frame = (replay->scanning ? replay->frame : (replay->frame + 1) % replay->device->frames.size ());
+        *params = replay->device->frames [frame].param;
+        return SANE_STATUS_GOOD;
+    }
+
+    if (!capturePath) return sane_get_parameters (handle, params);
+
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_get_parameters (handle, params);
+    unsigned long long duration = MonotonicNanoseconds () - start;
+
+    pthread_mutex_lock (&captureMutex);
+    FILE * captureFile = CaptureFile (handle);
+    if (captureFile) {
+        putc ('P', captureFile);
+        CapturePut (captureFile, duration, 8);
+        CapturePut (captureFile, status, 4);
+        CapturePut (captureFile, params->format, 4);
+        CapturePut (captureFile, params->last_frame, 4);
+        CapturePut (captureFile, params->bytes_per_line, 4);
+        CapturePut (captureFile, params->pixels_per_line, 4);
+        CapturePut (captureFile, params->lines, 4);
+        CapturePut (captureFile, params->depth, 4);
+    }
+    pthread_mutex_unlock (&captureMutex);
+
+    return status;
+}
+
+
+SANE_Status SaneCaptureStart (SANE_Handle handle) {
+
+    ReplayHandle * replay = ReplayFind (handle);
+    if (replay) {
+        // Frames are replayed in order, and the recording starts over when it runs out
+        replay->frame = (replay->frame + 1) % replay->device->frames.size ();
+        replay->chunk = 0;
+        replay->offset = 0;
+        const ReplayFrame & frame = replay->device->frames [replay->frame];
+        ReplayWait (frame.duration);
+        replay->scanning = (frame.status == SANE_STATUS_GOOD);
+        return frame.status;
+    }
+
+    if (!capturePath) return sane_start (handle);
+
+    pthread_mutex_lock (&captureMutex);
+    FILE * captureFile = CaptureDevice (handle);
+    if (captureFile) CaptureOptions (handle, captureFile);
+    pthread_mutex_unlock (&captureMutex);
+
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_start (handle);
+    unsigned long long duration = MonotonicNanoseconds () - start;
+
+    pthread_mutex_lock (&captureMutex);
+    if (captureFile) {
+        putc ('S', captureFile);
+        CapturePut (captureFile, duration, 8);
+        CapturePut (captureFile, status, 4);
+    }
+    pthread_mutex_unlock (&captureMutex);
+
+    // The parameters of the frame, even if the caller does not ask for them
+    if (status == SANE_STATUS_GOOD) {
+        SANE_Parameters params;
+        SaneCaptureGetParameters (handle, &params);
+    }
+
+    return status;
+}
+
+
+SANE_Status SaneCaptureRead (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
+                             SANE_Int * length) {
+
+    ReplayHandle * replay = ReplayFind (handle);
+    if (replay) {
+        *length = 0;
+        if (!replay->scanning) return SANE_STATUS_CANCELLED;
+        const ReplayFrame & frame = replay->device->frames [replay->frame];
+        if (replay->chunk >= frame.chunks.size ()) return SANE_STATUS_EOF;
+        const ReplayChunk & chunk = frame.chunks [replay->chunk];
+        // Recorded chunks larger than the caller's buffer are handed out in parts
+        if (replay->offset == 0) ReplayWait (chunk.duration);
+        if (chunk.status != SANE_STATUS_GOOD) return chunk.status;
+        size_t bytes = chunk.data.size () - replay->offset;
+        if (bytes > (size_t) max_length) bytes = max_length;
+        memcpy (data, chunk.data.data () + replay->offset, bytes);
+        *length = bytes;
+        replay->offset += bytes;
+        if (replay->offset == chunk.data.size ()) {
+            replay->chunk++;
+            replay->offset = 0;
+        }
+        return SANE_STATUS_GOOD;
+    }
+
+    if (!capturePath) return sane_read (handle, data, max_length, length);
+
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_read (handle, data, max_length, length);
+    unsigned long long duration = MonotonicNanoseconds () - start;
+
+    pthread_mutex_lock (&captureMutex);
+    FILE * captureFile = CaptureFile (handle);
+    if (captureFile) {
+        putc ('R', captureFile);
+        CapturePut (captureFile, duration, 8);
+        CapturePut (captureFile, status, 4);
+        CapturePutBytes (captureFile, data, status == SANE_STATUS_GOOD ? *length : 0);
+    }
+    pthread_mutex_unlock (&captureMutex);
+
+    return status;
+}
+
+
+void SaneCaptureCancel (SANE_Handle handle) {
+
+    ReplayHandle * replay = ReplayFind (handle);
+    if (replay) {
+        replay->scanning = false;
+        return;
+    }
+
+    sane_cancel (handle);
+
+    if (!capturePath) return;
+
+    pthread_mutex_lock (&captureMutex);
+    FILE * captureFile = CaptureFile (handle);
+    if (captureFile) {
+        putc ('C', captureFile);
+        fflush (captureFile);
+    }
+    pthread_mutex_unlock (&captureMutex);
+}
@@ -0,0 +1,43 @@
+#ifndef SANE_DS_CAPTURE_H
+#define SANE_DS_CAPTURE_H
+
+#include <sane/sane.h>
+
+// Record and replay of SANE devices, below the profiling and network emulation layers.
+// Set SANE_DS_CAPTURE to a file path to record the option values, parameters and the raw
+// sane_read stream of every scan, with the time each call took in the backend. Each device
+// handle gets a file of its own: the first the path given, the next ones the path with .2, .3
+// and so on appended.
+// Set SANE_DS_REPLAY to a list of such files, separated by colons, to make each of them
+// available as a device "replay:<file name>". SANE_DS_REPLAY_SCALE scales the recorded
+// call times: 1 (the default) replays them as recorded, 0 replays as fast as possible.
+
+SANE_Status SaneCaptureInit (SANE_Int * version_code, SANE_Auth_Callback authorize);
+void SaneCaptureExit ();
+SANE_Status SaneCaptureGetDevices (const SANE_Device *** device_list, SANE_Bool local_only);
+SANE_Status SaneCaptureOpen (SANE_String_Const devicename, SANE_Handle * handle);
+void SaneCaptureClose (SANE_Handle handle);
+const SANE_Option_Descriptor * SaneCaptureGetOptionDescriptor (SANE_Handle handle, SANE_Int option);
+SANE_Status SaneCaptureControlOption (SANE_Handle handle, SANE_Int option, SANE_Action action,
+                                      void * value, SANE_Int * info);
+SANE_Status SaneCaptureGetParameters (SANE_Handle handle, SANE_Parameters * params);
+SANE_Status SaneCaptureStart (SANE_Handle handle);
+SANE_Status SaneCaptureRead (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
+                             SANE_Int * length);
+void SaneCaptureCancel (SANE_Handle handle);
+
+#ifndef SANE_DS_CAPTURE_IMPLEMENTATION
+#define sane_init                  SaneCaptureInit
+#define sane_exit                  SaneCaptureExit
+#define sane_get_devices           SaneCaptureGetDevices
+#define sane_open                  SaneCaptureOpen
+#define sane_close                 SaneCaptureClose
+#define sane_get_option_descriptor SaneCaptureGetOptionDescriptor
+#define sane_control_option        SaneCaptureControlOption
+#define sane_get_parameters        SaneCaptureGetParameters
+#define sane_start                 SaneCaptureStart
+#define sane_read                  SaneCaptureRead
+#define sane_cancel                SaneCaptureCancel
+#endif
+
+#endif
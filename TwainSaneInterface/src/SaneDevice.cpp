@@ -1,142 +1,36 @@
-#include <Carbon/Carbon.h>
-#include <TWAIN/TWAIN.h>
-
-#include <libintl.h>
+#include "Platform.h"
 
 #include <sane/sane.h>
 #include <sane/saneopts.h>
 
 #include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "SaneDevice.h"
-#include "SaneCallback.h"
 #include "Buffer.h"
 #include "Image.h"
-#include "UserInterface.h"
-#include "MakeControls.h"
 #include "DataSource.h"
+#include "Trace.h"
+#include "MemoryAccount.h"
+#include "SaneProfile.h"
+#include "JpegEncoder.h"
+#include "FileWriter.h"
+#include "ImageWriter.h"
+#include "Interleave.h"
+#include "ToneMap.h"
+#include "Histogram.h"
+#include "BlankPage.h"
 
 extern "C" {
 SANE_Status sane_constrain_value (const SANE_Option_Descriptor * opt, void * value, SANE_Word * info);
 }
 
-const EventTypeSpec commandProcessEvent [] = { { kEventClassCommand, kEventCommandProcess } };
-
-
-static OSStatus AlertEventHandler (EventHandlerCallRef inHandlerCallRef, EventRef inEvent,
-                                   void * inUserData) {
-
-    OSStatus osstat;
-
-    HICommandExtended cmd;
-    osstat = GetEventParameter (inEvent, kEventParamDirectObject, typeHICommand, NULL,
-                                sizeof (HICommandExtended), NULL, &cmd);
-    assert (osstat == noErr);
-
-    switch (cmd.commandID) {
-        case kHICommandOK:
-            osstat = QuitAppModalLoopForWindow ((WindowRef) inUserData);
-            assert (osstat == noErr);
-            return noErr;
-            break;
-        default:
-            return eventNotHandledErr;
-            break;
-    }
-}
-
-
-SaneDevice::SaneDevice (DataSource * ds) : currentDevice (-1),
-                                           datasource (ds),
-                                           userinterface (NULL),
-                                           image (NULL) {
-
-    SANE_Status status;
-
-    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (BNDLNAME);
-
-    CFStringRef sanelocalization =
-        CFBundleCopyLocalizedString (bundle, CFSTR ("sane-localization"), NULL, NULL);
-    char locale [16];
-    CFStringGetCString (sanelocalization, locale, 16, kCFStringEncodingUTF8);
-    CFRelease (sanelocalization);
-    setenv ("LANG", locale, 1);
-
-    CFStringRef SANELocaleDir =
-        (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, CFSTR ("SANELocaleDir"));
-    char localedir [64];
-    CFStringGetCString (SANELocaleDir, localedir, 64, kCFStringEncodingUTF8);
-    bindtextdomain ("sane-backends", localedir);
-    bind_textdomain_codeset ("sane-backends", "UTF-8");
-
-    status = sane_init (&saneversion, SaneAuthCallback);
-    assert (status == SANE_STATUS_GOOD);
-
-    status = sane_get_devices (&devicelist, false);
-    assert (status == SANE_STATUS_GOOD);
-
-    if (!devicelist || !(*devicelist)) return;
-
-    int firstDevice = -1;
-    CFStringRef deviceString =
-        (CFStringRef) CFPreferencesCopyAppValue (CFSTR ("Current Device"), BNDLNAME);
-    if (deviceString) {
-        if (CFGetTypeID (deviceString) == CFStringGetTypeID ()) {
-            for (int device = 0; firstDevice == -1 && devicelist [device]; device++) {
-                CFStringRef deviceListString = CreateName (device);
-                if (CFStringCompare (deviceString, deviceListString,
-                                     kCFCompareCaseInsensitive) == kCFCompareEqualTo)
-                    firstDevice = device;
-                CFRelease (deviceListString);
-            }
-        }
-        CFRelease (deviceString);
-    }
-    if (firstDevice == -1) firstDevice = 0;
-    int newDevice = ChangeDevice (firstDevice);
-    for (int device = 0; newDevice == -1 && devicelist [device]; device++) {
-        if (device == firstDevice) continue;
-        newDevice = ChangeDevice (device);
-    }
-}
-
-
-SaneDevice::~SaneDevice() {
-
-    HideUI ();
-    DequeueImage ();
-
-    if (currentDevice != -1) {
-        CFStringRef deviceString = CreateName ();
-        CFPreferencesSetAppValue (CFSTR ("Current Device"), deviceString, BNDLNAME);
-        CFRelease (deviceString);
-    }
-
-    for (std::map <int, SANE_Handle>::iterator svsh = sanehandles.begin ();
-         svsh != sanehandles.end(); svsh++) {
-
-        currentDevice = svsh->first;
-
-        CFStringRef deviceString = CreateName ();
-        CFStringRef deviceKey =
-            CFStringCreateWithFormat (NULL, NULL, CFSTR ("Device %@"), deviceString);
-        CFRelease (deviceString);
-        CFDictionaryRef optionDictionary = CreateOptionDictionary ();
-        CFPreferencesSetAppValue (deviceKey, optionDictionary, BNDLNAME);
-        CFRelease (deviceKey);
-        CFRelease (optionDictionary);
-
-        sane_close (GetSaneHandle ());
-    }
-
-    sane_exit ();
-
-    CFPreferencesAppSynchronize (BNDLNAME);
-}
-
 
 void SaneDevice::CallBack (TW_UINT16 MSG) {
 
@@ -144,700 +38,6 @@ void SaneDevice::CallBack (TW_UINT16 MSG) {
 }
 
 
-CFStringRef SaneDevice::CreateName (int device) {
-
-    if (device == -1) device = currentDevice;
-
-    if (!devicelist [device]) return NULL;
-
-    CFStringRef constvendor = CFStringCreateWithCString (NULL, devicelist [device]->vendor, kCFStringEncodingUTF8);
-    CFMutableStringRef vendor = CFStringCreateMutableCopy (NULL, 0, constvendor);
-    CFRelease(constvendor);
-    CFStringTrimWhitespace (vendor);
-
-    CFStringRef constmodel = CFStringCreateWithCString (NULL, devicelist [device]->model, kCFStringEncodingUTF8);
-    CFMutableStringRef model = CFStringCreateMutableCopy (NULL, 0, constmodel);
-    CFRelease(constmodel);
-    CFStringTrimWhitespace (model);
-
-    char * backend = (char *) devicelist [device]->name;
-    char * end = strchr (backend, ':');
-    if (strncmp (backend, "net:", 4) == 0) {
-        // IPv6 addresses should be between brackets
-        if (*(end + 1) == '[') end = strchr (end + 1, ']');
-        if (end) end = strchr (end + 1, ':');
-        if (end) backend = end + 1;
-        if (end) end = strchr (end + 1, ':');
-    }
-    if (end && strncmp (backend, "test:", 5) == 0) end = strchr (end + 1, ':');
-    int len = (end ? end - devicelist [device]->name : strlen (devicelist [device]->name));
-
-    char * n = new char [len + 1];
-    strncpy (n, devicelist [device]->name, len);
-    n [len] = '\0';
-    CFStringRef name = CFStringCreateWithCString (NULL, n, kCFStringEncodingUTF8);
-    delete[] n;
-
-    CFStringRef text = CFStringCreateWithFormat (NULL, NULL, CFSTR ("%@ %@ (%@)"), vendor, model, name);
-
-    CFRelease (name);
-    CFRelease (vendor);
-    CFRelease (model);
-
-    return text;
-}
-
-
-int SaneDevice::ChangeDevice (int device) {
-
-    SANE_Status status;
-
-    int oldDevice = currentDevice;
-    currentDevice = device;
-
-    if (!GetSaneHandle ()) {
-        SANE_Handle sanehandle;
-
-        UInt32 result;
-        do {
-            SaneCallbackDevice (this);
-            status = sane_open (devicelist [currentDevice]->name, &sanehandle);
-            result = SaneCallbackResult ();
-        }
-        while (status != SANE_STATUS_GOOD && result == kHICommandOK);
-
-        if (status != SANE_STATUS_GOOD) {
-            if (HasUI()) OpenDeviceFailed ();
-            currentDevice = oldDevice;
-            return currentDevice;
-        }
-
-        assert (status == SANE_STATUS_GOOD);
-        assert (sanehandle);
-        sanehandles [currentDevice] = sanehandle;
-
-        CFStringRef deviceString = CreateName ();
-        CFStringRef deviceKey =
-            CFStringCreateWithFormat (NULL, NULL, CFSTR ("Device %@"), deviceString);
-        CFRelease (deviceString);
-        CFDictionaryRef optionDictionary =
-            (CFDictionaryRef) CFPreferencesCopyAppValue (deviceKey, BNDLNAME);
-        CFRelease (deviceKey);
-        if (optionDictionary) {
-            if (CFGetTypeID (optionDictionary) == CFDictionaryGetTypeID ())
-                ApplyOptionDictionary (optionDictionary);
-            CFRelease (optionDictionary);
-        }
-    }
-
-    optionIndex.clear ();
-
-    for (int option = 1; const SANE_Option_Descriptor * optdesc =
-         sane_get_option_descriptor (GetSaneHandle (), option); option++)
-        if (optdesc->type != SANE_TYPE_GROUP) optionIndex [optdesc->name] = option;
-
-    return currentDevice;
-}
-
-
-void SaneDevice::ShowUI (bool uionly) {
-
-    userinterface = new UserInterface (this, currentDevice, uionly);
-}
-
-
-void SaneDevice::HideUI () {
-
-    if (userinterface) delete userinterface;
-    userinterface = NULL;
-}
-
-
-bool SaneDevice::HasUI () {
-
-    return (userinterface != NULL);
-}
-
-
-void SaneDevice::ShowSheetWindow (WindowRef window) {
-
-    if (userinterface) userinterface->ShowSheetWindow (window);
-}
-
-
-void SaneDevice::OpenDeviceFailed () {
-
-    OSStatus osstat;
-    OSErr oserr;
-
-    CFStringRef text;
-
-    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (CFSTR ("se.ellert.twain-sane"));
-
-    Rect windowrect = { 0, 0, 100, 500 };
-    WindowRef window;
-
-    if (HasUI()) {
-        osstat = CreateNewWindow (kSheetWindowClass,
-                                  kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
-                                  &windowrect, &window);
-        assert (osstat == noErr);
-
-        osstat = SetThemeWindowBackground (window, kThemeBrushSheetBackgroundOpaque, true);
-        assert (osstat == noErr);
-    }
-    else {
-        osstat = CreateNewWindow (kMovableModalWindowClass,
-                                  kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
-                                  &windowrect, &window);
-        assert (osstat == noErr);
-
-        osstat = SetThemeWindowBackground (window, kThemeBrushMovableModalBackground, true);
-        assert (osstat == noErr);
-
-        text = (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, kCFBundleNameKey);
-        osstat = SetWindowTitleWithCFString (window, text);
-        assert (osstat == noErr);
-    }
-
-    ControlRef rootcontrol;
-    oserr = GetRootControl (window, &rootcontrol);
-    assert (oserr == noErr);
-
-    Rect controlrect;
-
-    controlrect.top = 20;
-    controlrect.left = 20;
-    controlrect.bottom = controlrect.top + 64;
-    controlrect.right = controlrect.left + 64;
-
-    IconRef icon;
-    ControlButtonContentInfo contentinfo;
-    ControlRef iconcontrol;
-
-    oserr = GetIconRef (kOnSystemDisk, kSystemIconsCreator, kAlertStopIcon, &icon);
-    assert (oserr == noErr);
-
-    contentinfo.contentType = kControlContentIconRef;
-    contentinfo.u.iconRef = icon;
-    osstat = CreateIconControl (NULL, &controlrect, &contentinfo, true, &iconcontrol);
-    assert (osstat == noErr);
-
-    oserr = EmbedControl (iconcontrol, rootcontrol);
-    assert (oserr == noErr);
-
-    controlrect.top += 32;
-    controlrect.left += 32;
-
-    oserr = GetIconRef (kOnSystemDisk, 'SANE', 'APPL', &icon);
-    assert (oserr == noErr);
-
-    contentinfo.contentType = kControlContentIconRef;
-    contentinfo.u.iconRef = icon;
-    osstat = CreateIconControl (NULL, &controlrect, &contentinfo, true, &iconcontrol);
-    assert (osstat == noErr);
-
-    oserr = EmbedControl (iconcontrol, rootcontrol);
-    assert (oserr == noErr);
-
-    int bottom = controlrect.bottom;
-
-    controlrect.top = 20;
-    controlrect.left = controlrect.right + 20;
-    controlrect.right = windowrect.right - windowrect.left - 20;
-
-    CFStringRef dev = CreateName ();
-    CFStringRef format =
-        CFBundleCopyLocalizedString (bundle, CFSTR ("Could not open the image source %@"), NULL, NULL);
-    text = CFStringCreateWithFormat (NULL, NULL, format, dev);
-    CFRelease (format);
-    CFRelease (dev);
-    MakeStaticTextControl (rootcontrol, &controlrect, text, teFlushLeft, false);
-    CFRelease (text);
-
-    controlrect.top = std::max (controlrect.bottom + 20, bottom - 20);
-
-    text = CFBundleCopyLocalizedString (bundle, CFSTR ("OK"), NULL, NULL);
-    MakeButtonControl (rootcontrol, &controlrect, text, kHICommandOK, true, NULL, 0);
-    CFRelease (text);
-
-    windowrect.bottom = controlrect.bottom + 20;
-
-    osstat = SetWindowBounds (window, kWindowContentRgn, &windowrect);
-    assert (osstat == noErr);
-
-    osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
-    assert (osstat == noErr);
-
-    EventHandlerUPP AlertEventHandlerUPP = NewEventHandlerUPP (AlertEventHandler);
-    osstat = InstallWindowEventHandler (window, AlertEventHandlerUPP,
-                                        GetEventTypeCount (commandProcessEvent), commandProcessEvent,
-                                        window, NULL);
-    assert (osstat == noErr);
-
-    if (HasUI()) {
-        ShowSheetWindow (window);
-    }
-    else {
-        osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
-        assert (osstat == noErr);
-
-        ShowWindow (window);
-    }
-
-    osstat = RunAppModalLoopForWindow (window);
-    assert (osstat == noErr);
-
-    if (HasUI())
-        HideSheetWindow (window);
-    else
-        HideWindow (window);
-
-    DisposeEventHandlerUPP (AlertEventHandlerUPP);
-
-    DisposeWindow (window);
-}
-
-
-void SaneDevice::SaneError (SANE_Status status) {
-
-    OSStatus osstat;
-    OSErr oserr;
-
-    CFStringRef text;
-
-    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (CFSTR ("se.ellert.twain-sane"));
-
-    Rect windowrect = { 0, 0, 100, 500 };
-    WindowRef window;
-
-    if (HasUI()) {
-        osstat = CreateNewWindow (kSheetWindowClass,
-                                  kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
-                                  &windowrect, &window);
-        assert (osstat == noErr);
-
-        osstat = SetThemeWindowBackground (window, kThemeBrushSheetBackgroundOpaque, true);
-        assert (osstat == noErr);
-    }
-    else {
-        osstat = CreateNewWindow (kMovableModalWindowClass,
-                                  kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
-                                  &windowrect, &window);
-        assert (osstat == noErr);
-
-        osstat = SetThemeWindowBackground (window, kThemeBrushMovableModalBackground, true);
-        assert (osstat == noErr);
-
-        text = (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, kCFBundleNameKey);
-        osstat = SetWindowTitleWithCFString (window, text);
-        assert (osstat == noErr);
-    }
-
-    ControlRef rootcontrol;
-    oserr = GetRootControl (window, &rootcontrol);
-    assert (oserr == noErr);
-
-    Rect controlrect;
-
-    controlrect.top = 20;
-    controlrect.left = 20;
-    controlrect.bottom = controlrect.top + 64;
-    controlrect.right = controlrect.left + 64;
-
-    IconRef icon;
-    ControlButtonContentInfo contentinfo;
-    ControlRef iconcontrol;
-
-    oserr = GetIconRef (kOnSystemDisk, kSystemIconsCreator, kAlertStopIcon, &icon);
-    assert (oserr == noErr);
-
-    contentinfo.contentType = kControlContentIconRef;
-    contentinfo.u.iconRef = icon;
-    osstat = CreateIconControl (NULL, &controlrect, &contentinfo, true, &iconcontrol);
-    assert (osstat == noErr);
-
-    oserr = EmbedControl (iconcontrol, rootcontrol);
-    assert (oserr == noErr);
-
-    controlrect.top += 32;
-    controlrect.left += 32;
-
-    oserr = GetIconRef (kOnSystemDisk, 'SANE', 'APPL', &icon);
-    assert (oserr == noErr);
-
-    contentinfo.contentType = kControlContentIconRef;
-    contentinfo.u.iconRef = icon;
-    osstat = CreateIconControl (NULL, &controlrect, &contentinfo, true, &iconcontrol);
-    assert (osstat == noErr);
-
-    oserr = EmbedControl (iconcontrol, rootcontrol);
-    assert (oserr == noErr);
-
-    int bottom = controlrect.bottom;
-
-    controlrect.top = 20;
-    controlrect.left = controlrect.right + 20;
-    controlrect.right = windowrect.right - windowrect.left - 20;
-
-    text = CFStringCreateWithCString (NULL, sane_strstatus (status), kCFStringEncodingUTF8);
-    MakeStaticTextControl (rootcontrol, &controlrect, text, teFlushLeft, false);
-    CFRelease (text);
-
-    controlrect.top = std::max (controlrect.bottom + 20, bottom - 20);
-
-    text = CFBundleCopyLocalizedString (bundle, CFSTR ("OK"), NULL, NULL);
-    MakeButtonControl (rootcontrol, &controlrect, text, kHICommandOK, true, NULL, 0);
-    CFRelease (text);
-
-    windowrect.bottom = controlrect.bottom + 20;
-
-    osstat = SetWindowBounds (window, kWindowContentRgn, &windowrect);
-    assert (osstat == noErr);
-
-    osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
-    assert (osstat == noErr);
-
-    EventHandlerUPP AlertEventHandlerUPP = NewEventHandlerUPP (AlertEventHandler);
-    osstat = InstallWindowEventHandler (window, AlertEventHandlerUPP,
-                                        GetEventTypeCount (commandProcessEvent), commandProcessEvent,
-                                        window, NULL);
-    assert (osstat == noErr);
-
-    if (HasUI()) {
-        ShowSheetWindow (window);
-    }
-    else {
-        osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
-        assert (osstat == noErr);
-
-        ShowWindow (window);
-    }
-
-    osstat = RunAppModalLoopForWindow (window);
-    assert (osstat == noErr);
-
-    if (HasUI())
-        HideSheetWindow (window);
-    else
-        HideWindow (window);
-
-    DisposeEventHandlerUPP (AlertEventHandlerUPP);
-
-    DisposeWindow (window);
-}
-
-
-TW_UINT16 SaneDevice::GetCustomData (pTW_CUSTOMDSDATA customdata) {
-
-    CFMutableDictionaryRef dataDictionary =
-        CFDictionaryCreateMutable (NULL, 0, &kCFTypeDictionaryKeyCallBacks,
-                                   &kCFTypeDictionaryValueCallBacks);
-    CFStringRef deviceString = CreateName();
-    CFDictionaryAddValue (dataDictionary, CFSTR ("Current Device"), deviceString);
-    CFStringRef deviceKey = CFStringCreateWithFormat (NULL, NULL, CFSTR ("Device %@"), deviceString);
-    CFRelease (deviceString);
-    CFDictionaryRef optionDictionary = CreateOptionDictionary ();
-    CFDictionaryAddValue (dataDictionary, deviceKey, optionDictionary);
-    CFRelease (deviceKey);
-    CFRelease (optionDictionary);
-
-    CFDataRef xml = CFPropertyListCreateXMLData (NULL, dataDictionary);
-    CFRelease (dataDictionary);
-
-    customdata->InfoLength = CFDataGetLength (xml);
-    customdata->hData = (TW_HANDLE) NewHandle (customdata->InfoLength);
-    HLock ((Handle) customdata->hData);
-    CFDataGetBytes (xml, CFRangeMake (0, customdata->InfoLength), (UInt8 *) *(Handle) customdata->hData);
-    HUnlock ((Handle) customdata->hData);
-
-    CFRelease (xml);
-
-    return TWRC_SUCCESS;
-}
-
-
-TW_UINT16 SaneDevice::SetCustomData (pTW_CUSTOMDSDATA customdata) {
-
-    bool done = false;
-
-    HLock ((Handle) customdata->hData);
-    CFDataRef xml = CFDataCreate (NULL, (UInt8 *) *(Handle) customdata->hData, customdata->InfoLength);
-    HUnlock ((Handle) customdata->hData);
-
-    CFDictionaryRef dataDictionary =
-        (CFDictionaryRef) CFPropertyListCreateFromXMLData (NULL, xml, kCFPropertyListImmutable, NULL);
-    CFRelease (xml);
-
-    if (dataDictionary) {
-        if (CFGetTypeID (dataDictionary) == CFDictionaryGetTypeID ()) {
-            CFStringRef deviceString =
-                (CFStringRef) CFDictionaryGetValue (dataDictionary, CFSTR ("Current Device"));
-            if (deviceString && CFGetTypeID (deviceString) == CFStringGetTypeID ()) {
-                for (int device = 0; devicelist [device]; device++) {
-                    CFStringRef deviceListString = CreateName (device);
-                    if (CFStringCompare (deviceString, deviceListString,
-                                         kCFCompareCaseInsensitive) == kCFCompareEqualTo) {
-                        if (ChangeDevice (device) == device) {
-                            CFStringRef deviceKey =
-                                CFStringCreateWithFormat (NULL, NULL, CFSTR ("Device %@"), deviceString);
-                            CFDictionaryRef optionDictictionary =
-                                (CFDictionaryRef) CFDictionaryGetValue (dataDictionary, deviceKey);
-                            CFRelease (deviceKey);
-                            if (optionDictictionary &&
-                                CFGetTypeID (optionDictictionary) == CFDictionaryGetTypeID ()) {
-                                ApplyOptionDictionary (optionDictictionary);
-                                done = true;
-                            }
-                        }
-                    }
-                    CFRelease (deviceListString);
-                }
-            }
-        }
-        CFRelease (dataDictionary);
-    }
-
-    return (done ? TWRC_SUCCESS : datasource->SetStatus (TWCC_OPERATIONERROR));
-}
-
-
-CFDictionaryRef SaneDevice::CreateOptionDictionary () {
-
-    SANE_Status status;
-
-    CFMutableDictionaryRef dict =
-        CFDictionaryCreateMutable (NULL, 0, &kCFTypeDictionaryKeyCallBacks,
-                                   &kCFTypeDictionaryValueCallBacks);
-
-    for (int option = 1; const SANE_Option_Descriptor * optdesc =
-         sane_get_option_descriptor (GetSaneHandle (), option); option++) {
-
-        if (optdesc->type != SANE_TYPE_GROUP &&
-            SANE_OPTION_IS_ACTIVE (optdesc->cap) && SANE_OPTION_IS_GETTABLE (optdesc->cap)) {
-
-            CFStringRef key = CFStringCreateWithCString (NULL, optdesc->name, kCFStringEncodingUTF8);
-
-            switch (optdesc->type) {
-
-                case SANE_TYPE_BOOL:
-
-                    SANE_Bool optval;
-                    status = sane_control_option (GetSaneHandle (), option,
-                                                  SANE_ACTION_GET_VALUE, &optval, NULL);
-                    assert (status == SANE_STATUS_GOOD);
-                    CFDictionaryAddValue (dict, key, (optval ? kCFBooleanTrue : kCFBooleanFalse));
-                    break;
-
-                case SANE_TYPE_INT:
-
-                    if (optdesc->size > sizeof (SANE_Word)) {
-                        SANE_Word * optval = new SANE_Word [optdesc->size / sizeof (SANE_Word)];
-                        status = sane_control_option (GetSaneHandle (), option,
-                                                      SANE_ACTION_GET_VALUE, optval, NULL);
-                        assert (status == SANE_STATUS_GOOD);
-                        CFMutableArrayRef cfarray =
-                            CFArrayCreateMutable (NULL, 0, &kCFTypeArrayCallBacks);
-                        for (int i = 0; i < optdesc->size / sizeof (SANE_Word); i++) {
-                            CFNumberRef cfvalue =
-                                CFNumberCreate (NULL, kCFNumberIntType, &optval [i]);
-                            CFArrayAppendValue (cfarray, cfvalue);
-                            CFRelease (cfvalue);
-                        }
-                        delete[] optval;
-                        CFDictionaryAddValue (dict, key, cfarray);
-                        CFRelease (cfarray);
-                    }
-                    else {
-                        SANE_Word optval;
-                        status = sane_control_option (GetSaneHandle (), option,
-                                                      SANE_ACTION_GET_VALUE, &optval, NULL);
-                        assert (status == SANE_STATUS_GOOD);
-                        CFNumberRef cfvalue = CFNumberCreate (NULL, kCFNumberIntType, &optval);
-                        CFDictionaryAddValue (dict, key, cfvalue);
-                        CFRelease (cfvalue);
-                    }
-                    break;
-
-                case SANE_TYPE_FIXED:
-
-                    if (optdesc->size > sizeof (SANE_Word)) {
-                        SANE_Word * optval = new SANE_Word [optdesc->size / sizeof (SANE_Word)];
-                        status = sane_control_option (GetSaneHandle (), option,
-                                                      SANE_ACTION_GET_VALUE, optval, NULL);
-                        assert (status == SANE_STATUS_GOOD);
-                        CFMutableArrayRef cfarray =
-                            CFArrayCreateMutable (NULL, 0, &kCFTypeArrayCallBacks);
-                        for (int i = 0; i < optdesc->size / sizeof (SANE_Word); i++) {
-                            double val = SANE_UNFIX (optval [i]);
-                            CFNumberRef cfvalue = CFNumberCreate (NULL, kCFNumberDoubleType, &val);
-                            CFArrayAppendValue (cfarray, cfvalue);
-                            CFRelease (cfvalue);
-                        }
-                        delete[] optval;
-                        CFDictionaryAddValue (dict, key, cfarray);
-                        CFRelease (cfarray);
-                    }
-                    else {
-                        SANE_Word optval;
-                        status = sane_control_option (GetSaneHandle (), option,
-                                                      SANE_ACTION_GET_VALUE, &optval, NULL);
-                        assert (status == SANE_STATUS_GOOD);
-                        double val = SANE_UNFIX (optval);
-                        CFNumberRef cfvalue = CFNumberCreate (NULL, kCFNumberDoubleType, &val);
-                        CFDictionaryAddValue (dict, key, cfvalue);
-                        CFRelease (cfvalue);
-                    }
-                    break;
-
-                case SANE_TYPE_STRING: {
-
-                    SANE_String optval = new char [optdesc->size];
-                    status = sane_control_option (GetSaneHandle (), option,
-                                                  SANE_ACTION_GET_VALUE, optval, NULL);
-                    assert (status == SANE_STATUS_GOOD);
-                    CFStringRef cfvalue = CFStringCreateWithCString (NULL, optval,
-                                                                     kCFStringEncodingUTF8);
-                    delete[] optval;
-                    CFDictionaryAddValue (dict, key, cfvalue);
-                    CFRelease (cfvalue);
-                    break;
-                }
-
-                default:
-                    break;
-            }
-
-            CFRelease (key);
-        }
-    }
-
-    return dict;
-}
-
-
-void SaneDevice::ApplyOptionDictionary (CFDictionaryRef dict) {
-
-    SANE_Status status;
-
-    for (int option = 1; const SANE_Option_Descriptor * optdesc =
-         sane_get_option_descriptor (GetSaneHandle (), option); option++) {
-
-        if (optdesc->type != SANE_TYPE_GROUP &&
-            SANE_OPTION_IS_ACTIVE (optdesc->cap) && SANE_OPTION_IS_SETTABLE (optdesc->cap)) {
-
-            CFStringRef key = CFStringCreateWithCString (NULL, optdesc->name, kCFStringEncodingUTF8);
-
-            switch (optdesc->type) {
-
-                case SANE_TYPE_BOOL: {
-
-                    CFBooleanRef cfvalue = (CFBooleanRef) CFDictionaryGetValue (dict, key);
-                    if (cfvalue && CFGetTypeID (cfvalue) == CFBooleanGetTypeID ()) {
-                        SANE_Bool optval = CFBooleanGetValue (cfvalue);
-                        status = sane_control_option (GetSaneHandle (), option,
-                                                      SANE_ACTION_SET_VALUE, &optval, NULL);
-                        assert (status == SANE_STATUS_GOOD);
-                    }
-                    break;
-                }
-
-                case SANE_TYPE_INT:
-
-                    if (optdesc->size > sizeof (SANE_Word)) {
-                        CFArrayRef cfarray = (CFArrayRef) CFDictionaryGetValue (dict, key);
-                        if (cfarray && CFGetTypeID (cfarray) == CFArrayGetTypeID () &&
-                            CFArrayGetCount (cfarray) == optdesc->size / sizeof (SANE_Word)) {
-                            SANE_Word * optval = new SANE_Word [optdesc->size / sizeof (SANE_Word)];
-                            status = sane_control_option (GetSaneHandle (), option,
-                                                          SANE_ACTION_GET_VALUE, optval, NULL);
-                            assert (status == SANE_STATUS_GOOD);
-                            for (int i = 0; i < optdesc->size / sizeof (SANE_Word); i++) {
-                                CFNumberRef cfvalue =
-                                    (CFNumberRef) CFArrayGetValueAtIndex (cfarray, i);
-                                if (cfvalue && CFGetTypeID (cfvalue) == CFNumberGetTypeID ())
-                                    CFNumberGetValue (cfvalue, kCFNumberIntType, &optval [i]);
-                            }
-                            status = sane_control_option (GetSaneHandle (), option,
-                                                          SANE_ACTION_SET_VALUE, optval, NULL);
-                            assert (status == SANE_STATUS_GOOD);
-                            delete[] optval;
-                        }
-                    }
-                    else {
-                        CFNumberRef cfvalue = (CFNumberRef) CFDictionaryGetValue (dict, key);
-                        if (cfvalue && CFGetTypeID (cfvalue) == CFNumberGetTypeID ()) {
-                            SANE_Word optval;
-                            CFNumberGetValue (cfvalue, kCFNumberIntType, &optval);
-                            status = sane_control_option (GetSaneHandle (), option,
-                                                          SANE_ACTION_SET_VALUE, &optval, NULL);
-                            assert (status == SANE_STATUS_GOOD);
-                        }
-                    }
-                    break;
-
-                case SANE_TYPE_FIXED:
-
-                    if (optdesc->size > sizeof (SANE_Word)) {
-                        CFArrayRef cfarray = (CFArrayRef) CFDictionaryGetValue (dict, key);
-                        if (cfarray && CFGetTypeID (cfarray) == CFArrayGetTypeID () &&
-                            CFArrayGetCount (cfarray) == optdesc->size / sizeof (SANE_Word)) {
-                            SANE_Word * optval = new SANE_Word [optdesc->size / sizeof (SANE_Word)];
-                            status = sane_control_option (GetSaneHandle (), option,
-                                                          SANE_ACTION_GET_VALUE, optval, NULL);
-                            assert (status == SANE_STATUS_GOOD);
-                            for (int i = 0; i < optdesc->size / sizeof (SANE_Word); i++) {
-                                CFNumberRef cfvalue =
-                                    (CFNumberRef) CFArrayGetValueAtIndex (cfarray, i);
-                                if (cfvalue && CFGetTypeID (cfvalue) == CFNumberGetTypeID ()) {
-                                    double val;
-                                    CFNumberGetValue (cfvalue, kCFNumberDoubleType, &val);
-                                    optval [i] = SANE_FIX (val);
-                                }
-                            }
-                            status = sane_control_option (GetSaneHandle (), option,
-                                                          SANE_ACTION_SET_VALUE, optval, NULL);
-                            assert (status == SANE_STATUS_GOOD);
-                            delete[] optval;
-                        }
-                    }
-                    else {
-                        CFNumberRef cfvalue = (CFNumberRef) CFDictionaryGetValue (dict, key);
-                        if (cfvalue && CFGetTypeID (cfvalue) == CFNumberGetTypeID ()) {
-                            double val;
-                            CFNumberGetValue (cfvalue, kCFNumberDoubleType, &val);
-                            SANE_Word optval = SANE_FIX (val);
-                            status = sane_control_option (GetSaneHandle (), option,
-                                                          SANE_ACTION_SET_VALUE, &optval, NULL);
-                            assert (status == SANE_STATUS_GOOD);
-                        }
-                    }
-                    break;
-
-                case SANE_TYPE_STRING: {
-
-                    CFStringRef cfvalue = (CFStringRef) CFDictionaryGetValue (dict, key);
-                    if (cfvalue && CFGetTypeID (cfvalue) == CFStringGetTypeID ()) {
-                        SANE_String optval = new char [optdesc->size];
-                        CFStringGetCString (cfvalue, optval, optdesc->size, kCFStringEncodingUTF8);
-                        status = sane_control_option (GetSaneHandle (), option,
-                                                      SANE_ACTION_SET_VALUE, optval, NULL);
-                        assert (status == SANE_STATUS_GOOD);
-                        delete[] optval;
-                    }
-                    break;
-                }
-
-                default:
-                    break;
-            }
-
-            CFRelease (key);
-        }
-    }
-}
-
-
 void SaneDevice::GetRect (SANE_Rect * rect) {
 
     int option;
@@ -1410,6 +610,7 @@ TW_UINT16 SaneDevice::GetBitDepth (pTW_CAPABILITY capability, bool onlyone) {
         case SANE_CONSTRAINT_WORD_LIST: {
 
             pTW_UINT16 itemlist = new TW_UINT16 [optdesc->constraint.word_list [0]];
+            MemoryAllocated (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_UINT16));
             TW_UINT32 currentindex = 0;
             for (int i = 0; i < optdesc->constraint.word_list [0]; i++) {
                 itemlist [i] = optdesc->constraint.word_list [i + 1];
@@ -1418,6 +619,7 @@ TW_UINT16 SaneDevice::GetBitDepth (pTW_CAPABILITY capability, bool onlyone) {
             TW_UINT16 retval = datasource->BuildEnumeration (capability, TWTY_UINT16,
                                                              optdesc->constraint.word_list [0],
                                                              currentindex, 0, itemlist);
+            MemoryReleased (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_UINT16));
             delete[] itemlist;
             return retval;
             break;
@@ -1657,6 +859,7 @@ TW_UINT16 SaneDevice::GetXResolution (pTW_CAPABILITY capability, bool onlyone) {
         case SANE_CONSTRAINT_WORD_LIST: {
 
             pTW_FIX32 itemlist = new TW_FIX32 [optdesc->constraint.word_list [0]];
+            MemoryAllocated (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_FIX32));
             TW_UINT32 currentindex = 0;
             TW_UINT32 defaultindex = 0;
             for (int i = 0; i < optdesc->constraint.word_list [0]; i++) {
@@ -1671,6 +874,7 @@ TW_UINT16 SaneDevice::GetXResolution (pTW_CAPABILITY capability, bool onlyone) {
             TW_UINT16 retval = datasource->BuildEnumeration (capability, TWTY_FIX32,
                                                              optdesc->constraint.word_list [0],
                                                              currentindex, defaultindex, itemlist);
+            MemoryReleased (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_FIX32));
             delete[] itemlist;
             return retval;
             break;
@@ -1790,6 +994,7 @@ TW_UINT16 SaneDevice::GetYResolution (pTW_CAPABILITY capability, bool onlyone) {
         case SANE_CONSTRAINT_WORD_LIST: {
 
             pTW_FIX32 itemlist = new TW_FIX32 [optdesc->constraint.word_list [0]];
+            MemoryAllocated (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_FIX32));
             TW_UINT32 currentindex = 0;
             TW_UINT32 defaultindex = 0;
             for (int i = 0; i < optdesc->constraint.word_list [0]; i++) {
@@ -1804,6 +1009,7 @@ TW_UINT16 SaneDevice::GetYResolution (pTW_CAPABILITY capability, bool onlyone) {
             TW_UINT16 retval = datasource->BuildEnumeration (capability, TWTY_FIX32,
                                                              optdesc->constraint.word_list [0],
                                                              currentindex, defaultindex, itemlist);
+            MemoryReleased (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_FIX32));
             delete[] itemlist;
             return retval;
             break;
@@ -1982,7 +1188,7 @@ TW_UINT16 SaneDevice::GetPhysicalHeight (pTW_CAPABILITY capability) {
 TW_UINT16 SaneDevice::GetBrightness (pTW_CAPABILITY capability, bool onlyone) {
 
     int option = optionIndex [SANE_NAME_BRIGHTNESS];
-    if (!option) return datasource->SetStatus (TWCC_CAPUNSUPPORTED);
+    if (!option) return GetSoftTone (capability, onlyone, softbrightness);
 
     const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (GetSaneHandle (), option);
 
@@ -2027,6 +1233,7 @@ TW_UINT16 SaneDevice::GetBrightness (pTW_CAPABILITY capability, bool onlyone) {
         case SANE_CONSTRAINT_WORD_LIST: {
 
             pTW_FIX32 itemlist = new TW_FIX32 [optdesc->constraint.word_list [0]];
+            MemoryAllocated (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_FIX32));
             TW_UINT32 currentindex = 0;
             TW_UINT32 defaultindex = 0;
             for (int i = 0; i < optdesc->constraint.word_list [0]; i++) {
@@ -2040,6 +1247,7 @@ TW_UINT16 SaneDevice::GetBrightness (pTW_CAPABILITY capability, bool onlyone) {
             TW_UINT16 retval = datasource->BuildEnumeration (capability, TWTY_FIX32,
                                                              optdesc->constraint.word_list [0],
                                                              currentindex, defaultindex, itemlist);
+            MemoryReleased (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_FIX32));
             delete[] itemlist;
             return retval;
             break;
@@ -2058,7 +1266,7 @@ TW_UINT16 SaneDevice::GetBrightness (pTW_CAPABILITY capability, bool onlyone) {
 TW_UINT16 SaneDevice::GetBrightnessDefault (pTW_CAPABILITY capability) {
 
     int option = optionIndex [SANE_NAME_BRIGHTNESS];
-    if (!option) return datasource->SetStatus (TWCC_CAPUNSUPPORTED);
+    if (!option) return datasource->BuildOneValue (capability, TWTY_FIX32, S2T (0));
 
     const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (GetSaneHandle (), option);
 
@@ -2074,7 +1282,7 @@ TW_UINT16 SaneDevice::GetBrightnessDefault (pTW_CAPABILITY capability) {
 TW_UINT16 SaneDevice::SetBrightness (pTW_CAPABILITY capability) {
 
     int option = optionIndex [SANE_NAME_BRIGHTNESS];
-    if (!option) return datasource->SetStatus (TWCC_CAPUNSUPPORTED);
+    if (!option) return SetSoftTone (capability, softbrightness);
 
     const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (GetSaneHandle (), option);
 
@@ -2106,7 +1314,7 @@ TW_UINT16 SaneDevice::SetBrightness (pTW_CAPABILITY capability) {
 TW_UINT16 SaneDevice::GetContrast (pTW_CAPABILITY capability, bool onlyone) {
 
     int option = optionIndex [SANE_NAME_CONTRAST];
-    if (!option) return datasource->SetStatus (TWCC_CAPUNSUPPORTED);
+    if (!option) return GetSoftTone (capability, onlyone, softcontrast);
 
     const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (GetSaneHandle (), option);
 
@@ -2151,6 +1359,7 @@ TW_UINT16 SaneDevice::GetContrast (pTW_CAPABILITY capability, bool onlyone) {
         case SANE_CONSTRAINT_WORD_LIST: {
 
             pTW_FIX32 itemlist = new TW_FIX32 [optdesc->constraint.word_list [0]];
+            MemoryAllocated (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_FIX32));
             TW_UINT32 currentindex = 0;
             TW_UINT32 defaultindex = 0;
             for (int i = 0; i < optdesc->constraint.word_list [0]; i++) {
@@ -2164,6 +1373,7 @@ TW_UINT16 SaneDevice::GetContrast (pTW_CAPABILITY capability, bool onlyone) {
             TW_UINT16 retval = datasource->BuildEnumeration (capability, TWTY_FIX32,
                                                              optdesc->constraint.word_list [0],
                                                              currentindex, defaultindex, itemlist);
+            MemoryReleased (MEMORY_CAPABILITY, optdesc->constraint.word_list [0] * sizeof (TW_FIX32));
             delete[] itemlist;
             return retval;
             break;
@@ -2182,7 +1392,7 @@ TW_UINT16 SaneDevice::GetContrast (pTW_CAPABILITY capability, bool onlyone) {
 TW_UINT16 SaneDevice::GetContrastDefault (pTW_CAPABILITY capability) {
 
     int option = optionIndex [SANE_NAME_CONTRAST];
-    if (!option) return datasource->SetStatus (TWCC_CAPUNSUPPORTED);
+    if (!option) return datasource->BuildOneValue (capability, TWTY_FIX32, S2T (0));
 
     const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (GetSaneHandle (), option);
 
@@ -2198,7 +1408,7 @@ TW_UINT16 SaneDevice::GetContrastDefault (pTW_CAPABILITY capability) {
 TW_UINT16 SaneDevice::SetContrast (pTW_CAPABILITY capability) {
 
     int option = optionIndex [SANE_NAME_CONTRAST];
-    if (!option) return datasource->SetStatus (TWCC_CAPUNSUPPORTED);
+    if (!option) return SetSoftTone (capability, softcontrast);
 
     const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (GetSaneHandle (), option);
 
@@ -2227,6 +1437,30 @@ TW_UINT16 SaneDevice::SetContrast (pTW_CAPABILITY capability) {
 }
 
 
+// Backends without brightness or contrast options get them in software, see ToneMap
+
+TW_UINT16 SaneDevice::GetSoftTone (pTW_CAPABILITY capability, bool onlyone, SANE_Fixed value) {
+
+    if (onlyone) return datasource->BuildOneValue (capability, TWTY_FIX32, S2T (value));
+    return datasource->BuildRange (capability, TWTY_FIX32, S2T (SANE_INT2FIX (-1000)), S2T (SANE_INT2FIX (1000)),
+                                   S2T (SANE_INT2FIX (1)), S2T (0), S2T (value));
+}
+
+
+TW_UINT16 SaneDevice::SetSoftTone (pTW_CAPABILITY capability, SANE_Fixed & value) {
+
+    if (!capability) {
+        value = 0;
+        return TWRC_SUCCESS;
+    }
+
+    if (capability->ConType != TWON_ONEVALUE) return datasource->SetStatus (TWCC_BADVALUE);
+    SANE_Fixed requested = T2S (*((TW_FIX32*) &(((pTW_ONEVALUE) *(Handle) capability->hContainer)->Item)));
+    value = std::max (SANE_INT2FIX (-1000), std::min (requested, SANE_INT2FIX (1000)));
+    return (value != requested ? TWRC_CHECKSTATUS : TWRC_SUCCESS);
+}
+
+
 TW_UINT16 SaneDevice::GetLayout (pTW_IMAGELAYOUT imagelayout) {
 
     SANE_Rect bounds;
@@ -2300,19 +1534,25 @@ Image * SaneDevice::Scan (bool queue, bool indicators) {
     Image * scanImage = new Image;
 
     SANE_Status status;
-    OSStatus osstat;
-    OSErr oserr;
-
-    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (BNDLNAME);
 
     GetRect (&scanImage->bounds);
     GetResolution (&scanImage->res);
 
     Buffer dataBuffer;
+    JpegEncoder * jpeg = NULL;
+    FileWriter * filewriter = NULL;
+    ToneMap * tonemap = NULL;
+
+    // Three-pass frames are interleaved into chunky rows as they come, through a small buffer
+    bool interleave = false;
+    std::vector <char> pass;
+    int rows = 0;
 
     bool cancelled = false;
     for (int iframe = 0; ; iframe++) {
 
+        TraceScope traceFrame ("sane", "Scan frame %d", iframe);
+
         status = sane_start (GetSaneHandle ());
 
         if (status != SANE_STATUS_GOOD) {
@@ -2344,98 +1584,147 @@ Image * SaneDevice::Scan (bool queue, bool indicators) {
             // Add one extra line so we don't trigger a resizing of the handle
             if (scanImage->param.format == SANE_FRAME_GRAY ||
                 scanImage->param.format == SANE_FRAME_RGB)
-                dataBuffer.SetSize ((lines + 1) * scanImage->param.bytes_per_line);
+                dataBuffer.SetSize ((Size) (lines + 1) * scanImage->param.bytes_per_line);
             else
-                dataBuffer.SetSize ((lines + 1) * scanImage->param.bytes_per_line * 3);
+                dataBuffer.SetSize ((Size) (lines + 1) * scanImage->param.bytes_per_line * 3);
+
+            // Lineart stays in frames, its colour rows keep eight pixels of a channel to a byte
+            interleave = (scanImage->param.format != SANE_FRAME_GRAY && scanImage->param.format != SANE_FRAME_RGB &&
+                          scanImage->param.depth != 1);
+            if (interleave) pass.resize (std::max (scanImage->param.bytes_per_line, 0x40000));
+
+            // Brightness, contrast and gamma the backend does not do itself
+            double brightness = (optionIndex [SANE_NAME_BRIGHTNESS] ? 0 : SANE_UNFIX (softbrightness));
+            double contrast = (optionIndex [SANE_NAME_CONTRAST] ? 0 : SANE_UNFIX (softcontrast));
+            double gamma = (datasource ? datasource->GetGamma () : 1);
+            if (scanImage->param.depth != 1 && !ToneMap::IsIdentity (brightness, contrast, gamma))
+                tonemap = new ToneMap (brightness, contrast, gamma, scanImage->param.depth);
+
+            scanImage->histogram.Start ((scanImage->param.format == SANE_FRAME_GRAY ? 1 : 3),
+                                        scanImage->param.depth);
+            if (queue && datasource && datasource->GetBlankPageLimit ())
+                scanImage->blankpage = new BlankPage (scanImage->param, scanImage->histogram);
+
+            // Single pass images of known height are JPEG encoded while the scanner is still busy
+            if (queue && datasource && datasource->GetMemoryCompression () == TWCP_JPEG &&
+                scanImage->param.lines > 0 && scanImage->param.depth != 1 &&
+                (scanImage->param.format == SANE_FRAME_GRAY || scanImage->param.format == SANE_FRAME_RGB))
+                jpeg = new JpegEncoder (scanImage->param.pixels_per_line, scanImage->param.lines,
+                                        (scanImage->param.format == SANE_FRAME_GRAY ? 1 : 3),
+                                        JpegEncoder::Quality (datasource->GetJpegQuality ()), scanImage->res);
+
+            // and file transfers are written by a thread of their own. The rows are still kept in the
+            // image, since the page is written again from them when DAT_SETUPFILEXFER changes the file
+            // or its format before the transfer, or the next page takes its place in a multi-page job.
+            std::string filename;
+            TW_UINT16 format;
+            TW_UINT16 compression;
+            TW_INT16 quality;
+            FileJob * job;
+            if (queue && datasource && datasource->GetFileSetup (filename, &format, &compression, &quality, &job) &&
+                scanImage->param.lines > 0 && ImageWriter::Supported (format) &&
+                (scanImage->param.format == SANE_FRAME_GRAY || scanImage->param.format == SANE_FRAME_RGB)) {
+                // The page still queued gives up its place in the job
+                if (job && image) image->DiscardFileWriter ();
+                filewriter = new FileWriter (filename, format, compression, quality, scanImage->param,
+                                             scanImage->res, job);
+                if (!filewriter->Start ()) {
+                    delete filewriter;
+                    filewriter = NULL;
+                }
+            }
         }
 
-        WindowRef window = NULL;
+        void * progress = OpenProgress (indicators);
+        Size received = 0;
+        Size mapped = 0;
+        Size encoded = 0;
+        Size queued = 0;
+        Size counted = 0;
+        Size pending = 0;
+        int channel = (scanImage->param.format == SANE_FRAME_GRAY || scanImage->param.format == SANE_FRAME_RGB ?
+                       -1 : scanImage->param.format - SANE_FRAME_RED);
+        int passrow = 0;
 
-        if (HasUI() || indicators) {
-
-            Rect windowrect = { 0, 0, 100, 300 };
-
-            if (HasUI()) {
-                osstat = CreateNewWindow (kSheetWindowClass,
-                                          kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
-                                          &windowrect, &window);
-                assert (osstat == noErr);
-
-                osstat = SetThemeWindowBackground (window, kThemeBrushSheetBackgroundOpaque, true);
-                assert (osstat == noErr);
+        while (status == SANE_STATUS_GOOD) {
+            // sane_read takes at most 2 GB at a time
+            Size maxlength;
+            Ptr p;
+            if (interleave) {
+                maxlength = pass.size () - pending;
+                p = &pass [pending];
             }
             else {
-                osstat = CreateNewWindow (kMovableModalWindowClass,
-                                          kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
-                                          &windowrect, &window);
-                assert (osstat == noErr);
-
-                osstat = SetThemeWindowBackground (window, kThemeBrushMovableModalBackground, true);
-                assert (osstat == noErr);
-
-                CFStringRef text = (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, kCFBundleNameKey);
-                osstat = SetWindowTitleWithCFString (window, text);
-                assert (osstat == noErr);
-            }
-
-            ControlRef rootcontrol;
-            oserr = GetRootControl (window, &rootcontrol);
-            assert (oserr == noErr);
-
-            Rect controlrect;
-
-            controlrect.top = 20;
-            controlrect.left = 20;
-            controlrect.right = windowrect.right - windowrect.left - 20;
-
-            CFStringRef text = CFBundleCopyLocalizedString (bundle, CFSTR ("Scanning Image..."), NULL, NULL);
-            MakeStaticTextControl (rootcontrol, &controlrect, text, teFlushLeft, false);
-            CFRelease (text);
-
-            controlrect.top = controlrect.bottom + 20;
-            controlrect.bottom = controlrect.top + 16;
-
-            ControlRef progressControl;
-            osstat = CreateProgressBarControl (NULL, &controlrect, 0, 0, 0, true, &progressControl);
-            assert (osstat == noErr);
-
-            oserr = EmbedControl (progressControl, rootcontrol);
-            assert (oserr == noErr);
-
-            windowrect.bottom = controlrect.bottom + 20;
-
-            osstat = SetWindowBounds (window, kWindowContentRgn, &windowrect);
-            assert (osstat == noErr);
-
-            if (HasUI()) {
-                userinterface->ShowSheetWindow (window);
+                maxlength = std::min (dataBuffer.CheckSize (), (Size) 0x7FFFFFFF);
+                p = dataBuffer.GetPtr ();
             }
-            else {
-                osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
-                assert (osstat == noErr);
-
-                ShowWindow (window);
+            if (!p || !maxlength) {
+                status = SANE_STATUS_NO_MEM;
+                break;
             }
-        }
-
-        while (status == SANE_STATUS_GOOD) {
-            Size maxlength = dataBuffer.CheckSize ();
-            Ptr p = dataBuffer.GetPtr ();
-            assert (p);
             SANE_Int length;
-            status = sane_read (GetSaneHandle (), (SANE_Byte *) p, maxlength, &length);
-            dataBuffer.ReleasePtr (length);
-        }
-
-        if (window) {
-
-            if (HasUI())
-                HideSheetWindow (window);
+            {
+                TraceScope traceRead ("sane", "sane_read");
+                status = sane_read (GetSaneHandle (), (SANE_Byte *) p, maxlength, &length);
+            }
+            if (!interleave && status == SANE_STATUS_GOOD) {
+                received += length;
+                unsigned char * start = (unsigned char *) p + length - received;
+                // The tone map runs first, while the samples are still in the cache. A 16 bit
+                // sample split between two reads is mapped with the next one.
+                if (tonemap) {
+                    TraceScope traceTone ("convert", "Tone map");
+                    mapped += tonemap->Apply (start + mapped, received - mapped);
+                }
+                else
+                    mapped = received;
+                {
+                    TraceScope traceStatistics ("convert", "Statistics");
+                    counted += scanImage->histogram.Add (start + counted, mapped - counted, channel);
+                }
+                if (jpeg) {
+                    TraceScope traceJpeg ("convert", "JPEG rows");
+                    for (; encoded + scanImage->param.bytes_per_line <= mapped;
+                         encoded += scanImage->param.bytes_per_line)
+                        jpeg->WriteRow (start + encoded, scanImage->param.depth);
+                }
+                if (filewriter) {
+                    filewriter->Write ((const char *) start + queued, mapped - queued);
+                    queued = mapped;
+                }
+            }
+            if (interleave) {
+                if (status == SANE_STATUS_GOOD) pending += length;
+                TraceScope traceInterleave ("convert", "Interleave rows");
+                Size bytes_per_line = scanImage->param.bytes_per_line;
+                Size done = 0;
+                for (; done + bytes_per_line <= pending; done += bytes_per_line, passrow++) {
+                    Ptr chunky = dataBuffer.GetPtr ((Size) (passrow + 1) * 3 * bytes_per_line);
+                    if (!chunky) {
+                        status = SANE_STATUS_NO_MEM;
+                        break;
+                    }
+                    if (tonemap) tonemap->Apply ((unsigned char *) &pass [done], bytes_per_line);
+                    scanImage->histogram.Add ((const unsigned char *) &pass [done], bytes_per_line, channel);
+                    InterleaveChannel ((const unsigned char *) &pass [done],
+                                       (unsigned char *) chunky + (Size) passrow * 3 * bytes_per_line,
+                                       bytes_per_line * 8 / scanImage->param.depth, channel,
+                                       scanImage->param.depth / 8);
+                    // Unlocked again before the next row may grow it, the offset moves once all passes are in
+                    dataBuffer.ReleasePtr (0);
+                }
+                memmove (&pass [0], &pass [done], pending - done);
+                pending -= done;
+            }
             else
-                HideWindow (window);
-
-            DisposeWindow (window);
+                dataBuffer.ReleasePtr (length);
+            // The bytes of the frame so far, for three-pass frames those of the rows interleaved
+            TraceCounter ("bytes read", interleave ? (long long) passrow * scanImage->param.bytes_per_line
+                                                   : (long long) received);
         }
+        if (passrow > rows) rows = passrow;
+
+        CloseProgress (progress);
 
         if (status != SANE_STATUS_GOOD && status != SANE_STATUS_EOF) {
             if (HasUI()) SaneError (status);
@@ -2448,9 +1737,37 @@ Image * SaneDevice::Scan (bool queue, bool indicators) {
 
     sane_cancel (GetSaneHandle ());
 
+    if (tonemap) delete tonemap;
+
+    if (jpeg) {
+        if (!cancelled) scanImage->SetJpegData (jpeg->Finish ());
+        delete jpeg;
+    }
+
+    if (filewriter) {
+        if (cancelled)
+            delete filewriter;
+        else {
+            filewriter->Close ();
+            scanImage->filewriter = filewriter;
+        }
+    }
+
     if (cancelled) return NULL;
 
-    scanImage->imagedata = dataBuffer.Claim ();
+    scanImage->histogram.Finish ();
+    for (int c = 0; c < scanImage->histogram.GetChannels (); c++)
+        TraceInstant ("sane", "Channel %d: %u to %u, mean %.2f, sd %.2f", c, scanImage->histogram.GetMin (c),
+                      scanImage->histogram.GetMax (c), scanImage->histogram.GetMean (c),
+                      sqrt (scanImage->histogram.GetVariance (c)));
+
+    if (interleave) {
+        dataBuffer.ReleasePtr ((Size) rows * 3 * scanImage->param.bytes_per_line);
+        scanImage->param.format = SANE_FRAME_RGB;
+        scanImage->param.bytes_per_line *= 3;
+    }
+
+    scanImage->imagedata = dataBuffer.Claim (MEMORY_IMAGE);
     assert (scanImage->imagedata);
 
     int lines = GetHandleSize (scanImage->imagedata) / scanImage->param.bytes_per_line;
@@ -2484,6 +1801,28 @@ void SaneDevice::SetPreview (SANE_Bool preview) {
 }
 
 
+// Whether the pages come from a document feeder, as far as the scan source of the backend says
+
+bool SaneDevice::IsFeeder () {
+
+    int option = optionIndex [SANE_NAME_SCAN_SOURCE];
+    if (!option) return false;
+
+    const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (GetSaneHandle (), option);
+
+    if (!optdesc || optdesc->type != SANE_TYPE_STRING ||
+        !SANE_OPTION_IS_ACTIVE (optdesc->cap) || !SANE_OPTION_IS_GETTABLE (optdesc->cap)) return false;
+
+    SANE_String optval = new char [optdesc->size];
+    SANE_Status status = sane_control_option (GetSaneHandle (), option, SANE_ACTION_GET_VALUE, optval, NULL);
+    bool feeder = (status == SANE_STATUS_GOOD &&
+                   (strcasestr (optval, "adf") || strcasestr (optval, "feeder") || strcasestr (optval, "duplex")));
+    delete[] optval;
+
+    return feeder;
+}
+
+
 Image * SaneDevice::GetImage () {
 
     return image;
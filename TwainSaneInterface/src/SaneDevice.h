@@ -1,8 +1,7 @@
 #ifndef SANE_DS_DEVICE_H
 #define SANE_DS_DEVICE_H
 
-#include <Carbon/Carbon.h>
-#include <TWAIN/TWAIN.h>
+#include "Platform.h"
 
 #include <sane/sane.h>
 
@@ -46,9 +45,11 @@ struct SANE_Resolution {
 #ifdef SANE_FIX
 #undef SANE_FIX
 #endif
-#define SANE_FIX(v) (lround ((v) * (1 << SANE_FIXED_SCALE_SHIFT)))
+#define SANE_FIX(v) ((SANE_Word) lround ((v) * (1 << SANE_FIXED_SCALE_SHIFT)))
 
+#ifdef __APPLE__
 #define BNDLNAME CFSTR ("se.ellert.twain-sane")
+#endif
 
 
 class DataSource;
@@ -64,12 +65,19 @@ public:
 
     void CallBack (TW_UINT16 MSG);
 
+#ifdef __APPLE__
     CFStringRef CreateName (int device = -1);
+#else
+    std::string CreateName (int device = -1);
+#endif
     int ChangeDevice (int device);
+    bool CanShowUI ();
     void ShowUI (bool uionly);
     void HideUI ();
     bool HasUI ();
+#ifdef __APPLE__
     void ShowSheetWindow (WindowRef window);
+#endif
     void OpenDeviceFailed ();
     void SaneError (SANE_Status status);
 
@@ -108,6 +116,7 @@ public:
     TW_UINT16 SetLayout (pTW_IMAGELAYOUT imagelayout);
 
     Image * Scan (bool queue = true, bool indicators = true);
+    bool IsFeeder ();
     void SetPreview (SANE_Bool preview);
     Image * GetImage ();
     void DequeueImage ();
@@ -117,8 +126,20 @@ public:
     void GetAreaOptions (int * top = NULL, int * left = NULL, int * bottom = NULL, int * right = NULL);
 
 private:
+#ifdef __APPLE__
     CFDictionaryRef CreateOptionDictionary ();
     void ApplyOptionDictionary (CFDictionaryRef optionDictionary);
+#else
+    std::string CreateOptionString ();
+    void ApplyOptionString (const std::string & optionString);
+#endif
+
+    TW_UINT16 GetSoftTone (pTW_CAPABILITY capability, bool onlyone, SANE_Fixed value);
+    TW_UINT16 SetSoftTone (pTW_CAPABILITY capability, SANE_Fixed & value);
+
+    // Progress window while reading from the scanner, NULL when there is none
+    void * OpenProgress (bool indicators);
+    void CloseProgress (void * progress);
 
     const SANE_Device ** devicelist;
     SANE_Int saneversion;
@@ -129,6 +150,10 @@ private:
     DataSource * datasource;
     UserInterface * userinterface;
     Image * image;
+
+    // Brightness and contrast for backends without the options
+    SANE_Fixed softbrightness;
+    SANE_Fixed softcontrast;
 };
 
 #endif
@@ -0,0 +1,932 @@
+#include <Carbon/Carbon.h>
+#include <TWAIN/TWAIN.h>
+
+#include <libintl.h>
+
+#include <sane/sane.h>
+#include <sane/saneopts.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#include "SaneDevice.h"
+#include "SaneCallback.h"
+#include "UserInterface.h"
+#include "MakeControls.h"
+#include "DataSource.h"
+#include "SaneProfile.h"
+
+const EventTypeSpec commandProcessEvent [] = { { kEventClassCommand, kEventCommandProcess } };
+
+
+static OSStatus AlertEventHandler (EventHandlerCallRef inHandlerCallRef, EventRef inEvent,
+                                   void * inUserData) {
+
+    OSStatus osstat;
+
+    HICommandExtended cmd;
+    osstat = GetEventParameter (inEvent, kEventParamDirectObject, typeHICommand, NULL,
+                                sizeof (HICommandExtended), NULL, &cmd);
+    assert (osstat == noErr);
+
+    switch (cmd.commandID) {
+        case kHICommandOK:
+            osstat = QuitAppModalLoopForWindow ((WindowRef) inUserData);
+            assert (osstat == noErr);
+            return noErr;
+            break;
+        default:
+            return eventNotHandledErr;
+            break;
+    }
+}
+
+
+SaneDevice::SaneDevice (DataSource * ds) : currentDevice (-1),
+                                           datasource (ds),
+                                           userinterface (NULL),
+                                           image (NULL),
+                                           softbrightness (0),
+                                           softcontrast (0) {
+
+    SANE_Status status;
+
+    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (BNDLNAME);
+
+    CFStringRef sanelocalization =
+        CFBundleCopyLocalizedString (bundle, CFSTR ("sane-localization"), NULL, NULL);
+    char locale [16];
+    CFStringGetCString (sanelocalization, locale, 16, kCFStringEncodingUTF8);
+    CFRelease (sanelocalization);
+    setenv ("LANG", locale, 1);
+
+    CFStringRef SANELocaleDir =
+        (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, CFSTR ("SANELocaleDir"));
+    char localedir [64];
+    CFStringGetCString (SANELocaleDir, localedir, 64, kCFStringEncodingUTF8);
+    bindtextdomain ("sane-backends", localedir);
+    bind_textdomain_codeset ("sane-backends", "UTF-8");
+
+    status = sane_init (&saneversion, SaneAuthCallback);
+    assert (status == SANE_STATUS_GOOD);
+
+    status = sane_get_devices (&devicelist, false);
+    assert (status == SANE_STATUS_GOOD);
+
+    if (!devicelist || !(*devicelist)) return;
+
+    int firstDevice = -1;
+    CFStringRef deviceString =
+        (CFStringRef) CFPreferencesCopyAppValue (CFSTR ("Current Device"), BNDLNAME);
+    if (deviceString) {
+        if (CFGetTypeID (deviceString) == CFStringGetTypeID ()) {
+            for (int device = 0; firstDevice == -1 && devicelist [device]; device++) {
+                CFStringRef deviceListString = CreateName (device);
+                if (CFStringCompare (deviceString, deviceListString,
+                                     kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+                    firstDevice = device;
+                CFRelease (deviceListString);
+            }
+        }
+        CFRelease (deviceString);
+    }
+    if (firstDevice == -1) firstDevice = 0;
+    int newDevice = ChangeDevice (firstDevice);
+    for (int device = 0; newDevice == -1 && devicelist [device]; device++) {
+        if (device == firstDevice) continue;
+        newDevice = ChangeDevice (device);
+    }
+}
+
+
+SaneDevice::~SaneDevice() {
+
+    HideUI ();
+    DequeueImage ();
+
+    if (currentDevice != -1) {
+        CFStringRef deviceString = CreateName ();
+        CFPreferencesSetAppValue (CFSTR ("Current Device"), deviceString, BNDLNAME);
+        CFRelease (deviceString);
+    }
+
+    for (std::map <int, SANE_Handle>::iterator svsh = sanehandles.begin ();
+         svsh != sanehandles.end(); svsh++) {
+
+        currentDevice = svsh->first;
+
+        CFStringRef deviceString = CreateName ();
+        CFStringRef deviceKey =
+            CFStringCreateWithFormat (NULL, NULL, CFSTR ("Device %@"), deviceString);
+        CFRelease (deviceString);
+        CFDictionaryRef optionDictionary = CreateOptionDictionary ();
+        CFPreferencesSetAppValue (deviceKey, optionDictionary, BNDLNAME);
+        CFRelease (deviceKey);
+        CFRelease (optionDictionary);
+
+        sane_close (GetSaneHandle ());
+    }
+
+    sane_exit ();
+
+    CFPreferencesAppSynchronize (BNDLNAME);
+}
+
+
+CFStringRef SaneDevice::CreateName (int device) {
+
+    if (device == -1) device = currentDevice;
+
+    if (!devicelist [device]) return NULL;
+
+    CFStringRef constvendor = CFStringCreateWithCString (NULL, devicelist [device]->vendor, kCFStringEncodingUTF8);
+    CFMutableStringRef vendor = CFStringCreateMutableCopy (NULL, 0, constvendor);
+    CFRelease(constvendor);
+    CFStringTrimWhitespace (vendor);
+
+    CFStringRef constmodel = CFStringCreateWithCString (NULL, devicelist [device]->model, kCFStringEncodingUTF8);
+    CFMutableStringRef model = CFStringCreateMutableCopy (NULL, 0, constmodel);
+    CFRelease(constmodel);
+    CFStringTrimWhitespace (model);
+
+    char * backend = (char *) devicelist [device]->name;
+    char * end = strchr (backend, ':');
+    if (strncmp (backend, "net:", 4) == 0) {
+        // IPv6 addresses should be between brackets
+        if (*(end + 1) == '[') end = strchr (end + 1, ']');
+        if (end) end = strchr (end + 1, ':');
+        if (end) backend = end + 1;
+        if (end) end = strchr (end + 1, ':');
+    }
+    if (end && (strncmp (backend, "test:", 5) == 0 || strncmp (backend, "replay:", 7) == 0))
+        end = strchr (end + 1, ':');
+    int len = (end ? end - devicelist [device]->name : strlen (devicelist [device]->name));
+
+    char * n = new char [len + 1];
+    strncpy (n, devicelist [device]->name, len);
+    n [len] = '\0';
+    CFStringRef name = CFStringCreateWithCString (NULL, n, kCFStringEncodingUTF8);
+    delete[] n;
+
+    CFStringRef text = CFStringCreateWithFormat (NULL, NULL, CFSTR ("%@ %@ (%@)"), vendor, model, name);
+
+    CFRelease (name);
+    CFRelease (vendor);
+    CFRelease (model);
+
+    return text;
+}
+
+
+int SaneDevice::ChangeDevice (int device) {
+
+    SANE_Status status;
+
+    int oldDevice = currentDevice;
+    currentDevice = device;
+
+    if (!GetSaneHandle ()) {
+        SANE_Handle sanehandle;
+
+        UInt32 result;
+        do {
+            SaneCallbackDevice (this);
+            status = sane_open (devicelist [currentDevice]->name, &sanehandle);
+            result = SaneCallbackResult ();
+        }
+        while (status != SANE_STATUS_GOOD && result == kHICommandOK);
+
+        if (status != SANE_STATUS_GOOD) {
+            if (HasUI()) OpenDeviceFailed ();
+            currentDevice = oldDevice;
+            return currentDevice;
+        }
+
+        assert (status == SANE_STATUS_GOOD);
+        assert (sanehandle);
+        sanehandles [currentDevice] = sanehandle;
+
+        CFStringRef deviceString = CreateName ();
+        CFStringRef deviceKey =
+            CFStringCreateWithFormat (NULL, NULL, CFSTR ("Device %@"), deviceString);
+        CFRelease (deviceString);
+        CFDictionaryRef optionDictionary =
+            (CFDictionaryRef) CFPreferencesCopyAppValue (deviceKey, BNDLNAME);
+        CFRelease (deviceKey);
+        if (optionDictionary) {
+            if (CFGetTypeID (optionDictionary) == CFDictionaryGetTypeID ())
+                ApplyOptionDictionary (optionDictionary);
+            CFRelease (optionDictionary);
+        }
+    }
+
+    optionIndex.clear ();
+
+    for (int option = 1; const SANE_Option_Descriptor * optdesc =
+         sane_get_option_descriptor (GetSaneHandle (), option); option++)
+        if (optdesc->type != SANE_TYPE_GROUP) optionIndex [optdesc->name] = option;
+
+    return currentDevice;
+}
+
+
+bool SaneDevice::CanShowUI () {
+
+    return true;
+}
+
+
+void SaneDevice::ShowUI (bool uionly) {
+
+    userinterface = new UserInterface (this, currentDevice, uionly);
+}
+
+
+void SaneDevice::HideUI () {
+
+    if (userinterface) delete userinterface;
+    userinterface = NULL;
+}
+
+
+bool SaneDevice::HasUI () {
+
+    return (userinterface != NULL);
+}
+
+
+void SaneDevice::ShowSheetWindow (WindowRef window) {
+
+    if (userinterface) userinterface->ShowSheetWindow (window);
+}
+
+
+void SaneDevice::OpenDeviceFailed () {
+
+    OSStatus osstat;
+    OSErr oserr;
+
+    CFStringRef text;
+
+    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (CFSTR ("se.ellert.twain-sane"));
+
+    Rect windowrect = { 0, 0, 100, 500 };
+    WindowRef window;
+
+    if (HasUI()) {
+        osstat = CreateNewWindow (kSheetWindowClass,
+                                  kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
+                                  &windowrect, &window);
+        assert (osstat == noErr);
+
+        osstat = SetThemeWindowBackground (window, kThemeBrushSheetBackgroundOpaque, true);
+        assert (osstat == noErr);
+    }
+    else {
+        osstat = CreateNewWindow (kMovableModalWindowClass,
+                                  kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
+                                  &windowrect, &window);
+        assert (osstat == noErr);
+
+        osstat = SetThemeWindowBackground (window, kThemeBrushMovableModalBackground, true);
+        assert (osstat == noErr);
+
+        text = (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, kCFBundleNameKey);
+        osstat = SetWindowTitleWithCFString (window, text);
+        assert (osstat == noErr);
+    }
+
+    ControlRef rootcontrol;
+    oserr = GetRootControl (window, &rootcontrol);
+    assert (oserr == noErr);
+
+    Rect controlrect;
+
+    controlrect.top = 20;
+    controlrect.left = 20;
+    controlrect.bottom = controlrect.top + 64;
+    controlrect.right = controlrect.left + 64;
+
+    IconRef icon;
+    ControlButtonContentInfo contentinfo;
+    ControlRef iconcontrol;
+
+    oserr = GetIconRef (kOnSystemDisk, kSystemIconsCreator, kAlertStopIcon, &icon);
+    assert (oserr == noErr);
+
+    contentinfo.contentType = kControlContentIconRef;
+    contentinfo.u.iconRef = icon;
+    osstat = CreateIconControl (NULL, &controlrect, &contentinfo, true, &iconcontrol);
+    assert (osstat == noErr);
+
+    oserr = EmbedControl (iconcontrol, rootcontrol);
+    assert (oserr == noErr);
+
+    controlrect.top += 32;
+    controlrect.left += 32;
+
+    oserr = GetIconRef (kOnSystemDisk, 'SANE', 'APPL', &icon);
+    assert (oserr == noErr);
+
+    contentinfo.contentType = kControlContentIconRef;
+    contentinfo.u.iconRef = icon;
+    osstat = CreateIconControl (NULL, &controlrect, &contentinfo, true, &iconcontrol);
+    assert (osstat == noErr);
+
+    oserr = EmbedControl (iconcontrol, rootcontrol);
+    assert (oserr == noErr);
+
+    int bottom = controlrect.bottom;
+
+    controlrect.top = 20;
+    controlrect.left = controlrect.right + 20;
+    controlrect.right = windowrect.right - windowrect.left - 20;
+
+    CFStringRef dev = CreateName ();
+    CFStringRef format =
+        CFBundleCopyLocalizedString (bundle, CFSTR ("Could not open the image source %@"), NULL, NULL);
+    text = CFStringCreateWithFormat (NULL, NULL, format, dev);
+    CFRelease (format);
+    CFRelease (dev);
+    MakeStaticTextControl (rootcontrol, &controlrect, text, teFlushLeft, false);
+    CFRelease (text);
+
+    controlrect.top = std::max (controlrect.bottom + 20, bottom - 20);
+
+    text = CFBundleCopyLocalizedString (bundle, CFSTR ("OK"), NULL, NULL);
+    MakeButtonControl (rootcontrol, &controlrect, text, kHICommandOK, true, NULL, 0);
+    CFRelease (text);
+
+    windowrect.bottom = controlrect.bottom + 20;
+
+    osstat = SetWindowBounds (window, kWindowContentRgn, &windowrect);
+    assert (osstat == noErr);
+
+    osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
+    assert (osstat == noErr);
+
+    EventHandlerUPP AlertEventHandlerUPP = NewEventHandlerUPP (AlertEventHandler);
+    osstat = InstallWindowEventHandler (window, AlertEventHandlerUPP,
+                                        GetEventTypeCount (commandProcessEvent), commandProcessEvent,
+                                        window, NULL);
+    assert (osstat == noErr);
+
+    if (HasUI()) {
+        ShowSheetWindow (window);
+    }
+    else {
+        osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
+        assert (osstat == noErr);
+
+        ShowWindow (window);
+    }
+
+    osstat = RunAppModalLoopForWindow (window);
+    assert (osstat == noErr);
+
+    if (HasUI())
+        HideSheetWindow (window);
+    else
+        HideWindow (window);
+
+    DisposeEventHandlerUPP (AlertEventHandlerUPP);
+
+    DisposeWindow (window);
+}
+
+
+void SaneDevice::SaneError (SANE_Status status) {
+
+    OSStatus osstat;
+    OSErr oserr;
+
+    CFStringRef text;
+
+    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (CFSTR ("se.ellert.twain-sane"));
+
+    Rect windowrect = { 0, 0, 100, 500 };
+    WindowRef window;
+
+    if (HasUI()) {
+        osstat = CreateNewWindow (kSheetWindowClass,
+                                  kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
+                                  &windowrect, &window);
+        assert (osstat == noErr);
+
+        osstat = SetThemeWindowBackground (window, kThemeBrushSheetBackgroundOpaque, true);
+        assert (osstat == noErr);
+    }
+    else {
+        osstat = CreateNewWindow (kMovableModalWindowClass,
+                                  kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
+                                  &windowrect, &window);
+        assert (osstat == noErr);
+
+        osstat = SetThemeWindowBackground (window, kThemeBrushMovableModalBackground, true);
+        assert (osstat == noErr);
+
+        text = (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, kCFBundleNameKey);
+        osstat = SetWindowTitleWithCFString (window, text);
+        assert (osstat == noErr);
+    }
+
+    ControlRef rootcontrol;
+    oserr = GetRootControl (window, &rootcontrol);
+    assert (oserr == noErr);
+
+    Rect controlrect;
+
+    controlrect.top = 20;
+    controlrect.left = 20;
+    controlrect.bottom = controlrect.top + 64;
+    controlrect.right = controlrect.left + 64;
+
+    IconRef icon;
+    ControlButtonContentInfo contentinfo;
+    ControlRef iconcontrol;
+
+    oserr = GetIconRef (kOnSystemDisk, kSystemIconsCreator, kAlertStopIcon, &icon);
+    assert (oserr == noErr);
+
+    contentinfo.contentType = kControlContentIconRef;
+    contentinfo.u.iconRef = icon;
+    osstat = CreateIconControl (NULL, &controlrect, &contentinfo, true, &iconcontrol);
+    assert (osstat == noErr);
+
+    oserr = EmbedControl (iconcontrol, rootcontrol);
+    assert (oserr == noErr);
+
+    controlrect.top += 32;
+    controlrect.left += 32;
+
+    oserr = GetIconRef (kOnSystemDisk, 'SANE', 'APPL', &icon);
+    assert (oserr == noErr);
+
+    contentinfo.contentType = kControlContentIconRef;
+    contentinfo.u.iconRef = icon;
+    osstat = CreateIconControl (NULL, &controlrect, &contentinfo, true, &iconcontrol);
+    assert (osstat == noErr);
+
+    oserr = EmbedControl (iconcontrol, rootcontrol);
+    assert (oserr == noErr);
+
+    int bottom = controlrect.bottom;
+
+    controlrect.top = 20;
+    controlrect.left = controlrect.right + 20;
+    controlrect.right = windowrect.right - windowrect.left - 20;
+
+    text = CFStringCreateWithCString (NULL, sane_strstatus (status), kCFStringEncodingUTF8);
+    MakeStaticTextControl (rootcontrol, &controlrect, text, teFlushLeft, false);
+    CFRelease (text);
+
+    controlrect.top = std::max (controlrect.bottom + 20, bottom - 20);
+
+    text = CFBundleCopyLocalizedString (bundle, CFSTR ("OK"), NULL, NULL);
+    MakeButtonControl (rootcontrol, &controlrect, text, kHICommandOK, true, NULL, 0);
+    CFRelease (text);
+
+    windowrect.bottom = controlrect.bottom + 20;
+
+    osstat = SetWindowBounds (window, kWindowContentRgn, &windowrect);
+    assert (osstat == noErr);
+
+    osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
+    assert (osstat == noErr);
+
+    EventHandlerUPP AlertEventHandlerUPP = NewEventHandlerUPP (AlertEventHandler);
+    osstat = InstallWindowEventHandler (window, AlertEventHandlerUPP,
+                                        GetEventTypeCount (commandProcessEvent), commandProcessEvent,
+                                        window, NULL);
+    assert (osstat == noErr);
+
+    if (HasUI()) {
+        ShowSheetWindow (window);
+    }
+    else {
+        osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
+        assert (osstat == noErr);
+
+        ShowWindow (window);
+    }
+
+    osstat = RunAppModalLoopForWindow (window);
+    assert (osstat == noErr);
+
+    if (HasUI())
+        HideSheetWindow (window);
+    else
+        HideWindow (window);
+
+    DisposeEventHandlerUPP (AlertEventHandlerUPP);
+
+    DisposeWindow (window);
+}
+
+
+TW_UINT16 SaneDevice::GetCustomData (pTW_CUSTOMDSDATA customdata) {
+
+    CFMutableDictionaryRef dataDictionary =
+        CFDictionaryCreateMutable (NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                   &kCFTypeDictionaryValueCallBacks);
+    CFStringRef deviceString = CreateName();
+    CFDictionaryAddValue (dataDictionary, CFSTR ("Current Device"), deviceString);
+    CFStringRef deviceKey = CFStringCreateWithFormat (NULL, NULL, CFSTR ("Device %@"), deviceString);
+    CFRelease (deviceString);
+    CFDictionaryRef optionDictionary = CreateOptionDictionary ();
+    CFDictionaryAddValue (dataDictionary, deviceKey, optionDictionary);
+    CFRelease (deviceKey);
+    CFRelease (optionDictionary);
+
+    CFDataRef xml = CFPropertyListCreateXMLData (NULL, dataDictionary);
+    CFRelease (dataDictionary);
+
+    customdata->InfoLength = CFDataGetLength (xml);
+    customdata->hData = (TW_HANDLE) NewHandle (customdata->InfoLength);
+    HLock ((Handle) customdata->hData);
+    CFDataGetBytes (xml, CFRangeMake (0, customdata->InfoLength), (UInt8 *) *(Handle) customdata->hData);
+    HUnlock ((Handle) customdata->hData);
+
+    CFRelease (xml);
+
+    return TWRC_SUCCESS;
+}
+
+
+TW_UINT16 SaneDevice::SetCustomData (pTW_CUSTOMDSDATA customdata) {
+
+    bool done = false;
+
+    HLock ((Handle) customdata->hData);
+    CFDataRef xml = CFDataCreate (NULL, (UInt8 *) *(Handle) customdata->hData, customdata->InfoLength);
+    HUnlock ((Handle) customdata->hData);
+
+    CFDictionaryRef dataDictionary =
+        (CFDictionaryRef) CFPropertyListCreateFromXMLData (NULL, xml, kCFPropertyListImmutable, NULL);
+    CFRelease (xml);
+
+    if (dataDictionary) {
+        if (CFGetTypeID (dataDictionary) == CFDictionaryGetTypeID ()) {
+            CFStringRef deviceString =
+                (CFStringRef) CFDictionaryGetValue (dataDictionary, CFSTR ("Current Device"));
+            if (deviceString && CFGetTypeID (deviceString) == CFStringGetTypeID ()) {
+                for (int device = 0; devicelist [device]; device++) {
+                    CFStringRef deviceListString = CreateName (device);
+                    if (CFStringCompare (deviceString, deviceListString,
+                                         kCFCompareCaseInsensitive) == kCFCompareEqualTo) {
+                        if (ChangeDevice (device) == device) {
+                            CFStringRef deviceKey =
+                                CFStringCreateWithFormat (NULL, NULL, CFSTR ("Device %@"), deviceString);
+                            CFDictionaryRef optionDictictionary =
+                                (CFDictionaryRef) CFDictionaryGetValue (dataDictionary, deviceKey);
+                            CFRelease (deviceKey);
+                            if (optionDictictionary &&
+                                CFGetTypeID (optionDictictionary) == CFDictionaryGetTypeID ()) {
+                                ApplyOptionDictionary (optionDictictionary);
+                                done = true;
+                            }
+                        }
+                    }
+                    CFRelease (deviceListString);
+                }
+            }
+        }
+        CFRelease (dataDictionary);
+    }
+
+    return (done ? TWRC_SUCCESS : datasource->SetStatus (TWCC_OPERATIONERROR));
+}
+
+
+CFDictionaryRef SaneDevice::CreateOptionDictionary () {
+
+    SANE_Status status;
+
+    CFMutableDictionaryRef dict =
+        CFDictionaryCreateMutable (NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                   &kCFTypeDictionaryValueCallBacks);
+
+    for (int option = 1; const SANE_Option_Descriptor * optdesc =
+         sane_get_option_descriptor (GetSaneHandle (), option); option++) {
+
+        if (optdesc->type != SANE_TYPE_GROUP &&
+            SANE_OPTION_IS_ACTIVE (optdesc->cap) && SANE_OPTION_IS_GETTABLE (optdesc->cap)) {
+
+            CFStringRef key = CFStringCreateWithCString (NULL, optdesc->name, kCFStringEncodingUTF8);
+
+            switch (optdesc->type) {
+
+                case SANE_TYPE_BOOL:
+
+                    SANE_Bool optval;
+                    status = sane_control_option (GetSaneHandle (), option,
+                                                  SANE_ACTION_GET_VALUE, &optval, NULL);
+                    assert (status == SANE_STATUS_GOOD);
+                    CFDictionaryAddValue (dict, key, (optval ? kCFBooleanTrue : kCFBooleanFalse));
+                    break;
+
+                case SANE_TYPE_INT:
+
+                    if (optdesc->size > sizeof (SANE_Word)) {
+                        SANE_Word * optval = new SANE_Word [optdesc->size / sizeof (SANE_Word)];
+                        status = sane_control_option (GetSaneHandle (), option,
+                                                      SANE_ACTION_GET_VALUE, optval, NULL);
+                        assert (status == SANE_STATUS_GOOD);
+                        CFMutableArrayRef cfarray =
+                            CFArrayCreateMutable (NULL, 0, &kCFTypeArrayCallBacks);
+                        for (int i = 0; i < optdesc->size / sizeof (SANE_Word); i++) {
+                            CFNumberRef cfvalue =
+                                CFNumberCreate (NULL, kCFNumberIntType, &optval [i]);
+                            CFArrayAppendValue (cfarray, cfvalue);
+                            CFRelease (cfvalue);
+                        }
+                        delete[] optval;
+                        CFDictionaryAddValue (dict, key, cfarray);
+                        CFRelease (cfarray);
+                    }
+                    else {
+                        SANE_Word optval;
+                        status = sane_control_option (GetSaneHandle (), option,
+                                                      SANE_ACTION_GET_VALUE, &optval, NULL);
+                        assert (status == SANE_STATUS_GOOD);
+                        CFNumberRef cfvalue = CFNumberCreate (NULL, kCFNumberIntType, &optval);
+                        CFDictionaryAddValue (dict, key, cfvalue);
+                        CFRelease (cfvalue);
+                    }
+                    break;
+
+                case SANE_TYPE_FIXED:
+
+                    if (optdesc->size > sizeof (SANE_Word)) {
+                        SANE_Word * optval = new SANE_Word [optdesc->size / sizeof (SANE_Word)];
+                        status = sane_control_option (GetSaneHandle (), option,
+                                                      SANE_ACTION_GET_VALUE, optval, NULL);
+                        assert (status == SANE_STATUS_GOOD);
+                        CFMutableArrayRef cfarray =
+                            CFArrayCreateMutable (NULL, 0, &kCFTypeArrayCallBacks);
+                        for (int i = 0; i < optdesc->size / sizeof (SANE_Word); i++) {
+                            double val = SANE_UNFIX (optval [i]);
+                            CFNumberRef cfvalue = CFNumberCreate (NULL, kCFNumberDoubleType, &val);
+                            CFArrayAppendValue (cfarray, cfvalue);
+                            CFRelease (cfvalue);
+                        }
+                        delete[] optval;
+                        CFDictionaryAddValue (dict, key, cfarray);
+                        CFRelease (cfarray);
+                    }
+                    else {
+                        SANE_Word optval;
+                        status = sane_control_option (GetSaneHandle (), option,
+                                                      SANE_ACTION_GET_VALUE, &optval, NULL);
+                        assert (status == SANE_STATUS_GOOD);
+                        double val = SANE_UNFIX (optval);
+                        CFNumberRef cfvalue = CFNumberCreate (NULL, kCFNumberDoubleType, &val);
+                        CFDictionaryAddValue (dict, key, cfvalue);
+                        CFRelease (cfvalue);
+                    }
+                    break;
+
+                case SANE_TYPE_STRING: {
+
+                    SANE_String optval = new char [optdesc->size];
+                    status = sane_control_option (GetSaneHandle (), option,
+                                                  SANE_ACTION_GET_VALUE, optval, NULL);
+                    assert (status == SANE_STATUS_GOOD);
+                    CFStringRef cfvalue = CFStringCreateWithCString (NULL, optval,
+                                                                     kCFStringEncodingUTF8);
+                    delete[] optval;
+                    CFDictionaryAddValue (dict, key, cfvalue);
+                    CFRelease (cfvalue);
+                    break;
+                }
+
+                default:
+                    break;
+            }
+
+            CFRelease (key);
+        }
+    }
+
+    return dict;
+}
+
+
+void SaneDevice::ApplyOptionDictionary (CFDictionaryRef dict) {
+
+    SANE_Status status;
+
+    for (int option = 1; const SANE_Option_Descriptor * optdesc =
+         sane_get_option_descriptor (GetSaneHandle (), option); option++) {
+
+        if (optdesc->type != SANE_TYPE_GROUP &&
+            SANE_OPTION_IS_ACTIVE (optdesc->cap) && SANE_OPTION_IS_SETTABLE (optdesc->cap)) {
+
+            CFStringRef key = CFStringCreateWithCString (NULL, optdesc->name, kCFStringEncodingUTF8);
+
+            switch (optdesc->type) {
+
+                case SANE_TYPE_BOOL: {
+
+                    CFBooleanRef cfvalue = (CFBooleanRef) CFDictionaryGetValue (dict, key);
+                    if (cfvalue && CFGetTypeID (cfvalue) == CFBooleanGetTypeID ()) {
+                        SANE_Bool optval = CFBooleanGetValue (cfvalue);
+                        status = sane_control_option (GetSaneHandle (), option,
+                                                      SANE_ACTION_SET_VALUE, &optval, NULL);
+                        assert (status == SANE_STATUS_GOOD);
+                    }
+                    break;
+                }
+
+                case SANE_TYPE_INT:
+
+                    if (optdesc->size > sizeof (SANE_Word)) {
+                        CFArrayRef cfarray = (CFArrayRef) CFDictionaryGetValue (dict, key);
+                        if (cfarray && CFGetTypeID (cfarray) == CFArrayGetTypeID () &&
+                            CFArrayGetCount (cfarray) == optdesc->size / sizeof (SANE_Word)) {
+                            SANE_Word * optval = new SANE_Word [optdesc->size / sizeof (SANE_Word)];
+                            status = sane_control_option (GetSaneHandle (), option,
+                                                          SANE_ACTION_GET_VALUE, optval, NULL);
+                            assert (status == SANE_STATUS_GOOD);
+                            for (int i = 0; i < optdesc->size / sizeof (SANE_Word); i++) {
+                                CFNumberRef cfvalue =
+                                    (CFNumberRef) CFArrayGetValueAtIndex (cfarray, i);
+                                if (cfvalue && CFGetTypeID (cfvalue) == CFNumberGetTypeID ())
+                                    CFNumberGetValue (cfvalue, kCFNumberIntType, &optval [i]);
+                            }
+                            status = sane_control_option (GetSaneHandle (), option,
+                                                          SANE_ACTION_SET_VALUE, optval, NULL);
+                            assert (status == SANE_STATUS_GOOD);
+                            delete[] optval;
+                        }
+                    }
+                    else {
+                        CFNumberRef cfvalue = (CFNumberRef) CFDictionaryGetValue (dict, key);
+                        if (cfvalue && CFGetTypeID (cfvalue) == CFNumberGetTypeID ()) {
+                            SANE_Word optval;
+                            CFNumberGetValue (cfvalue, kCFNumberIntType, &optval);
+                            status = sane_control_option (GetSaneHandle (), option,
+                                                          SANE_ACTION_SET_VALUE, &optval, NULL);
+                            assert (status == SANE_STATUS_GOOD);
+                        }
+                    }
+                    break;
+
+                case SANE_TYPE_FIXED:
+
+                    if (optdesc->size > sizeof (SANE_Word)) {
+                        CFArrayRef cfarray = (CFArrayRef) CFDictionaryGetValue (dict, key);
+                        if (cfarray && CFGetTypeID (cfarray) == CFArrayGetTypeID () &&
+                            CFArrayGetCount (cfarray) == optdesc->size / sizeof (SANE_Word)) {
+                            SANE_Word * optval = new SANE_Word [optdesc->size / sizeof (SANE_Word)];
+                            status = sane_control_option (GetSaneHandle (), option,
+                                                          SANE_ACTION_GET_VALUE, optval, NULL);
+                            assert (status == SANE_STATUS_GOOD);
+                            for (int i = 0; i < optdesc->size / sizeof (SANE_Word); i++) {
+                                CFNumberRef cfvalue =
+                                    (CFNumberRef) CFArrayGetValueAtIndex (cfarray, i);
+                                if (cfvalue && CFGetTypeID (cfvalue) == CFNumberGetTypeID ()) {
+                                    double val;
+                                    CFNumberGetValue (cfvalue, kCFNumberDoubleType, &val);
+                                    optval [i] = SANE_FIX (val);
+                                }
+                            }
+                            status = sane_control_option (GetSaneHandle (), option,
+                                                          SANE_ACTION_SET_VALUE, optval, NULL);
+                            assert (status == SANE_STATUS_GOOD);
+                            delete[] optval;
+                        }
+                    }
+                    else {
+                        CFNumberRef cfvalue = (CFNumberRef) CFDictionaryGetValue (dict, key);
+                        if (cfvalue && CFGetTypeID (cfvalue) == CFNumberGetTypeID ()) {
+                            double val;
+                            CFNumberGetValue (cfvalue, kCFNumberDoubleType, &val);
+                            SANE_Word optval = SANE_FIX (val);
+                            status = sane_control_option (GetSaneHandle (), option,
+                                                          SANE_ACTION_SET_VALUE, &optval, NULL);
+                            assert (status == SANE_STATUS_GOOD);
+                        }
+                    }
+                    break;
+
+                case SANE_TYPE_STRING: {
+
+                    CFStringRef cfvalue = (CFStringRef) CFDictionaryGetValue (dict, key);
+                    if (cfvalue && CFGetTypeID (cfvalue) == CFStringGetTypeID ()) {
+                        SANE_String optval = new char [optdesc->size];
+                        CFStringGetCString (cfvalue, optval, optdesc->size, kCFStringEncodingUTF8);
+                        status = sane_control_option (GetSaneHandle (), option,
+                                                      SANE_ACTION_SET_VALUE, optval, NULL);
+                        assert (status == SANE_STATUS_GOOD);
+                        delete[] optval;
+                    }
+                    break;
+                }
+
+                default:
+                    break;
+            }
+
+            CFRelease (key);
+        }
+    }
+}
+
+
+void * SaneDevice::OpenProgress (bool indicators) {
+
+    OSStatus osstat;
+    OSErr oserr;
+
+    CFBundleRef bundle = CFBundleGetBundleWithIdentifier (BNDLNAME);
+
+    WindowRef window = NULL;
+
+    if (HasUI() || indicators) {
+
+        Rect windowrect = { 0, 0, 100, 300 };
+
+        if (HasUI()) {
+            osstat = CreateNewWindow (kSheetWindowClass,
+                                      kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
+                                      &windowrect, &window);
+            assert (osstat == noErr);
+
+            osstat = SetThemeWindowBackground (window, kThemeBrushSheetBackgroundOpaque, true);
+            assert (osstat == noErr);
+        }
+        else {
+            osstat = CreateNewWindow (kMovableModalWindowClass,
+                                      kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
+                                      &windowrect, &window);
+            assert (osstat == noErr);
+
+            osstat = SetThemeWindowBackground (window, kThemeBrushMovableModalBackground, true);
+            assert (osstat == noErr);
+
+            CFStringRef text = (CFStringRef) CFBundleGetValueForInfoDictionaryKey (bundle, kCFBundleNameKey);
+            osstat = SetWindowTitleWithCFString (window, text);
+            assert (osstat == noErr);
+        }
+
+        ControlRef rootcontrol;
+        oserr = GetRootControl (window, &rootcontrol);
+        assert (oserr == noErr);
+
+        Rect controlrect;
+
+        controlrect.top = 20;
+        controlrect.left = 20;
+        controlrect.right = windowrect.right - windowrect.left - 20;
+
+        CFStringRef text = CFBundleCopyLocalizedString (bundle, CFSTR ("Scanning Image..."), NULL, NULL);
+        MakeStaticTextControl (rootcontrol, &controlrect, text, teFlushLeft, false);
+        CFRelease (text);
+
+        controlrect.top = controlrect.bottom + 20;
+        controlrect.bottom = controlrect.top + 16;
+
+        ControlRef progressControl;
+        osstat = CreateProgressBarControl (NULL, &controlrect, 0, 0, 0, true, &progressControl);
+        assert (osstat == noErr);
+
+        oserr = EmbedControl (progressControl, rootcontrol);
+        assert (oserr == noErr);
+
+        windowrect.bottom = controlrect.bottom + 20;
+
+        osstat = SetWindowBounds (window, kWindowContentRgn, &windowrect);
+        assert (osstat == noErr);
+
+        if (HasUI()) {
+            userinterface->ShowSheetWindow (window);
+        }
+        else {
+            osstat = RepositionWindow (window, NULL, kWindowAlertPositionOnMainScreen);
+            assert (osstat == noErr);
+
+            ShowWindow (window);
+        }
+    }
+
+    return window;
+}
+
+
+void SaneDevice::CloseProgress (void * progress) {
+
+    WindowRef window = (WindowRef) progress;
+
+    if (window) {
+
+        if (HasUI())
+            HideSheetWindow (window);
+        else
+            HideWindow (window);
+
+        DisposeWindow (window);
+    }
+}
@@ -0,0 +1,358 @@
+#include "Platform.h"
+
+#include <sane/sane.h>
+#include <sane/saneopts.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include "SaneDevice.h"
+#include "DataSource.h"
+#include "Image.h"
+#include "SaneProfile.h"
+
+// Headless counterpart of SaneDeviceCarbon.cpp: no user interface, no progress window,
+// errors go to stderr and device settings are stored as "name=value" lines.
+
+
+SaneDevice::SaneDevice (DataSource * ds) : currentDevice (-1),
+                                           datasource (ds),
+                                           userinterface (NULL),
+                                           image (NULL),
+                                           softbrightness (0),
+                                           softcontrast (0) {
+
+    SANE_Status status;
+
+    status = sane_init (&saneversion, NULL);
+    assert (status == SANE_STATUS_GOOD);
+
+    status = sane_get_devices (&devicelist, false);
+    assert (status == SANE_STATUS_GOOD);
+
+    if (!devicelist || !(*devicelist)) return;
+
+    int firstDevice = -1;
+    std::string deviceString;
+    if (PreferenceGetString ("Current Device", deviceString)) {
+        for (int device = 0; firstDevice == -1 && devicelist [device]; device++)
+            if (strcasecmp (deviceString.c_str (), CreateName (device).c_str ()) == 0)
+                firstDevice = device;
+    }
+    if (firstDevice == -1) firstDevice = 0;
+    int newDevice = ChangeDevice (firstDevice);
+    for (int device = 0; newDevice == -1 && devicelist [device]; device++) {
+        if (device == firstDevice) continue;
+        newDevice = ChangeDevice (device);
+    }
+}
+
+
+SaneDevice::~SaneDevice() {
+
+    DequeueImage ();
+
+    if (currentDevice != -1)
+        PreferenceSetString ("Current Device", CreateName ());
+
+    for (std::map <int, SANE_Handle>::iterator svsh = sanehandles.begin ();
+         svsh != sanehandles.end(); svsh++) {
+
+        currentDevice = svsh->first;
+
+        PreferenceSetString (("Device " + CreateName ()).c_str (), CreateOptionString ());
+
+        sane_close (GetSaneHandle ());
+    }
+
+    sane_exit ();
+
+    PreferencesSynchronize ();
+}
+
+
+std::string SaneDevice::CreateName (int device) {
+
+    if (device == -1) device = currentDevice;
+
+    if (!devicelist [device]) return std::string ();
+
+    std::string vendor = devicelist [device]->vendor;
+    vendor.erase (vendor.find_last_not_of (" \t") + 1);
+    vendor.erase (0, vendor.find_first_not_of (" \t"));
+
+    std::string model = devicelist [device]->model;
+    model.erase (model.find_last_not_of (" \t") + 1);
+    model.erase (0, model.find_first_not_of (" \t"));
+
+    const char * backend = devicelist [device]->name;
+    const char * end = strchr (backend, ':');
+    if (strncmp (backend, "net:", 4) == 0) {
+        // IPv6 addresses should be between brackets
+        if (*(end + 1) == '[') end = strchr (end + 1, ']');
+        if (end) end = strchr (end + 1, ':');
+        if (end) backend = end + 1;
+        if (end) end = strchr (end + 1, ':');
+    }
+    if (end && (strncmp (backend, "test:", 5) == 0 || strncmp (backend, "replay:", 7) == 0))
+        end = strchr (end + 1, ':');
+    int len = (end ? end - devicelist [device]->name : strlen (devicelist [device]->name));
+
+    return vendor + " " + model + " (" + std::string (devicelist [device]->name, len) + ")";
+}
+
+
+int SaneDevice::ChangeDevice (int device) {
+
+    SANE_Status status;
+
+    int oldDevice = currentDevice;
+    currentDevice = device;
+
+    if (!GetSaneHandle ()) {
+        SANE_Handle sanehandle;
+
+        status = sane_open (devicelist [currentDevice]->name, &sanehandle);
+
+        if (status != SANE_STATUS_GOOD) {
+            currentDevice = oldDevice;
+            return currentDevice;
+        }
+
+        assert (sanehandle);
+        sanehandles [currentDevice] = sanehandle;
+
+        std::string optionString;
+        if (PreferenceGetString (("Device " + CreateName ()).c_str (), optionString))
+            ApplyOptionString (optionString);
+    }
+
+    optionIndex.clear ();
+
+    for (int option = 1; const SANE_Option_Descriptor * optdesc =
+         sane_get_option_descriptor (GetSaneHandle (), option); option++)
+        if (optdesc->type != SANE_TYPE_GROUP) optionIndex [optdesc->name] = option;
+
+    return currentDevice;
+}
+
+
+bool SaneDevice::CanShowUI () {
+
+    return false;
+}
+
+
+void SaneDevice::ShowUI (bool uionly) {}
+
+
+void SaneDevice::HideUI () {}
+
+
+bool SaneDevice::HasUI () {
+
+    return false;
+}
+
+
+void SaneDevice::OpenDeviceFailed () {
+
+    fprintf (stderr, "SANE.ds: could not open %s\n", CreateName ().c_str ());
+}
+
+
+void SaneDevice::SaneError (SANE_Status status) {
+
+    fprintf (stderr, "SANE.ds: %s\n", sane_strstatus (status));
+}
+
+
+TW_UINT16 SaneDevice::GetCustomData (pTW_CUSTOMDSDATA customdata) {
+
+    std::string deviceString = CreateName ();
+    std::string data = "Current Device=" + deviceString + "\n" + CreateOptionString ();
+
+    customdata->InfoLength = data.size ();
+    customdata->hData = (TW_HANDLE) NewHandle (customdata->InfoLength);
+    HLock ((Handle) customdata->hData);
+    memcpy (*(Handle) customdata->hData, data.data (), customdata->InfoLength);
+    HUnlock ((Handle) customdata->hData);
+
+    return TWRC_SUCCESS;
+}
+
+
+TW_UINT16 SaneDevice::SetCustomData (pTW_CUSTOMDSDATA customdata) {
+
+    bool done = false;
+
+    HLock ((Handle) customdata->hData);
+    std::string data (*(Handle) customdata->hData, customdata->InfoLength);
+    HUnlock ((Handle) customdata->hData);
+
+    if (data.compare (0, 15, "Current Device=") == 0) {
+        size_t eol = data.find ('\n');
+        std::string deviceString = data.substr (15, eol - 15);
+        std::string optionString = (eol == std::string::npos ? std::string () : data.substr (eol + 1));
+        for (int device = 0; !done && devicelist [device]; device++) {
+            if (strcasecmp (deviceString.c_str (), CreateName (device).c_str ()) == 0 &&
+                ChangeDevice (device) == device) {
+                ApplyOptionString (optionString);
+                done = true;
+            }
+        }
+    }
+
+    return (done ? TWRC_SUCCESS : datasource->SetStatus (TWCC_OPERATIONERROR));
+}
+
+
+// One "name=value" line per option. Booleans are 0 or 1, arrays are separated by commas
+// and fixed point values are written as decimals, so the file stays readable.
+
+std::string SaneDevice::CreateOptionString () {
+
+    SANE_Status status;
+
+    std::string options;
+
+    for (int option = 1; const SANE_Option_Descriptor * optdesc =
+         sane_get_option_descriptor (GetSaneHandle (), option); option++) {
+
+        if (optdesc->type == SANE_TYPE_GROUP ||
+            !SANE_OPTION_IS_ACTIVE (optdesc->cap) || !SANE_OPTION_IS_GETTABLE (optdesc->cap))
+            continue;
+
+        std::string value;
+
+        switch (optdesc->type) {
+
+            case SANE_TYPE_BOOL:
+            case SANE_TYPE_INT:
+            case SANE_TYPE_FIXED: {
+
+                int count = optdesc->size / sizeof (SANE_Word);
+                SANE_Word * optval = new SANE_Word [count];
+                status = sane_control_option (GetSaneHandle (), option,
+                                              SANE_ACTION_GET_VALUE, optval, NULL);
+                assert (status == SANE_STATUS_GOOD);
+                for (int i = 0; i < count; i++) {
+                    char number [32];
+                    if (optdesc->type == SANE_TYPE_FIXED)
+                        snprintf (number, sizeof (number), "%g", SANE_UNFIX (optval [i]));
+                    else
+                        snprintf (number, sizeof (number), "%d", optval [i]);
+                    if (i) value += ",";
+                    value += number;
+                }
+                delete[] optval;
+                break;
+            }
+
+            case SANE_TYPE_STRING: {
+
+                SANE_String optval = new char [optdesc->size];
+                status = sane_control_option (GetSaneHandle (), option,
+                                              SANE_ACTION_GET_VALUE, optval, NULL);
+                assert (status == SANE_STATUS_GOOD);
+                value = optval;
+                delete[] optval;
+                break;
+            }
+
+            default:
+                continue;
+        }
+
+        options += std::string (optdesc->name) + "=" + value + "\n";
+    }
+
+    return options;
+}
+
+
+void SaneDevice::ApplyOptionString (const std::string & optionString) {
+
+    SANE_Status status;
+
+    std::map <std::string, std::string> values;
+    for (size_t pos = 0; pos < optionString.size (); ) {
+        size_t eol = optionString.find ('\n', pos);
+        if (eol == std::string::npos) eol = optionString.size ();
+        size_t eq = optionString.find ('=', pos);
+        if (eq < eol) values [optionString.substr (pos, eq - pos)] = optionString.substr (eq + 1, eol - eq - 1);
+        pos = eol + 1;
+    }
+
+    for (int option = 1; const SANE_Option_Descriptor * optdesc =
+         sane_get_option_descriptor (GetSaneHandle (), option); option++) {
+
+        if (optdesc->type == SANE_TYPE_GROUP ||
+            !SANE_OPTION_IS_ACTIVE (optdesc->cap) || !SANE_OPTION_IS_SETTABLE (optdesc->cap))
+            continue;
+
+        std::map <std::string, std::string>::iterator value = values.find (optdesc->name);
+        if (value == values.end ()) continue;
+
+        switch (optdesc->type) {
+
+            case SANE_TYPE_BOOL:
+            case SANE_TYPE_INT:
+            case SANE_TYPE_FIXED: {
+
+                int count = optdesc->size / sizeof (SANE_Word);
+                SANE_Word * optval = new SANE_Word [count];
+                status = sane_control_option (GetSaneHandle (), option,
+                                              SANE_ACTION_GET_VALUE, optval, NULL);
+                assert (status == SANE_STATUS_GOOD);
+                const char * s = value->second.c_str ();
+                int i;
+                for (i = 0; i < count && *s; i++) {
+                    char * end;
+                    if (optdesc->type == SANE_TYPE_FIXED)
+                        optval [i] = SANE_FIX (strtod (s, &end));
+                    else
+                        optval [i] = strtol (s, &end, 10);
+                    if (end == s) break;
+                    s = (*end == ',' ? end + 1 : end);
+                }
+                // Ignore values that do not match the current size of the option
+                if (i == count && !*s) {
+                    status = sane_control_option (GetSaneHandle (), option,
+                                                  SANE_ACTION_SET_VALUE, optval, NULL);
+                    assert (status == SANE_STATUS_GOOD);
+                }
+                delete[] optval;
+                break;
+            }
+
+            case SANE_TYPE_STRING: {
+
+                SANE_String optval = new char [optdesc->size];
+                strncpy (optval, value->second.c_str (), optdesc->size - 1);
+                optval [optdesc->size - 1] = '\0';
+                status = sane_control_option (GetSaneHandle (), option,
+                                              SANE_ACTION_SET_VALUE, optval, NULL);
+                assert (status == SANE_STATUS_GOOD);
+                delete[] optval;
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+}
+
+
+void * SaneDevice::OpenProgress (bool indicators) {
+
+    return NULL;
+}
+
+
+void SaneDevice::CloseProgress (void * progress) {}
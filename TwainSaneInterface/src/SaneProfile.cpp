@@ -0,0 +1,377 @@
+#define SANE_DS_PROFILE_IMPLEMENTATION
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "SaneProfile.h"
+#include "SaneShim.h"
+
+
+// Log-linear histogram in the style of HdrHistogram: values below 32 ns get a bucket each,
+// above that every power of two is split into 16 buckets, i.e. about 6 % relative precision.
+
+#define PROFILE_SUB_BUCKETS 16
+#define PROFILE_BUCKETS (2 * PROFILE_SUB_BUCKETS + 59 * PROFILE_SUB_BUCKETS)
+
+class ProfileHistogram {
+
+public:
+    ProfileHistogram () : count (0), total (0), min (0), max (0) {
+        memset (buckets, 0, sizeof (buckets));
+    }
+    void Record (unsigned long long value);
+    unsigned long long Percentile (double percentile) const;
+
+    unsigned long long count;
+    unsigned long long total;
+    unsigned long long min;
+    unsigned long long max;
+private:
+    static int Index (unsigned long long value);
+    static unsigned long long Value (int index);
+    unsigned int buckets [PROFILE_BUCKETS];
+};
+
+
+int ProfileHistogram::Index (unsigned long long value) {
+
+    if (value < 2 * PROFILE_SUB_BUCKETS) return value;
+    int magnitude = 63 - __builtin_clzll (value);
+    int shift = magnitude - 4;
+    return PROFILE_SUB_BUCKETS * (magnitude - 3) + (value >> shift) - PROFILE_SUB_BUCKETS;
+}
+
+
+unsigned long long ProfileHistogram::Value (int index) {
+
+    if (index < 2 * PROFILE_SUB_BUCKETS) return index;
+    int shift = index / PROFILE_SUB_BUCKETS - 1;
+    unsigned long long sub = index % PROFILE_SUB_BUCKETS + PROFILE_SUB_BUCKETS;
+    // Report the middle of the bucket
+    return (sub << shift) + (1ULL << shift) / 2;
+}
+
+
+void ProfileHistogram::Record (unsigned long long value) {
+
+    buckets [Index (value)]++;
+    if (count == 0 || value < min) min = value;
+    if (value > max) max = value;
+    total += value;
+    count++;
+}
+
+
+unsigned long long ProfileHistogram::Percentile (double percentile) const {
+
+    unsigned long long limit = (unsigned long long) (percentile / 100 * count + 0.5);
+    if (limit == 0) limit = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        seen += buckets [i];
+        if (seen >= limit) return std::min (std::max (Value (i), min), max);
+    }
+    return max;
+}
+
+
+enum ProfileEntry {
+    PROFILE_INIT,
+    PROFILE_EXIT,
+    PROFILE_GET_DEVICES,
+    PROFILE_OPEN,
+    PROFILE_CLOSE,
+    PROFILE_GET_OPTION_DESCRIPTOR,
+    PROFILE_CONTROL_OPTION,
+    PROFILE_GET_PARAMETERS,
+    PROFILE_START,
+    PROFILE_READ,
+    PROFILE_CANCEL,
+    PROFILE_ENTRIES
+};
+
+static const char * profileEntryName [PROFILE_ENTRIES] = {
+    "sane_init",
+    "sane_exit",
+    "sane_get_devices",
+    "sane_open",
+    "sane_close",
+    "sane_get_option_descriptor",
+    "sane_control_option",
+    "sane_get_parameters",
+    "sane_start",
+    "sane_read",
+    "sane_cancel"
+};
+
+static pthread_once_t profileOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+static const char * profilePath = NULL;
+static volatile sig_atomic_t profileDumpRequested = 0;
+static ProfileHistogram * profileEntries = NULL;
+static std::map <std::string, ProfileHistogram> * profileOptions = NULL;
+
+
+static void ProfileSignal (int) {
+
+    profileDumpRequested = 1;
+}
+
+
+static void ProfileInit () {
+
+    const char * path = getenv ("SANE_DS_PROFILE");
+    if (!path || !*path) return;
+    profilePath = strdup (path);
+    profileEntries = new ProfileHistogram [PROFILE_ENTRIES];
+    profileOptions = new std::map <std::string, ProfileHistogram>;
+
+    // Dumps on SIGUSR1, unless the application has a use of its own for it
+    struct sigaction action;
+    if (sigaction (SIGUSR1, NULL, &action) == 0 && action.sa_handler == SIG_DFL &&
+        !(action.sa_flags & SA_SIGINFO)) {
+        memset (&action, 0, sizeof (action));
+        action.sa_handler = ProfileSignal;
+        sigemptyset (&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction (SIGUSR1, &action, NULL);
+    }
+}
+
+
+static bool ProfileEnabled () {
+
+    pthread_once (&profileOnce, ProfileInit);
+    return profilePath;
+}
+
+
+static void ProfileWrite () {
+
+    FILE * file = fopen (profilePath, "w");
+    if (!file) return;
+    SaneProfileDump (file);
+    fclose (file);
+}
+
+
+static void ProfileRecord (ProfileEntry entry, unsigned long long start, const std::string * option = NULL) {
+
+    unsigned long long elapsed = MonotonicNanoseconds () - start;
+
+    pthread_mutex_lock (&profileMutex);
+    profileEntries [entry].Record (elapsed);
+    if (option) (*profileOptions) [*option].Record (elapsed);
+    pthread_mutex_unlock (&profileMutex);
+
+    if (profileDumpRequested) {
+        profileDumpRequested = 0;
+        ProfileWrite ();
+    }
+}
+
+
+static std::string ProfileOptionKey (SANE_Handle handle, SANE_Int option, SANE_Action action) {
+
+    const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (handle, option);
+
+    std::string key;
+    if (optdesc && optdesc->name && *optdesc->name)
+        key = optdesc->name;
+    else {
+        char number [16];
+        snprintf (number, sizeof (number), "#%d", option);
+        key = number;
+    }
+
+    switch (action) {
+        case SANE_ACTION_GET_VALUE:
+            key += " (get)";
+            break;
+        case SANE_ACTION_SET_VALUE:
+            key += " (set)";
+            break;
+        case SANE_ACTION_SET_AUTO:
+            key += " (auto)";
+            break;
+    }
+
+    return key;
+}
+
+
+SANE_Status SaneProfileInit (SANE_Int * version_code, SANE_Auth_Callback authorize) {
+
+    if (!ProfileEnabled ()) return sane_init (version_code, authorize);
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_init (version_code, authorize);
+    ProfileRecord (PROFILE_INIT, start);
+    return status;
+}
+
+
+void SaneProfileExit () {
+
+    if (!ProfileEnabled ()) {
+        sane_exit ();
+        return;
+    }
+    unsigned long long start = MonotonicNanoseconds ();
+    sane_exit ();
+    ProfileRecord (PROFILE_EXIT, start);
+    ProfileWrite ();
+}
+
+
+SANE_Status SaneProfileGetDevices (const SANE_Device *** device_list, SANE_Bool local_only) {
+
+    if (!ProfileEnabled ()) return sane_get_devices (device_list, local_only);
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_get_devices (device_list, local_only);
+    ProfileRecord (PROFILE_GET_DEVICES, start);
+    return status;
+}
+
+
+SANE_Status SaneProfileOpen (SANE_String_Const devicename, SANE_Handle * handle) {
+
+    if (!ProfileEnabled ()) return sane_open (devicename, handle);
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_open (devicename, handle);
+    ProfileRecord (PROFILE_OPEN, start);
+    return status;
+}
+
+
+void SaneProfileClose (SANE_Handle handle) {
+
+    if (!ProfileEnabled ()) {
+        sane_close (handle);
+        return;
+    }
+    unsigned long long start = MonotonicNanoseconds ();
+    sane_close (handle);
+    ProfileRecord (PROFILE_CLOSE, start);
+}
+
+
+const SANE_Option_Descriptor * SaneProfileGetOptionDescriptor (SANE_Handle handle, SANE_Int option) {
+
+    if (!ProfileEnabled ()) return sane_get_option_descriptor (handle, option);
+    unsigned long long start = MonotonicNanoseconds ();
+    const SANE_Option_Descriptor * optdesc = sane_get_option_descriptor (handle, option);
+    ProfileRecord (PROFILE_GET_OPTION_DESCRIPTOR, start);
+    return optdesc;
+}
+
+
+SANE_Status SaneProfileControlOption (SANE_Handle handle, SANE_Int option, SANE_Action action,
+                                      void * value, SANE_Int * info) {
+
+    if (!ProfileEnabled ()) return sane_control_option (handle, option, action, value, info);
+    // Look up the name first, so the descriptor call is not part of the measurement
+    std::string key = ProfileOptionKey (handle, option, action);
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_control_option (handle, option, action, value, info);
+    ProfileRecord (PROFILE_CONTROL_OPTION, start, &key);
+    return status;
+}
+
+
+SANE_Status SaneProfileGetParameters (SANE_Handle handle, SANE_Parameters * params) {
+
+    if (!ProfileEnabled ()) return sane_get_parameters (handle, params);
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_get_parameters (handle, params);
+    ProfileRecord (PROFILE_GET_PARAMETERS, start);
+    return status;
+}
+
+
+SANE_Status SaneProfileStart (SANE_Handle handle) {
+
+    if (!ProfileEnabled ()) return sane_start (handle);
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_start (handle);
+    ProfileRecord (PROFILE_START, start);
+    return status;
+}
+
+
+SANE_Status SaneProfileRead (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
+                             SANE_Int * length) {
+
+    if (!ProfileEnabled ()) return sane_read (handle, data, max_length, length);
+    unsigned long long start = MonotonicNanoseconds ();
+    SANE_Status status = sane_read (handle, data, max_length, length);
+    ProfileRecord (PROFILE_READ, start);
+    return status;
+}
+
+
+void SaneProfileCancel (SANE_Handle handle) {
+
+    if (!ProfileEnabled ()) {
+        sane_cancel (handle);
+        return;
+    }
+    unsigned long long start = MonotonicNanoseconds ();
+    sane_cancel (handle);
+    ProfileRecord (PROFILE_CANCEL, start);
+}
+
+
+static void ProfilePrint (FILE * file, const char * name, const ProfileHistogram & histogram) {
+
+    fprintf (file, "%-40s %8llu %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+             histogram.count, histogram.total / 1000.0, histogram.min / 1000.0,
+             histogram.Percentile (50) / 1000.0, histogram.Percentile (90) / 1000.0,
+             histogram.Percentile (99) / 1000.0, histogram.Percentile (99.9) / 1000.0,
+             histogram.max / 1000.0);
+}
+
+
+static bool ProfileMoreTime (const std::pair <std::string, ProfileHistogram *> & a,
+                             const std::pair <std::string, ProfileHistogram *> & b) {
+
+    return a.second->total > b.second->total;
+}
+
+
+void SaneProfileDump (FILE * file) {
+
+    if (!ProfileEnabled ()) return;
+
+    pthread_mutex_lock (&profileMutex);
+
+    fprintf (file, "%-40s %8s %12s %10s %10s %10s %10s %10s %10s\n", "entry point (times in us)",
+             "calls", "total", "min", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < PROFILE_ENTRIES; i++)
+        if (profileEntries [i].count) ProfilePrint (file, profileEntryName [i], profileEntries [i]);
+
+    // Options sorted by the total time spent, the most expensive first
+    std::vector <std::pair <std::string, ProfileHistogram *> > options;
+    for (std::map <std::string, ProfileHistogram>::iterator it = profileOptions->begin ();
+         it != profileOptions->end (); it++)
+        options.push_back (std::make_pair (it->first, &it->second));
+    std::sort (options.begin (), options.end (), ProfileMoreTime);
+
+    fprintf (file, "\n%-40s %8s %12s %10s %10s %10s %10s %10s %10s\n", "sane_control_option (times in us)",
+             "calls", "total", "min", "p50", "p90", "p99", "p99.9", "max");
+    for (size_t i = 0; i < options.size (); i++)
+        ProfilePrint (file, options [i].first.c_str (), *options [i].second);
+
+    pthread_mutex_unlock (&profileMutex);
+}
@@ -0,0 +1,43 @@
+#ifndef SANE_DS_PROFILE_H
+#define SANE_DS_PROFILE_H
+
+#include <sane/sane.h>
+
+#include <cstdio>
+
+// Interposition layer for the SANE API. Every call is timed and counted per entry point,
+// and sane_control_option additionally per option name and action.
+// Set SANE_DS_PROFILE to a file path to get a dump when SANE is closed, or on SIGUSR1 when the
+// application does not handle that signal itself.
+
+SANE_Status SaneProfileInit (SANE_Int * version_code, SANE_Auth_Callback authorize);
+void SaneProfileExit ();
+SANE_Status SaneProfileGetDevices (const SANE_Device *** device_list, SANE_Bool local_only);
+SANE_Status SaneProfileOpen (SANE_String_Const devicename, SANE_Handle * handle);
+void SaneProfileClose (SANE_Handle handle);
+const SANE_Option_Descriptor * SaneProfileGetOptionDescriptor (SANE_Handle handle, SANE_Int option);
+SANE_Status SaneProfileControlOption (SANE_Handle handle, SANE_Int option, SANE_Action action,
+                                      void * value, SANE_Int * info);
+SANE_Status SaneProfileGetParameters (SANE_Handle handle, SANE_Parameters * params);
+SANE_Status SaneProfileStart (SANE_Handle handle);
+SANE_Status SaneProfileRead (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
+                             SANE_Int * length);
+void SaneProfileCancel (SANE_Handle handle);
+
+void SaneProfileDump (FILE * file);
+
+#ifndef SANE_DS_PROFILE_IMPLEMENTATION
+#define sane_init                  SaneProfileInit
+#define sane_exit                  SaneProfileExit
+#define sane_get_devices           SaneProfileGetDevices
+#define sane_open                  SaneProfileOpen
+#define sane_close                 SaneProfileClose
+#define sane_get_option_descriptor SaneProfileGetOptionDescriptor
+#define sane_control_option        SaneProfileControlOption
+#define sane_get_parameters        SaneProfileGetParameters
+#define sane_start                 SaneProfileStart
+#define sane_read                  SaneProfileRead
+#define sane_cancel                SaneProfileCancel
+#endif
+
+#endif
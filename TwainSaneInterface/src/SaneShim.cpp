@@ -0,0 +1,307 @@
+#define SANE_DS_SHIM_IMPLEMENTATION
+
+#include "Platform.h"
+
+#include <sane/sane.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "SaneShim.h"
+#include "SaneCapture.h"
+
+
+#define SHIM_PREFIX "net:shim:"
+
+static pthread_mutex_t shimMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool shimEnabled = false;
+static unsigned long long shimLatency = 0;
+static unsigned long long shimJitter = 0;
+static double shimBandwidth = 0;
+static double shimBusy = 0;
+static unsigned int shimSeed = 1;
+static std::vector <std::string> shimDevices;
+
+// The wrapped handles, with the time their link is free again for the bandwidth cap
+static std::map <SANE_Handle, unsigned long long> * shimHandles = NULL;
+static std::vector <SANE_Device> * shimDeviceList = NULL;
+static std::vector <std::string> * shimDeviceNames = NULL;
+static std::vector <const SANE_Device *> * shimDevicePointers = NULL;
+
+
+static void ShimSleep (unsigned long long ns) {
+
+    if (ns == 0) return;
+    struct timespec ts = { (time_t) (ns / 1000000000ULL), (long) (ns % 1000000000ULL) };
+    while (nanosleep (&ts, &ts) != 0);
+}
+
+
+// Uniform in [0, 1), from a generator of its own so runs with the same seed are alike
+static double ShimRandom () {
+
+    pthread_mutex_lock (&shimMutex);
+    shimSeed = shimSeed * 1103515245 + 12345;
+    double random = ((shimSeed >> 8) & 0xFFFFFF) / 16777216.0;
+    pthread_mutex_unlock (&shimMutex);
+    return random;
+}
+
+
+static unsigned long long ShimParseTime (const char * value) {
+
+    char * unit;
+    double time = strtod (value, &unit);
+    if (strcmp (unit, "us") == 0) return (unsigned long long) (time * 1e3);
+    if (strcmp (unit, "s") == 0) return (unsigned long long) (time * 1e9);
+    return (unsigned long long) (time * 1e6);
+}
+
+
+static double ShimParseBytes (const char * value) {
+
+    char * unit;
+    double bytes = strtod (value, &unit);
+    switch (*unit) {
+        case 'K': case 'k': return bytes * 1024;
+        case 'M': case 'm': return bytes * 1024 * 1024;
+        case 'G': case 'g': return bytes * 1024 * 1024 * 1024;
+        default: return bytes;
+    }
+}
+
+
+static void ShimConfigure () {
+
+    const char * config = getenv ("SANE_DS_SHIM");
+    if (!config || !*config) return;
+
+    std::string settings = config;
+    for (size_t pos = 0; pos < settings.size (); ) {
+        size_t comma = settings.find (',', pos);
+        if (comma == std::string::npos) comma = settings.size ();
+        std::string setting = settings.substr (pos, comma - pos);
+        size_t eq = setting.find ('=');
+        std::string key = setting.substr (0, eq);
+        const char * value = (eq == std::string::npos ? "" : setting.c_str () + eq + 1);
+        if (key == "latency") shimLatency = ShimParseTime (value);
+        else if (key == "jitter") shimJitter = ShimParseTime (value);
+        else if (key == "bandwidth") shimBandwidth = ShimParseBytes (value);
+        else if (key == "busy") shimBusy = atof (value);
+        else if (key == "seed") shimSeed = strtoul (value, NULL, 0);
+        else if (key == "devices") {
+            std::string devices = value;
+            for (size_t start = 0; start < devices.size (); ) {
+                size_t plus = devices.find ('+', start);
+                if (plus == std::string::npos) plus = devices.size ();
+                if (plus > start) shimDevices.push_back (devices.substr (start, plus - start));
+                start = plus + 1;
+            }
+        }
+        else if (!key.empty ()) fprintf (stderr, "SANE.ds: unknown SANE_DS_SHIM setting %s\n", key.c_str ());
+        pos = comma + 1;
+    }
+
+    shimEnabled = true;
+}
+
+
+// One round trip to saned
+static void ShimRoundTrip () {
+
+    unsigned long long latency = shimLatency;
+    if (shimJitter) {
+        long long jitter = (long long) ((2 * ShimRandom () - 1) * shimJitter);
+        latency = (jitter < 0 && (unsigned long long) -jitter > latency ? 0 : latency + jitter);
+    }
+    ShimSleep (latency);
+}
+
+
+static bool ShimDevice (const char * name) {
+
+    for (size_t i = 0; i < shimDevices.size (); i++)
+        if (strncmp (name, shimDevices [i].c_str (), shimDevices [i].size ()) == 0) return true;
+    return false;
+}
+
+
+static bool ShimBusy () {
+
+    return (shimBusy > 0 && ShimRandom () < shimBusy);
+}
+
+
+static bool ShimWrapped (SANE_Handle handle) {
+
+    if (!shimEnabled) return false;
+    pthread_mutex_lock (&shimMutex);
+    bool wrapped = (shimHandles->find (handle) != shimHandles->end ());
+    pthread_mutex_unlock (&shimMutex);
+    return wrapped;
+}
+
+
+SANE_Status SaneShimInit (SANE_Int * version_code, SANE_Auth_Callback authorize) {
+
+    if (!shimHandles) {
+        shimHandles = new std::map <SANE_Handle, unsigned long long>;
+        shimDeviceList = new std::vector <SANE_Device>;
+        shimDeviceNames = new std::vector <std::string>;
+        shimDevicePointers = new std::vector <const SANE_Device *>;
+        ShimConfigure ();
+    }
+    return sane_init (version_code, authorize);
+}
+
+
+void SaneShimExit () {
+
+    sane_exit ();
+}
+
+
+SANE_Status SaneShimGetDevices (const SANE_Device *** device_list, SANE_Bool local_only) {
+
+    if (!shimEnabled) return sane_get_devices (device_list, local_only);
+
+    ShimRoundTrip ();
+    SANE_Status status = sane_get_devices (device_list, local_only);
+    if (status != SANE_STATUS_GOOD) return status;
+
+    // The wrapped devices get names like those of the net backend
+    shimDeviceList->clear ();
+    shimDeviceNames->clear ();
+    shimDevicePointers->clear ();
+    int count = 0;
+    while ((*device_list) [count]) count++;
+    shimDeviceList->reserve (count);
+    shimDeviceNames->reserve (count);
+    for (int i = 0; i < count; i++) {
+        const SANE_Device * device = (*device_list) [i];
+        if (!ShimDevice (device->name)) {
+            shimDevicePointers->push_back (device);
+            continue;
+        }
+        shimDeviceNames->push_back (SHIM_PREFIX + std::string (device->name));
+        shimDeviceList->push_back (*device);
+        shimDeviceList->back ().name = shimDeviceNames->back ().c_str ();
+        shimDevicePointers->push_back (&shimDeviceList->back ());
+    }
+    shimDevicePointers->push_back (NULL);
+    *device_list = &(*shimDevicePointers) [0];
+
+    return status;
+}
+
+
+SANE_Status SaneShimOpen (SANE_String_Const devicename, SANE_Handle * handle) {
+
+    if (!shimEnabled || strncmp (devicename, SHIM_PREFIX, strlen (SHIM_PREFIX)) != 0)
+        return sane_open (devicename, handle);
+
+    ShimRoundTrip ();
+    if (ShimBusy ()) return SANE_STATUS_DEVICE_BUSY;
+
+    SANE_Status status = sane_open (devicename + strlen (SHIM_PREFIX), handle);
+    if (status == SANE_STATUS_GOOD) {
+        pthread_mutex_lock (&shimMutex);
+        (*shimHandles) [*handle] = 0;
+        pthread_mutex_unlock (&shimMutex);
+    }
+    return status;
+}
+
+
+void SaneShimClose (SANE_Handle handle) {
+
+    if (ShimWrapped (handle)) {
+        ShimRoundTrip ();
+        pthread_mutex_lock (&shimMutex);
+        shimHandles->erase (handle);
+        pthread_mutex_unlock (&shimMutex);
+    }
+    sane_close (handle);
+}
+
+
+// The net backend keeps the descriptors on the client, they only cost a round trip when reloaded
+const SANE_Option_Descriptor * SaneShimGetOptionDescriptor (SANE_Handle handle, SANE_Int option) {
+
+    return sane_get_option_descriptor (handle, option);
+}
+
+
+SANE_Status SaneShimControlOption (SANE_Handle handle, SANE_Int option, SANE_Action action,
+                                   void * value, SANE_Int * info) {
+
+    if (ShimWrapped (handle)) ShimRoundTrip ();
+    return sane_control_option (handle, option, action, value, info);
+}
+
+
+SANE_Status SaneShimGetParameters (SANE_Handle handle, SANE_Parameters * params) {
+
+    if (ShimWrapped (handle)) ShimRoundTrip ();
+    return sane_get_parameters (handle, params);
+}
+
+
+SANE_Status SaneShimStart (SANE_Handle handle) {
+
+    if (ShimWrapped (handle)) {
+        ShimRoundTrip ();
+        if (ShimBusy ()) return SANE_STATUS_DEVICE_BUSY;
+        pthread_mutex_lock (&shimMutex);
+        (*shimHandles) [handle] = 0;
+        pthread_mutex_unlock (&shimMutex);
+    }
+    return sane_start (handle);
+}
+
+
+SANE_Status SaneShimRead (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
+                          SANE_Int * length) {
+
+    if (!ShimWrapped (handle)) return sane_read (handle, data, max_length, length);
+
+    // Image data is streamed, so only the first read of a frame waits for the round trip
+    pthread_mutex_lock (&shimMutex);
+    unsigned long long & linkfree = (*shimHandles) [handle];
+    bool first = (linkfree == 0);
+    pthread_mutex_unlock (&shimMutex);
+    if (first) ShimRoundTrip ();
+
+    SANE_Status status = sane_read (handle, data, max_length, length);
+
+    if (shimBandwidth > 0 && status == SANE_STATUS_GOOD) {
+        unsigned long long now = MonotonicNanoseconds ();
+        pthread_mutex_lock (&shimMutex);
+        if (linkfree < now) linkfree = now;
+        linkfree += (unsigned long long) (*length / shimBandwidth * 1e9);
+        unsigned long long until = linkfree;
+        pthread_mutex_unlock (&shimMutex);
+        if (until > now) ShimSleep (until - now);
+    }
+    else if (first) {
+        pthread_mutex_lock (&shimMutex);
+        linkfree = MonotonicNanoseconds ();
+        pthread_mutex_unlock (&shimMutex);
+    }
+
+    return status;
+}
+
+
+void SaneShimCancel (SANE_Handle handle) {
+
+    if (ShimWrapped (handle)) ShimRoundTrip ();
+    sane_cancel (handle);
+}
@@ -0,0 +1,47 @@
+#ifndef SANE_DS_SHIM_H
+#define SANE_DS_SHIM_H
+
+#include <sane/sane.h>
+
+// Network emulation for the SANE API, between the profiling and the capture layers.
+// Set SANE_DS_SHIM to a comma separated list of settings to make local devices behave like
+// devices behind saned; they are then listed as "net:shim:<name>".
+//   latency=20ms     added to every call that goes over the network (also us and s)
+//   jitter=5ms       uniformly distributed variation of the latency
+//   bandwidth=2M     sane_read throughput cap in bytes per second (also K and G)
+//   busy=0.01        probability that sane_open or sane_start fails with
+//                    SANE_STATUS_DEVICE_BUSY, as when another client has the scanner
+//   seed=1           seed for the jitter and busy decisions
+//   devices=test     wrap the devices whose names start with this, several separated by +
+//                    (devices=test+epson2); no device is wrapped without this setting
+// Each wrapped handle has a link of its own, with its own bandwidth.
+
+SANE_Status SaneShimInit (SANE_Int * version_code, SANE_Auth_Callback authorize);
+void SaneShimExit ();
+SANE_Status SaneShimGetDevices (const SANE_Device *** device_list, SANE_Bool local_only);
+SANE_Status SaneShimOpen (SANE_String_Const devicename, SANE_Handle * handle);
+void SaneShimClose (SANE_Handle handle);
+const SANE_Option_Descriptor * SaneShimGetOptionDescriptor (SANE_Handle handle, SANE_Int option);
+SANE_Status SaneShimControlOption (SANE_Handle handle, SANE_Int option, SANE_Action action,
+                                   void * value, SANE_Int * info);
+SANE_Status SaneShimGetParameters (SANE_Handle handle, SANE_Parameters * params);
+SANE_Status SaneShimStart (SANE_Handle handle);
+SANE_Status SaneShimRead (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
+                          SANE_Int * length);
+void SaneShimCancel (SANE_Handle handle);
+
+#ifndef SANE_DS_SHIM_IMPLEMENTATION
+#define sane_init                  SaneShimInit
+#define sane_exit                  SaneShimExit
+#define sane_get_devices           SaneShimGetDevices
+#define sane_open                  SaneShimOpen
+#define sane_close                 SaneShimClose
+#define sane_get_option_descriptor SaneShimGetOptionDescriptor
+#define sane_control_option        SaneShimControlOption
+#define sane_get_parameters        SaneShimGetParameters
+#define sane_start                 SaneShimStart
+#define sane_read                  SaneShimRead
+#define sane_cancel                SaneShimCancel
+#endif
+
+#endif
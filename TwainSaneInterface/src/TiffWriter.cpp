@@ -0,0 +1,607 @@
+#include "Platform.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "TiffWriter.h"
+#include "Group4.h"
+#include "Lzw.h"
+#include "PackBits.h"
+#include "Trace.h"
+
+#ifndef TWCP_ZIP
+#define TWCP_ZIP 13
+#endif
+
+
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_RATIONAL 5
+#define TIFF_LONG8 16
+
+// Uncompressed strips of about this size
+#define TIFF_STRIP 0x10000
+
+// Compression threads, on top of the ones scanning and writing
+#define TIFF_MAXTHREADS 4
+
+// A classic TIFF header, with room for it to become a BigTIFF header
+#define TIFF_HEADER 16
+
+#define TIFF_CLASSICLIMIT 0xFFFFFFFFULL
+
+
+static Size TypeSize (UInt16 type) {
+
+    switch (type) {
+        case 3: case 8:           return 2;
+        case 4: case 9: case 11:  return 4;
+        case 5: case 10: case 12:
+        case 16: case 17: case 18: return 8;
+        default:                  return 1;
+    }
+}
+
+
+TiffWriter::TiffWriter (FILE * infile) : file (infile),
+                                         failed (false),
+                                         bigtiff (false),
+                                         position (0),
+                                         linkoffset (4),
+                                         pages (0),
+                                         compression (TWCP_NONE),
+                                         width (0),
+                                         height (0),
+                                         samples (1),
+                                         depth (1),
+                                         xdpi (0),
+                                         ydpi (0),
+                                         rowbytes (0),
+                                         rowsperstrip (0),
+                                         predictor (false),
+                                         rows (0),
+                                         pagestart (0),
+                                         inpage (false),
+                                         pageifd (0),
+                                         pagelink (0),
+                                         pagebig (false),
+                                         fill (0),
+                                         next (0),
+                                         submitted (0),
+                                         quit (false),
+                                         lzw (new LzwEncoder) {
+
+    unsigned char header [TIFF_HEADER];
+    memset (header, 0, sizeof (header));
+#ifdef __BIG_ENDIAN__
+    header [0] = header [1] = 'M';
+#else
+    header [0] = header [1] = 'I';
+#endif
+    UInt16 magic = 42;
+    memcpy (&header [2], &magic, 2);
+    Write (header, sizeof (header));
+
+    pthread_mutex_init (&mutex, NULL);
+    pthread_cond_init (&ready, NULL);
+    pthread_cond_init (&done, NULL);
+
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    int count = std::min ((long) TIFF_MAXTHREADS, cpus - 1);
+    for (int i = 0; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create (&thread, NULL, Run, this) != 0) break;
+        threads.push_back (thread);
+    }
+    strips.resize (threads.size () + 2);
+    for (size_t i = 0; i < strips.size (); i++) strips [i].state = Strip::FREE;
+}
+
+
+TiffWriter::~TiffWriter () {
+
+    if (inpage) DropPage ();
+
+    pthread_mutex_lock (&mutex);
+    quit = true;
+    pthread_cond_broadcast (&ready);
+    pthread_mutex_unlock (&mutex);
+    for (size_t i = 0; i < threads.size (); i++) pthread_join (threads [i], NULL);
+
+    pthread_cond_destroy (&done);
+    pthread_cond_destroy (&ready);
+    pthread_mutex_destroy (&mutex);
+
+    delete lzw;
+}
+
+
+bool TiffWriter::Failed () {
+
+    return failed;
+}
+
+
+int TiffWriter::GetPages () {
+
+    return pages;
+}
+
+
+void TiffWriter::Write (const void * data, Size length) {
+
+    if (failed) return;
+    if (fwrite (data, 1, length, file) != (size_t) length) failed = true;
+    position += length;
+}
+
+
+// Reads and writes elsewhere in the file leave the file position at the end
+bool TiffWriter::WriteAt (UInt64 offset, const void * data, Size length) {
+
+    if (failed) return false;
+    if (fseeko (file, offset, SEEK_SET) != 0 || fwrite (data, 1, length, file) != (size_t) length ||
+        fseeko (file, position, SEEK_SET) != 0)
+        failed = true;
+    return !failed;
+}
+
+
+bool TiffWriter::ReadAt (UInt64 offset, void * data, Size length) {
+
+    if (failed) return false;
+    if (fseeko (file, offset, SEEK_SET) != 0 || fread (data, 1, length, file) != (size_t) length ||
+        fseeko (file, position, SEEK_SET) != 0)
+        failed = true;
+    return !failed;
+}
+
+
+void TiffWriter::Align () {
+
+    if (position & 1) Write ("", 1);
+}
+
+
+void TiffWriter::StartPage (TW_UINT16 incompression, int inwidth, int inheight, int insamples, int indepth,
+                            double inxdpi, double inydpi) {
+
+    if (inpage) DropPage ();
+
+    compression = incompression;
+    width = inwidth;
+    height = inheight;
+    samples = insamples;
+    depth = indepth;
+    xdpi = inxdpi;
+    ydpi = inydpi;
+    rowbytes = ((Size) width * samples * depth + 7) / 8;
+    rowsperstrip = std::max ((Size) 1, TIFF_STRIP / rowbytes);
+    if (height > 0 && rowsperstrip > height) rowsperstrip = height;
+    predictor = ((compression == TWCP_LZW || compression == TWCP_ZIP) && depth >= 8);
+
+    rows = 0;
+    pagestart = position;
+    inpage = true;
+    pageifd = 0;
+    stripoffsets.clear ();
+    stripbytecounts.clear ();
+    fill = 0;
+    next = 0;
+    submitted = 0;
+}
+
+
+void TiffWriter::WriteRow (const unsigned char * data) {
+
+    if (!inpage || pageifd) return;
+
+    Strip & strip = strips [fill];
+    if (strip.state == Strip::FREE) {
+        strip.state = Strip::FILLING;
+        strip.rows = 0;
+        strip.data.clear ();
+    }
+    strip.data.insert (strip.data.end (), data, data + rowbytes);
+    strip.rows++;
+    rows++;
+
+    if (strip.rows == rowsperstrip) Submit ();
+}
+
+
+// Hands a full strip to the compression threads, and makes room for the next one
+void TiffWriter::Submit () {
+
+    Strip & strip = strips [fill];
+    strip.number = submitted++;
+
+    if (threads.empty ()) {
+        Compress (strip, *lzw);
+        strip.state = Strip::DONE;
+    }
+    else {
+        pthread_mutex_lock (&mutex);
+        strip.state = Strip::READY;
+        pthread_cond_signal (&ready);
+        pthread_mutex_unlock (&mutex);
+    }
+
+    fill = (fill + 1) % strips.size ();
+    for (;;) {
+        pthread_mutex_lock (&mutex);
+        bool full = (strips [fill].state != Strip::FREE);
+        pthread_mutex_unlock (&mutex);
+        if (!WriteStrip (full)) break;
+    }
+}
+
+
+// Writes the oldest strip once it is compressed
+bool TiffWriter::WriteStrip (bool wait) {
+
+    Strip & strip = strips [next];
+
+    pthread_mutex_lock (&mutex);
+    bool pending = (strip.state == Strip::READY || strip.state == Strip::BUSY || strip.state == Strip::DONE);
+    while (pending && wait && strip.state != Strip::DONE)
+        pthread_cond_wait (&done, &mutex);
+    bool available = (strip.state == Strip::DONE);
+    pthread_mutex_unlock (&mutex);
+    if (!available) return false;
+
+    if (strip.failed) failed = true;
+    stripoffsets.push_back (position);
+    stripbytecounts.push_back (strip.length);
+    Write (strip.out, strip.length);
+
+    pthread_mutex_lock (&mutex);
+    strip.state = Strip::FREE;
+    pthread_mutex_unlock (&mutex);
+
+    next = (next + 1) % strips.size ();
+    return true;
+}
+
+
+void * TiffWriter::Run (void * arg) {
+
+    ((TiffWriter *) arg)->Work ();
+    return NULL;
+}
+
+
+void TiffWriter::Work () {
+
+    LzwEncoder encoder;
+
+    pthread_mutex_lock (&mutex);
+    for (;;) {
+        // The oldest strip first
+        Strip * strip = NULL;
+        for (size_t i = 0; i < strips.size (); i++)
+            if (strips [i].state == Strip::READY && (!strip || strips [i].number < strip->number))
+                strip = &strips [i];
+        if (!strip) {
+            if (quit) break;
+            pthread_cond_wait (&ready, &mutex);
+            continue;
+        }
+        strip->state = Strip::BUSY;
+        pthread_mutex_unlock (&mutex);
+
+        Compress (*strip, encoder);
+
+        pthread_mutex_lock (&mutex);
+        strip->state = Strip::DONE;
+        pthread_cond_broadcast (&done);
+    }
+    pthread_mutex_unlock (&mutex);
+}
+
+
+// Only reads the settings of the page, which do not change while strips are in flight
+void TiffWriter::Compress (Strip & strip, LzwEncoder & encoder) {
+
+    TraceScope trace ("convert", "TIFF strip %d", strip.number);
+
+    strip.failed = false;
+    strip.out = &strip.data [0];
+    strip.length = strip.data.size ();
+
+    if (predictor) {
+        // Horizontal differencing, from the right so the left neighbours are still intact
+        for (int r = 0; r < strip.rows; r++) {
+            unsigned char * p = &strip.data [r * rowbytes];
+            if (depth == 8)
+                for (Size i = rowbytes - 1; i >= samples; i--)
+                    p [i] -= p [i - samples];
+            else {
+                UInt16 * s = (UInt16 *) p;
+                for (Size i = rowbytes / 2 - 1; i >= samples; i--)
+                    s [i] -= s [i - samples];
+            }
+        }
+    }
+
+    if (compression == TWCP_PACKBITS) {
+        // Runs never cross rows
+        strip.packed.resize (strip.rows * (rowbytes + (rowbytes + 127) / 128 + rowbytes / 0x4000 + 1));
+        unsigned char * dst = &strip.packed [0];
+        for (int r = 0; r < strip.rows; r++) {
+            const unsigned char * src = &strip.data [r * rowbytes];
+            for (Size done = 0; done < rowbytes; done += 0x4000)
+                dst += PackBitsRow (src + done, std::min (rowbytes - done, (Size) 0x4000), dst);
+        }
+        strip.out = &strip.packed [0];
+        strip.length = dst - &strip.packed [0];
+    }
+
+    else if (compression == TWCP_GROUP4) {
+        strip.packed.resize (strip.rows * Group4Encoder::WorstRow (width) + Group4Encoder::Trailer ());
+        Group4Encoder g4 ((Ptr) &strip.packed [0], strip.packed.size (), width);
+        for (int r = 0; r < strip.rows; r++)
+            g4.EncodeRow (&strip.data [r * rowbytes]);
+        strip.out = &strip.packed [0];
+        strip.length = g4.Finish ();
+    }
+
+    else if (compression == TWCP_LZW) {
+        strip.packed.clear ();
+        encoder.Encode (&strip.data [0], strip.data.size (), strip.packed);
+        encoder.Finish (strip.packed);
+        strip.out = &strip.packed [0];
+        strip.length = strip.packed.size ();
+    }
+
+    else if (compression == TWCP_ZIP) {
+        uLongf size = compressBound (strip.data.size ());
+        strip.packed.resize (size);
+        if (compress2 (&strip.packed [0], &size, &strip.data [0], strip.data.size (), Z_DEFAULT_COMPRESSION) != Z_OK)
+            strip.failed = true;
+        strip.out = &strip.packed [0];
+        strip.length = size;
+    }
+}
+
+
+// A directory entry in host byte order, the value is written out of line when it does not fit
+void TiffWriter::Entry (std::vector <unsigned char> & entries, bool big, UInt16 tag, UInt16 type, UInt64 count,
+                        const void * value) {
+
+    Size length = count * TypeSize (type);
+    unsigned char entry [20];
+    memset (entry, 0, sizeof (entry));
+    memcpy (&entry [0], &tag, 2);
+    memcpy (&entry [2], &type, 2);
+
+    Size inlinesize = (big ? 8 : 4);
+    unsigned char * field = &entry [big ? 12 : 8];
+    if (big)
+        memcpy (&entry [4], &count, 8);
+    else {
+        UInt32 count32 = count;
+        memcpy (&entry [4], &count32, 4);
+    }
+
+    if (length <= inlinesize)
+        memcpy (field, value, length);
+    else {
+        Align ();
+        UInt64 offset = position;
+        Write (value, length);
+        if (big)
+            memcpy (field, &offset, 8);
+        else {
+            UInt32 offset32 = offset;
+            memcpy (field, &offset32, 4);
+        }
+    }
+
+    entries.insert (entries.end (), entry, entry + (big ? 20 : 12));
+}
+
+
+void TiffWriter::Entry (std::vector <unsigned char> & entries, bool big, UInt16 tag, UInt16 type, UInt32 value) {
+
+    UInt16 shortvalue = value;
+    Entry (entries, big, tag, type, 1, (type == TIFF_SHORT ? (const void *) &shortvalue : (const void *) &value));
+}
+
+
+UInt64 TiffWriter::WriteDirectory (const std::vector <unsigned char> & entries, bool big, UInt64 * link) {
+
+    Align ();
+    UInt64 offset = position;
+    if (big) {
+        UInt64 count = entries.size () / 20;
+        UInt64 nextifd = 0;
+        Write (&count, sizeof (count));
+        Write (&entries [0], entries.size ());
+        *link = position;
+        Write (&nextifd, sizeof (nextifd));
+    }
+    else {
+        UInt16 count = entries.size () / 12;
+        UInt32 nextifd = 0;
+        Write (&count, sizeof (count));
+        Write (&entries [0], entries.size ());
+        *link = position;
+        Write (&nextifd, sizeof (nextifd));
+    }
+    return offset;
+}
+
+
+// Writes what is left of the page and its directory, the page is not yet part of the file
+bool TiffWriter::EndPage () {
+
+    if (!inpage || pageifd) return false;
+
+    if (strips [fill].state == Strip::FILLING) Submit ();
+    while (WriteStrip (true));
+
+    if (failed || rows == 0) return false;
+
+    UInt64 count = stripoffsets.size ();
+
+    // Directories, and values beyond them, stay below 4 GB in a classic TIFF
+    pagebig = (bigtiff || position + count * 16 + 1024 > TIFF_CLASSICLIMIT);
+
+    UInt16 tiffcompression;
+    switch (compression) {
+        case TWCP_PACKBITS: tiffcompression = 32773; break;
+        case TWCP_GROUP4:   tiffcompression = 4;     break;
+        case TWCP_LZW:      tiffcompression = 5;     break;
+        case TWCP_ZIP:      tiffcompression = 8;     break;
+        default:            tiffcompression = 1;     break;
+    }
+
+    // Bilevel images are white is zero, as SANE delivers them
+    UInt16 photometric = (samples == 3 ? 2 : depth == 1 ? 0 : 1);
+
+    UInt16 bits [3] = { (UInt16) depth, (UInt16) depth, (UInt16) depth };
+    UInt32 xres [2] = { (UInt32) lround (xdpi * 1000), 1000 };
+    UInt32 yres [2] = { (UInt32) lround (ydpi * 1000), 1000 };
+
+    std::vector <unsigned char> entries;
+    Entry (entries, pagebig, 254, TIFF_LONG, (UInt32) 0);                   // NewSubfileType
+    Entry (entries, pagebig, 256, TIFF_LONG, width);                        // ImageWidth
+    Entry (entries, pagebig, 257, TIFF_LONG, rows);                         // ImageLength
+    Entry (entries, pagebig, 258, TIFF_SHORT, samples, bits);               // BitsPerSample
+    Entry (entries, pagebig, 259, TIFF_SHORT, tiffcompression);             // Compression
+    Entry (entries, pagebig, 262, TIFF_SHORT, photometric);                 // PhotometricInterpretation
+    if (pagebig)
+        Entry (entries, pagebig, 273, TIFF_LONG8, count, &stripoffsets [0]);    // StripOffsets
+    else {
+        std::vector <UInt32> offsets (stripoffsets.begin (), stripoffsets.end ());
+        Entry (entries, pagebig, 273, TIFF_LONG, count, &offsets [0]);
+    }
+    Entry (entries, pagebig, 277, TIFF_SHORT, samples);                     // SamplesPerPixel
+    Entry (entries, pagebig, 278, TIFF_LONG, rowsperstrip);                 // RowsPerStrip
+    {
+        std::vector <UInt32> counts (stripbytecounts.begin (), stripbytecounts.end ());
+        Entry (entries, pagebig, 279, TIFF_LONG, count, &counts [0]);       // StripByteCounts
+    }
+    Entry (entries, pagebig, 282, TIFF_RATIONAL, 1, xres);                  // XResolution
+    Entry (entries, pagebig, 283, TIFF_RATIONAL, 1, yres);                  // YResolution
+    Entry (entries, pagebig, 284, TIFF_SHORT, 1);                           // PlanarConfiguration
+    if (compression == TWCP_GROUP4)
+        Entry (entries, pagebig, 293, TIFF_LONG, (UInt32) 0);               // T6Options
+    Entry (entries, pagebig, 296, TIFF_SHORT, 2);                           // ResolutionUnit, inches
+    if (predictor)
+        Entry (entries, pagebig, 317, TIFF_SHORT, 2);                       // Predictor, horizontal
+
+    pageifd = WriteDirectory (entries, pagebig, &pagelink);
+
+    return !failed;
+}
+
+
+bool TiffWriter::Link (UInt64 ifdoffset) {
+
+    if (bigtiff) return WriteAt (linkoffset, &ifdoffset, sizeof (ifdoffset));
+    UInt32 offset32 = ifdoffset;
+    return WriteAt (linkoffset, &offset32, sizeof (offset32));
+}
+
+
+// Adds the page after the ones already in the file
+bool TiffWriter::LinkPage () {
+
+    if (!inpage || !pageifd) return false;
+    if (pagebig && !bigtiff && !Promote ()) return false;
+    if (!Link (pageifd)) return false;
+    linkoffset = pagelink;
+    inpage = false;
+    pageifd = 0;
+    pages++;
+    if (fflush (file) != 0) failed = true;
+    return !failed;
+}
+
+
+// Cuts the file back to where the page started
+void TiffWriter::DropPage () {
+
+    if (!inpage) return;
+
+    if (strips [fill].state == Strip::FILLING) strips [fill].state = Strip::FREE;
+    while (WriteStrip (true));
+
+    inpage = false;
+    pageifd = 0;
+    if (failed) return;
+    position = pagestart;
+    if (fflush (file) != 0 || ftruncate (fileno (file), pagestart) != 0 || fseeko (file, pagestart, SEEK_SET) != 0)
+        failed = true;
+}
+
+
+// Copies the directories of the pages in the file in the BigTIFF layout and turns the header
+// into a BigTIFF header. Until the header changes the file is still a valid classic TIFF.
+bool TiffWriter::Promote () {
+
+    TraceScope trace ("convert", "BigTIFF");
+
+    UInt64 link = 8;
+    UInt32 offset;
+    if (!ReadAt (4, &offset, sizeof (offset))) return false;
+
+    while (offset != 0) {
+        UInt16 count;
+        if (!ReadAt (offset, &count, sizeof (count))) return false;
+        std::vector <unsigned char> classic (count * 12);
+        if (count && !ReadAt (offset + 2, &classic [0], classic.size ())) return false;
+        UInt32 nextifd;
+        if (!ReadAt (offset + 2 + count * 12, &nextifd, sizeof (nextifd))) return false;
+
+        std::vector <unsigned char> entries;
+        for (int i = 0; i < count; i++) {
+            const unsigned char * entry = &classic [i * 12];
+            UInt16 tag, type;
+            UInt32 values;
+            memcpy (&tag, &entry [0], 2);
+            memcpy (&type, &entry [2], 2);
+            memcpy (&values, &entry [4], 4);
+            std::vector <unsigned char> value (std::max ((Size) 4, values * TypeSize (type)));
+            if (values * TypeSize (type) <= 4)
+                memcpy (&value [0], &entry [8], 4);
+            else {
+                UInt32 valueoffset;
+                memcpy (&valueoffset, &entry [8], 4);
+                if (!ReadAt (valueoffset, &value [0], value.size ())) return false;
+            }
+            Entry (entries, true, tag, type, values, &value [0]);
+        }
+
+        UInt64 nextlink;
+        UInt64 ifd = WriteDirectory (entries, true, &nextlink);
+        if (!WriteAt (link, &ifd, sizeof (ifd))) return false;
+        link = nextlink;
+        offset = nextifd;
+    }
+
+    unsigned char header [8];
+    UInt16 magic = 43;
+    UInt16 offsetsize = 8;
+    UInt16 reserved = 0;
+#ifdef __BIG_ENDIAN__
+    header [0] = header [1] = 'M';
+#else
+    header [0] = header [1] = 'I';
+#endif
+    memcpy (&header [2], &magic, 2);
+    memcpy (&header [4], &offsetsize, 2);
+    memcpy (&header [6], &reserved, 2);
+    if (!WriteAt (0, header, sizeof (header))) return false;
+
+    bigtiff = true;
+    linkoffset = link;
+    return true;
+}
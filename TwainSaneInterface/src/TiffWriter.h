@@ -0,0 +1,105 @@
+#ifndef SANE_DS_TIFFWRITER_H
+#define SANE_DS_TIFFWRITER_H
+
+#include "Platform.h"
+
+#include <pthread.h>
+
+#include <cstdio>
+#include <vector>
+
+class LzwEncoder;
+
+// Streaming TIFF writer for one or more pages. The strips of a page go to the file as soon
+// as they are compressed, by a few threads when there are processors to spare, and the
+// directory of a page is written after its strips. A page only becomes part of the file when
+// it is linked into the chain of directories, so a page that is not wanted can be dropped
+// again. Memory use does not depend on the number of pages or the size of the file.
+//
+// Offsets are 32 bits until the file grows past 4 GB. The file is then turned into a
+// BigTIFF: the directories already in the file are copied in the BigTIFF layout, their
+// strips stay where they are.
+
+class TiffWriter {
+
+public:
+    TiffWriter (FILE * infile);
+    ~TiffWriter ();
+    void StartPage (TW_UINT16 incompression, int inwidth, int inheight, int insamples, int indepth,
+                    double inxdpi, double inydpi);
+    void WriteRow (const unsigned char * data);
+    bool EndPage ();
+    bool LinkPage ();
+    void DropPage ();
+    bool Failed ();
+    int GetPages ();
+
+private:
+    struct Strip {
+        enum { FREE, FILLING, READY, BUSY, DONE } state;
+        int number;
+        int rows;
+        std::vector <unsigned char> data;
+        std::vector <unsigned char> packed;
+        const unsigned char * out;
+        Size length;
+        bool failed;
+    };
+
+    static void * Run (void * arg);
+    void Work ();
+    void Compress (Strip & strip, LzwEncoder & encoder);
+    void Submit ();
+    bool WriteStrip (bool wait);
+    void Write (const void * data, Size length);
+    bool WriteAt (UInt64 offset, const void * data, Size length);
+    bool ReadAt (UInt64 offset, void * data, Size length);
+    void Align ();
+    void Entry (std::vector <unsigned char> & entries, bool big, UInt16 tag, UInt16 type, UInt64 count,
+                const void * value);
+    void Entry (std::vector <unsigned char> & entries, bool big, UInt16 tag, UInt16 type, UInt32 value);
+    UInt64 WriteDirectory (const std::vector <unsigned char> & entries, bool big, UInt64 * link);
+    bool Link (UInt64 ifdoffset);
+    bool Promote ();
+
+    FILE * file;
+    bool failed;
+    bool bigtiff;
+    UInt64 position;
+    UInt64 linkoffset;
+    int pages;
+
+    // The page being written
+    TW_UINT16 compression;
+    int width;
+    int height;
+    int samples;
+    int depth;
+    double xdpi;
+    double ydpi;
+    Size rowbytes;
+    int rowsperstrip;
+    bool predictor;
+    int rows;
+    UInt64 pagestart;
+    bool inpage;
+    UInt64 pageifd;
+    UInt64 pagelink;
+    bool pagebig;
+    std::vector <UInt64> stripoffsets;
+    std::vector <UInt64> stripbytecounts;
+
+    // Strips in flight, written in order
+    std::vector <Strip> strips;
+    int fill;
+    int next;
+    int submitted;
+    std::vector <pthread_t> threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    bool quit;
+    LzwEncoder * lzw;
+};
+
+#endif
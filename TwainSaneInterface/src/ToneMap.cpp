@@ -0,0 +1,59 @@
+#include "Platform.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "ToneMap.h"
+
+
+ToneMap::ToneMap (double brightness, double contrast, double gamma, int indepth) : depth (indepth) {
+
+    // Contrast turns the line through the middle grey, from flat at -1000 to a step at 1000
+    double slope = tan ((std::max (-1000.0, std::min (contrast, 999.0)) / 1000 + 1) * M_PI / 4);
+    double offset = brightness / 1000;
+    if (gamma <= 0) gamma = 1;
+
+    int entries = (depth == 16 ? 65536 : 256);
+    double max = entries - 1;
+    if (depth == 16) lut16.resize (entries); else lut8.resize (entries);
+
+    for (int i = 0; i < entries; i++) {
+        double value = pow (i / max, 1 / gamma);
+        value = (value - 0.5) * slope + 0.5 + offset;
+        long sample = lround (std::max (0.0, std::min (value, 1.0)) * max);
+        if (depth == 16) lut16 [i] = sample; else lut8 [i] = sample;
+    }
+}
+
+
+bool ToneMap::IsIdentity (double brightness, double contrast, double gamma) {
+
+    return (brightness == 0 && contrast == 0 && (gamma == 1 || gamma <= 0));
+}
+
+
+Size ToneMap::Apply (unsigned char * data, Size length) {
+
+    if (depth == 8) {
+        const unsigned char * lut = &lut8 [0];
+        for (Size i = 0; i < length; i++)
+            data [i] = lut [data [i]];
+        return length;
+    }
+
+    // 16 bit samples are in host order, and a read can end in the middle of one
+    if (depth == 16) {
+        length &= ~(Size) 1;
+        const UInt16 * lut = &lut16 [0];
+        for (Size i = 0; i < length; i += 2) {
+            UInt16 sample;
+            memcpy (&sample, &data [i], 2);
+            sample = lut [sample];
+            memcpy (&data [i], &sample, 2);
+        }
+        return length;
+    }
+
+    return length;
+}
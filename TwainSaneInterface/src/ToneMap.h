@@ -0,0 +1,29 @@
+#ifndef SANE_DS_TONEMAP_H
+#define SANE_DS_TONEMAP_H
+
+#include "Platform.h"
+
+#include <vector>
+
+// Software brightness, contrast and gamma for backends that have none of their own. The three
+// are combined into one lookup table of 256 or 65536 entries, which is applied to the samples
+// of each sane_read while they are still in the cache, before anything else reads them.
+// Brightness and contrast are in TWAIN units, -1000 to 1000, and the samples are raised to
+// 1 / gamma.
+
+class ToneMap {
+
+public:
+    ToneMap (double brightness, double contrast, double gamma, int indepth);
+    static bool IsIdentity (double brightness, double contrast, double gamma);
+
+    // Maps the whole samples in length bytes and returns how many bytes that is
+    Size Apply (unsigned char * data, Size length);
+
+private:
+    int depth;
+    std::vector <unsigned char> lut8;
+    std::vector <UInt16> lut16;
+};
+
+#endif
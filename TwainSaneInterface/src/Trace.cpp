@@ -0,0 +1,222 @@
+#include "Platform.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Trace.h"
+
+
+// Events are appended by their own thread only, so recording needs no locks.
+// The per-thread buffers are chained into a list with compare-and-swap and are
+// kept for the life of the process; every flush rewrites the whole trace.
+
+#define TRACE_EVENTS_PER_THREAD 0x8000
+
+struct TraceEvent {
+    char phase;
+    const char * category;
+    char name [64];
+    long long ts;
+    long long value;
+};
+
+struct TraceBuffer {
+    TraceBuffer * next;
+    int tid;
+    volatile int count;
+    volatile int dropped;
+    TraceEvent events [TRACE_EVENTS_PER_THREAD];
+};
+
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t traceKey;
+static const char * tracePath = NULL;
+static long long traceEpoch = 0;
+static TraceBuffer * volatile traceBuffers = NULL;
+static volatile int traceThreads = 0;
+static pthread_mutex_t traceFlushMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static long long TraceNow () {
+
+    return (long long) (MonotonicNanoseconds () / 1000) - traceEpoch;
+}
+
+
+static void TraceInit () {
+
+    const char * path = getenv ("SANE_DS_TRACE");
+    if (!path || !*path) return;
+    pthread_key_create (&traceKey, NULL);
+    traceEpoch = TraceNow ();
+    tracePath = strdup (path);
+}
+
+
+bool TraceEnabled () {
+
+    pthread_once (&traceOnce, TraceInit);
+    return tracePath;
+}
+
+
+static TraceEvent * TraceAppend (char phase) {
+
+    TraceBuffer * buffer = (TraceBuffer *) pthread_getspecific (traceKey);
+
+    if (!buffer) {
+        buffer = (TraceBuffer *) calloc (1, sizeof (TraceBuffer));
+        if (!buffer) return NULL;
+        buffer->tid = __sync_add_and_fetch (&traceThreads, 1);
+        do
+            buffer->next = traceBuffers;
+        while (!__sync_bool_compare_and_swap (&traceBuffers, buffer->next, buffer));
+        pthread_setspecific (traceKey, buffer);
+    }
+
+    if (buffer->count == TRACE_EVENTS_PER_THREAD) {
+        buffer->dropped++;
+        return NULL;
+    }
+
+    TraceEvent * event = &buffer->events [buffer->count];
+    event->phase = phase;
+    return event;
+}
+
+
+static void TraceCommit () {
+
+    TraceBuffer * buffer = (TraceBuffer *) pthread_getspecific (traceKey);
+
+    // Make the event contents visible before the new count
+    __sync_synchronize ();
+    buffer->count++;
+}
+
+
+TraceScope::TraceScope (const char * incategory, const char * format, ...) : category (NULL) {
+
+    if (!TraceEnabled ()) return;
+
+    category = incategory;
+    va_list ap;
+    va_start (ap, format);
+    vsnprintf (name, sizeof (name), format, ap);
+    va_end (ap);
+    start = TraceNow ();
+}
+
+
+TraceScope::~TraceScope () {
+
+    if (!category) return;
+
+    TraceEvent * event = TraceAppend ('X');
+    if (!event) return;
+    event->category = category;
+    strcpy (event->name, name);
+    event->ts = start;
+    event->value = TraceNow () - start;
+    TraceCommit ();
+}
+
+
+void TraceCounter (const char * name, long long value) {
+
+    if (!TraceEnabled ()) return;
+
+    TraceEvent * event = TraceAppend ('C');
+    if (!event) return;
+    event->category = "counter";
+    strncpy (event->name, name, sizeof (event->name) - 1);
+    event->name [sizeof (event->name) - 1] = '\0';
+    event->ts = TraceNow ();
+    event->value = value;
+    TraceCommit ();
+}
+
+
+void TraceInstant (const char * category, const char * format, ...) {
+
+    if (!TraceEnabled ()) return;
+
+    TraceEvent * event = TraceAppend ('i');
+    if (!event) return;
+    event->category = category;
+    va_list ap;
+    va_start (ap, format);
+    vsnprintf (event->name, sizeof (event->name), format, ap);
+    va_end (ap);
+    event->ts = TraceNow ();
+    event->value = 0;
+    TraceCommit ();
+}
+
+
+static void TraceWriteString (FILE * file, const char * s) {
+
+    fputc ('"', file);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc ('\\', file);
+        if ((unsigned char) *s < 0x20)
+            fputc (' ', file);
+        else
+            fputc (*s, file);
+    }
+    fputc ('"', file);
+}
+
+
+void TraceFlush () {
+
+    if (!TraceEnabled ()) return;
+
+    pthread_mutex_lock (&traceFlushMutex);
+
+    FILE * file = fopen (tracePath, "w");
+
+    if (file) {
+        int pid = getpid ();
+        bool first = true;
+        fprintf (file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for (TraceBuffer * buffer = traceBuffers; buffer; buffer = buffer->next) {
+            int count = buffer->count;
+            __sync_synchronize ();
+            for (int i = 0; i < count; i++) {
+                TraceEvent * event = &buffer->events [i];
+                fprintf (file, "%s{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"cat\":",
+                         first ? "" : ",\n", event->phase, pid, buffer->tid, event->ts);
+                TraceWriteString (file, event->category);
+                fprintf (file, ",\"name\":");
+                TraceWriteString (file, event->name);
+                if (event->phase == 'X')
+                    fprintf (file, ",\"dur\":%lld}", event->value);
+                else if (event->phase == 'C')
+                    fprintf (file, ",\"args\":{\"value\":%lld}}", event->value);
+                else
+                    fprintf (file, ",\"s\":\"t\"}");
+                first = false;
+            }
+            if (buffer->dropped)
+                fprintf (file, "%s{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"name\":\"thread_name\","
+                         "\"args\":{\"name\":\"thread %d (%d events dropped)\"}}",
+                         first ? "" : ",\n", pid, buffer->tid, buffer->tid, buffer->dropped);
+            else
+                fprintf (file, "%s{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"name\":\"thread_name\","
+                         "\"args\":{\"name\":\"thread %d\"}}",
+                         first ? "" : ",\n", pid, buffer->tid, buffer->tid);
+            first = false;
+        }
+        fprintf (file, "\n]}\n");
+        fclose (file);
+    }
+
+    pthread_mutex_unlock (&traceFlushMutex);
+}
@@ -0,0 +1,23 @@
+#ifndef SANE_DS_TRACE_H
+#define SANE_DS_TRACE_H
+
+// Opt-in session tracer writing Chrome trace-event JSON (chrome://tracing, Perfetto).
+// Enabled by setting SANE_DS_TRACE to the path of the output file.
+
+bool TraceEnabled ();
+void TraceCounter (const char * name, long long value);
+void TraceInstant (const char * category, const char * format, ...);
+void TraceFlush ();
+
+class TraceScope {
+
+public:
+    TraceScope (const char * category, const char * format, ...);
+    ~TraceScope ();
+private:
+    const char * category;
+    char name [64];
+    long long start;
+};
+
+#endif
@@ -16,6 +16,9 @@
 #include "GammaTable.h"
 #include "Image.h"
 #include "Alerts.h"
+#include "Trace.h"
+#include "MemoryAccount.h"
+#include "SaneProfile.h"
 
 
 const EventTypeSpec mouseMovedEvent []        = { { kEventClassMouse, kEventMouseMoved       } };
@@ -373,7 +376,8 @@ static OSStatus PreviewMouseMovedHandler (EventHandlerCallRef inHandlerCallRef,
 UserInterface::UserInterface (SaneDevice * sd, int currentdevice, bool uionly) : sanedevice (sd),
                                                                                  canpreview (false),
                                                                                  bootstrap (false),
-                                                                                 preview (NULL) {
+                                                                                 preview (NULL),
+                                                                                 previewPict (NULL) {
 
     OSStatus osstat;
     OSErr oserr;
@@ -561,6 +565,9 @@ int UserInterface::ChangeDevice (int device) {
 
 void UserInterface::ProcessCommand (UInt32 command) {
 
+    TraceScope trace ("ui", "Command '%c%c%c%c'", (char) (command >> 24), (char) (command >> 16),
+                      (char) (command >> 8), (char) command);
+
     while (!invalid.empty ())
         Validate (*invalid.begin ());
 
@@ -2478,9 +2485,25 @@ void UserInterface::OpenPreview () {
 
     if (!image) return;
 
-    PicHandle pict = image->MakePict ();
+    // When no area has been chosen, the scan is cut down to what the preview finds on the glass
+    SANE_Rect area;
+    if (viewrect.top == maxrect.top && viewrect.left == maxrect.left &&
+        viewrect.bottom == maxrect.bottom && viewrect.right == maxrect.right &&
+        image->FindContentArea (&area)) {
+
+        viewrect.top = std::max (area.top, maxrect.top);
+        viewrect.left = std::max (area.left, maxrect.left);
+        viewrect.bottom = std::min (area.bottom, maxrect.bottom);
+        viewrect.right = std::min (area.right, maxrect.right);
+
+        SetAreaControls ();
+        if (scanareacontrol) UpdateScanArea ();
+        sanedevice->SetRect (&viewrect);
+    }
+
+    previewPict = image->MakePict (MEMORY_PREVIEW);
     delete image;
-    assert (pict);
+    assert (previewPict);
 
     osstat = CreateNewWindow (kDrawerWindowClass,
                               kWindowCompositingAttribute | kWindowStandardHandlerAttribute,
@@ -2500,7 +2523,7 @@ void UserInterface::OpenPreview () {
 
     ControlButtonContentInfo content;
     content.contentType = kControlContentPictHandle;
-    content.u.picture = pict;
+    content.u.picture = previewPict;
     osstat = CreatePictureControl (NULL, &controlrect, &content, false, &previewPictControl);
     assert (osstat == noErr);
 
@@ -2545,6 +2568,11 @@ void UserInterface::ClosePreview () {
 
     DisposeWindow (preview);
     preview = NULL;
+
+    // The picture control does not dispose of its picture
+    MemoryReleased (MEMORY_PREVIEW, GetHandleSize ((Handle) previewPict));
+    DisposeHandle ((Handle) previewPict);
+    previewPict = NULL;
 }
 
 
@@ -55,6 +55,7 @@ private:
     bool bootstrap;
     WindowRef preview;
     ControlRef previewPictControl;
+    PicHandle previewPict;
 
     SANE_Rect maxrect;
     SANE_Rect viewrect;